@@ -139,6 +139,11 @@ bool kvm_has_free_slot(MachineState *ms)
     return false;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
 void kvm_init_cpu_signals(CPUState *cpu)
 {
     abort();
@@ -2562,6 +2562,7 @@ static void bdrv_replace_child_noperm(BdrvChild *child,
     }
 
     child->bs = new_bs;
+    bdrv_chain_map_invalidate();
 
     if (new_bs) {
         QLIST_INSERT_HEAD(&new_bs->parents, child, next_parent);
@@ -5825,6 +5826,9 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
      * of the image is tried.
      */
     if (bs->open_flags & BDRV_O_INACTIVE) {
+        /* Someone else may have written to the image meanwhile */
+        bdrv_chain_map_invalidate();
+
         bs->open_flags &= ~BDRV_O_INACTIVE;
         ret = bdrv_refresh_perms(bs, errp);
         if (ret < 0) {
@@ -338,6 +338,14 @@ static void backup_cancel(Job *job)
     bdrv_cancel_in_flight(s->target_bs);
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    info->has_copy_stats = true;
+    info->copy_stats = block_copy_get_stats(s->bcs);
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -352,6 +360,7 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 static int64_t backup_calculate_cluster_size(BlockDriverState *target,
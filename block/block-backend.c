@@ -82,10 +82,18 @@ struct BlockBackend {
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
-    int quiesce_counter;
+    int quiesce_counter; /* accessed with atomic ops */
+    QemuMutex queued_requests_lock; /* protects queued_requests */
     CoQueue queued_requests;
     bool disable_request_queuing;
 
+    /*
+     * Requests complete in the AioContext that submitted them, and run
+     * there too while multiqueue_active; see blk_set_multiqueue().
+     */
+    bool multiqueue;
+    bool multiqueue_active;
+
     VMChangeStateEntry *vmsh;
     bool force_allow_inactivate;
 
@@ -110,6 +118,7 @@ static const AIOCBInfo block_backend_aiocb_info = {
 
 static void drive_info_del(DriveInfo *dinfo);
 static BlockBackend *bdrv_first_blk(BlockDriverState *bs);
+static void blk_update_multiqueue(BlockBackend *blk);
 
 /* All BlockBackends */
 static QTAILQ_HEAD(, BlockBackend) block_backends =
@@ -347,6 +356,7 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
 
     block_acct_init(&blk->stats);
 
+    qemu_mutex_init(&blk->queued_requests_lock);
     qemu_co_queue_init(&blk->queued_requests);
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
@@ -456,6 +466,7 @@ static void blk_delete(BlockBackend *blk)
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
+    qemu_mutex_destroy(&blk->queued_requests_lock);
     g_free(blk);
 }
 
@@ -829,6 +840,7 @@ void blk_remove_bs(BlockBackend *blk)
     root = blk->root;
     blk->root = NULL;
     bdrv_root_unref_child(root);
+    blk_update_multiqueue(blk);
 }
 
 /*
@@ -851,6 +863,7 @@ int blk_insert_bs(BlockBackend *blk, BlockDriverState *bs, Error **errp)
         throttle_group_detach_aio_context(tgm);
         throttle_group_attach_aio_context(tgm, bdrv_get_aio_context(bs));
     }
+    blk_update_multiqueue(blk);
 
     return 0;
 }
@@ -1138,6 +1151,50 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     blk->disable_request_queuing = disable;
 }
 
+static void blk_update_multiqueue(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    qatomic_set(&blk->multiqueue_active,
+                blk->multiqueue && bs && bdrv_supports_multiqueue(bs) &&
+                !blk->public.throttle_group_member.throttle_state);
+}
+
+/*
+ * Let asynchronous requests run and complete in the AioContext they are
+ * submitted from, rather than in the one of @blk.  A device can then
+ * process its queues in several iothreads without funnelling all I/O
+ * through a single one.
+ *
+ * Requests still run in the AioContext of @blk (but complete in the
+ * submitting one) when the graph below @blk does not support it, or
+ * while I/O throttling is enabled.  Returns whether they are spread out.
+ */
+bool blk_set_multiqueue(BlockBackend *blk, bool enable)
+{
+    blk->multiqueue = enable;
+    blk_update_multiqueue(blk);
+    return blk->multiqueue_active;
+}
+
+/* The AioContext in which a request submitted by the caller runs */
+static AioContext *blk_request_aio_context(BlockBackend *blk)
+{
+    if (qatomic_read(&blk->multiqueue_active)) {
+        return qemu_get_current_aio_context();
+    }
+    return blk_get_aio_context(blk);
+}
+
+/* The AioContext in which a request submitted by the caller completes */
+static AioContext *blk_completion_aio_context(BlockBackend *blk)
+{
+    if (blk->multiqueue) {
+        return qemu_get_current_aio_context();
+    }
+    return blk_get_aio_context(blk);
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1174,10 +1231,30 @@ static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
 {
     assert(blk->in_flight > 0);
 
-    if (blk->quiesce_counter && !blk->disable_request_queuing) {
+    /*
+     * Multi-queue requests are submitted from other AioContexts, which do
+     * not stop for the drained section.  Pairs with smp_mb() in
+     * blk_root_drained_begin(): either this request sees the drained
+     * section, or the drained section sees this request in flight and
+     * waits for it.
+     */
+    smp_mb();
+    if (qatomic_read(&blk->quiesce_counter) &&
+        !blk->disable_request_queuing) {
         blk_dec_in_flight(blk);
-        qemu_co_queue_wait(&blk->queued_requests, NULL);
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        /* Recheck, blk_root_drained_end() resumes requests under the lock */
+        if (qatomic_read(&blk->quiesce_counter)) {
+            qemu_co_queue_wait(&blk->queued_requests,
+                               &blk->queued_requests_lock);
+        }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
         blk_inc_in_flight(blk);
+
+        /* The graph may no longer support running in this AioContext */
+        if (blk->multiqueue && !qatomic_read(&blk->multiqueue_active)) {
+            aio_co_reschedule_self(blk_get_aio_context(blk));
+        }
     }
 }
 
@@ -1358,10 +1435,31 @@ void blk_inc_in_flight(BlockBackend *blk)
 
 void blk_dec_in_flight(BlockBackend *blk)
 {
+    AioContext *ctx = qatomic_read(&blk->ctx);
+
     qatomic_dec(&blk->in_flight);
+
+    /*
+     * aio_wait_kick() only wakes up the main loop; a drained section
+     * polling in the home iothread of a multi-queue BlockBackend must be
+     * woken up too when a request completes in another iothread.
+     */
+    if (qemu_get_current_aio_context() != ctx) {
+        aio_notify(ctx);
+    }
     aio_wait_kick();
 }
 
+/*
+ * Returns true while @blk is in a drained section.  Callers that may run
+ * outside the AioContext of @blk must count themselves in flight and
+ * issue smp_mb() first, see blk_wait_while_drained().
+ */
+bool blk_in_drain(BlockBackend *blk)
+{
+    return qatomic_read(&blk->quiesce_counter);
+}
+
 static void error_callback_bh(void *opaque)
 {
     struct BlockBackendAIOCB *acb = opaque;
@@ -1382,7 +1480,7 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
+    replay_bh_schedule_oneshot_event(blk_completion_aio_context(blk),
                                      error_callback_bh, acb);
     return &acb->common;
 }
@@ -1392,13 +1490,15 @@ typedef struct BlkAioEmAIOCB {
     BlkRwCo rwco;
     int bytes;
     bool has_returned;
+    /* where the request completes */
+    AioContext *ctx;
 } BlkAioEmAIOCB;
 
 static AioContext *blk_aio_em_aiocb_get_aio_context(BlockAIOCB *acb_)
 {
     BlkAioEmAIOCB *acb = container_of(acb_, BlkAioEmAIOCB, common);
 
-    return blk_get_aio_context(acb->rwco.blk);
+    return acb->ctx;
 }
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
@@ -1409,6 +1509,10 @@ static const AIOCBInfo blk_aio_em_aiocb_info = {
 static void blk_aio_complete(BlkAioEmAIOCB *acb)
 {
     if (acb->has_returned) {
+        if (qemu_in_coroutine()) {
+            /* Run the callback where the request was submitted */
+            aio_co_reschedule_self(acb->ctx);
+        }
         acb->common.cb(acb->common.opaque, acb->rwco.ret);
         blk_dec_in_flight(acb->rwco.blk);
         qemu_aio_unref(acb);
@@ -1428,6 +1532,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 BlockCompletionFunc *cb, void *opaque)
 {
     BlkAioEmAIOCB *acb;
+    AioContext *ctx;
     Coroutine *co;
 
     blk_inc_in_flight(blk);
@@ -1441,14 +1546,24 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     };
     acb->bytes = bytes;
     acb->has_returned = false;
+    acb->ctx = blk_completion_aio_context(blk);
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    ctx = blk_request_aio_context(blk);
+    if (ctx != qemu_get_current_aio_context()) {
+        /*
+         * The coroutine is only scheduled and may complete in the other
+         * thread at any time, so it must not wait for us to return.
+         */
+        acb->has_returned = true;
+        aio_co_enter(ctx, co);
+        return &acb->common;
+    }
+    aio_co_enter(ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
-                                         blk_aio_complete_bh, acb);
+        replay_bh_schedule_oneshot_event(acb->ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -2050,7 +2165,7 @@ static int blk_do_set_aio_context(BlockBackend *blk, AioContext *new_context,
         }
     }
 
-    blk->ctx = new_context;
+    qatomic_set(&blk->ctx, new_context);
     return 0;
 }
 
@@ -2333,9 +2448,20 @@ void blk_io_limits_disable(BlockBackend *blk)
 /* should be called before blk_set_io_limits if a limit is set */
 void blk_io_limits_enable(BlockBackend *blk, const char *group)
 {
+    BlockDriverState *bs = blk_bs(blk);
+    bool drain = bs && blk->multiqueue_active;
+
     assert(!blk->public.throttle_group_member.throttle_state);
+    /* Throttling is not thread-safe, take requests back home first */
+    if (drain) {
+        bdrv_drained_begin(bs);
+    }
     throttle_group_register_tgm(&blk->public.throttle_group_member,
                                 group, blk_get_aio_context(blk));
+    blk_update_multiqueue(blk);
+    if (drain) {
+        bdrv_drained_end(bs);
+    }
 }
 
 void blk_io_limits_update_group(BlockBackend *blk, const char *group)
@@ -2361,7 +2487,9 @@ static void blk_root_drained_begin(BdrvChild *child)
     BlockBackend *blk = child->opaque;
     ThrottleGroupMember *tgm = &blk->public.throttle_group_member;
 
-    if (++blk->quiesce_counter == 1) {
+    if (qatomic_fetch_inc(&blk->quiesce_counter) == 0) {
+        /* Pairs with smp_mb() in blk_wait_while_drained() */
+        smp_mb();
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
         }
@@ -2379,7 +2507,7 @@ static bool blk_root_drained_poll(BdrvChild *child)
 {
     BlockBackend *blk = child->opaque;
     assert(blk->quiesce_counter);
-    return !!blk->in_flight;
+    return !!qatomic_read(&blk->in_flight);
 }
 
 static void blk_root_drained_end(BdrvChild *child, int *drained_end_counter)
@@ -2390,13 +2518,17 @@ static void blk_root_drained_end(BdrvChild *child, int *drained_end_counter)
     assert(blk->public.throttle_group_member.io_limits_disabled);
     qatomic_dec(&blk->public.throttle_group_member.io_limits_disabled);
 
-    if (--blk->quiesce_counter == 0) {
+    if (qatomic_fetch_dec(&blk->quiesce_counter) == 1) {
         if (blk->dev_ops && blk->dev_ops->drained_end) {
             blk->dev_ops->drained_end(blk->dev_opaque);
         }
-        while (qemu_co_enter_next(&blk->queued_requests, NULL)) {
+        blk_update_multiqueue(blk);
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        while (qemu_co_enter_next(&blk->queued_requests,
+                                  &blk->queued_requests_lock)) {
             /* Resume all queued requests */
         }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
     }
 }
 
@@ -20,14 +20,25 @@
 #include "sysemu/block-backend.h"
 #include "qemu/units.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "block/aio_task.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
-#define BLOCK_COPY_MAX_BUFFER (1 * MiB)
+#define BLOCK_COPY_INITIAL_BUFFER (1 * MiB)
+#define BLOCK_COPY_MAX_BUFFER (8 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
+#define BLOCK_COPY_INITIAL_WORKERS 16
+#define BLOCK_COPY_MIN_WORKERS 4
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 
+/* Busy time over which throughput is measured before adapting */
+#define BLOCK_COPY_ADAPT_WINDOW 1000000000LL /* ns */
+/* Windows to wait after backing off before probing again */
+#define BLOCK_COPY_ADAPT_HOLD 8
+/* Delay before retrying copy offloading after it failed */
+#define BLOCK_COPY_COPY_RANGE_RETRY (30 * NANOSECONDS_PER_SECOND)
+
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
 typedef struct BlockCopyCallState {
@@ -38,6 +49,8 @@ typedef struct BlockCopyCallState {
     int max_workers;
     int64_t max_chunk;
     bool ignore_ratelimit;
+    /* Whether the number of workers follows BlockCopyState.workers */
+    bool adapt_workers;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
 
@@ -74,6 +87,12 @@ static int64_t task_end(BlockCopyTask *task)
     return task->offset + task->bytes;
 }
 
+typedef enum BlockCopyAdaptStep {
+    BLOCK_COPY_ADAPT_NONE,
+    BLOCK_COPY_ADAPT_CHUNK,
+    BLOCK_COPY_ADAPT_WORKERS,
+} BlockCopyAdaptStep;
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -115,6 +134,41 @@ typedef struct BlockCopyState {
 
     uint64_t speed;
     RateLimit rate_limit;
+
+    /*
+     * Adaptive request size and concurrency.
+     *
+     * copy_size and workers are tuned by hill climbing: after each
+     * BLOCK_COPY_ADAPT_WINDOW of time in which copy requests are in flight,
+     * one of them is increased if the throughput of the window improved, or
+     * if the requests did not get slower.  If they got slower without any
+     * gain in throughput, the last increase is undone and no new one is
+     * tried for BLOCK_COPY_ADAPT_HOLD windows.  Write zeroes requests are
+     * cheap and not taken into account.
+     */
+    int workers;
+    int adapt_hold;
+    BlockCopyAdaptStep adapt_step;
+    int running;
+    int64_t busy_since;
+    int64_t window_busy_ns;
+    uint64_t window_bytes;
+    uint64_t window_requests;
+    uint64_t window_latency_ns;
+    uint64_t last_throughput;
+    uint64_t last_latency_ns;
+
+    /* Whether copy_range succeeded since use_copy_range was last set */
+    bool copy_range_ok;
+    /* When to try copy_range again after a failure, 0 for never */
+    int64_t copy_range_retry;
+
+    /* Statistics */
+    uint64_t bytes_copied;
+    uint64_t bytes_offloaded;
+    uint64_t bytes_zeroed;
+    uint64_t requests;
+    uint64_t total_latency_ns;
 } BlockCopyState;
 
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
@@ -265,6 +319,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         .len = bdrv_dirty_bitmap_size(copy_bitmap),
         .write_flags = write_flags,
         .mem = shres_create(BLOCK_COPY_MAX_MEM),
+        .workers = BLOCK_COPY_INITIAL_WORKERS,
     };
 
     if (block_copy_max_transfer(source, target) < cluster_size) {
@@ -286,7 +341,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
          * successful copy_range (look at block_copy_do_copy).
          */
         s->use_copy_range = use_copy_range;
-        s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+        s->copy_size = MAX(s->cluster_size, BLOCK_COPY_INITIAL_BUFFER);
     }
 
     QLIST_INIT(&s->tasks);
@@ -300,6 +355,148 @@ void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
     s->progress = pm;
 }
 
+/* Upper limit of copy_size for the current way of copying */
+static int64_t block_copy_max_copy_size(BlockCopyState *s)
+{
+    if (s->use_copy_range) {
+        /*
+         * copy_range does not respect max_transfer (it's a TODO), so we factor
+         * that in here.
+         */
+        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
+                   QEMU_ALIGN_DOWN(block_copy_max_transfer(s->source,
+                                                           s->target),
+                                   s->cluster_size));
+    }
+    return MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+}
+
+/*
+ * Maximum number of parallel tasks of @call_state.  Copy-before-write
+ * operations are not throttled by the adapted number of workers.
+ */
+static int block_copy_call_workers(BlockCopyCallState *call_state)
+{
+    if (!call_state->adapt_workers) {
+        return call_state->max_workers;
+    }
+    return MIN(call_state->max_workers, call_state->s->workers);
+}
+
+/* Forget the measurements made so far, e.g. because copy_range changed */
+static void block_copy_adapt_reset(BlockCopyState *s)
+{
+    s->adapt_step = BLOCK_COPY_ADAPT_NONE;
+    s->adapt_hold = 0;
+    s->window_busy_ns = 0;
+    s->window_bytes = 0;
+    s->window_requests = 0;
+    s->window_latency_ns = 0;
+    s->last_throughput = 0;
+    s->last_latency_ns = 0;
+}
+
+static void block_copy_adapt(BlockCopyState *s)
+{
+    BlockCopyCallState *call_state;
+    uint64_t throughput, latency;
+    int64_t max_copy_size = block_copy_max_copy_size(s);
+    int max_workers = BLOCK_COPY_MIN_WORKERS;
+    bool faster, slower_requests;
+
+    QLIST_FOREACH(call_state, &s->calls, list) {
+        if (call_state->adapt_workers) {
+            max_workers = MAX(max_workers, call_state->max_workers);
+        }
+    }
+
+    throughput = muldiv64(s->window_bytes, NANOSECONDS_PER_SECOND,
+                          s->window_busy_ns);
+    latency = s->window_latency_ns / s->window_requests;
+    faster = throughput > s->last_throughput + s->last_throughput / 16;
+    slower_requests = latency > s->last_latency_ns + s->last_latency_ns / 4;
+
+    if (s->last_throughput && !faster && slower_requests) {
+        /*
+         * Undo the last increase if it did not pay off.  Without one, this
+         * is noise or a change of the workload, and there is nothing to
+         * undo; only the reference values are updated below.
+         */
+        if (s->adapt_step == BLOCK_COPY_ADAPT_CHUNK) {
+            s->copy_size = MAX(s->cluster_size,
+                               QEMU_ALIGN_DOWN(s->copy_size / 2,
+                                               s->cluster_size));
+            s->adapt_hold = BLOCK_COPY_ADAPT_HOLD;
+        } else if (s->adapt_step == BLOCK_COPY_ADAPT_WORKERS) {
+            s->workers = MAX(s->workers / 2, BLOCK_COPY_MIN_WORKERS);
+            s->adapt_hold = BLOCK_COPY_ADAPT_HOLD;
+        }
+        s->adapt_step = BLOCK_COPY_ADAPT_NONE;
+    } else if (s->adapt_hold) {
+        s->adapt_hold--;
+    } else if (s->copy_size < max_copy_size) {
+        s->copy_size = MIN(s->copy_size * 2, max_copy_size);
+        s->adapt_step = BLOCK_COPY_ADAPT_CHUNK;
+    } else if (s->workers < max_workers) {
+        s->workers = MIN(s->workers * 2, max_workers);
+        s->adapt_step = BLOCK_COPY_ADAPT_WORKERS;
+    } else {
+        s->adapt_step = BLOCK_COPY_ADAPT_NONE;
+    }
+
+    trace_block_copy_adapt(s, throughput, latency, s->copy_size, s->workers);
+
+    s->last_throughput = throughput;
+    s->last_latency_ns = latency;
+    s->window_busy_ns = 0;
+    s->window_bytes = 0;
+    s->window_requests = 0;
+    s->window_latency_ns = 0;
+}
+
+/* Returns the start time of the request, to be passed to request_end */
+static int64_t block_copy_request_start(BlockCopyState *s, bool zeroes)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (!zeroes && s->running++ == 0) {
+        s->busy_since = now;
+    }
+    return now;
+}
+
+static void block_copy_request_end(BlockCopyState *s, BlockCopyTask *task,
+                                   int64_t start, int ret)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (task->zeroes) {
+        if (ret == 0) {
+            s->bytes_zeroed += task->bytes;
+        }
+        return;
+    }
+
+    s->running--;
+    s->window_busy_ns += now - s->busy_since;
+    s->busy_since = now;
+
+    if (ret < 0) {
+        return;
+    }
+
+    s->bytes_copied += task->bytes;
+    s->requests++;
+    s->total_latency_ns += now - start;
+
+    s->window_bytes += task->bytes;
+    s->window_requests++;
+    s->window_latency_ns += now - start;
+    if (s->window_busy_ns >= BLOCK_COPY_ADAPT_WINDOW) {
+        block_copy_adapt(s);
+    }
+}
+
 /*
  * Takes ownership of @task
  *
@@ -319,6 +516,8 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
         return ret;
     }
 
+    aio_task_pool_set_max_busy_tasks(pool,
+                                     block_copy_call_workers(task->call_state));
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
         co_put_to_shres(task->s->mem, task->bytes);
@@ -368,30 +567,51 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
         return ret;
     }
 
+    if (!s->use_copy_range && s->copy_range_retry &&
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= s->copy_range_retry)
+    {
+        trace_block_copy_copy_range_retry(s);
+        s->use_copy_range = true;
+        s->copy_range_ok = false;
+        s->copy_range_retry = 0;
+    }
+
     if (s->use_copy_range) {
         ret = bdrv_co_copy_range(s->source, offset, s->target, offset, nbytes,
                                  0, s->write_flags);
         if (ret < 0) {
             trace_block_copy_copy_range_fail(s, offset, ret);
-            s->use_copy_range = false;
-            s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+            if (s->use_copy_range) {
+                s->use_copy_range = false;
+                s->copy_size = MAX(s->cluster_size, BLOCK_COPY_INITIAL_BUFFER);
+                block_copy_adapt_reset(s);
+                /*
+                 * Offloading may fail for reasons that go away, like a
+                 * request crossing into a part of the target that does not
+                 * support it, so try again later unless it is not supported
+                 * at all.
+                 */
+                if (ret != -ENOTSUP) {
+                    s->copy_range_retry =
+                        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                        BLOCK_COPY_COPY_RANGE_RETRY;
+                }
+            }
             /* Fallback to read+write with allocated buffer */
         } else {
-            if (s->use_copy_range) {
+            s->bytes_offloaded += bytes;
+            if (s->use_copy_range && !s->copy_range_ok) {
                 /*
-                 * Successful copy-range. Now increase copy_size.  copy_range
-                 * does not respect max_transfer (it's a TODO), so we factor
-                 * that in here.
+                 * First successful copy-range. Now increase copy_size, further
+                 * changes are up to block_copy_adapt().
                  *
                  * Note: we double-check s->use_copy_range for the case when
                  * parallel block-copy request unsets it during previous
                  * bdrv_co_copy_range call.
                  */
-                s->copy_size =
-                        MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
-                            QEMU_ALIGN_DOWN(block_copy_max_transfer(s->source,
-                                                                    s->target),
-                                            s->cluster_size));
+                s->copy_range_ok = true;
+                s->copy_size = block_copy_max_copy_size(s);
+                block_copy_adapt_reset(s);
             }
             goto out;
         }
@@ -433,10 +653,13 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
     bool error_is_read = false;
+    int64_t start;
     int ret;
 
+    start = block_copy_request_start(t->s, t->zeroes);
     ret = block_copy_do_copy(t->s, t->offset, t->bytes, t->zeroes,
                              &error_is_read);
+    block_copy_request_end(t->s, t, start, ret);
     if (ret < 0 && !t->call_state->ret) {
         t->call_state->ret = ret;
         t->call_state->error_is_read = error_is_read;
@@ -640,7 +863,7 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         bytes = end - offset;
 
         if (!aio && bytes) {
-            aio = aio_task_pool_new(call_state->max_workers);
+            aio = aio_task_pool_new(block_copy_call_workers(call_state));
         }
 
         ret = block_copy_task_run(aio, task);
@@ -754,6 +977,7 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .offset = offset,
         .bytes = bytes,
         .max_workers = max_workers,
+        .adapt_workers = true,
         .max_chunk = max_chunk,
         .cb = cb,
         .cb_opaque = cb_opaque,
@@ -823,6 +1047,26 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
     s->skip_unallocated = skip;
 }
 
+BlockCopyStats *block_copy_get_stats(BlockCopyState *s)
+{
+    BlockCopyStats *stats = g_new(BlockCopyStats, 1);
+
+    *stats = (BlockCopyStats) {
+        .bytes_copied       = s->bytes_copied,
+        .bytes_offloaded    = s->bytes_offloaded,
+        .bytes_zeroed       = s->bytes_zeroed,
+        .requests           = s->requests,
+        .avg_latency_ns     = s->requests ?
+                              s->total_latency_ns / s->requests : 0,
+        .throughput         = s->last_throughput,
+        .chunk_size         = s->copy_size,
+        .workers            = s->workers,
+        .copy_offload       = s->use_copy_range,
+    };
+
+    return stats;
+}
+
 void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
 {
     s->speed = speed;
@@ -0,0 +1,379 @@
+/*
+ * Backing chain allocation map
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Reads from and block status queries of a node with a long backing chain
+ * go through every layer until one of them has the data, each layer doing
+ * its own metadata lookup.  A chain map remembers, for each chunk of the
+ * disk that is not allocated in the node itself, which node of its backing
+ * chain owns the data, so that the owner can be accessed directly.
+ *
+ * The map is filled lazily with bdrv_co_common_block_status_above().  Only
+ * chunks that are owned by a single node as a whole get an owner; chunks
+ * that are split between nodes, e.g. because the backing file has smaller
+ * clusters than the node, are marked as mixed so that they are not looked
+ * up again, and are read through the backing chain as usual.  Below
+ * the node, the chain only changes when something writes to one of its
+ * nodes, like a commit job does, or when the graph changes.  As both are
+ * rare, any of them simply drops the contents of all maps.
+ *
+ * A map is only accessed from the AioContext of its node.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/coroutines.h"
+#include "qemu/atomic.h"
+#include "trace.h"
+
+/* Chunks per page of the map */
+#define CHAIN_MAP_PAGE_SIZE 4096
+
+/*
+ * Depths are stored in a byte, 0 means unknown and CHAIN_MAP_MAX_DEPTH
+ * that the chunk has no single owner that can be recorded
+ */
+#define CHAIN_MAP_MAX_DEPTH UINT8_MAX
+
+struct BdrvChainMap {
+    int64_t granularity;
+    unsigned gen;
+    uint8_t **pages;
+    size_t nb_pages;
+};
+
+/* Incremented whenever the contents of any backing chain may change */
+static unsigned chain_map_gen;
+/* Number of maps; writes do not bother to invalidate anything without */
+static int chain_map_users;
+
+void bdrv_chain_map_enable(BlockDriverState *bs, int64_t granularity)
+{
+    BdrvChainMap *map;
+
+    assert(is_power_of_2(granularity));
+    if (bs->chain_map) {
+        return;
+    }
+
+    map = g_new0(BdrvChainMap, 1);
+    map->granularity = granularity;
+    map->gen = qatomic_read(&chain_map_gen);
+    bs->chain_map = map;
+    qatomic_inc(&chain_map_users);
+}
+
+static void chain_map_clear(BdrvChainMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->nb_pages; i++) {
+        g_free(map->pages[i]);
+    }
+    g_free(map->pages);
+    map->pages = NULL;
+    map->nb_pages = 0;
+}
+
+void bdrv_chain_map_disable(BlockDriverState *bs)
+{
+    if (!bs->chain_map) {
+        return;
+    }
+
+    chain_map_clear(bs->chain_map);
+    g_free(bs->chain_map);
+    bs->chain_map = NULL;
+    qatomic_dec(&chain_map_users);
+}
+
+void bdrv_chain_map_invalidate(void)
+{
+    qatomic_inc(&chain_map_gen);
+}
+
+/* Whether @bs is part of the backing chain of another node */
+static bool chain_map_in_chain(BlockDriverState *bs)
+{
+    BdrvChild *c;
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->role & BDRV_CHILD_COW) {
+            return true;
+        }
+        if ((c->role & BDRV_CHILD_FILTERED) && c->klass->parent_is_bds &&
+            chain_map_in_chain(c->opaque))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Called for every write, discard and truncate of @bs.  If @bs is part of
+ * a backing chain, whoever is above it may now see different data.  Writes
+ * to the top of a chain, which are the common case, do not matter.
+ */
+void bdrv_chain_map_write(BlockDriverState *bs)
+{
+    if (qatomic_read(&chain_map_users) && chain_map_in_chain(bs)) {
+        bdrv_chain_map_invalidate();
+    }
+}
+
+static void chain_map_check_gen(BdrvChainMap *map)
+{
+    unsigned gen = qatomic_read(&chain_map_gen);
+
+    if (map->gen != gen) {
+        chain_map_clear(map);
+        map->gen = gen;
+    }
+}
+
+static int chain_map_get_depth(BdrvChainMap *map, uint64_t chunk)
+{
+    uint64_t page = chunk / CHAIN_MAP_PAGE_SIZE;
+
+    if (page >= map->nb_pages || !map->pages[page]) {
+        return 0;
+    }
+    return map->pages[page][chunk % CHAIN_MAP_PAGE_SIZE];
+}
+
+static void chain_map_set_depth(BdrvChainMap *map, uint64_t chunk, int depth)
+{
+    uint64_t page = chunk / CHAIN_MAP_PAGE_SIZE;
+
+    if (page >= map->nb_pages) {
+        map->pages = g_renew(uint8_t *, map->pages, page + 1);
+        memset(map->pages + map->nb_pages, 0,
+               (page + 1 - map->nb_pages) * sizeof(map->pages[0]));
+        map->nb_pages = page + 1;
+    }
+    if (!map->pages[page]) {
+        map->pages[page] = g_malloc0(CHAIN_MAP_PAGE_SIZE);
+    }
+    map->pages[page][chunk % CHAIN_MAP_PAGE_SIZE] = depth;
+}
+
+/*
+ * Records that [offset, offset + bytes) is owned by the node at @depth
+ * below @bs, where 1 is @bs itself.  Chunks that are only partially
+ * covered are left alone.
+ */
+static void chain_map_record(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes, int depth)
+{
+    BdrvChainMap *map = bs->chain_map;
+    int64_t len = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int64_t end = offset + bytes;
+    uint64_t chunk;
+
+    if (depth < 2) {
+        return;
+    }
+    depth = MIN(depth, CHAIN_MAP_MAX_DEPTH);
+
+    /* The last chunk may be cut short by the end of the node */
+    if (end >= len) {
+        end = ROUND_UP(len, map->granularity);
+    }
+
+    for (chunk = DIV_ROUND_UP(offset, map->granularity);
+         (chunk + 1) * map->granularity <= end;
+         chunk++)
+    {
+        chain_map_set_depth(map, chunk, depth);
+    }
+}
+
+static void coroutine_fn chain_map_fill(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes)
+{
+    BdrvChainMap *map = bs->chain_map;
+    BlockDriverState *cow_bs = bdrv_cow_bs(bs);
+    unsigned gen = map->gen;
+    int64_t start, end, pnum;
+    uint64_t chunk;
+    int depth, ret;
+
+    if (!cow_bs) {
+        return;
+    }
+
+    end = ROUND_UP(offset + bytes, map->granularity);
+    offset = QEMU_ALIGN_DOWN(offset, map->granularity);
+    trace_bdrv_chain_map_fill(bs, offset, end - offset);
+
+    start = offset;
+    while (offset < end) {
+        ret = bdrv_co_common_block_status_above(cow_bs, NULL, false, false,
+                                                offset, end - offset, &pnum,
+                                                NULL, NULL, &depth);
+        if (ret < 0 || qatomic_read(&chain_map_gen) != gen) {
+            return;
+        }
+        if (pnum == 0) {
+            /* Beyond the end of the backing file, which reads as zeroes */
+            chain_map_record(bs, offset, end - offset, 2);
+            break;
+        }
+
+        chain_map_record(bs, offset, pnum, depth + 1);
+        offset += pnum;
+    }
+
+    /* What is left unknown of the whole range is split between nodes */
+    for (chunk = start / map->granularity;
+         chunk < end / map->granularity;
+         chunk++)
+    {
+        if (!chain_map_get_depth(map, chunk)) {
+            chain_map_set_depth(map, chunk, CHAIN_MAP_MAX_DEPTH);
+        }
+    }
+}
+
+/*
+ * Returns the child through which the owner of the data at @offset in
+ * @bs can be accessed, and sets *depth to the depth of the owner, 1 being
+ * @bs itself.  *bytes is reduced to the part of the range that the owner
+ * owns as well.  Returns NULL if the owner is not known, if the chunk has
+ * no single owner, or if the owner cannot be accessed directly.
+ *
+ * Nodes below @base (or @base itself, unless @include_base is true) are
+ * never returned.
+ */
+static BdrvChild *chain_map_lookup(BlockDriverState *bs,
+                                   BlockDriverState *base, bool include_base,
+                                   int64_t offset, int64_t *bytes, int *depth)
+{
+    BdrvChainMap *map = bs->chain_map;
+    uint64_t chunk = offset / map->granularity;
+    uint64_t end_chunk = DIV_ROUND_UP(offset + *bytes, map->granularity);
+    BdrvChild *child;
+    int d, i;
+
+    d = chain_map_get_depth(map, chunk);
+    if (!d || d == CHAIN_MAP_MAX_DEPTH) {
+        return NULL;
+    }
+
+    /* Intermediate filters and copy-on-read may not be bypassed */
+    child = bdrv_cow_child(bs);
+    for (i = 2; i < d; i++) {
+        BlockDriverState *p = child ? child->bs : NULL;
+
+        if (!p || p == base || !p->drv || p->drv->is_filter ||
+            (p->open_flags & BDRV_O_COPY_ON_READ))
+        {
+            return NULL;
+        }
+        child = bdrv_filter_or_cow_child(p);
+    }
+    if (!child || (child->bs == base && !include_base)) {
+        return NULL;
+    }
+
+    for (chunk++; chunk < end_chunk; chunk++) {
+        if (chain_map_get_depth(map, chunk) != d) {
+            *bytes = chunk * map->granularity - offset;
+            break;
+        }
+    }
+
+    *depth = d;
+    return child;
+}
+
+/*
+ * Like chain_map_lookup(), but first fills the map if the owner of
+ * @offset is not known yet.
+ */
+BdrvChild *coroutine_fn bdrv_co_chain_map_get(BlockDriverState *bs,
+                                              BlockDriverState *base,
+                                              bool include_base,
+                                              int64_t offset, int64_t *bytes,
+                                              int *depth)
+{
+    BdrvChainMap *map = bs->chain_map;
+    uint64_t chunk = offset / map->granularity;
+
+    chain_map_check_gen(map);
+    if (!chain_map_get_depth(map, chunk)) {
+        chain_map_fill(bs, offset, *bytes);
+        chain_map_check_gen(map);
+    }
+
+    return chain_map_lookup(bs, base, include_base, offset, bytes, depth);
+}
+
+/*
+ * Returns the length of the part of [offset, offset + bytes) whose owner
+ * cannot be reached directly, either because it is not known or because
+ * it lies below a filter, so that it can be read through the COW child of
+ * @bs in a single request.
+ */
+static int64_t chain_map_unresolved(BlockDriverState *bs, int64_t offset,
+                                    int64_t bytes)
+{
+    BdrvChainMap *map = bs->chain_map;
+    int64_t end = offset + bytes;
+    int64_t next = ROUND_UP(offset + 1, map->granularity);
+
+    for (; next < end; next += map->granularity) {
+        int64_t n = map->granularity;
+        int depth;
+
+        if (chain_map_lookup(bs, NULL, false, next, &n, &depth)) {
+            break;
+        }
+    }
+
+    return MIN(next, end) - offset;
+}
+
+/*
+ * Reads from the backing chain of @bs, for a range that is not allocated
+ * in @bs itself.
+ */
+int coroutine_fn bdrv_co_chain_map_preadv(BlockDriverState *bs,
+                                          int64_t offset, int64_t bytes,
+                                          QEMUIOVector *qiov,
+                                          size_t qiov_offset)
+{
+    BdrvChild *cow = bdrv_cow_child(bs);
+
+    assert(bs->chain_map && cow);
+
+    while (bytes) {
+        BdrvChild *child;
+        int64_t n = bytes;
+        int depth, ret;
+
+        child = bdrv_co_chain_map_get(bs, NULL, false, offset, &n, &depth);
+        if (!child) {
+            child = cow;
+            n = chain_map_unresolved(bs, offset, bytes);
+        }
+
+        ret = bdrv_co_preadv_part(child, offset, n, qiov, qiov_offset, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
@@ -32,6 +32,9 @@
 #include "qemu/option.h"
 #include "qemu/units.h"
 #include "trace.h"
+#include "exec/ramlist.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
@@ -160,6 +163,8 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_linux_io_uring_fixed:1;
+    bool io_uring_no_iopoll:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -172,6 +177,21 @@ typedef struct BDRVRawState {
     } stats;
 
     PRManager *pr_mgr;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * With io-uring-fixed=on, the io_uring instance that fixed_fd and the
+     * buffers in fixed_bufs (struct iovec) are registered with.
+     */
+    LuringState *fixed_ring;
+    int fixed_fd;
+    GArray *fixed_bufs;
+
+    /* Keeps guest RAM in fixed_bufs, see raw_fixed_register_ram() */
+    RAMBlockNotifier ram_notifier;
+    bool ram_registered;
+    BlockDriverState *bs;
+#endif
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -519,6 +539,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the file and I/O buffers with io_uring "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -547,6 +573,147 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+/*
+ * With io-uring-fixed=on, s->fd, guest RAM and the buffers from
+ * bdrv_register_buf() are registered with the io_uring instance of the
+ * node's AioContext.
+ * Requests submitted from other AioContexts use the plain fd and buffers.
+ * Unregister before closing s->fd, so that a new file that happens to get
+ * the same fd is not mistaken for it.
+ */
+static void raw_fixed_register(BDRVRawState *s, AioContext *ctx)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *ring;
+    guint i;
+
+    if (!s->use_linux_io_uring || !s->use_linux_io_uring_fixed) {
+        return;
+    }
+    ring = aio_get_linux_io_uring(ctx);
+    if (!ring) {
+        return;
+    }
+
+    s->fixed_ring = ring;
+    s->fixed_fd = -1;
+    if (s->fd >= 0 && luring_register_file(ring, s->fd)) {
+        s->fixed_fd = s->fd;
+    }
+    for (i = 0; i < s->fixed_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->fixed_bufs, struct iovec, i);
+
+        luring_register_buf(ring, iov->iov_base, iov->iov_len);
+    }
+#endif
+}
+
+static void raw_fixed_unregister(BDRVRawState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    guint i;
+
+    if (!s->fixed_ring) {
+        return;
+    }
+
+    if (s->fixed_fd >= 0) {
+        luring_unregister_file(s->fixed_ring, s->fixed_fd);
+        s->fixed_fd = -1;
+    }
+    for (i = 0; i < s->fixed_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->fixed_bufs, struct iovec, i);
+
+        luring_unregister_buf(s->fixed_ring, iov->iov_base);
+    }
+    s->fixed_ring = NULL;
+#endif
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_fixed_add_buf(BDRVRawState *s, void *host, size_t size)
+{
+    struct iovec iov = { .iov_base = host, .iov_len = size };
+
+    g_array_append_val(s->fixed_bufs, iov);
+    if (s->fixed_ring) {
+        luring_register_buf(s->fixed_ring, host, size);
+    }
+}
+
+static void raw_fixed_remove_buf(BDRVRawState *s, void *host)
+{
+    guint i;
+
+    for (i = 0; i < s->fixed_bufs->len; i++) {
+        if (g_array_index(s->fixed_bufs, struct iovec, i).iov_base == host) {
+            g_array_remove_index_fast(s->fixed_bufs, i);
+            if (s->fixed_ring) {
+                luring_unregister_buf(s->fixed_ring, host);
+            }
+            return;
+        }
+    }
+}
+
+static void raw_ram_block_added(RAMBlockNotifier *n, void *host, size_t size)
+{
+    BDRVRawState *s = container_of(n, BDRVRawState, ram_notifier);
+    AioContext *ctx = bdrv_get_aio_context(s->bs);
+
+    aio_context_acquire(ctx);
+    raw_fixed_add_buf(s, host, size);
+    aio_context_release(ctx);
+}
+
+static void raw_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                  size_t size)
+{
+    BDRVRawState *s = container_of(n, BDRVRawState, ram_notifier);
+    AioContext *ctx = bdrv_get_aio_context(s->bs);
+
+    if (host) {
+        aio_context_acquire(ctx);
+        raw_fixed_remove_buf(s, host);
+        aio_context_release(ctx);
+    }
+}
+
+static int raw_fixed_init_ramblock(RAMBlock *rb, void *opaque)
+{
+    BDRVRawState *s = opaque;
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        raw_fixed_add_buf(s, host, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+/*
+ * Guest requests are served from guest RAM, so register it to make them
+ * use READ_FIXED/WRITE_FIXED.  The pages stay pinned, and a page that the
+ * guest discards (for example with a balloon) would no longer be the one
+ * it reads and writes afterwards, so discarding must be disabled.
+ */
+static void raw_fixed_register_ram(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (ram_block_discard_disable(true) < 0) {
+        warn_report("io-uring-fixed: guest RAM is not registered because "
+                    "it may be discarded");
+        return;
+    }
+    s->bs = bs;
+    s->ram_notifier.ram_block_added = raw_ram_block_added;
+    s->ram_notifier.ram_block_removed = raw_ram_block_removed;
+    ram_block_notifier_add(&s->ram_notifier);
+    qemu_ram_foreach_block(raw_fixed_init_ramblock, s);
+    s->ram_registered = true;
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -636,6 +803,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         }
     }
 
+    s->use_linux_io_uring_fixed = qemu_opt_get_bool(opts, "io-uring-fixed",
+                                                    false);
+    if (s->use_linux_io_uring_fixed &&
+        aio != BLOCKDEV_AIO_OPTIONS_IO_URING) {
+        error_setg(errp, "io-uring-fixed=on requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     s->drop_cache = qemu_opt_get_bool(opts, "drop-cache", true);
     s->check_cache_dropped = qemu_opt_get_bool(opts, "x-check-cache-dropped",
                                                false);
@@ -784,6 +960,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring_fixed) {
+        s->fixed_fd = -1;
+        s->fixed_bufs = g_array_new(false, false, sizeof(struct iovec));
+        raw_fixed_register_ram(bs);
+        raw_fixed_register(s, bdrv_get_aio_context(bs));
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1146,8 +1331,10 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_fixed_unregister(s);
     qemu_close(s->fd);
     s->fd = rs->fd;
+    raw_fixed_register(s, bdrv_get_aio_context(state->bs));
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1986,11 +2173,52 @@ out:
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    /* Complete the request in the AioContext that submitted it */
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
     return thread_pool_submit_co(pool, func, arg);
 }
 
+/*
+ * Requests go through the Linux AIO or io_uring instance of the AioContext
+ * they are submitted from.  This is the node's own AioContext unless the
+ * node is used by several of them at once (see supports_multiqueue); other
+ * contexts get their instance on first use, and fall back to the thread
+ * pool if it cannot be created.
+ */
+#ifdef CONFIG_LINUX_AIO
+static LinuxAioState *raw_get_linux_aio(BDRVRawState *s)
+{
+    if (!s->use_linux_aio) {
+        return NULL;
+    }
+    return aio_setup_linux_aio(qemu_get_current_aio_context(), NULL);
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_linux_io_uring(BDRVRawState *s)
+{
+    if (!s->use_linux_io_uring) {
+        return NULL;
+    }
+    return aio_setup_linux_io_uring(qemu_get_current_aio_context(), NULL);
+}
+
+/*
+ * O_DIRECT reads and writes go through the io_uring instance that polls for
+ * completions instead, if the AioContext has one (see the io-uring-iopoll
+ * property of iothreads).
+ */
+static LuringState *raw_get_linux_io_uring_iopoll(BDRVRawState *s)
+{
+    if (!s->use_linux_io_uring || !(s->open_flags & O_DIRECT)) {
+        return NULL;
+    }
+    return aio_setup_linux_io_uring_iopoll(qemu_get_current_aio_context(),
+                                           NULL);
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -2008,17 +2236,38 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      */
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
+    } else {
+#ifdef CONFIG_LINUX_IO_URING
+        LuringState *luring = raw_get_linux_io_uring(s);
+        LuringState *luring_iopoll = raw_get_linux_io_uring_iopoll(s);
+#endif
+#ifdef CONFIG_LINUX_AIO
+        LinuxAioState *laio = raw_get_linux_aio(s);
+#endif
+
 #ifdef CONFIG_LINUX_IO_URING
-    } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        if (luring_iopoll && !s->io_uring_no_iopoll) {
+            int ret;
+
+            assert(qiov->size == bytes);
+            ret = luring_co_submit(bs, luring_iopoll, s->fd, offset, qiov,
+                                   type);
+            if (ret != -EOPNOTSUPP) {
+                return ret;
+            }
+            /* The file does not support polling, stop trying */
+            s->io_uring_no_iopoll = true;
+        }
+        if (luring) {
+            assert(qiov->size == bytes);
+            return luring_co_submit(bs, luring, s->fd, offset, qiov, type);
+        }
 #endif
 #ifdef CONFIG_LINUX_AIO
-    } else if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        assert(qiov->size == bytes);
-        return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+        if (laio) {
+            assert(qiov->size == bytes);
+            return laio_co_submit(bs, laio, s->fd, offset, qiov, type);
+        }
 #endif
     }
 
@@ -2057,15 +2306,24 @@ static void raw_aio_plug(BlockDriverState *bs)
 {
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_plug(bs, aio);
+    LinuxAioState *laio = raw_get_linux_aio(s);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *luring = raw_get_linux_io_uring(s);
+    LuringState *luring_iopoll = raw_get_linux_io_uring_iopoll(s);
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (laio) {
+        laio_io_plug(bs, laio);
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_plug(bs, aio);
+    if (luring) {
+        luring_io_plug(bs, luring);
+    }
+    if (luring_iopoll) {
+        luring_io_plug(bs, luring_iopoll);
     }
 #endif
 }
@@ -2074,15 +2332,24 @@ static void raw_aio_unplug(BlockDriverState *bs)
 {
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_unplug(bs, aio);
+    LinuxAioState *laio = raw_get_linux_aio(s);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *luring = raw_get_linux_io_uring(s);
+    LuringState *luring_iopoll = raw_get_linux_io_uring_iopoll(s);
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (laio) {
+        laio_io_unplug(bs, laio);
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_unplug(bs, aio);
+    if (luring) {
+        luring_io_unplug(bs, luring);
+    }
+    if (luring_iopoll) {
+        luring_io_unplug(bs, luring_iopoll);
     }
 #endif
 }
@@ -2105,9 +2372,9 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+    LuringState *luring = raw_get_linux_io_uring(s);
+    if (luring) {
+        return luring_co_submit(bs, luring, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
@@ -2137,12 +2404,52 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+    raw_fixed_register(s, new_context);
+}
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_fixed_unregister(bs->opaque);
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->fixed_bufs) {
+        raw_fixed_add_buf(s, host, size);
+    }
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->fixed_bufs) {
+        raw_fixed_remove_buf(s, host);
+    }
 }
+#endif
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->ram_registered) {
+        ram_block_notifier_remove(&s->ram_notifier);
+        ram_block_discard_disable(false);
+        s->ram_registered = false;
+    }
+#endif
+    raw_fixed_unregister(s);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->fixed_bufs) {
+        g_array_free(s->fixed_bufs, true);
+        s->fixed_bufs = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3146,9 +3453,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_fixed_unregister(s);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_fixed_register(s, bdrv_get_aio_context(bs));
     }
     s->perm_change_fd = 0;
 
@@ -3223,6 +3532,7 @@ BlockDriver bdrv_file = {
     .protocol_name = "file",
     .instance_size = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe = NULL, /* no probe for protocols */
     .bdrv_parse_filename = raw_parse_filename,
     .bdrv_file_open = raw_open,
@@ -3248,6 +3558,11 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3599,6 +3914,7 @@ static BlockDriver bdrv_host_device = {
     .protocol_name        = "host_device",
     .instance_size      = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_file_open     = hdev_open,
@@ -3622,6 +3938,11 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3746,6 +4067,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3876,6 +4198,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -884,6 +884,12 @@ void bdrv_inc_in_flight(BlockDriverState *bs)
 
 void bdrv_wakeup(BlockDriverState *bs)
 {
+    AioContext *ctx = qatomic_read(&bs->aio_context);
+
+    /* Multi-queue requests may complete outside the home AioContext */
+    if (ctx && qemu_get_current_aio_context() != ctx) {
+        aio_notify(ctx);
+    }
     aio_wait_kick();
 }
 
@@ -2001,6 +2007,7 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
     bdrv_check_request(offset, bytes, &error_abort);
 
     qatomic_inc(&bs->write_gen);
+    bdrv_chain_map_write(bs);
 
     /*
      * Discard cannot extend the image, but in error handling cases, such as
@@ -2561,6 +2568,35 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
     assert(*pnum <= bytes);
     bytes = *pnum;
 
+    if (bs->chain_map) {
+        BdrvChild *owner;
+        int owner_depth;
+
+        owner = bdrv_co_chain_map_get(bs, base, include_base, offset, &bytes,
+                                      &owner_depth);
+        if (owner) {
+            p = owner->bs;
+            ret = bdrv_co_block_status(p, want_zero, offset, bytes, pnum, map,
+                                       file);
+            *depth = owner_depth;
+            if (ret < 0) {
+                return ret;
+            }
+            if (*pnum == 0) {
+                /* Short layer, see below */
+                assert(ret & BDRV_BLOCK_EOF);
+                *pnum = bytes;
+                if (file) {
+                    *file = p;
+                }
+                ret = BDRV_BLOCK_ZERO | BDRV_BLOCK_ALLOCATED;
+            } else if (ret & BDRV_BLOCK_ALLOCATED) {
+                ret &= ~BDRV_BLOCK_EOF;
+            }
+            goto out;
+        }
+    }
+
     for (p = bdrv_filter_or_cow_bs(bs); include_base || p != base;
          p = bdrv_filter_or_cow_bs(p))
     {
@@ -2613,6 +2649,7 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
         bytes = *pnum;
     }
 
+out:
     if (offset + *pnum == eof) {
         ret |= BDRV_BLOCK_EOF;
     }
@@ -3143,6 +3180,30 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+/*
+ * Return true if requests to @bs may run in several AioContexts at the
+ * same time, which needs every node below it to support that.  Before
+ * write notifiers are not thread-safe, so nodes that have some installed
+ * do not.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    if (!bs->drv || !bs->drv->supports_multiqueue) {
+        return false;
+    }
+    if (!QLIST_EMPTY(&bs->before_write_notifiers.notifiers)) {
+        return false;
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BdrvChild *child;
@@ -3151,7 +3212,13 @@ void bdrv_io_plug(BlockDriverState *bs)
         bdrv_io_plug(child->bs);
     }
 
-    if (qatomic_fetch_inc(&bs->io_plugged) == 0) {
+    /*
+     * With several AioContexts submitting requests the outermost plug may
+     * belong to another one, so multi-queue drivers see every call and
+     * keep track of plugging per AioContext.
+     */
+    if (qatomic_fetch_inc(&bs->io_plugged) == 0 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
@@ -3164,7 +3231,8 @@ void bdrv_io_unplug(BlockDriverState *bs)
     BdrvChild *child;
 
     assert(bs->io_plugged);
-    if (qatomic_fetch_dec(&bs->io_plugged) == 1) {
+    if (qatomic_fetch_dec(&bs->io_plugged) == 1 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_unplug) {
             drv->bdrv_io_unplug(bs);
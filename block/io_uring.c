@@ -10,6 +10,7 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#include <sys/syscall.h>
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "qemu/queue.h"
@@ -17,11 +18,24 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* How long the SQPOLL kernel thread spins before it goes to sleep */
+#define SQ_THREAD_IDLE_MS 100
+
+/* Size of the registered file and buffer tables */
+#define MAX_FIXED_FILES 64
+#define MAX_FIXED_BUFS 64
+#define MAX_FIXED_SLOTS 1024
+
+/* The kernel refuses to register larger buffers */
+#define MAX_FIXED_SLOT_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -50,12 +64,36 @@ typedef struct LuringState {
     AioContext *aio_context;
 
     struct io_uring ring;
+    bool sqpoll;
+    bool iopoll;
 
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /*
+     * Registered files and buffers, see luring_register_file() and
+     * luring_register_buf().  Protected by AioContext lock.
+     */
+    bool files_registered;
+    int files[MAX_FIXED_FILES];
+    unsigned int nfiles;
+    struct iovec bufs[MAX_FIXED_BUFS];
+    unsigned int buf_refs[MAX_FIXED_BUFS];
+    unsigned int nbufs;
+
+    /*
+     * The buffer table of the kernel: @bufs cut in pieces it accepts,
+     * sorted by address.  Requests refer to it by index, so it is only
+     * replaced while no READ_FIXED/WRITE_FIXED request is queued or in
+     * flight; see luring_update_bufs().
+     */
+    struct iovec slots[MAX_FIXED_SLOTS];
+    unsigned int nslots;
+    bool slots_stale;
+    unsigned int fixed_reqs;
 } LuringState;
 
 /**
@@ -70,6 +108,14 @@ static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
     s->io_q.in_queue++;
 }
 
+static void luring_update_bufs(LuringState *s);
+
+static bool luring_is_fixed(LuringAIOCB *luringcb)
+{
+    return luringcb->sqeq.opcode == IORING_OP_READ_FIXED ||
+           luringcb->sqeq.opcode == IORING_OP_WRITE_FIXED;
+}
+
 /**
  * luring_resubmit_short_read:
  *
@@ -89,8 +135,17 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     trace_luring_resubmit_short_read(s, luringcb, nread);
 
     /* Update read position */
-    luringcb->total_read = nread;
+    luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
+    luringcb->sqeq.off += nread;
+
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED ||
+        luringcb->sqeq.opcode == IORING_OP_READ) {
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
 
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
@@ -103,7 +158,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                       remaining);
 
     /* Update sqe */
-    luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
 
@@ -193,6 +247,9 @@ static void luring_process_completions(LuringState *s)
 end:
         luringcb->ret = ret;
         qemu_iovec_destroy(&luringcb->resubmit_qiov);
+        if (luring_is_fixed(luringcb) && !--s->fixed_reqs) {
+            luring_update_bufs(s);
+        }
 
         /*
          * If the coroutine is already entered it must be in ioq_submit()
@@ -204,7 +261,15 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
-    qemu_bh_cancel(s->completion_bh);
+
+    /*
+     * Completions of a polled ring are only posted when we ask for them,
+     * so keep the BH going, and the event loop spinning, until all
+     * requests are done.
+     */
+    if (!s->iopoll || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -262,9 +327,26 @@ static void luring_process_completions_and_submit(LuringState *s)
     aio_context_release(s->aio_context);
 }
 
+/*
+ * Poll the device for completions of an IOPOLL ring.  With SQPOLL the
+ * kernel thread does that for us.
+ */
+static void luring_iopoll(LuringState *s)
+{
+    int ret;
+
+    if (!s->iopoll || s->sqpoll || !s->io_q.in_flight) {
+        return;
+    }
+    ret = syscall(__NR_io_uring_enter, s->ring.ring_fd, 0, 0,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+    trace_luring_iopoll(s, ret < 0 ? -errno : ret);
+}
+
 static void qemu_luring_completion_bh(void *opaque)
 {
     LuringState *s = opaque;
+    luring_iopoll(s);
     luring_process_completions_and_submit(s);
 }
 
@@ -278,6 +360,7 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_iopoll(s);
     if (io_uring_cq_ready(&s->ring)) {
         luring_process_completions_and_submit(s);
         return true;
@@ -312,6 +395,219 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/* Index of @fd in the registered file table, or -1 */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nfiles; i++) {
+        if (s->files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Index of the buffer table slot that contains @iov, or -1 */
+static int luring_fixed_buf(LuringState *s, const struct iovec *iov)
+{
+    unsigned int lo = 0, hi = s->nslots, mid;
+    struct iovec *slot;
+
+    /* Find the last slot that starts at or before @iov */
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (s->slots[mid].iov_base <= iov->iov_base) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    slot = &s->slots[lo];
+    if (iov->iov_base >= slot->iov_base &&
+        iov->iov_base + iov->iov_len <= slot->iov_base + slot->iov_len) {
+        return lo;
+    }
+    return -1;
+}
+
+/**
+ * luring_register_file:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Add @fd to the registered files of the ring.  Requests for @fd are then
+ * submitted with IOSQE_FIXED_FILE, which saves the kernel looking the file
+ * up on every request.  The caller must unregister @fd before closing it.
+ *
+ * Returns true on success; on failure, requests still work on the plain fd.
+ */
+bool luring_register_file(LuringState *s, int fd)
+{
+    int slot, ret;
+
+    if (!s->files_registered) {
+        for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+            s->files[slot] = -1;
+        }
+        ret = io_uring_register_files(&s->ring, s->files, MAX_FIXED_FILES);
+        trace_luring_register_file(s, -1, ret);
+        if (ret < 0) {
+            return false;
+        }
+        s->files_registered = true;
+    }
+
+    slot = luring_fixed_file(s, -1);
+    if (slot < 0) {
+        if (s->nfiles == MAX_FIXED_FILES) {
+            return false;
+        }
+        slot = s->nfiles;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    trace_luring_register_file(s, fd, ret);
+    if (ret < 0) {
+        return false;
+    }
+    s->files[slot] = fd;
+    s->nfiles = MAX(s->nfiles, slot + 1);
+    return true;
+}
+
+void luring_unregister_file(LuringState *s, int fd)
+{
+    int slot = luring_fixed_file(s, fd);
+    int none = -1;
+
+    if (slot < 0) {
+        return;
+    }
+
+    /* Drops the ring's reference to the file */
+    io_uring_register_files_update(&s->ring, slot, &none, 1);
+    trace_luring_unregister_file(s, fd);
+    s->files[slot] = -1;
+}
+
+static int luring_slot_cmp(const void *a, const void *b)
+{
+    const struct iovec *sa = a, *sb = b;
+
+    if (sa->iov_base != sb->iov_base) {
+        return sa->iov_base < sb->iov_base ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Hand the buffers to the kernel again if they changed.  Replacing the
+ * table while READ_FIXED/WRITE_FIXED requests are around would make them
+ * point to the wrong buffer, so this waits for the last of them to
+ * complete.  Until then, new buffers are not used for fixed requests.
+ */
+static void luring_update_bufs(LuringState *s)
+{
+    unsigned int i, n = 0;
+    size_t off;
+    int ret;
+
+    if (!s->slots_stale || s->fixed_reqs) {
+        return;
+    }
+    s->slots_stale = false;
+
+    if (s->nslots) {
+        io_uring_unregister_buffers(&s->ring);
+        s->nslots = 0;
+    }
+    for (i = 0; i < s->nbufs; i++) {
+        for (off = 0; off < s->bufs[i].iov_len && n < MAX_FIXED_SLOTS;
+             off += MAX_FIXED_SLOT_SIZE) {
+            s->slots[n++] = (struct iovec) {
+                .iov_base = s->bufs[i].iov_base + off,
+                .iov_len = MIN(s->bufs[i].iov_len - off, MAX_FIXED_SLOT_SIZE),
+            };
+        }
+    }
+    if (!n) {
+        return;
+    }
+    qsort(s->slots, n, sizeof(s->slots[0]), luring_slot_cmp);
+
+    ret = io_uring_register_buffers(&s->ring, s->slots, n);
+    trace_luring_update_bufs(s, n, ret);
+    if (ret == 0) {
+        s->nslots = n;
+    }
+}
+
+/**
+ * luring_register_buf:
+ * @s: AIO state
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Register a buffer with the ring.  Reads and writes that fall entirely in
+ * it use IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED, so that the kernel
+ * does not have to pin and map the pages on every request.  Registering a
+ * buffer that is already registered only takes a reference.
+ *
+ * The buffer is used once no fixed request is in flight anymore, and is
+ * pinned until then after luring_unregister_buf().
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nbufs; i++) {
+        if (s->bufs[i].iov_base == host && s->bufs[i].iov_len == size) {
+            s->buf_refs[i]++;
+            return;
+        }
+    }
+    if (s->nbufs == MAX_FIXED_BUFS) {
+        return;
+    }
+
+    s->bufs[s->nbufs] = (struct iovec) { .iov_base = host, .iov_len = size };
+    s->buf_refs[s->nbufs] = 1;
+    s->nbufs++;
+    s->slots_stale = true;
+    luring_update_bufs(s);
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < s->nbufs; i++) {
+        if (s->bufs[i].iov_base == host) {
+            break;
+        }
+    }
+    if (i == s->nbufs || --s->buf_refs[i]) {
+        return;
+    }
+
+    /* The memory may be reused, stop using it right away */
+    for (j = 0; j < s->nslots; j++) {
+        if (s->slots[j].iov_base >= host &&
+            s->slots[j].iov_base < host + s->bufs[i].iov_len) {
+            s->slots[j].iov_len = 0;
+        }
+    }
+
+    s->nbufs--;
+    memmove(&s->bufs[i], &s->bufs[i + 1],
+            (s->nbufs - i) * sizeof(s->bufs[0]));
+    memmove(&s->buf_refs[i], &s->buf_refs[i + 1],
+            (s->nbufs - i) * sizeof(s->buf_refs[0]));
+    s->slots_stale = true;
+    luring_update_bufs(s);
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -328,15 +624,30 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    int file = s->nfiles ? luring_fixed_file(s, fd) : -1;
+    int buf = -1;
+
+    if (s->nslots && qiov && qiov->niov == 1) {
+        buf = luring_fixed_buf(s, &qiov->iov[0]);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, buf);
+        } else {
+            io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, buf);
+        } else {
+            io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -346,6 +657,13 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file >= 0) {
+        sqes->fd = file;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
+    if (buf >= 0) {
+        s->fixed_reqs++;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -402,19 +720,66 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+/*
+ * Set up the ring with a kernel thread that picks up submissions, so that
+ * submitting does not need a syscall.  Without IORING_FEAT_SQPOLL_NONFIXED
+ * (Linux 5.11) such a ring only works with registered files, which is not
+ * good enough for us.
+ */
+static bool luring_init_sqpoll(LuringState *s, unsigned int flags)
+{
+#ifdef IORING_FEAT_SQPOLL_NONFIXED
+    struct io_uring_params p = {
+        .flags = flags | IORING_SETUP_SQPOLL,
+        .sq_thread_idle = SQ_THREAD_IDLE_MS,
+    };
+    int rc;
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    if (rc < 0) {
+        warn_report("io_uring submission polling is not available: %s",
+                    strerror(-rc));
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+        io_uring_queue_exit(&s->ring);
+        warn_report("io_uring submission polling needs Linux 5.11 or newer");
+        return false;
+    }
+    return true;
+#else
+    warn_report("io_uring submission polling is not supported "
+                "in this build");
+    return false;
+#endif
+}
+
+/**
+ * luring_init:
+ * @sqpoll: let a kernel thread pick up submissions (IORING_SETUP_SQPOLL),
+ *          if the host supports it
+ * @iopoll: poll the device for completions (IORING_SETUP_IOPOLL).  Only
+ *          reads and writes of O_DIRECT files on devices that support
+ *          polling can be submitted to such a ring.
+ */
+LuringState *luring_init(bool sqpoll, bool iopoll, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    unsigned int flags = iopoll ? IORING_SETUP_IOPOLL : 0;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
-    if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
-        g_free(s);
-        return NULL;
+    s->sqpoll = sqpoll && luring_init_sqpoll(s, flags);
+    s->iopoll = iopoll;
+    if (!s->sqpoll) {
+        rc = io_uring_queue_init(MAX_ENTRIES, ring, flags);
+        if (rc < 0) {
+            error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+            g_free(s);
+            return NULL;
+        }
     }
 
     ioq_init(&s->io_q);
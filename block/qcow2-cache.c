@@ -23,14 +23,29 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table on their offset, chained
+ * through Qcow2CachedTable.next, so that lookups do not depend on the size
+ * of the cache.  When a table must be replaced, a CLOCK hand sweeps over
+ * the entries and takes the first unused one that has not been accessed
+ * since the hand last passed it.  Dirty entries are tracked in a bitmap, so
+ * that writing back the cache does not have to look at every entry either.
+ * A second bitmap tracks the dirty entries that were not copied to the
+ * metadata journal yet.
+ *
+ * Like the rest of the qcow2 metadata, the cache is protected by s->lock.
+ */
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
-    bool     dirty;
+    int      next;
+    bool     accessed;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -42,6 +57,11 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+    int                    *buckets;
+    int                     hash_bits;
+    int                     clock_hand;
+    unsigned long          *dirty;
+    unsigned long          *unjournaled;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -69,6 +89,47 @@ static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
     }
 }
 
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t hash = offset / c->table_size * 0x9e3779b97f4a7c15ULL;
+
+    return &c->buckets[hash >> (64 - c->hash_bits)];
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0; i = c->entries[i].next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        for (p = qcow2_cache_bucket(c, t->offset); *p != i;
+             p = &c->entries[*p].next) {
+            assert(*p >= 0);
+        }
+        *p = t->next;
+    }
+
+    t->offset = offset;
+    t->next = -1;
+    if (offset) {
+        p = qcow2_cache_bucket(c, offset);
+        t->next = *p;
+        *p = i;
+    }
+}
+
 static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 {
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
@@ -87,7 +148,7 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
-    return t->ref == 0 && !t->dirty && t->offset != 0 &&
+    return t->ref == 0 && !test_bit(i, c->dirty) && t->offset != 0 &&
         t->lru_counter <= c->cache_clean_lru_counter;
 }
 
@@ -104,8 +165,9 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
+            qcow2_cache_set_offset(c, i, 0);
             c->entries[i].lru_counter = 0;
+            c->entries[i].accessed = false;
             i++;
             to_clean++;
         }
@@ -123,6 +185,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -132,15 +195,32 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    /* At least as many buckets as entries, so that chains stay short */
+    c->hash_bits = MAX(ctz32(pow2ceil(num_tables)), 1);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
+    c->dirty = bitmap_try_new(num_tables);
+    c->unjournaled = bitmap_try_new(num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->dirty || !c->unjournaled ||
+        !c->table_array)
+    {
         qemu_vfree(c->table_array);
+        g_free(c->unjournaled);
+        g_free(c->dirty);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i < 1 << c->hash_bits; i++) {
+        c->buckets[i] = -1;
+    }
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].next = -1;
     }
 
     return c;
@@ -155,6 +235,9 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->unjournaled);
+    g_free(c->dirty);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -181,13 +264,24 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     BDRVQcow2State *s = bs->opaque;
     int ret = 0;
 
-    if (!c->entries[i].dirty || !c->entries[i].offset) {
+    if (!test_bit(i, c->dirty) || !c->entries[i].offset) {
         return 0;
     }
 
     trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
                                   c == s->l2_table_cache, i);
 
+    /*
+     * Replaying the journal would overwrite the table with an older
+     * version, so apply the journal before the table goes home.
+     */
+    if (qcow2_journal_contains(bs, c->entries[i].offset)) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (c->depends) {
         ret = qcow2_cache_flush_dependency(bs, c);
     } else if (c->depends_on_flush) {
@@ -228,7 +322,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         return ret;
     }
 
-    c->entries[i].dirty = false;
+    clear_bit(i, c->dirty);
+    clear_bit(i, c->unjournaled);
 
     return 0;
 }
@@ -242,7 +337,8 @@ int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
-    for (i = 0; i < c->size; i++) {
+    for (i = find_first_bit(c->dirty, c->size); i < c->size;
+         i = find_next_bit(c->dirty, c->size, i + 1)) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
             result = ret;
@@ -294,6 +390,44 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+bool qcow2_cache_has_flush_dependency(Qcow2Cache *c)
+{
+    return c->depends_on_flush;
+}
+
+/*
+ * Return the index of the first table at or after @start that was modified
+ * since the last call to qcow2_cache_set_journaled(), or -1 if there is
+ * none.  The offset and contents of the table are returned in @offset and
+ * @table.
+ */
+int qcow2_cache_find_unjournaled(Qcow2Cache *c, int start, uint64_t *offset,
+                                 void **table)
+{
+    int i = find_next_bit(c->unjournaled, c->size, start);
+
+    if (i >= c->size) {
+        return -1;
+    }
+
+    *offset = c->entries[i].offset;
+    *table = qcow2_cache_get_table_addr(c, i);
+    return i;
+}
+
+/*
+ * All modified tables are now in the journal.  They are written to the
+ * same transaction, so the order between them and the other cache does
+ * not matter any more; the caller has taken care of the flush that
+ * qcow2_cache_depends_on_flush() asked for.
+ */
+void qcow2_cache_set_journaled(Qcow2Cache *c)
+{
+    bitmap_zero(c->unjournaled, c->size);
+    c->depends = NULL;
+    c->depends_on_flush = false;
+}
+
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret, i;
@@ -306,25 +440,56 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
+        c->entries[i].next = -1;
         c->entries[i].lru_counter = 0;
+        c->entries[i].accessed = false;
+    }
+    for (i = 0; i < 1 << c->hash_bits; i++) {
+        c->buckets[i] = -1;
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->clock_hand = 0;
 
     return 0;
 }
 
+/*
+ * Pick the entry to replace: the first one that is not in use and was not
+ * accessed since the last sweep of the clock hand.  Free entries are never
+ * marked accessed, so they go first.
+ */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    int n;
+
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+        if (t->ref) {
+            continue;
+        }
+        if (t->accessed) {
+            t->accessed = false;
+            continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -339,29 +504,19 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    i = qcow2_cache_find_victim(c);
+    if (i == -1) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -372,7 +527,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -386,11 +541,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
     c->entries[i].ref++;
+    c->entries[i].accessed = true;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -429,19 +585,15 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
     assert(c->entries[i].offset != 0);
-    c->entries[i].dirty = true;
+    set_bit(i, c->dirty);
+    set_bit(i, c->unjournaled);
 }
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
@@ -450,9 +602,11 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     c->entries[i].lru_counter = 0;
-    c->entries[i].dirty = false;
+    c->entries[i].accessed = false;
+    clear_bit(i, c->dirty);
+    clear_bit(i, c->unjournaled);
 
     qcow2_cache_table_release(c, i, 1);
 }
@@ -1581,9 +1581,10 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == INV_OFFSET) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+    if (*host_offset == INV_OFFSET ||
+        (s->reserved_bytes && *host_offset == s->reserved_offset)) {
+        /* The latter continues a previous allocation in the reservation */
+        int64_t cluster_offset = qcow2_alloc_data_clusters(bs, nb_clusters);
         if (cluster_offset < 0) {
             return cluster_offset;
         }
@@ -0,0 +1,393 @@
+/*
+ * Readahead and caching of compressed clusters for the QCOW2 format
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Every compressed cluster is read and decompressed on its own, so a guest
+ * reading a compressed image sequentially pays the latency of one read and
+ * one decompression per cluster.  With the compressed-readahead option, a
+ * compressed read that continues where the previous one stopped starts
+ * background coroutines for the following clusters.  They look up the L2
+ * entries, read the compressed data and decompress it on the thread pool,
+ * all in parallel, and leave the result in a small cache of decompressed
+ * clusters where the guest read finds it.
+ *
+ * The cache is indexed by the host offset of the compressed data, so guest
+ * writes, which never modify compressed data in place, do not affect it.
+ * Entries are dropped when their host cluster is freed, because it may be
+ * reused for something else afterwards.
+ *
+ * The cache is only ever accessed from the AioContext of the image and it
+ * never yields while inspecting or changing entries, so it needs no lock.
+ */
+
+#include "qemu/osdep.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2CompressedCacheEntry {
+    /* Host offset of the compressed data, 0 for an unused entry */
+    uint64_t coffset;
+    int csize;
+    uint8_t *data;
+    uint64_t lru_counter;
+    /* The data is being read; requests for it wait on @waiters */
+    bool pending;
+    /* The host cluster was freed while the data was being read */
+    bool stale;
+    CoQueue waiters;
+} Qcow2CompressedCacheEntry;
+
+struct Qcow2CompressedCache {
+    Qcow2CompressedCacheEntry *entries;
+    uint8_t *data;
+    int size;
+    uint64_t lru_counter;
+
+    /* Number of clusters to read ahead */
+    int readahead;
+    /* Guest offset where the last compressed read ended */
+    uint64_t next;
+    /* Guest offset up to which readahead was started */
+    uint64_t end;
+    int in_flight;
+};
+
+typedef struct Qcow2ReadaheadCo {
+    BlockDriverState *bs;
+    uint64_t offset;
+} Qcow2ReadaheadCo;
+
+static uint64_t compressed_cluster_range(BDRVQcow2State *s,
+                                         uint64_t cluster_descriptor,
+                                         int *csize)
+{
+    uint64_t coffset = cluster_descriptor & s->cluster_offset_mask;
+    int nb_csectors = ((cluster_descriptor >> s->csize_shift) &
+                       s->csize_mask) + 1;
+
+    *csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
+        (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+    return coffset;
+}
+
+/*
+ * Reads the compressed cluster described by @cluster_descriptor and
+ * decompresses it into @dest, which must be cluster_size bytes long.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_descriptor,
+                                          void *dest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret, csize;
+    uint64_t coffset;
+    uint8_t *buf;
+
+    coffset = compressed_cluster_range(s, cluster_descriptor, &csize);
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (qcow2_co_decompress_shared(bs, coffset, dest, s->cluster_size,
+                                   buf, csize) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    ret = 0;
+out:
+    g_free(buf);
+    return ret;
+}
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs,
+                                                    int readahead)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c;
+    int i;
+
+    c = g_new0(Qcow2CompressedCache, 1);
+    c->readahead = readahead;
+    /* Room for the clusters being read ahead and as many already read */
+    c->size = 2 * readahead;
+    c->entries = g_new0(Qcow2CompressedCacheEntry, c->size);
+    c->data = qemu_try_blockalign(bs->file->bs,
+                                  (size_t) c->size * s->cluster_size);
+    if (!c->data) {
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].data = c->data + (size_t) i * s->cluster_size;
+        qemu_co_queue_init(&c->entries[i].waiters);
+    }
+
+    return c;
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        assert(!c->entries[i].pending);
+    }
+    assert(c->in_flight == 0);
+
+    qemu_vfree(c->data);
+    g_free(c->entries);
+    g_free(c);
+}
+
+/*
+ * Drops all entries whose compressed data overlaps the given host range.
+ * Must be called before the range can be reused.
+ */
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (e->coffset && e->coffset < offset + bytes &&
+            offset < e->coffset + e->csize)
+        {
+            if (e->pending) {
+                e->stale = true;
+            } else {
+                e->coffset = 0;
+            }
+        }
+    }
+}
+
+static Qcow2CompressedCacheEntry *
+compressed_cache_lookup(Qcow2CompressedCache *c, uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].coffset == coffset && !c->entries[i].stale) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static Qcow2CompressedCacheEntry *
+compressed_cache_victim(Qcow2CompressedCache *c)
+{
+    Qcow2CompressedCacheEntry *victim = NULL;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (e->pending) {
+            continue;
+        }
+        if (!e->coffset) {
+            return e;
+        }
+        if (!victim || e->lru_counter < victim->lru_counter) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Returns in *entry the cache entry holding the decompressed cluster
+ * described by @cluster_descriptor, reading it first if necessary.  The
+ * entry may be reused as soon as the caller yields.  If all entries are
+ * busy, *entry is set to NULL and the cluster is not read.
+ */
+static int coroutine_fn
+compressed_cache_get(BlockDriverState *bs, uint64_t cluster_descriptor,
+                     Qcow2CompressedCacheEntry **entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedCacheEntry *e;
+    uint64_t coffset;
+    int csize, ret;
+
+    coffset = compressed_cluster_range(s, cluster_descriptor, &csize);
+
+    while ((e = compressed_cache_lookup(c, coffset)) && e->pending) {
+        /* The entry may be gone or reused when we are woken up */
+        qemu_co_queue_wait(&e->waiters, NULL);
+    }
+
+    if (e) {
+        e->lru_counter = ++c->lru_counter;
+        *entry = e;
+        return 0;
+    }
+
+    e = compressed_cache_victim(c);
+    *entry = e;
+    if (!e) {
+        return 0;
+    }
+
+    e->coffset = coffset;
+    e->csize = csize;
+    e->stale = false;
+    e->pending = true;
+    e->lru_counter = ++c->lru_counter;
+
+    ret = qcow2_co_read_compressed(bs, cluster_descriptor, e->data);
+    trace_qcow2_compressed_cache_fill(bs, coffset, ret);
+
+    e->pending = false;
+    if (ret < 0 || e->stale) {
+        /* Whoever waits for it will read the cluster again */
+        e->coffset = 0;
+        e->stale = false;
+    }
+    qemu_co_queue_restart_all(&e->waiters);
+
+    return ret;
+}
+
+static void coroutine_fn qcow2_readahead_entry(void *opaque)
+{
+    Qcow2ReadaheadCo *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCacheEntry *e;
+    QCow2SubclusterType type;
+    unsigned int bytes = s->cluster_size;
+    uint64_t host_offset;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_get_host_offset(bs, ra->offset, &bytes, &host_offset, &type);
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* Errors are reported when the guest actually reads the cluster */
+    if (ret == 0 && type == QCOW2_SUBCLUSTER_COMPRESSED) {
+        compressed_cache_get(bs, host_offset, &e);
+    }
+
+    s->compressed_cache->in_flight--;
+    bdrv_dec_in_flight(bs);
+    g_free(ra);
+}
+
+/*
+ * Called for every compressed read of the guest.  If it continues the
+ * previous one, start reading the following clusters in the background.
+ */
+static void qcow2_compressed_readahead(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t cluster = start_of_cluster(s, offset);
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t start, limit, ra_offset;
+    bool sequential;
+
+    sequential = c->next >= cluster && c->next <= offset;
+    c->next = offset + bytes;
+    if (!sequential) {
+        c->end = 0;
+        return;
+    }
+
+    start = MAX(c->end, cluster + s->cluster_size);
+    limit = MIN(cluster + (uint64_t) (c->readahead + 1) * s->cluster_size,
+                disk_size);
+
+    for (ra_offset = start;
+         ra_offset < limit && c->in_flight < c->readahead;
+         ra_offset += s->cluster_size)
+    {
+        Qcow2ReadaheadCo *ra = g_new(Qcow2ReadaheadCo, 1);
+        Coroutine *co;
+
+        *ra = (Qcow2ReadaheadCo) {
+            .bs     = bs,
+            .offset = ra_offset,
+        };
+
+        trace_qcow2_compressed_readahead(bs, ra_offset);
+        c->in_flight++;
+        bdrv_inc_in_flight(bs);
+        co = qemu_coroutine_create(qcow2_readahead_entry, ra);
+        aio_co_enter(bdrv_get_aio_context(bs), co);
+    }
+
+    c->end = MAX(c->end, ra_offset);
+}
+
+/*
+ * Reads @bytes from the compressed cluster described by @cluster_descriptor
+ * at guest offset @offset into @qiov, going through the cache.
+ */
+int coroutine_fn
+qcow2_co_preadv_compressed_cached(BlockDriverState *bs,
+                                  uint64_t cluster_descriptor,
+                                  uint64_t offset, uint64_t bytes,
+                                  QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCacheEntry *e;
+    uint8_t *out_buf;
+    int ret;
+
+    qcow2_compressed_readahead(bs, offset, bytes);
+
+    ret = compressed_cache_get(bs, cluster_descriptor, &e);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (e) {
+        out_buf = e->data;
+    } else {
+        out_buf = qemu_blockalign(bs, s->cluster_size);
+        ret = qcow2_co_read_compressed(bs, cluster_descriptor, out_buf);
+    }
+
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            out_buf + offset_into_cluster(s, offset), bytes);
+    }
+
+    if (!e) {
+        qemu_vfree(out_buf);
+    }
+    return ret;
+}
@@ -0,0 +1,587 @@
+/*
+ * Metadata journal for the QCOW2 format
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Without a journal, flushing the image writes every modified L2 table and
+ * refcount block back to its place in the image file, with flushes in
+ * between so that refcounts always reach the disk before the L2 entries
+ * that need them.  With a journal, all of them are appended to the journal
+ * as a single transaction instead, and only the flush of the caller is
+ * needed to make them stable.
+ *
+ * The tables stay dirty in the cache and are written back to their home
+ * locations later, when they are evicted or the whole cache is written.
+ * Before the first of them goes home the journal is checkpointed: its
+ * transactions are copied to their home locations and it starts over.
+ * The incompatible journal bit is set in the image header while the journal
+ * may hold transactions that are not at home yet; such an image must be
+ * opened read-write so that the journal can be replayed.
+ *
+ * Like the rest of the qcow2 metadata, the journal is protected by s->lock.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/crc32c.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_JOURNAL_MAGIC     0x514a524e /* "QJRN" */
+#define QCOW2_JOURNAL_TX_MAGIC  0x514a5458 /* "QJTX" */
+
+/* Transactions start and end on this boundary */
+#define QCOW2_JOURNAL_BLOCK     4096
+
+typedef struct Qcow2JournalHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t seq_start;
+} QEMU_PACKED Qcow2JournalHeader;
+
+typedef struct Qcow2JournalTx {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t seq;
+    uint32_t nb_tables;
+    uint32_t length;
+} QEMU_PACKED Qcow2JournalTx;
+
+typedef struct Qcow2JournalTable {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t type;
+} QEMU_PACKED Qcow2JournalTable;
+
+enum {
+    QCOW2_JOURNAL_L2        = 1,
+    QCOW2_JOURNAL_REFBLOCK  = 2,
+};
+
+/* Size of the transaction header and table descriptors */
+static uint64_t journal_tx_header_size(uint32_t nb_tables)
+{
+    return ROUND_UP(sizeof(Qcow2JournalTx) +
+                    (uint64_t) nb_tables * sizeof(Qcow2JournalTable),
+                    QCOW2_JOURNAL_BLOCK);
+}
+
+static uint32_t journal_tx_crc(uint8_t *buf, uint32_t length)
+{
+    size_t start = offsetof(Qcow2JournalTx, seq);
+
+    return crc32c(0xffffffff, buf + start, length - start);
+}
+
+static int journal_write_header(BlockDriverState *bs, uint64_t seq_start)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader *header;
+    int ret;
+
+    header = g_malloc0(QCOW2_JOURNAL_BLOCK);
+    header->magic = cpu_to_be32(QCOW2_JOURNAL_MAGIC);
+    header->seq_start = cpu_to_be64(seq_start);
+
+    ret = bdrv_pwrite(bs->file, s->journal_offset, header,
+                      QCOW2_JOURNAL_BLOCK);
+    g_free(header);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Sets or clears the journal bit in the image header, without flushing.
+ * Like qcow2_mark_dirty(), only the feature field is written.
+ */
+static int journal_update_bit(BlockDriverState *bs, bool set)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t features = s->incompatible_features;
+    uint64_t val;
+    int ret;
+
+    if (set) {
+        features |= QCOW2_INCOMPAT_JOURNAL;
+    } else {
+        features &= ~QCOW2_INCOMPAT_JOURNAL;
+    }
+    if (features == s->incompatible_features) {
+        return 0;
+    }
+
+    val = cpu_to_be64(features);
+    ret = bdrv_pwrite(bs->file, offsetof(QCowHeader, incompatible_features),
+                      &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features = features;
+    return 0;
+}
+
+/*
+ * Writes the tables of all valid transactions in the first @end bytes of
+ * the journal to their home locations.  Stores the sequence number that
+ * the first invalid transaction should have had in @next_seq.
+ */
+static int journal_replay(BlockDriverState *bs, uint64_t end,
+                          uint64_t *next_seq)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t pos = QCOW2_JOURNAL_BLOCK;
+    uint64_t seq = s->journal_seq_start;
+    uint8_t *buf = NULL;
+    uint32_t buf_size = 0;
+    int ret;
+
+    while (end - pos >= QCOW2_JOURNAL_BLOCK) {
+        Qcow2JournalTx tx;
+        Qcow2JournalTable *tables;
+        uint64_t data;
+        uint32_t i;
+
+        ret = bdrv_pread(bs->file, s->journal_offset + pos, &tx, sizeof(tx));
+        if (ret < 0) {
+            goto out;
+        }
+
+        tx.magic = be32_to_cpu(tx.magic);
+        tx.crc = be32_to_cpu(tx.crc);
+        tx.seq = be64_to_cpu(tx.seq);
+        tx.nb_tables = be32_to_cpu(tx.nb_tables);
+        tx.length = be32_to_cpu(tx.length);
+
+        /* Whatever follows the last complete transaction is stale */
+        if (tx.magic != QCOW2_JOURNAL_TX_MAGIC || tx.seq != seq ||
+            tx.length > end - pos ||
+            !QEMU_IS_ALIGNED(tx.length, QCOW2_JOURNAL_BLOCK) ||
+            journal_tx_header_size(tx.nb_tables) > tx.length)
+        {
+            break;
+        }
+
+        if (tx.length > buf_size) {
+            qemu_vfree(buf);
+            buf = qemu_try_blockalign(bs->file->bs, tx.length);
+            if (buf == NULL) {
+                ret = -ENOMEM;
+                goto out;
+            }
+            buf_size = tx.length;
+        }
+
+        ret = bdrv_pread(bs->file, s->journal_offset + pos, buf, tx.length);
+        if (ret < 0) {
+            goto out;
+        }
+        if (journal_tx_crc(buf, tx.length) != tx.crc) {
+            break;
+        }
+
+        tables = (Qcow2JournalTable *) (buf + sizeof(tx));
+        data = journal_tx_header_size(tx.nb_tables);
+        for (i = 0; i < tx.nb_tables; i++) {
+            uint64_t offset = be64_to_cpu(tables[i].offset);
+            uint32_t size = be32_to_cpu(tables[i].size);
+            uint32_t type = be32_to_cpu(tables[i].type);
+            int ign;
+
+            /*
+             * A snapshot operation may have been interrupted after it
+             * journaled tables of a snapshot, or before the ones it made
+             * inactive went home, so L2 tables can be either.
+             */
+            if (type == QCOW2_JOURNAL_L2) {
+                ign = QCOW2_OL_ACTIVE_L2 | QCOW2_OL_INACTIVE_L2;
+            } else if (type == QCOW2_JOURNAL_REFBLOCK) {
+                ign = QCOW2_OL_REFCOUNT_BLOCK;
+            } else {
+                ret = -EINVAL;
+                goto out;
+            }
+
+            if (offset == 0 || size > tx.length - data ||
+                offset_into_cluster(s, offset) + size > s->cluster_size)
+            {
+                ret = -EINVAL;
+                goto out;
+            }
+
+            ret = qcow2_pre_write_overlap_check(bs, ign, offset, size, false);
+            if (ret < 0) {
+                goto out;
+            }
+
+            ret = bdrv_pwrite(bs->file, offset, buf + data, size);
+            if (ret < 0) {
+                goto out;
+            }
+            data += size;
+        }
+
+        pos += tx.length;
+        seq++;
+    }
+
+    *next_seq = seq;
+    ret = 0;
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Copies the journal to the home locations of its tables and empties it.
+ * The cache is not touched: tables that were modified again after they
+ * were journaled keep their newer version there.
+ */
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t seq;
+    int ret;
+
+    if (!s->journal_tables ||
+        !(s->incompatible_features & QCOW2_INCOMPAT_JOURNAL))
+    {
+        return 0;
+    }
+
+    trace_qcow2_journal_checkpoint(bs, s->journal_seq_start, s->journal_pos);
+
+    ret = journal_replay(bs, s->journal_pos, &seq);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * Transactions of earlier rounds may still follow the ones that were
+     * just replayed.  Each of them takes at least a block, so skip enough
+     * sequence numbers that none of them can ever look valid again.
+     */
+    seq += s->journal_size / QCOW2_JOURNAL_BLOCK;
+
+    ret = journal_write_header(bs, seq);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = journal_update_bit(bs, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Tables must not go home before the journal is known to be empty */
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->journal_seq_start = seq;
+    s->journal_seq = seq;
+    s->journal_pos = QCOW2_JOURNAL_BLOCK;
+    g_hash_table_remove_all(s->journal_tables);
+
+    return 0;
+}
+
+/*
+ * Writes all tables home and empties the journal.  Home writes only skip
+ * the overlap check for active L2 tables, so snapshot operations do this
+ * before the set of active L2 tables changes, as they would have written
+ * the tables without a journal.
+ */
+int qcow2_journal_write_home(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->journal_tables) {
+        return 0;
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qcow2_journal_checkpoint(bs);
+}
+
+/*
+ * Appends all tables that were modified since the last transaction to the
+ * journal.  The caller is responsible for flushing bs->file afterwards.
+ */
+int coroutine_fn qcow2_journal_commit(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Cache *caches[] = { s->l2_table_cache, s->refcount_block_cache };
+    uint32_t sizes[] = { s->l2_slice_size * l2_entry_size(s), s->cluster_size };
+    uint32_t types[] = { QCOW2_JOURNAL_L2, QCOW2_JOURNAL_REFBLOCK };
+    Qcow2JournalTx *tx;
+    Qcow2JournalTable *tables;
+    uint64_t offset, data, length;
+    uint32_t nb_tables = 0;
+    uint8_t *buf;
+    void *table;
+    int c, i, ret;
+
+    data = 0;
+    for (c = 0; c < ARRAY_SIZE(caches); c++) {
+        for (i = qcow2_cache_find_unjournaled(caches[c], 0, &offset, &table);
+             i >= 0;
+             i = qcow2_cache_find_unjournaled(caches[c], i + 1, &offset,
+                                              &table))
+        {
+            nb_tables++;
+            data += sizes[c];
+        }
+    }
+
+    if (nb_tables == 0) {
+        return 0;
+    }
+
+    length = journal_tx_header_size(nb_tables) +
+             ROUND_UP(data, QCOW2_JOURNAL_BLOCK);
+    if (length > s->journal_size - QCOW2_JOURNAL_BLOCK) {
+        /* Too big for the journal, write the tables home directly */
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        return qcow2_write_caches(bs);
+    }
+
+    if (length > s->journal_size - s->journal_pos) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Data that the new entries point to must be stable first */
+    for (c = 0; c < ARRAY_SIZE(caches); c++) {
+        if (qcow2_cache_has_flush_dependency(caches[c])) {
+            ret = bdrv_flush(bs->file->bs);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
+    }
+
+    buf = qemu_try_blockalign0(bs->file->bs, length);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    tx = (Qcow2JournalTx *) buf;
+    tables = (Qcow2JournalTable *) (tx + 1);
+    data = journal_tx_header_size(nb_tables);
+    for (c = 0; c < ARRAY_SIZE(caches); c++) {
+        for (i = qcow2_cache_find_unjournaled(caches[c], 0, &offset, &table);
+             i >= 0;
+             i = qcow2_cache_find_unjournaled(caches[c], i + 1, &offset,
+                                              &table))
+        {
+            *tables++ = (Qcow2JournalTable) {
+                .offset = cpu_to_be64(offset),
+                .size   = cpu_to_be32(sizes[c]),
+                .type   = cpu_to_be32(types[c]),
+            };
+            memcpy(buf + data, table, sizes[c]);
+            data += sizes[c];
+        }
+    }
+
+    *tx = (Qcow2JournalTx) {
+        .magic      = cpu_to_be32(QCOW2_JOURNAL_TX_MAGIC),
+        .seq        = cpu_to_be64(s->journal_seq),
+        .nb_tables  = cpu_to_be32(nb_tables),
+        .length     = cpu_to_be32(length),
+    };
+    tx->crc = cpu_to_be32(journal_tx_crc(buf, length));
+
+    /*
+     * No flush in between: if the bit does not make it to the disk, the
+     * transaction is lost as if the flush had never been requested.
+     */
+    ret = journal_update_bit(bs, true);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_JOURNAL,
+                                        s->journal_offset +
+                                        s->journal_pos, length, false);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_pwrite(bs->file, s->journal_offset + s->journal_pos, buf,
+                      length);
+    if (ret < 0) {
+        goto out;
+    }
+
+    trace_qcow2_journal_commit(bs, s->journal_seq, nb_tables, length);
+
+    tables = (Qcow2JournalTable *) (tx + 1);
+    for (i = 0; i < nb_tables; i++) {
+        uint64_t *cluster = g_new(uint64_t, 1);
+
+        *cluster = start_of_cluster(s, be64_to_cpu(tables[i].offset));
+        g_hash_table_add(s->journal_tables, cluster);
+    }
+    for (c = 0; c < ARRAY_SIZE(caches); c++) {
+        qcow2_cache_set_journaled(caches[c]);
+    }
+
+    s->journal_pos += length;
+    s->journal_seq++;
+    ret = 0;
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Returns whether the journal holds a table in the cluster at @offset
+ */
+bool qcow2_journal_contains(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster = start_of_cluster(s, offset);
+
+    return s->journal_tables &&
+           g_hash_table_contains(s->journal_tables, &cluster);
+}
+
+/*
+ * Allocates a journal of @size bytes for a newly created image.  It is
+ * only used from the next time the image is opened.
+ */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    size = ROUND_UP(size, s->cluster_size);
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Could not allocate the metadata "
+                         "journal");
+        return offset;
+    }
+
+    s->journal_offset = offset;
+    s->journal_size = size;
+
+    ret = journal_write_header(bs, 1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the metadata journal "
+                         "header");
+        return ret;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Sets up the journal of an image that is being opened, replaying it if
+ * it is not empty.
+ */
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader header;
+    int ret;
+
+    if (!s->journal_size) {
+        if (s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) {
+            error_setg(errp, "Image has the journal bit set, but no "
+                       "metadata journal");
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (flags & BDRV_O_NO_IO) {
+        return 0;
+    }
+
+    ret = bdrv_pread(bs->file, s->journal_offset, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the metadata journal "
+                         "header");
+        return ret;
+    }
+
+    if (be32_to_cpu(header.magic) != QCOW2_JOURNAL_MAGIC) {
+        error_setg(errp, "Invalid metadata journal header");
+        return -EINVAL;
+    }
+
+    s->journal_tables = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              g_free, NULL);
+    s->journal_seq_start = be64_to_cpu(header.seq_start);
+    s->journal_seq = s->journal_seq_start;
+    s->journal_pos = QCOW2_JOURNAL_BLOCK;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) ||
+        (flags & BDRV_O_INACTIVE))
+    {
+        return 0;
+    }
+
+    if (bs->read_only) {
+        error_setg(errp, "The metadata journal of the image must be replayed; "
+                   "open it read-write");
+        return -EPERM;
+    }
+
+    /* Where the transactions end is not known, so look at all of them */
+    s->journal_pos = s->journal_size;
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not replay the metadata journal");
+        return ret;
+    }
+
+    return 0;
+}
+
+void qcow2_journal_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->journal_tables) {
+        g_hash_table_destroy(s->journal_tables);
+        s->journal_tables = NULL;
+    }
+}
@@ -878,6 +878,13 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         } else {
             refcount += addend;
         }
+        if (refcount == 0 && qcow2_journal_contains(bs, cluster_offset)) {
+            /* A replay must not overwrite whatever reuses the cluster */
+            ret = qcow2_journal_checkpoint(bs);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
@@ -899,6 +906,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            qcow2_compressed_cache_invalidate(bs, cluster_offset,
+                                              s->cluster_size);
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -1026,6 +1036,63 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
     return offset;
 }
 
+/*
+ * Allocate up to *nb_clusters contiguous clusters for guest data, and
+ * decrease *nb_clusters if fewer were allocated.
+ *
+ * When other allocating writes are in flight, small allocations are taken
+ * from a run of QCOW2_CLUSTER_RESERVATION bytes that is refcounted in one
+ * go.  Concurrent writers then mostly neither update nor load refcount
+ * blocks while holding s->lock.  The clusters are still handed out in
+ * order, so sequential writes stay contiguous, and a single writer gets the
+ * same image layout as without the reservation.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t reservation = QCOW2_CLUSTER_RESERVATION >> s->cluster_bits;
+    uint64_t bytes;
+    int64_t offset;
+
+    if (!s->reserved_bytes) {
+        if (*nb_clusters >= reservation || QLIST_EMPTY(&s->cluster_allocs)) {
+            return qcow2_alloc_clusters(bs, *nb_clusters << s->cluster_bits);
+        }
+
+        offset = qcow2_alloc_clusters(bs, reservation << s->cluster_bits);
+        if (offset < 0) {
+            /* Maybe the smaller request still fits */
+            return qcow2_alloc_clusters(bs, *nb_clusters << s->cluster_bits);
+        }
+        s->reserved_offset = offset;
+        s->reserved_bytes = reservation << s->cluster_bits;
+    }
+
+    offset = s->reserved_offset;
+    bytes = MIN(*nb_clusters << s->cluster_bits, s->reserved_bytes);
+    s->reserved_offset += bytes;
+    s->reserved_bytes -= bytes;
+    *nb_clusters = bytes >> s->cluster_bits;
+    return offset;
+}
+
+/*
+ * Free the clusters that qcow2_alloc_data_clusters() refcounted but did not
+ * hand out yet.  Everything that expects each refcounted cluster to be in
+ * use, like image checks and refcount rebuilds, and everything that leaves
+ * the image to somebody else must call this first.
+ */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->reserved_bytes) {
+        qcow2_free_clusters(bs, s->reserved_offset, s->reserved_bytes,
+                            QCOW2_DISCARD_NEVER);
+        s->reserved_bytes = 0;
+    }
+}
+
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters)
 {
@@ -1418,6 +1485,13 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     }
 
     ret = bdrv_flush(bs);
+    if (ret == 0) {
+        /*
+         * With a journal, the flush left the tables in the journal, but
+         * the caller is about to change which L2 tables are active.
+         */
+        ret = qcow2_journal_write_home(bs);
+    }
 fail:
     if (l2_slice) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
@@ -2186,6 +2260,15 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* metadata journal */
+    if (s->journal_size) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->journal_offset, s->journal_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
@@ -2795,6 +2878,12 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
+    if ((chk & QCOW2_OL_JOURNAL) && s->journal_size) {
+        if (overlaps_with(s->journal_offset, s->journal_size)) {
+            return QCOW2_OL_JOURNAL;
+        }
+    }
+
     return 0;
 }
 
@@ -2808,6 +2897,7 @@ static const char *metadata_ol_names[] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]        = "inactive L1 table",
     [QCOW2_OL_INACTIVE_L2_BITNR]        = "inactive L2 table",
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR]   = "bitmap directory",
+    [QCOW2_OL_JOURNAL_BITNR]            = "metadata journal",
 };
 QEMU_BUILD_BUG_ON(QCOW2_OL_MAX_BITNR != ARRAY_SIZE(metadata_ol_names));
 
@@ -0,0 +1,373 @@
+/*
+ * Decompressed cluster cache for the QCOW2 format shared between processes
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Guests started from the same compressed base image decompress the same
+ * clusters over and over.  With the compressed-shared-cache option, the
+ * decompressed clusters of read-only images are additionally stored in a
+ * shared memory file, typically a memfd passed to every QEMU process with
+ * add-fd, or a file in /dev/shm.  Each process looks there before
+ * decompressing a cluster, and stores its own results there.
+ *
+ * The file starts with a header, followed by the slot descriptors and
+ * then the slot data, each slot holding one decompressed cluster.  Slots
+ * are found by hashing the image identity and the host offset of the
+ * compressed data; each hash selects a set of QCOW2_SHARED_CACHE_WAYS
+ * slots.
+ *
+ * The processes sharing the file must trust each other, but they need not
+ * cooperate beyond the following protocol: a slot is written after
+ * changing its sequence number from even to odd, and released by making it
+ * even again.  Readers copy the data and then check that the sequence
+ * number did not change and that the data matches its checksum.  A slot
+ * whose writer died stays odd and is never used again.
+ *
+ * The cache file may outlive the image it was filled from, e.g. when a
+ * base image is rebuilt at the same path, and the image identity, derived
+ * from the file name and the location of the image metadata, does not
+ * tell such images apart.  Each slot therefore also records the length
+ * and a checksum of the compressed data it was decompressed from.  The
+ * compressed data is still read for every lookup and must match, so only
+ * the decompression is saved, but an entry can never be used for data it
+ * was not created from.  Entries are only ever added for images that are
+ * opened read-only.
+ *
+ * The checksum of the compressed data is only 32 bits wide, which is
+ * enough to catch a rebuilt image but not to tell apart the clusters of
+ * all images sharing the file.  The image identity keeps entries of
+ * unrelated images out of the comparison, so that a checksum collision
+ * needs both a stale entry and a rebuilt image.
+ *
+ * Computing the checksums costs about as much as a fast decompression, so
+ * lookups run in the thread pool together with the decompression, see
+ * qcow2_co_decompress_shared().
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/crc32c.h"
+#include "qemu/xxhash.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_SHARED_CACHE_MAGIC    0x51534343 /* "QSCC" */
+#define QCOW2_SHARED_CACHE_VERSION  2
+#define QCOW2_SHARED_CACHE_WAYS     4
+
+/* Attempts to take the initialisation lock, 10 ms apart */
+#define QCOW2_SHARED_CACHE_LOCK_RETRIES 100
+
+typedef struct Qcow2SharedCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t nb_slots;
+    uint32_t stamp;
+    uint8_t padding[44];
+} Qcow2SharedCacheHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(Qcow2SharedCacheHeader) != 64);
+
+typedef struct Qcow2SharedCacheSlot {
+    uint32_t seq;
+    uint32_t crc;
+    uint32_t len;
+    uint32_t stamp;
+    uint64_t image[2];
+    uint64_t coffset;
+    /* Length and crc32c of the compressed data */
+    uint32_t clen;
+    uint32_t ccrc;
+    uint8_t padding[16];
+} Qcow2SharedCacheSlot;
+
+QEMU_BUILD_BUG_ON(sizeof(Qcow2SharedCacheSlot) != 64);
+
+struct Qcow2SharedCache {
+    int fd;
+    void *map;
+    size_t map_size;
+    Qcow2SharedCacheHeader *header;
+    Qcow2SharedCacheSlot *slots;
+    uint8_t *data;
+    uint32_t slot_size;
+    uint32_t nb_slots;
+    uint64_t image[2];
+};
+
+static size_t shared_cache_data_offset(uint32_t nb_slots)
+{
+    return ROUND_UP(sizeof(Qcow2SharedCacheHeader) +
+                    (size_t) nb_slots * sizeof(Qcow2SharedCacheSlot),
+                    qemu_real_host_page_size);
+}
+
+static int shared_cache_lock(int fd)
+{
+    int i, ret;
+
+    for (i = 0; i < QCOW2_SHARED_CACHE_LOCK_RETRIES; i++) {
+        ret = qemu_lock_fd(fd, 0, 1, true);
+        if (ret != -EAGAIN && ret != -EACCES) {
+            return ret;
+        }
+        g_usleep(10000);
+    }
+    return ret;
+}
+
+/*
+ * Maps the file at @fd, initialising it with @size bytes of slots for
+ * clusters of @cluster_size bytes if it is empty.
+ */
+static int shared_cache_map(Qcow2SharedCache *c, uint64_t size,
+                            int cluster_size, Error **errp)
+{
+    Qcow2SharedCacheHeader *header;
+    struct stat st;
+    uint64_t nb_slots;
+    bool init = false;
+    int ret;
+
+    if (fstat(c->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat the shared cache");
+        return ret;
+    }
+
+    if (st.st_size == 0) {
+        nb_slots = size / (sizeof(Qcow2SharedCacheSlot) + cluster_size);
+        nb_slots = QEMU_ALIGN_DOWN(nb_slots, QCOW2_SHARED_CACHE_WAYS);
+        if (nb_slots == 0 || nb_slots > UINT32_MAX) {
+            error_setg(errp, "Invalid shared cache size %" PRIu64, size);
+            return -EINVAL;
+        }
+        c->map_size = shared_cache_data_offset(nb_slots) +
+                      nb_slots * cluster_size;
+        if (ftruncate(c->fd, c->map_size) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not resize the shared cache");
+            return ret;
+        }
+        init = true;
+    } else {
+        c->map_size = st.st_size;
+        if (c->map_size < sizeof(Qcow2SharedCacheHeader)) {
+            error_setg(errp, "Shared cache file is too small");
+            return -EINVAL;
+        }
+    }
+
+    c->map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  c->fd, 0);
+    if (c->map == MAP_FAILED) {
+        ret = -errno;
+        c->map = NULL;
+        error_setg_errno(errp, errno, "Could not map the shared cache");
+        return ret;
+    }
+    header = c->map;
+
+    if (init) {
+        header->version = QCOW2_SHARED_CACHE_VERSION;
+        header->slot_size = cluster_size;
+        header->nb_slots = nb_slots;
+        header->stamp = 0;
+        qatomic_store_release(&header->magic, QCOW2_SHARED_CACHE_MAGIC);
+    }
+
+    if (qatomic_load_acquire(&header->magic) != QCOW2_SHARED_CACHE_MAGIC ||
+        header->version != QCOW2_SHARED_CACHE_VERSION)
+    {
+        error_setg(errp, "Shared cache file has an invalid header");
+        return -EINVAL;
+    }
+    if (header->nb_slots == 0 ||
+        header->nb_slots % QCOW2_SHARED_CACHE_WAYS ||
+        c->map_size < shared_cache_data_offset(header->nb_slots) +
+                      (uint64_t) header->nb_slots * header->slot_size)
+    {
+        error_setg(errp, "Shared cache file is too small");
+        return -EINVAL;
+    }
+    if (header->slot_size < cluster_size) {
+        error_setg(errp, "Shared cache was created for clusters of up to %"
+                   PRIu32 " bytes, but the image uses %d byte clusters",
+                   header->slot_size, cluster_size);
+        return -EINVAL;
+    }
+
+    c->header = header;
+    c->slot_size = header->slot_size;
+    c->nb_slots = header->nb_slots;
+    c->slots = (Qcow2SharedCacheSlot *)(header + 1);
+    c->data = (uint8_t *) c->map + shared_cache_data_offset(c->nb_slots);
+    return 0;
+}
+
+static void shared_cache_image_id(BlockDriverState *bs, uint64_t *image)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    uint64_t fields[] = {
+        cpu_to_be64(bs->total_sectors),
+        cpu_to_be64(s->cluster_bits),
+        cpu_to_be64(s->l1_table_offset),
+        cpu_to_be64(s->refcount_table_offset),
+    };
+    uint8_t digest[32];
+    gsize len = sizeof(digest);
+
+    g_checksum_update(checksum, (const guchar *) bs->file->bs->filename,
+                      strlen(bs->file->bs->filename));
+    g_checksum_update(checksum, (const guchar *) fields, sizeof(fields));
+    g_checksum_get_digest(checksum, digest, &len);
+    memcpy(image, digest, 2 * sizeof(uint64_t));
+}
+
+Qcow2SharedCache *qcow2_shared_cache_open(BlockDriverState *bs,
+                                          const char *filename, uint64_t size,
+                                          Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2SharedCache *c;
+    int ret;
+
+    c = g_new0(Qcow2SharedCache, 1);
+    c->fd = qemu_create(filename, O_RDWR, 0600, errp);
+    if (c->fd < 0) {
+        g_free(c);
+        return NULL;
+    }
+
+    /* Only one process may initialise an empty file */
+    ret = shared_cache_lock(c->fd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not lock the shared cache");
+        goto fail;
+    }
+    ret = shared_cache_map(c, size, s->cluster_size, errp);
+    qemu_unlock_fd(c->fd, 0, 1);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    shared_cache_image_id(bs, c->image);
+    trace_qcow2_shared_cache_open(bs, c->nb_slots, c->slot_size);
+    return c;
+
+fail:
+    qcow2_shared_cache_close(c);
+    return NULL;
+}
+
+void qcow2_shared_cache_close(Qcow2SharedCache *c)
+{
+    if (!c) {
+        return;
+    }
+
+    if (c->map) {
+        munmap(c->map, c->map_size);
+    }
+    qemu_close(c->fd);
+    g_free(c);
+}
+
+static uint32_t shared_cache_set(Qcow2SharedCache *c, uint64_t coffset)
+{
+    uint64_t hash = qemu_xxhash64_4(c->image[0], c->image[1], coffset, 0);
+
+    return (hash % (c->nb_slots / QCOW2_SHARED_CACHE_WAYS)) *
+           QCOW2_SHARED_CACHE_WAYS;
+}
+
+/*
+ * Copies the decompressed cluster whose compressed data is at host offset
+ * @coffset and was read into @cdata, @clen bytes long, into @dest, which
+ * must be @len bytes long.  Returns whether it was found.
+ */
+bool qcow2_shared_cache_get(Qcow2SharedCache *c, uint64_t coffset,
+                            const void *cdata, int clen,
+                            void *dest, int len)
+{
+    uint32_t first = shared_cache_set(c, coffset);
+    uint32_t ccrc = crc32c(~0, cdata, clen);
+    int i;
+
+    for (i = first; i < first + QCOW2_SHARED_CACHE_WAYS; i++) {
+        Qcow2SharedCacheSlot *slot = &c->slots[i];
+        uint32_t seq, crc;
+
+        seq = qatomic_load_acquire(&slot->seq);
+        if ((seq & 1) || slot->coffset != coffset ||
+            slot->image[0] != c->image[0] || slot->image[1] != c->image[1] ||
+            slot->len != len || slot->clen != clen || slot->ccrc != ccrc)
+        {
+            continue;
+        }
+
+        memcpy(dest, c->data + (size_t) i * c->slot_size, len);
+        crc = slot->crc;
+        /* Read the slot before checking that nobody wrote to it meanwhile */
+        smp_rmb();
+        if (qatomic_read(&slot->seq) != seq || crc32c(~0, dest, len) != crc) {
+            continue;
+        }
+
+        qatomic_set(&slot->stamp, qatomic_fetch_inc(&c->header->stamp));
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Stores the decompressed cluster whose compressed data is at host offset
+ * @coffset and consists of the @clen bytes at @cdata, replacing the least
+ * recently used entry of its set.  Nothing is stored if another process is
+ * writing to that entry.
+ */
+void qcow2_shared_cache_put(Qcow2SharedCache *c, uint64_t coffset,
+                            const void *cdata, int clen,
+                            const void *data, int len)
+{
+    uint32_t first = shared_cache_set(c, coffset);
+    Qcow2SharedCacheSlot *slot = NULL;
+    uint32_t seq;
+    int i;
+
+    for (i = first; i < first + QCOW2_SHARED_CACHE_WAYS; i++) {
+        Qcow2SharedCacheSlot *e = &c->slots[i];
+
+        if (!slot || qatomic_read(&e->stamp) < qatomic_read(&slot->stamp)) {
+            slot = e;
+        }
+    }
+
+    /* qatomic_cmpxchg() orders the writes below after taking the slot */
+    seq = qatomic_read(&slot->seq);
+    if ((seq & 1) || qatomic_cmpxchg(&slot->seq, seq, seq + 1) != seq) {
+        return;
+    }
+
+    i = slot - c->slots;
+    memcpy(c->data + (size_t) i * c->slot_size, data, len);
+    slot->len = len;
+    slot->crc = crc32c(~0, data, len);
+    slot->clen = clen;
+    slot->ccrc = crc32c(~0, cdata, clen);
+    slot->coffset = coffset;
+    slot->image[0] = c->image[0];
+    slot->image[1] = c->image[1];
+    qatomic_set(&slot->stamp, qatomic_fetch_inc(&c->header->stamp));
+
+    qatomic_store_release(&slot->seq, seq + 2);
+}
@@ -388,6 +388,21 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
     return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
 }
 
+static Qcow2CompressFunc qcow2_decompress_func(BDRVQcow2State *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_decompress;
+
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_decompress;
+#endif
+    default:
+        abort();
+    }
+}
+
 /*
  * qcow2_co_decompress()
  *
@@ -406,25 +421,75 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size)
 {
     BDRVQcow2State *s = bs->opaque;
-    Qcow2CompressFunc fn;
 
-    switch (s->compression_type) {
-    case QCOW2_COMPRESSION_TYPE_ZLIB:
-        fn = qcow2_zlib_decompress;
-        break;
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
+                                qcow2_decompress_func(s));
+}
 
-#ifdef CONFIG_ZSTD
-    case QCOW2_COMPRESSION_TYPE_ZSTD:
-        fn = qcow2_zstd_decompress;
-        break;
-#endif
-    default:
-        abort();
+typedef struct Qcow2SharedDecompressData {
+    Qcow2CompressData data;
+    Qcow2SharedCache *cache;
+    uint64_t coffset;
+} Qcow2SharedDecompressData;
+
+static int qcow2_shared_decompress_pool_func(void *opaque)
+{
+    Qcow2SharedDecompressData *arg = opaque;
+    Qcow2CompressData *data = &arg->data;
+
+    if (qcow2_shared_cache_get(arg->cache, arg->coffset,
+                               data->src, data->src_size,
+                               data->dest, data->dest_size))
+    {
+        data->ret = 0;
+        return 0;
     }
 
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    if (data->ret == 0) {
+        qcow2_shared_cache_put(arg->cache, arg->coffset,
+                               data->src, data->src_size,
+                               data->dest, data->dest_size);
+    }
+
+    return 0;
 }
 
+/*
+ * qcow2_co_decompress_shared()
+ *
+ * Like qcow2_co_decompress(), but first looks up the compressed data at
+ * host offset @coffset in the shared cache of the image, and stores the
+ * result there otherwise.  The lookup checksums both the compressed and the
+ * decompressed data, so it runs in the thread pool like the decompression.
+ */
+ssize_t coroutine_fn
+qcow2_co_decompress_shared(BlockDriverState *bs, uint64_t coffset,
+                           void *dest, size_t dest_size,
+                           const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2SharedDecompressData arg = {
+        .data = {
+            .dest = dest,
+            .dest_size = dest_size,
+            .src = src,
+            .src_size = src_size,
+            .func = qcow2_decompress_func(s),
+        },
+        .cache = s->shared_cache,
+        .coffset = coffset,
+    };
+
+    if (!s->shared_cache) {
+        return qcow2_co_decompress(bs, dest, dest_size, src, src_size);
+    }
+
+    qcow2_co_process(bs, qcow2_shared_decompress_pool_func, &arg);
+
+    return arg.data.ret;
+}
 
 /*
  * Cryptography
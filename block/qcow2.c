@@ -71,6 +71,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_JOURNAL 0x6a726e6c
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -207,6 +208,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     uint64_t offset;
     int ret;
     Qcow2BitmapHeaderExt bitmaps_ext;
+    Qcow2JournalHeaderExt journal_ext;
 
     if (need_update_header != NULL) {
         *need_update_header = false;
@@ -427,6 +429,37 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_JOURNAL:
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "journal_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &journal_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "journal_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            journal_ext.offset = be64_to_cpu(journal_ext.offset);
+            journal_ext.size = be64_to_cpu(journal_ext.size);
+
+            if (offset_into_cluster(s, journal_ext.offset) ||
+                offset_into_cluster(s, journal_ext.size) ||
+                journal_ext.size < QCOW2_JOURNAL_MIN_SIZE ||
+                journal_ext.size > QCOW2_JOURNAL_MAX_SIZE ||
+                journal_ext.offset > QCOW_MAX_CLUSTER_OFFSET)
+            {
+                error_setg(errp, "journal_ext: Invalid journal offset or "
+                           "size");
+                return -EINVAL;
+            }
+
+            s->journal_offset = journal_ext.offset;
+            s->journal_size = journal_ext.size;
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -611,6 +644,8 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -692,11 +727,16 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_OVERLAP_INACTIVE_L1,
     QCOW2_OPT_OVERLAP_INACTIVE_L2,
     QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    QCOW2_OPT_OVERLAP_JOURNAL,
     QCOW2_OPT_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_COMPRESSED_READAHEAD,
+    QCOW2_OPT_COMPRESSED_SHARED_CACHE,
+    QCOW2_OPT_COMPRESSED_SHARED_CACHE_SIZE,
+    QCOW2_OPT_CHAIN_MAP,
     NULL
 };
 
@@ -782,6 +822,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into the bitmap directory",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_JOURNAL,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the metadata journal",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -808,6 +853,29 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_COMPRESSED_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of compressed clusters to read ahead on "
+                    "sequential reads",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_SHARED_CACHE,
+            .type = QEMU_OPT_STRING,
+            .help = "File shared with other processes to cache "
+                    "decompressed clusters of read-only images",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_SHARED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the shared cache file when it is created",
+        },
+        {
+            .name = QCOW2_OPT_CHAIN_MAP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Remember which backing file holds the data of "
+                    "unallocated clusters",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -824,6 +892,7 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L2,
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    [QCOW2_OL_JOURNAL_BITNR]          = QCOW2_OPT_OVERLAP_JOURNAL,
 };
 
 static void cache_clean_timer_cb(void *opaque)
@@ -968,6 +1037,10 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t compressed_readahead;
+    Qcow2CompressedCache *compressed_cache;
+    Qcow2SharedCache *shared_cache;
+    bool chain_map;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -979,6 +1052,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
+    const char *opt_shared_cache;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
@@ -1069,6 +1143,48 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->compressed_readahead =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESSED_READAHEAD, 0);
+    if (r->compressed_readahead > QCOW2_MAX_COMPRESSED_READAHEAD) {
+        error_setg(errp, QCOW2_OPT_COMPRESSED_READAHEAD " may not exceed %d",
+                   QCOW2_MAX_COMPRESSED_READAHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->compressed_readahead) {
+        r->compressed_cache =
+            qcow2_compressed_cache_create(bs, r->compressed_readahead);
+        if (!r->compressed_cache) {
+            error_setg(errp, "Could not allocate compressed cluster cache");
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    /* The shared cache is never invalidated, so only use it read-only */
+    opt_shared_cache = qemu_opt_get(opts, QCOW2_OPT_COMPRESSED_SHARED_CACHE);
+#ifndef CONFIG_POSIX
+    if (opt_shared_cache) {
+        error_setg(errp, QCOW2_OPT_COMPRESSED_SHARED_CACHE
+                   " not supported on this host");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (opt_shared_cache && !(flags & BDRV_O_RDWR)) {
+        r->shared_cache = qcow2_shared_cache_open(bs, opt_shared_cache,
+            qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_SHARED_CACHE_SIZE,
+                              DEFAULT_COMPRESSED_SHARED_CACHE_SIZE),
+            errp);
+        if (!r->shared_cache) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+#endif
+
+    r->chain_map = qemu_opt_get_bool(opts, QCOW2_OPT_CHAIN_MAP, false);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1224,6 +1340,17 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = r->compressed_cache;
+    qcow2_shared_cache_close(s->shared_cache);
+    s->shared_cache = r->shared_cache;
+
+    if (r->chain_map) {
+        bdrv_chain_map_enable(bs, s->cluster_size);
+    } else {
+        bdrv_chain_map_disable(bs);
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1237,6 +1364,8 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    qcow2_compressed_cache_destroy(r->compressed_cache);
+    qcow2_shared_cache_close(r->shared_cache);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1728,6 +1857,12 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
     }
 
+    /* Bring the tables up to date before anything else looks at them */
+    ret = qcow2_journal_open(bs, flags, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* == Handle persistent dirty bitmaps ==
      *
      * We want load dirty bitmaps in three cases:
@@ -1845,6 +1980,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_journal_close(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
@@ -1856,6 +1992,11 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
+    qcow2_shared_cache_close(s->shared_cache);
+    s->shared_cache = NULL;
+    bdrv_chain_map_disable(bs);
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -1926,6 +2067,7 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BDRVQcow2State *s = state->bs->opaque;
     Qcow2ReopenState *r;
     int ret;
 
@@ -1940,6 +2082,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_release_reserved_clusters(state->bs);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
@@ -1950,6 +2094,19 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        /* The flush only appended the tables to the journal */
+        if (s->journal_tables) {
+            ret = qcow2_flush_caches(state->bs);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            ret = qcow2_journal_checkpoint(state->bs);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
         ret = qcow2_mark_clean(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2245,6 +2402,10 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
         assert(bs->backing); /* otherwise handled in qcow2_co_preadv_part */
 
         BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
+        if (bs->chain_map) {
+            return bdrv_co_chain_map_preadv(bs, offset, bytes,
+                                            qiov, qiov_offset);
+        }
         return bdrv_co_preadv_part(bs->backing, offset, bytes,
                                    qiov, qiov_offset, 0);
 
@@ -2654,6 +2815,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_reserved_clusters(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2676,6 +2839,13 @@ static int qcow2_inactivate(BlockDriverState *bs)
                      strerror(-ret));
     }
 
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to checkpoint the metadata journal: %s",
+                     strerror(-ret));
+    }
+
     if (result == 0) {
         qcow2_mark_clean(bs);
     }
@@ -2697,6 +2867,11 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
+    qcow2_shared_cache_close(s->shared_cache);
+    s->shared_cache = NULL;
+    bdrv_chain_map_disable(bs);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -2714,6 +2889,7 @@ static void qcow2_close(BlockDriverState *bs)
         s->data_file = NULL;
     }
 
+    qcow2_journal_close(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2948,6 +3124,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+                .name = "metadata journal",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2993,6 +3174,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Metadata journal extension */
+    if (s->journal_size) {
+        Qcow2JournalHeaderExt journal_header = {
+            .offset = cpu_to_be64(s->journal_offset),
+            .size   = cpu_to_be64(s->journal_size),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_JOURNAL,
+                             &journal_header, sizeof(journal_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -3491,6 +3688,25 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     }
     refcount_order = ctz32(qcow2_opts->refcount_bits);
 
+    if (qcow2_opts->has_journal_size && qcow2_opts->journal_size) {
+        if (version < 3) {
+            error_setg(errp, "Metadata journals are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (qcow2_opts->journal_size < QCOW2_JOURNAL_MIN_SIZE ||
+            qcow2_opts->journal_size > QCOW2_JOURNAL_MAX_SIZE)
+        {
+            error_setg(errp, "Journal size must be between %" PRId64
+                       " and %" PRId64 " bytes", QCOW2_JOURNAL_MIN_SIZE,
+                       QCOW2_JOURNAL_MAX_SIZE);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
     if (qcow2_opts->data_file_raw && !qcow2_opts->data_file) {
         error_setg(errp, "data-file-raw requires data-file");
         ret = -EINVAL;
@@ -3659,6 +3875,15 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    /* Want a metadata journal? There you go. */
+    if (qcow2_opts->has_journal_size && qcow2_opts->journal_size) {
+        ret = qcow2_journal_create(blk_bs(blk), qcow2_opts->journal_size,
+                                   errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     /* Okay, now that we have a valid image, let's give it the right size */
     ret = blk_truncate(blk, qcow2_opts->size, false, qcow2_opts->preallocation,
                        0, errp);
@@ -3778,6 +4003,7 @@ static int coroutine_fn qcow2_co_create_opts(BlockDriver *drv,
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
         { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_JOURNAL_SIZE,       "journal-size" },
         { NULL, NULL },
     };
 
@@ -4149,6 +4375,9 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
 
     qemu_co_mutex_lock(&s->lock);
 
+    /* Shrinking looks for the last cluster in use */
+    qcow2_release_reserved_clusters(bs);
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4637,40 +4866,25 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize, nb_csectors;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
+    int ret;
+    uint8_t *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
-    coffset = cluster_descriptor & s->cluster_offset_mask;
-    nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
-    csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
-        (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
-
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
+    if (s->compressed_cache) {
+        return qcow2_co_preadv_compressed_cached(bs, cluster_descriptor,
+                                                 offset, bytes, qiov,
+                                                 qiov_offset);
     }
 
     out_buf = qemu_blockalign(bs, s->cluster_size);
 
-    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
-    if (ret < 0) {
-        goto fail;
+    ret = qcow2_co_read_compressed(bs, cluster_descriptor, out_buf);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
-    }
-
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
-fail:
     qemu_vfree(out_buf);
-    g_free(buf);
-
     return ret;
 }
 
@@ -4698,6 +4912,8 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    qcow2_compressed_cache_invalidate(bs, 0, INT64_MAX);
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -4785,6 +5001,7 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    s->reserved_bytes = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -4837,16 +5054,16 @@ static int qcow2_make_empty(BlockDriverState *bs)
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
-        !has_data_file(bs)) {
+        !has_data_file(bs) && !s->journal_size) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
-         * empties the image.  Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one
-         * refcount block) have to fit inside one refcount block. It
-         * only resets the image file, i.e. does not work with an
-         * external data file. */
+         * LUKS header, persistent bitmaps or a metadata journal),
+         * because it completely empties the image.  Furthermore, the L1
+         * table and three additional clusters (image header, refcount
+         * table, one refcount block) have to fit inside one refcount
+         * block. It only resets the image file, i.e. does not work with
+         * an external data file. */
         return make_completely_empty(bs);
     }
 
@@ -4875,7 +5092,11 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_write_caches(bs);
+    if (s->journal_tables) {
+        ret = qcow2_journal_commit(bs);
+    } else {
+        ret = qcow2_write_caches(bs);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -4891,6 +5112,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     uint64_t refcount_bits;
     uint64_t l2_tables;
     uint64_t luks_payload_size = 0;
+    uint64_t journal_size;
     size_t cluster_size;
     int version;
     char *optstr;
@@ -4959,6 +5181,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     virtual_size = qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0);
     virtual_size = ROUND_UP(virtual_size, cluster_size);
 
+    journal_size = qemu_opt_get_size_del(opts, BLOCK_OPT_JOURNAL_SIZE, 0);
+    journal_size = ROUND_UP(journal_size, cluster_size);
+
     /* Check that virtual disk size is valid */
     l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
@@ -5025,7 +5250,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     }
 
     info = g_new0(BlockMeasureInfo, 1);
-    info->fully_allocated = luks_payload_size +
+    info->fully_allocated = luks_payload_size + journal_size +
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
                                  ctz32(refcount_bits), extended_l2);
 
@@ -5106,6 +5331,10 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
             .compression_type   = s->compression_type,
+            .has_journal_offset = s->journal_size != 0,
+            .journal_offset     = s->journal_offset,
+            .has_journal_size   = s->journal_size != 0,
+            .journal_size       = s->journal_size,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -5215,6 +5444,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->journal_size) {
+        error_setg(errp, "Cannot downgrade an image with a metadata journal");
+        return -ENOTSUP;
+    }
+
     /*
      * If any internal snapshot has a different size than the current
      * image size, or VM state size that exceeds 32 bits, downgrading
@@ -5556,6 +5790,7 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
 
         helper_cb_info.current_operation = QCOW2_CHANGING_REFCOUNT_ORDER;
+        qcow2_release_reserved_clusters(bs);
         ret = qcow2_change_refcount_order(bs, refcount_order,
                                           &qcow2_amend_helper_cb,
                                           &helper_cb_info, errp);
@@ -5843,6 +6078,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Compression method used for image cluster "        \
                     "compression",                                      \
             .def_value_str = "zlib"                                     \
+        },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_JOURNAL_SIZE,                             \
+            .type = QEMU_OPT_SIZE,                                      \
+            .help = "Size of the metadata journal, 0 for none"          \
         },
         QCOW_COMMON_OPTIONS,
         { /* end of list */ }
@@ -57,6 +57,9 @@
  * (128 GB for 512 byte clusters, 2 EB for 2 MB clusters) */
 #define QCOW_MAX_L1_SIZE (32 * MiB)
 
+/* Size of the cluster runs that qcow2_alloc_data_clusters() refcounts */
+#define QCOW2_CLUSTER_RESERVATION (4 * MiB)
+
 /* Allow for an average of 1k per snapshot table entry, should be plenty of
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
@@ -64,6 +67,10 @@
 /* Maximum amount of extra data per snapshot table entry to accept */
 #define QCOW_MAX_SNAPSHOT_EXTRA_DATA 1024
 
+/* Metadata journal size limits */
+#define QCOW2_JOURNAL_MIN_SIZE (1 * MiB)
+#define QCOW2_JOURNAL_MAX_SIZE (1 * GiB)
+
 /* Bitmap header extension constraints */
 #define QCOW2_MAX_BITMAPS 65535
 #define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
@@ -129,6 +136,10 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+#define QCOW2_MAX_COMPRESSED_READAHEAD 64 /* clusters */
+
+#define DEFAULT_COMPRESSED_SHARED_CACHE_SIZE (256 * MiB)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -145,11 +156,16 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY "overlap-check.bitmap-directory"
+#define QCOW2_OPT_OVERLAP_JOURNAL "overlap-check.journal"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_COMPRESSED_READAHEAD "compressed-readahead"
+#define QCOW2_OPT_COMPRESSED_SHARED_CACHE "compressed-shared-cache"
+#define QCOW2_OPT_COMPRESSED_SHARED_CACHE_SIZE "compressed-shared-cache-size"
+#define QCOW2_OPT_CHAIN_MAP "chain-map"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -231,6 +247,9 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+typedef struct Qcow2SharedCache Qcow2SharedCache;
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
@@ -256,17 +275,20 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_JOURNAL_BITNR    = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_JOURNAL          = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_JOURNAL,
 };
 
 /* Compatible feature bits */
@@ -322,6 +344,11 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2JournalHeaderExt {
+    uint64_t offset;
+    uint64_t size;
+} QEMU_PACKED Qcow2JournalHeaderExt;
+
 #define QCOW2_MAX_THREADS 4
 
 typedef struct BDRVQcow2State {
@@ -356,6 +383,9 @@ typedef struct BDRVQcow2State {
     uint32_t max_refcount_table_index; /* Last used entry in refcount_table */
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
+    /* Clusters refcounted by qcow2_alloc_data_clusters() but not used yet */
+    uint64_t reserved_offset;
+    uint64_t reserved_bytes;
 
     CoMutex lock;
 
@@ -374,6 +404,14 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /* Metadata journal, see qcow2-journal.c */
+    uint64_t journal_offset;
+    uint64_t journal_size;
+    uint64_t journal_pos;
+    uint64_t journal_seq_start;
+    uint64_t journal_seq;
+    GHashTable *journal_tables;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -409,6 +447,11 @@ typedef struct BDRVQcow2State {
     CoQueue thread_task_queue;
     int nb_threads;
 
+    /* Decompressed clusters, NULL without compressed readahead */
+    Qcow2CompressedCache *compressed_cache;
+    /* Decompressed clusters shared with other processes, read-only only */
+    Qcow2SharedCache *shared_cache;
+
     BdrvChild *data_file;
 
     bool metadata_preallocation_checked;
@@ -555,8 +598,9 @@ typedef enum QCow2MetadataOverlap {
     QCOW2_OL_INACTIVE_L1_BITNR      = 6,
     QCOW2_OL_INACTIVE_L2_BITNR      = 7,
     QCOW2_OL_BITMAP_DIRECTORY_BITNR = 8,
+    QCOW2_OL_JOURNAL_BITNR          = 9,
 
-    QCOW2_OL_MAX_BITNR              = 9,
+    QCOW2_OL_MAX_BITNR              = 10,
 
     QCOW2_OL_NONE             = 0,
     QCOW2_OL_MAIN_HEADER      = (1 << QCOW2_OL_MAIN_HEADER_BITNR),
@@ -570,12 +614,13 @@ typedef enum QCow2MetadataOverlap {
      * reads. */
     QCOW2_OL_INACTIVE_L2      = (1 << QCOW2_OL_INACTIVE_L2_BITNR),
     QCOW2_OL_BITMAP_DIRECTORY = (1 << QCOW2_OL_BITMAP_DIRECTORY_BITNR),
+    QCOW2_OL_JOURNAL          = (1 << QCOW2_OL_JOURNAL_BITNR),
 } QCow2MetadataOverlap;
 
 /* Perform all overlap checks which can be done in constant time */
 #define QCOW2_OL_CONSTANT \
     (QCOW2_OL_MAIN_HEADER | QCOW2_OL_ACTIVE_L1 | QCOW2_OL_REFCOUNT_TABLE | \
-     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY)
+     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY | QCOW2_OL_JOURNAL)
 
 /* Perform all overlap checks which don't require disk access */
 #define QCOW2_OL_CACHED \
@@ -864,6 +909,8 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *nb_clusters);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -962,6 +1009,10 @@ int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
+bool qcow2_cache_has_flush_dependency(Qcow2Cache *c);
+int qcow2_cache_find_unjournaled(Qcow2Cache *c, int start, uint64_t *offset,
+                                 void **table);
+void qcow2_cache_set_journaled(Qcow2Cache *c);
 
 void qcow2_cache_clean_unused(Qcow2Cache *c);
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
@@ -974,6 +1025,65 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-journal.c functions */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size, Error **errp);
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp);
+void qcow2_journal_close(BlockDriverState *bs);
+bool qcow2_journal_contains(BlockDriverState *bs, uint64_t offset);
+int coroutine_fn qcow2_journal_commit(BlockDriverState *bs);
+int qcow2_journal_checkpoint(BlockDriverState *bs);
+int qcow2_journal_write_home(BlockDriverState *bs);
+
+/* qcow2-compressed.c functions */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t cluster_descriptor,
+                                          void *dest);
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs,
+                                                    int readahead);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes);
+int coroutine_fn
+qcow2_co_preadv_compressed_cached(BlockDriverState *bs,
+                                  uint64_t cluster_descriptor,
+                                  uint64_t offset, uint64_t bytes,
+                                  QEMUIOVector *qiov, size_t qiov_offset);
+
+/* qcow2-shared-cache.c functions */
+#ifdef CONFIG_POSIX
+Qcow2SharedCache *qcow2_shared_cache_open(BlockDriverState *bs,
+                                          const char *filename, uint64_t size,
+                                          Error **errp);
+void qcow2_shared_cache_close(Qcow2SharedCache *c);
+bool qcow2_shared_cache_get(Qcow2SharedCache *c, uint64_t coffset,
+                            const void *cdata, int clen,
+                            void *dest, int len);
+void qcow2_shared_cache_put(Qcow2SharedCache *c, uint64_t coffset,
+                            const void *cdata, int clen,
+                            const void *data, int len);
+#else
+/* Never opened, see qcow2_update_options_prepare() */
+static inline void qcow2_shared_cache_close(Qcow2SharedCache *c)
+{
+}
+
+static inline bool qcow2_shared_cache_get(Qcow2SharedCache *c,
+                                          uint64_t coffset,
+                                          const void *cdata, int clen,
+                                          void *dest, int len)
+{
+    g_assert_not_reached();
+}
+
+static inline void qcow2_shared_cache_put(Qcow2SharedCache *c,
+                                          uint64_t coffset,
+                                          const void *cdata, int clen,
+                                          const void *data, int len)
+{
+    g_assert_not_reached();
+}
+#endif
+
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                   void **refcount_table,
@@ -1004,6 +1114,10 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size);
+ssize_t coroutine_fn
+qcow2_co_decompress_shared(BlockDriverState *bs, uint64_t coffset,
+                           void *dest, size_t dest_size,
+                           const void *src, size_t src_size);
 int coroutine_fn
 qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
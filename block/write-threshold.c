@@ -118,7 +118,13 @@ void qmp_block_set_write_threshold(const char *node_name,
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
+    /*
+     * The notifier is not thread-safe; draining makes multi-queue parents
+     * re-check whether they may spread their requests over AioContexts.
+     */
+    bdrv_drained_begin(bs);
     bdrv_write_threshold_set(bs, threshold_bytes);
+    bdrv_drained_end(bs);
 
     aio_context_release(aio_context);
 }
@@ -301,6 +301,7 @@ int64_t block_job_ratelimit_get_delay(BlockJob *job, uint64_t n)
 
 BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
 {
+    const BlockJobDriver *drv = block_job_driver(job);
     BlockJobInfo *info;
 
     if (block_job_is_internal(job)) {
@@ -326,6 +327,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
                         g_strdup(error_get_pretty(job->job.err)) :
                         g_strdup(strerror(-job->job.ret));
     }
+    if (drv->query) {
+        drv->query(job, info);
+    }
     return info;
 }
 
@@ -43,6 +43,17 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * With several iothreads, virtqueue i is processed in vq_ctx[i].  The
+     * first iothread is the home of the BlockBackend, ctx above.
+     */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext **vq_ctx;
+
+    /* Whether the host notifiers are hooked up to vq_ctx[] */
+    bool notifiers_attached;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -88,10 +99,11 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread || conf->num_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -119,13 +131,37 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
-
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+
+    if (conf->num_iothreads) {
+        s->iothreads = g_new0(IOThread *, conf->num_iothreads);
+        for (i = 0; i < conf->num_iothreads; i++) {
+            s->iothreads[i] = iothread_by_id(conf->iothreads[i]);
+            if (!s->iothreads[i]) {
+                error_setg(errp, "iothread '%s' not found",
+                           conf->iothreads[i]);
+                virtio_blk_data_plane_destroy(s);
+                return false;
+            }
+            object_ref(OBJECT(s->iothreads[i]));
+            s->num_iothreads++;
+        }
+        s->ctx = iothread_get_aio_context(s->iothreads[0]);
+        for (i = 0; i < conf->num_queues; i++) {
+            s->vq_ctx[i] = iothread_get_aio_context(
+                               s->iothreads[i % s->num_iothreads]);
+        }
     } else {
-        s->ctx = qemu_get_aio_context();
+        if (conf->iothread) {
+            s->iothread = conf->iothread;
+            object_ref(OBJECT(s->iothread));
+            s->ctx = iothread_get_aio_context(s->iothread);
+        } else {
+            s->ctx = qemu_get_aio_context();
+        }
+        for (i = 0; i < conf->num_queues; i++) {
+            s->vq_ctx[i] = s->ctx;
+        }
     }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
@@ -139,6 +175,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -147,22 +184,91 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+    }
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->vq_ctx);
     g_free(s);
 }
 
+/* The AioContext that processes @vq, and whose lock protects it */
+AioContext *virtio_blk_data_plane_vq_context(VirtIOBlockDataPlane *s,
+                                             VirtQueue *vq)
+{
+    return s->vq_ctx[virtio_get_queue_index(vq)];
+}
+
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
+    bool progress = false;
 
     assert(s->dataplane);
     assert(s->dataplane_started);
 
-    return virtio_blk_handle_vq(s, vq);
+    /*
+     * A drained section stops only the home AioContext, and the handlers of
+     * the other iothreads may still be running after
+     * virtio_blk_data_plane_drained_begin() detached them.  Count as in
+     * flight so that the drained section waits for us, and leave the
+     * virtqueue alone if it has already begun; drained_end kicks it again.
+     */
+    blk_inc_in_flight(s->conf.conf.blk);
+    smp_mb(); /* pairs with smp_mb() in blk_root_drained_begin() */
+    if (!blk_in_drain(s->conf.conf.blk)) {
+        progress = virtio_blk_handle_vq(s, vq);
+    }
+    blk_dec_in_flight(s->conf.conf.blk);
+
+    return progress;
+}
+
+/*
+ * Detach the virtqueues from their iothreads for a drained section of the
+ * BlockBackend.  aio_disable_external() only covers the home AioContext.
+ *
+ * Context: QEMU global mutex or the home AioContext held
+ */
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->notifiers_attached) {
+        return;
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        virtio_queue_aio_detach_host_notifier(vq, s->vq_ctx[i]);
+    }
+}
+
+/* Context: QEMU global mutex or the home AioContext held */
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->notifiers_attached) {
+        return;
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i],
+                virtio_blk_data_plane_handle_output);
+        /* Requests may have been left in the vring during the section */
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
 }
 
 /* Context: QEMU global mutex held */
@@ -184,7 +290,9 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    /* The notification BH is shared, only batch within one iothread */
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX) &&
+        s->num_iothreads <= 1) {
         s->batch_notifications = true;
     } else {
         s->batch_notifications = false;
@@ -224,6 +332,13 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
         goto fail_guest_notifiers;
     }
 
+    if (s->num_iothreads > 1 &&
+        !blk_set_multiqueue(s->conf->conf.blk, true)) {
+        warn_report("virtio-blk: the block graph does not support "
+                    "multi-queue, I/O will be funnelled through iothread "
+                    "'%s'", s->conf->iothreads[0]);
+    }
+
     /* Process queued requests before the ones in vring */
     virtio_blk_process_queued_requests(vblk, false);
 
@@ -235,14 +350,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i],
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(s->vq_ctx[i]);
     }
-    aio_context_release(s->ctx);
+    s->notifiers_attached = true;
     return 0;
 
   fail_guest_notifiers:
@@ -259,17 +375,20 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
 /* Stop notifications for new requests from guest.
  *
- * Context: BH in IOThread
+ * Context: BH in IOThread, for the virtqueues it processes
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_ctx[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -294,14 +413,24 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
         return;
     }
     s->stopping = true;
+    s->notifiers_attached = false;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 1; i < s->num_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->iothreads[i]);
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context(), NULL);
+    blk_set_multiqueue(s->conf->conf.blk, false);
 
     aio_context_release(s->ctx);
 
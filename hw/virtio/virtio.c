@@ -3561,6 +3561,17 @@ static void virtio_queue_host_notifier_aio_poll_end(EventNotifier *n)
     virtio_queue_set_notification(vq, 1);
 }
 
+/*
+ * Stops watching the host notifier of @vq in @ctx without processing the
+ * virtqueue, so unlike virtio_queue_aio_set_host_notifier_handler() it may
+ * be called from outside @ctx.  A handler that is already running in @ctx
+ * is not waited for.
+ */
+void virtio_queue_aio_detach_host_notifier(VirtQueue *vq, AioContext *ctx)
+{
+    aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL, NULL);
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleAIOOutput handle_output)
 {
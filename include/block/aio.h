@@ -211,6 +211,12 @@ struct AioContext {
      */
     struct LuringState *linux_io_uring;
 
+    /*
+     * io_uring instance that polls for completions, for O_DIRECT reads and
+     * writes.  Same locking as linux_io_uring.
+     */
+    struct LuringState *linux_io_uring_iopoll;
+
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
@@ -232,6 +238,10 @@ struct AioContext {
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /* io_uring polling modes, see aio_context_set_io_uring_params() */
+    bool io_uring_sqpoll;
+    bool io_uring_iopoll;
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -492,6 +502,14 @@ struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/*
+ * Setup the LuringState bound to this AioContext that polls for
+ * completions.  Returns NULL without setting @errp if completion polling
+ * is disabled for the AioContext.
+ */
+struct LuringState *aio_setup_linux_io_uring_iopoll(AioContext *ctx,
+                                                    Error **errp);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -727,4 +745,19 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll: submit io_uring requests through a kernel thread that polls
+ *          the submission queue, instead of a syscall
+ * @iopoll: poll the device for completions of O_DIRECT reads and writes,
+ *          instead of waiting for an interrupt
+ *
+ * Only takes effect for io_uring instances that are set up afterwards, so
+ * call this before the AioContext is used for I/O.  Completion polling
+ * keeps the event loop spinning while requests are in flight.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, bool sqpoll,
+                                     bool iopoll);
+
 #endif
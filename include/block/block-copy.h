@@ -89,4 +89,11 @@ void block_copy_call_cancel(BlockCopyCallState *call_state);
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
+/*
+ * Return statistics of all copy requests made so far, together with the
+ * current request size and concurrency.  Caller must free the result with
+ * qapi_free_BlockCopyStats().
+ */
+BlockCopyStats *block_copy_get_stats(BlockCopyState *s);
+
 #endif /* BLOCK_COPY_H */
@@ -707,6 +707,7 @@ int bdrv_probe_geometry(BlockDriverState *bs, HDGeometry *geo);
 
 void bdrv_io_plug(BlockDriverState *bs);
 void bdrv_io_unplug(BlockDriverState *bs);
+bool bdrv_supports_multiqueue(BlockDriverState *bs);
 
 /**
  * bdrv_parent_drained_begin_single:
@@ -60,6 +60,7 @@
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 #define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_JOURNAL_SIZE      "journal_size"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -120,6 +121,15 @@ struct BlockDriver {
      * on those children.
      */
     bool is_format;
+    /*
+     * Set to true if the driver's request functions may be called from
+     * several AioContexts at the same time, each request running to
+     * completion in the context that submitted it.  Plugging must then
+     * be tracked per AioContext by the driver, so .bdrv_io_plug and
+     * .bdrv_io_unplug are called for every plug/unplug pair, not just
+     * the outermost one.
+     */
+    bool supports_multiqueue;
     /*
      * Return true if @to_replace can be replaced by a BDS with the
      * same data as @bs without it affecting @bs's behavior (that is,
@@ -707,6 +717,8 @@ typedef struct BlockLimits {
 
 typedef struct BdrvOpBlocker BdrvOpBlocker;
 
+typedef struct BdrvChainMap BdrvChainMap;
+
 typedef struct BdrvAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
     void (*detach_aio_context)(void *opaque);
@@ -1011,6 +1023,9 @@ struct BlockDriverState {
 
     /* BdrvChild links to this node may never be frozen */
     bool never_freeze;
+
+    /* Owners of unallocated ranges in the backing chain, or NULL */
+    BdrvChainMap *chain_map;
 };
 
 struct BlockBackendRootState {
@@ -1092,6 +1107,9 @@ bool bdrv_backing_overridden(BlockDriverState *bs);
  *
  * Register a callback that is invoked before write requests are processed but
  * after any throttling or waiting for overlapping requests.
+ *
+ * The node must be drained while the notifier is added, so that multi-queue
+ * BlockBackends above it move their requests back to a single AioContext.
  */
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
@@ -1447,4 +1465,19 @@ static inline BlockDriverState *bdrv_primary_bs(BlockDriverState *bs)
  */
 void bdrv_drain_all_end_quiesce(BlockDriverState *bs);
 
+/* block/chain-map.c */
+void bdrv_chain_map_enable(BlockDriverState *bs, int64_t granularity);
+void bdrv_chain_map_disable(BlockDriverState *bs);
+void bdrv_chain_map_invalidate(void);
+void bdrv_chain_map_write(BlockDriverState *bs);
+BdrvChild *coroutine_fn bdrv_co_chain_map_get(BlockDriverState *bs,
+                                              BlockDriverState *base,
+                                              bool include_base,
+                                              int64_t offset, int64_t *bytes,
+                                              int *depth);
+int coroutine_fn bdrv_co_chain_map_preadv(BlockDriverState *bs,
+                                          int64_t offset, int64_t bytes,
+                                          QEMUIOVector *qiov,
+                                          size_t qiov_offset);
+
 #endif /* BLOCK_INT_H */
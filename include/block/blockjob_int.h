@@ -54,6 +54,12 @@ struct BlockJobDriver {
     void (*attached_aio_context)(BlockJob *job, AioContext *new_context);
 
     void (*set_speed)(BlockJob *job, int64_t speed);
+
+    /*
+     * If the callback is not NULL, it will be invoked when the job is
+     * queried, to fill in job type specific fields of @info.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 };
 
 /**
@@ -59,6 +59,16 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * For the mapped-ram format: pages of the block present in the file,
+     * or compressed length of each chunk, and where the block's index
+     * and pages live in the file.
+     */
+    unsigned long *file_bmap;
+    uint32_t *file_chunk_len;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
@@ -36,6 +36,8 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    uint32_t num_iothreads;
+    char **iothreads;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -189,6 +189,13 @@ struct VMStateDescription {
     int (*post_save)(void *opaque);
     bool (*needed)(void *opaque);
     bool (*dev_unplug_pending)(void *opaque);
+    /*
+     * The hooks and field types only access the device's own state, so
+     * with the VM stopped the section can be saved and loaded outside
+     * the BQL, concurrently with other sections.  Descriptions without
+     * hooks that only use the basic field types don't need to set it.
+     */
+    bool parallel_safe;
 
     const VMStateField *fields;
     const VMStateDescription **subsections;
@@ -1175,6 +1182,7 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                          int version_id);
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
+bool vmstate_parallel_safe(const VMStateDescription *vmsd);
 
 #define  VMSTATE_INSTANCE_ID_ANY  -1
 
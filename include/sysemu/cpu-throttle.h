@@ -42,10 +42,23 @@ void cpu_throttle_init(void);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99, or 0 to
+ * stop throttling @cpu alone.
+ *
+ * Like cpu_throttle_set, but only throttles @cpu.  The other vcpus keep
+ * running at full speed unless they are throttled themselves.  When both
+ * apply, a vcpu is throttled by the higher of the two percentages.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -65,4 +78,14 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to query.
+ *
+ * Returns the throttle percentage set by cpu_throttle_set_vcpu for @cpu.
+ *
+ * Returns: The throttle percentage in range 1 to 99, or 0 if @cpu has none.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #endif /* SYSEMU_CPU_THROTTLE_H */
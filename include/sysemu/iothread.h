@@ -37,6 +37,10 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* io_uring polling modes, see aio_context_set_io_uring_params() */
+    bool io_uring_sqpoll;
+    bool io_uring_iopoll;
 };
 typedef struct IOThread IOThread;
 
@@ -15,6 +15,7 @@
 #include "tls.h"
 #include "migration.h"
 #include "qemu-file-channel.h"
+#include "qemu-file-uring.h"
 #include "trace.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
@@ -95,7 +96,14 @@ void migration_channel_connect(MigrationState *s,
                 return;
             }
         } else {
-            QEMUFile *f = qemu_fopen_channel_output(ioc);
+            QEMUFile *f = NULL;
+
+            if (migrate_io_uring()) {
+                f = qemu_fopen_uring_output(ioc);
+            }
+            if (!f) {
+                f = qemu_fopen_channel_output(ioc);
+            }
 
             qemu_mutex_lock(&s->qemu_file_lock);
             s->to_dst_file = f;
@@ -45,6 +45,15 @@ static Notifier packets_compare_notifier;
 /* User need to know colo mode after COLO failover */
 static COLOMode last_colo_mode;
 
+/* Checkpoints loaded by the secondary, protected by the BQL */
+static struct {
+    uint64_t checkpoints;
+    int64_t last_checkpoint_us;
+    uint64_t last_flush_pages;
+    int64_t last_flush_us;
+    int64_t total_flush_us;
+} colo_incoming_stats;
+
 #define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
 
 bool migration_in_colo_state(void)
@@ -282,6 +291,19 @@ COLOStatus *qmp_query_colo_status(Error **errp)
     s->mode = get_colo_mode();
     s->last_mode = last_colo_mode;
 
+    if (s->last_mode == COLO_MODE_SECONDARY) {
+        s->has_checkpoints = true;
+        s->checkpoints = colo_incoming_stats.checkpoints;
+        s->has_last_checkpoint_time = true;
+        s->last_checkpoint_time = colo_incoming_stats.last_checkpoint_us;
+        s->has_last_flush_pages = true;
+        s->last_flush_pages = colo_incoming_stats.last_flush_pages;
+        s->has_last_flush_time = true;
+        s->last_flush_time = colo_incoming_stats.last_flush_us;
+        s->has_total_flush_time = true;
+        s->total_flush_time = colo_incoming_stats.total_flush_us;
+    }
+
     switch (failover_get_state()) {
     case FAILOVER_STATUS_NONE:
         s->reason = COLO_EXIT_REASON_NONE;
@@ -681,8 +703,10 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
     uint64_t total_size;
     uint64_t value;
     Error *local_err = NULL;
+    int64_t start_us, flush_us;
     int ret;
 
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     qemu_mutex_lock_iothread();
     vm_stop_force_state(RUN_STATE_COLO);
     trace_colo_vm_state_change("run", "stop");
@@ -713,6 +737,9 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
         return;
     }
 
+    /* Get the flush going while the device state comes in */
+    colo_flush_ram_cache_begin();
+
     value = colo_receive_message_value(mis->from_src_file,
                              COLO_MESSAGE_VMSTATE_SIZE, &local_err);
     if (local_err) {
@@ -747,7 +774,11 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
 
     qemu_mutex_lock_iothread();
     vmstate_loading = true;
-    colo_flush_ram_cache();
+    flush_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    colo_incoming_stats.last_flush_pages = colo_flush_ram_cache();
+    flush_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - flush_us;
+    colo_incoming_stats.last_flush_us = flush_us;
+    colo_incoming_stats.total_flush_us += flush_us;
     ret = qemu_load_device_state(fb);
     if (ret < 0) {
         error_setg(errp, "COLO: load device state failed");
@@ -789,6 +820,9 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
     vmstate_loading = false;
     vm_start();
     trace_colo_vm_state_change("stop", "run");
+    colo_incoming_stats.checkpoints++;
+    colo_incoming_stats.last_checkpoint_us =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
     qemu_mutex_unlock_iothread();
 
     if (failover_get_state() == FAILOVER_STATUS_RELAUNCH) {
@@ -12,10 +12,16 @@
 
 #include "qemu/osdep.h"
 #include <zlib.h>
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "cpu.h"
 #include "exec/ramblock.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/main-loop.h"
+#include "exec/memory.h"
+#include "hw/core/cpu.h"
+#include "sysemu/kvm.h"
+#include "migration/misc.h"
 #include "qapi/qapi-commands-migration.h"
 #include "ram.h"
 #include "trace.h"
@@ -72,13 +78,32 @@ static struct DirtyRateInfo *query_dirty_rate_info(void)
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
+    info->mode = DirtyStat.mode;
+
+    if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED &&
+        DirtyStat.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+        DirtyRateVcpuList *head = NULL, **tail = &head;
+        int i;
+
+        for (i = 0; i < DirtyStat.nvcpu; i++) {
+            DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+            entry->value = g_memdup(&DirtyStat.vcpu_rates[i],
+                                    sizeof(DirtyRateVcpu));
+            *tail = entry;
+            tail = &entry->next;
+        }
+        info->has_vcpu_dirty_rate = true;
+        info->vcpu_dirty_rate = head;
+    }
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
     return info;
 }
 
-static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time)
+static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
+                                DirtyRateMeasureMode mode)
 {
     DirtyStat.total_dirty_samples = 0;
     DirtyStat.total_sample_count = 0;
@@ -86,6 +111,10 @@ static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time)
     DirtyStat.dirty_rate = -1;
     DirtyStat.start_time = start_time;
     DirtyStat.calc_time = calc_time;
+    DirtyStat.mode = mode;
+    DirtyStat.nvcpu = 0;
+    g_free(DirtyStat.vcpu_rates);
+    DirtyStat.vcpu_rates = NULL;
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
@@ -322,7 +351,111 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
     return true;
 }
 
-static void calculate_dirtyrate(struct DirtyRateConfig config)
+/*
+ * Start dirty logging for the measurement unless it is already on, e.g.
+ * because of a migration, and flush the dirty rings.  The vcpu dirty page
+ * counters are then recorded into @pages, under the BQL like the reaping,
+ * and the index of each vcpu into the id of the matching entry of @rates.
+ *
+ * Returns true if dirty logging was started here.
+ */
+static bool dirtyrate_dirty_ring_start(uint64_t *pages, DirtyRateVcpu *rates,
+                                       int nvcpu)
+{
+    bool started = false;
+    CPUState *cpu;
+    int i = 0;
+
+    qemu_mutex_lock_iothread();
+    if (!global_dirty_log) {
+        memory_global_dirty_log_start();
+        started = true;
+    }
+    memory_global_dirty_log_sync();
+    CPU_FOREACH(cpu) {
+        if (i >= nvcpu) {
+            break;
+        }
+        rates[i].id = cpu->cpu_index;
+        pages[i++] = cpu->dirty_pages;
+    }
+    qemu_mutex_unlock_iothread();
+
+    return started;
+}
+
+/*
+ * Flush the dirty rings, turn @pages into the number of pages dirtied by
+ * each vcpu since dirtyrate_dirty_ring_start, and stop dirty logging if
+ * it was started for the measurement and no migration needs it since.
+ */
+static void dirtyrate_dirty_ring_stop(uint64_t *pages, int nvcpu,
+                                      bool started)
+{
+    CPUState *cpu;
+    int i = 0;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    CPU_FOREACH(cpu) {
+        if (i >= nvcpu) {
+            break;
+        }
+        pages[i] = cpu->dirty_pages - pages[i];
+        i++;
+    }
+    if (started && migration_is_idle()) {
+        memory_global_dirty_log_stop();
+    }
+    qemu_mutex_unlock_iothread();
+}
+
+static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
+{
+    CPUState *cpu;
+    uint64_t *dirty_pages;
+    uint64_t dirtyrate_sum = 0;
+    int64_t msec = 0;
+    int64_t initial_time;
+    int nvcpu = 0;
+    bool started;
+    int i;
+
+    qemu_mutex_lock_iothread();
+    CPU_FOREACH(cpu) {
+        nvcpu++;
+    }
+    qemu_mutex_unlock_iothread();
+
+    dirty_pages = g_new0(uint64_t, nvcpu);
+    DirtyStat.vcpu_rates = g_new0(DirtyRateVcpu, nvcpu);
+    DirtyStat.nvcpu = nvcpu;
+
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    started = dirtyrate_dirty_ring_start(dirty_pages, DirtyStat.vcpu_rates,
+                                         nvcpu);
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+
+    dirtyrate_dirty_ring_stop(dirty_pages, nvcpu, started);
+
+    for (i = 0; i < nvcpu; i++) {
+        uint64_t dirtyrate = dirty_pages[i] * qemu_real_host_page_size *
+                             1000 / (msec * MiB);
+
+        trace_dirtyrate_calc_vcpu(DirtyStat.vcpu_rates[i].id, dirtyrate);
+        DirtyStat.vcpu_rates[i].dirty_rate = dirtyrate;
+        dirtyrate_sum += dirtyrate;
+    }
+    DirtyStat.dirty_rate = dirtyrate_sum;
+
+    g_free(dirty_pages);
+}
+
+static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
     int block_count = 0;
@@ -355,6 +488,17 @@ out:
     rcu_unregister_thread();
 }
 
+static void calculate_dirtyrate(struct DirtyRateConfig config)
+{
+    if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+        rcu_register_thread();
+        calculate_dirtyrate_dirty_ring(config);
+        rcu_unregister_thread();
+    } else {
+        calculate_dirtyrate_sample_vm(config);
+    }
+}
+
 void *get_dirtyrate_thread(void *arg)
 {
     struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
@@ -371,7 +515,7 @@ void *get_dirtyrate_thread(void *arg)
 
     start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
     calc_time = config.sample_period_seconds;
-    init_dirtyrate_stat(start_time, calc_time);
+    init_dirtyrate_stat(start_time, calc_time, config.mode);
 
     calculate_dirtyrate(config);
 
@@ -383,7 +527,8 @@ void *get_dirtyrate_thread(void *arg)
     return NULL;
 }
 
-void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
@@ -404,6 +549,17 @@ void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
         return;
     }
 
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "dirty ring is not enabled, use 'page-sampling' "
+                         "mode instead.");
+        return;
+    }
+
     /*
      * Init calculation state as unstarted.
      */
@@ -416,6 +572,7 @@ void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
 
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    config.mode = mode;
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
@@ -0,0 +1,1091 @@
+/*
+ * Mapped RAM migration format
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * With the mapped-ram capability, RAM isn't sent in the stream.  Instead
+ * each RAMBlock gets a fixed region in the (seekable) migration file:
+ *
+ *   stream: ... | idstr, length, header | <skipped region> | ... stream ...
+ *   region:     | index | pad | pages at their offset in the block |
+ *
+ * The header holds the offsets of the index and of the pages.  Since a
+ * page always lands at the same place, pages can be written by several
+ * threads in any order, rewriting a page just overwrites it, and the
+ * file can be mapped back into memory.
+ *
+ * Uncompressed, the index is a little endian bitmap of the pages in the
+ * file; the other pages are zero.  With a compression method the block
+ * is cut in chunks that are compressed whole and written at the start
+ * of their slot (leaving the rest of the slot as a hole), and the index
+ * holds the be32 compressed length of each chunk.  A length equal to
+ * the chunk size means the chunk is stored as is.  As chunks are only
+ * written once, compression is only allowed for background snapshots,
+ * where each page is saved exactly once.
+ *
+ * With lazy-restore, the destination only reads the indexes while
+ * loading.  Guest RAM is registered with userfaultfd as for postcopy,
+ * the fault thread reads the pages from the file as they are touched and
+ * a fill thread loads the rest, so the guest can start right away.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "io/channel-file.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "qemu-file.h"
+#include "ram.h"
+#include "postcopy-ram.h"
+#include "mapped-ram.h"
+#include "trace.h"
+
+#define MAPPED_RAM_ALIGN        (1 * MiB)
+#define MAPPED_RAM_CHUNK_SIZE   (256 * KiB)
+/* Pages copied per job for the uncompressed format */
+#define MAPPED_RAM_BATCH_PAGES  64
+/* Jobs a writer can have pending before the migration thread waits */
+#define MAPPED_RAM_QUEUE_DEPTH  16
+
+typedef struct MappedRamJob {
+    RAMBlock *block;
+    uint8_t *buf;
+    /* Uncompressed: offset in the block of each page in buf */
+    ram_addr_t offsets[MAPPED_RAM_BATCH_PAGES];
+    unsigned int npages;
+    /* Compressed: chunk held in buf */
+    unsigned long chunk;
+    QSIMPLEQ_ENTRY(MappedRamJob) next;
+} MappedRamJob;
+
+typedef struct MappedRamWriter {
+    QemuThread thread;
+    QemuMutex mutex;
+    /* Signalled when a job is queued or finished */
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, MappedRamJob) jobs;
+    /* Jobs queued, including the one being written */
+    unsigned int queued;
+    bool quit;
+    /* Uncompressed: batch being filled by the migration thread */
+    MappedRamJob *batch;
+    uint8_t *zbuf;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zcs;
+#endif
+} MappedRamWriter;
+
+static struct {
+    int fd;
+    MultiFDCompression compression;
+    int level;
+    MappedRamWriter *writers;
+    unsigned int nwriters;
+    unsigned int next_writer;
+    /* Compressed: chunks being filled, keyed by their host address */
+    GHashTable *chunks;
+    /* First error hit by a writer */
+    int error;
+} *mapped_ram_send;
+
+static struct {
+    int fd;
+    uint32_t chunk_size;
+    uint32_t compression;
+    /*
+     * Taken by the fault and fill threads to place a page, it also
+     * protects the chunk cache and mis->postcopy_tmp_page.
+     */
+    QemuMutex mutex;
+    QemuThread thread;
+    /* Last chunk decompressed */
+    RAMBlock *zblock;
+    unsigned long zchunk;
+    uint8_t *zcache;
+    uint8_t *zbuf;
+} *mapped_ram_lazy;
+
+static int mapped_ram_pwrite(int fd, const uint8_t *buf, size_t len, off_t off)
+{
+#ifdef CONFIG_POSIX
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, off);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+static int mapped_ram_pread(int fd, uint8_t *buf, size_t len, off_t off)
+{
+#ifdef CONFIG_POSIX
+    while (len) {
+        ssize_t ret = pread(fd, buf, len, off);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* Truncated file */
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+static int mapped_ram_get_fd(QEMUFile *f, Error **errp)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+
+    if (!ioc || !object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "mapped-ram needs the migration stream to be a file");
+        return -1;
+    }
+    return QIO_CHANNEL_FILE(ioc)->fd;
+}
+
+static unsigned long mapped_ram_nchunks(RAMBlock *block, size_t chunk_size)
+{
+    return DIV_ROUND_UP(block->used_length, chunk_size);
+}
+
+/* Bytes of the block in @chunk; the last chunk may be short */
+static size_t mapped_ram_chunk_len(RAMBlock *block, size_t chunk_size,
+                                   unsigned long chunk)
+{
+    return MIN(chunk_size, block->used_length - chunk * chunk_size);
+}
+
+/* The bitmap is stored as 64 bit words, whatever the size of a long */
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> qemu_target_page_bits(), 64) *
+           sizeof(uint64_t);
+}
+
+static bool mapped_ram_compressed(void)
+{
+    return mapped_ram_send->compression != MULTIFD_COMPRESSION_NONE;
+}
+
+static MappedRamJob *mapped_ram_job_new(RAMBlock *block, size_t size)
+{
+    MappedRamJob *job = g_new0(MappedRamJob, 1);
+
+    job->block = block;
+    job->buf = g_malloc0(size);
+    return job;
+}
+
+static void mapped_ram_job_free(MappedRamJob *job)
+{
+    if (job) {
+        g_free(job->buf);
+        g_free(job);
+    }
+}
+
+/* Returns the compressed length, or 0 if the chunk is better stored as is */
+static size_t mapped_ram_compress(MappedRamWriter *w, const uint8_t *buf,
+                                  size_t len)
+{
+    switch (mapped_ram_send->compression) {
+    case MULTIFD_COMPRESSION_ZLIB: {
+        uLongf zlen = len - 1;
+
+        if (compress2(w->zbuf, &zlen, buf, len,
+                      mapped_ram_send->level) != Z_OK) {
+            return 0;
+        }
+        return zlen;
+    }
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ZSTD: {
+        size_t zlen = ZSTD_compressCCtx(w->zcs, w->zbuf, len - 1, buf, len,
+                                        mapped_ram_send->level);
+
+        return ZSTD_isError(zlen) ? 0 : zlen;
+    }
+#endif
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static int mapped_ram_write_job(MappedRamWriter *w, MappedRamJob *job)
+{
+    RAMBlock *block = job->block;
+    size_t page_size = qemu_target_page_size();
+    unsigned int i, n;
+    int ret;
+
+    if (mapped_ram_compressed()) {
+        size_t len = mapped_ram_chunk_len(block, MAPPED_RAM_CHUNK_SIZE,
+                                          job->chunk);
+        size_t zlen = mapped_ram_compress(w, job->buf, len);
+
+        trace_mapped_ram_write_chunk(block->idstr, job->chunk, len, zlen);
+        ret = mapped_ram_pwrite(mapped_ram_send->fd, zlen ? w->zbuf : job->buf,
+                                zlen ? zlen : len,
+                                block->pages_offset +
+                                job->chunk * MAPPED_RAM_CHUNK_SIZE);
+        block->file_chunk_len[job->chunk] = zlen ? zlen : len;
+        return ret;
+    }
+
+    for (i = 0; i < job->npages; i += n) {
+        /* Pages that follow each other in the block go in a single write */
+        for (n = 1; i + n < job->npages &&
+             job->offsets[i + n] == job->offsets[i] + n * page_size; n++) {
+            /* nothing */
+        }
+        ret = mapped_ram_pwrite(mapped_ram_send->fd, job->buf + i * page_size,
+                                n * page_size,
+                                block->pages_offset + job->offsets[i]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void *mapped_ram_writer_thread(void *opaque)
+{
+    MappedRamWriter *w = opaque;
+    MappedRamJob *job;
+    int ret;
+
+    qemu_mutex_lock(&w->mutex);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&w->jobs);
+        if (!job) {
+            if (w->quit) {
+                break;
+            }
+            qemu_cond_wait(&w->cond, &w->mutex);
+            continue;
+        }
+        qemu_mutex_unlock(&w->mutex);
+
+        ret = mapped_ram_write_job(w, job);
+        if (ret < 0) {
+            qatomic_cmpxchg(&mapped_ram_send->error, 0, ret);
+        }
+
+        qemu_mutex_lock(&w->mutex);
+        QSIMPLEQ_REMOVE_HEAD(&w->jobs, next);
+        w->queued--;
+        qemu_cond_broadcast(&w->cond);
+        mapped_ram_job_free(job);
+    }
+    qemu_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+static void mapped_ram_submit(MappedRamWriter *w, MappedRamJob *job)
+{
+    qemu_mutex_lock(&w->mutex);
+    while (w->queued >= MAPPED_RAM_QUEUE_DEPTH) {
+        qemu_cond_wait(&w->cond, &w->mutex);
+    }
+    QSIMPLEQ_INSERT_TAIL(&w->jobs, job, next);
+    w->queued++;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->mutex);
+}
+
+static void mapped_ram_submit_chunk(MappedRamJob *job)
+{
+    MappedRamWriter *w;
+
+    w = &mapped_ram_send->writers[mapped_ram_send->next_writer++ %
+                                  mapped_ram_send->nwriters];
+    mapped_ram_submit(w, job);
+}
+
+static gboolean mapped_ram_submit_staged(gpointer key, gpointer value,
+                                         gpointer opaque)
+{
+    mapped_ram_submit_chunk(value);
+    return TRUE;
+}
+
+int mapped_ram_send_setup(QEMUFile *f, Error **errp)
+{
+    int fd;
+    unsigned int i;
+
+    fd = mapped_ram_get_fd(f, errp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    mapped_ram_send = g_new0(typeof(*mapped_ram_send), 1);
+    mapped_ram_send->fd = fd;
+    mapped_ram_send->compression = migrate_multifd_compression();
+    switch (mapped_ram_send->compression) {
+    case MULTIFD_COMPRESSION_NONE:
+        break;
+    case MULTIFD_COMPRESSION_ZLIB:
+        mapped_ram_send->level = migrate_multifd_zlib_level();
+        break;
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ZSTD:
+        mapped_ram_send->level = migrate_multifd_zstd_level();
+        break;
+#endif
+    default:
+        error_setg(errp, "mapped-ram doesn't support %s compression",
+                   MultiFDCompression_str(mapped_ram_send->compression));
+        goto err;
+    }
+    if (mapped_ram_compressed()) {
+        if (!migrate_background_snapshot()) {
+            error_setg(errp, "Compressed mapped-ram requires "
+                       "background-snapshot");
+            goto err;
+        }
+        mapped_ram_send->chunks = g_hash_table_new(NULL, NULL);
+    }
+
+    mapped_ram_send->nwriters = migrate_multifd_channels();
+    mapped_ram_send->writers = g_new0(MappedRamWriter,
+                                      mapped_ram_send->nwriters);
+    for (i = 0; i < mapped_ram_send->nwriters; i++) {
+        MappedRamWriter *w = &mapped_ram_send->writers[i];
+        char *name;
+
+        qemu_mutex_init(&w->mutex);
+        qemu_cond_init(&w->cond);
+        QSIMPLEQ_INIT(&w->jobs);
+        if (mapped_ram_compressed()) {
+            w->zbuf = g_malloc(MAPPED_RAM_CHUNK_SIZE);
+#ifdef CONFIG_ZSTD
+            w->zcs = ZSTD_createCCtx();
+#endif
+        }
+
+        name = g_strdup_printf("mappedram_%u", i);
+        qemu_thread_create(&w->thread, name, mapped_ram_writer_thread, w,
+                           QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+    trace_mapped_ram_send_setup(mapped_ram_send->nwriters,
+                                mapped_ram_send->compression);
+
+    return 0;
+
+err:
+    g_free(mapped_ram_send);
+    mapped_ram_send = NULL;
+    return -1;
+}
+
+void mapped_ram_send_cleanup(void)
+{
+    unsigned int i;
+
+    if (!mapped_ram_send) {
+        return;
+    }
+
+    for (i = 0; i < mapped_ram_send->nwriters; i++) {
+        MappedRamWriter *w = &mapped_ram_send->writers[i];
+
+        qemu_mutex_lock(&w->mutex);
+        w->quit = true;
+        qemu_cond_broadcast(&w->cond);
+        qemu_mutex_unlock(&w->mutex);
+        qemu_thread_join(&w->thread);
+
+        mapped_ram_job_free(w->batch);
+        g_free(w->zbuf);
+#ifdef CONFIG_ZSTD
+        ZSTD_freeCCtx(w->zcs);
+#endif
+        qemu_cond_destroy(&w->cond);
+        qemu_mutex_destroy(&w->mutex);
+    }
+    g_free(mapped_ram_send->writers);
+
+    if (mapped_ram_send->chunks) {
+        GHashTableIter iter;
+        gpointer job;
+
+        g_hash_table_iter_init(&iter, mapped_ram_send->chunks);
+        while (g_hash_table_iter_next(&iter, NULL, &job)) {
+            mapped_ram_job_free(job);
+        }
+        g_hash_table_destroy(mapped_ram_send->chunks);
+    }
+
+    g_free(mapped_ram_send);
+    mapped_ram_send = NULL;
+}
+
+/*
+ * Write the mapped-ram header of @block and skip its region of the file,
+ * the stream carries on after it.
+ */
+int mapped_ram_send_block_header(QEMUFile *f, RAMBlock *block, Error **errp)
+{
+    size_t index_size;
+    off_t pos;
+
+    pos = qemu_get_offset(f, errp);
+    if (pos < 0) {
+        return -1;
+    }
+
+    if (mapped_ram_compressed()) {
+        unsigned long nchunks = mapped_ram_nchunks(block,
+                                                   MAPPED_RAM_CHUNK_SIZE);
+
+        index_size = nchunks * sizeof(uint32_t);
+        g_free(block->file_chunk_len);
+        block->file_chunk_len = g_new0(uint32_t, nchunks);
+    } else {
+        index_size = mapped_ram_bitmap_size(block);
+        g_free(block->file_bmap);
+        block->file_bmap = bitmap_new(index_size * BITS_PER_BYTE);
+    }
+
+    /* Header: chunk size, compression and the two offsets */
+    block->bitmap_offset = QEMU_ALIGN_UP(pos + 24, MAPPED_RAM_ALIGN);
+    block->pages_offset = QEMU_ALIGN_UP(block->bitmap_offset + index_size,
+                                        MAPPED_RAM_ALIGN);
+
+    qemu_put_be32(f, mapped_ram_compressed() ? MAPPED_RAM_CHUNK_SIZE : 0);
+    qemu_put_be32(f, mapped_ram_send->compression);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    trace_mapped_ram_send_block_header(block->idstr, block->bitmap_offset,
+                                       block->pages_offset);
+    return qemu_set_offset(f, block->pages_offset + block->used_length, errp);
+}
+
+static void mapped_ram_stage_page(RAMBlock *block, ram_addr_t offset,
+                                  bool zero)
+{
+    size_t page_size = qemu_target_page_size();
+    unsigned long chunk = offset / MAPPED_RAM_CHUNK_SIZE;
+    uint8_t *key = block->host + chunk * MAPPED_RAM_CHUNK_SIZE;
+    MappedRamJob *job;
+
+    job = g_hash_table_lookup(mapped_ram_send->chunks, key);
+    if (!job) {
+        job = mapped_ram_job_new(block, MAPPED_RAM_CHUNK_SIZE);
+        job->chunk = chunk;
+        g_hash_table_insert(mapped_ram_send->chunks, key, job);
+    }
+
+    if (!zero) {
+        memcpy(job->buf + offset % MAPPED_RAM_CHUNK_SIZE,
+               block->host + offset, page_size);
+    }
+    job->npages++;
+
+    if (job->npages * page_size ==
+        mapped_ram_chunk_len(block, MAPPED_RAM_CHUNK_SIZE, chunk)) {
+        g_hash_table_remove(mapped_ram_send->chunks, key);
+        mapped_ram_submit_chunk(job);
+    }
+}
+
+/*
+ * Save a page of @block; its content is copied, so it can change as soon
+ * as this returns.
+ *
+ * Returns 0 for a zero page, 1 for a page with data and negative on error
+ */
+int mapped_ram_save_page(RAMBlock *block, ram_addr_t offset)
+{
+    size_t page_size = qemu_target_page_size();
+    bool zero = buffer_is_zero(block->host + offset, page_size);
+    MappedRamWriter *w;
+    MappedRamJob *job;
+    int ret;
+
+    ret = qatomic_read(&mapped_ram_send->error);
+    if (ret) {
+        return ret;
+    }
+
+    if (mapped_ram_compressed()) {
+        mapped_ram_stage_page(block, offset, zero);
+        return !zero;
+    }
+
+    if (zero) {
+        clear_bit(offset >> qemu_target_page_bits(), block->file_bmap);
+        return 0;
+    }
+    set_bit(offset >> qemu_target_page_bits(), block->file_bmap);
+
+    /*
+     * A given page always goes through the same writer, so that a newer
+     * version of it can't be overtaken by an older one.
+     */
+    w = &mapped_ram_send->writers[(offset / MAPPED_RAM_CHUNK_SIZE) %
+                                  mapped_ram_send->nwriters];
+    job = w->batch;
+    if (job && job->block != block) {
+        mapped_ram_submit(w, job);
+        job = NULL;
+    }
+    if (!job) {
+        job = mapped_ram_job_new(block, MAPPED_RAM_BATCH_PAGES * page_size);
+        w->batch = job;
+    }
+
+    memcpy(job->buf + job->npages * page_size, block->host + offset,
+           page_size);
+    job->offsets[job->npages++] = offset;
+    if (job->npages == MAPPED_RAM_BATCH_PAGES) {
+        mapped_ram_submit(w, job);
+        w->batch = NULL;
+    }
+    return 1;
+}
+
+static int mapped_ram_write_index(RAMBlock *block)
+{
+    if (mapped_ram_compressed()) {
+        unsigned long i, nchunks = mapped_ram_nchunks(block,
+                                                      MAPPED_RAM_CHUNK_SIZE);
+        g_autofree uint32_t *index = g_new(uint32_t, nchunks);
+
+        for (i = 0; i < nchunks; i++) {
+            index[i] = cpu_to_be32(block->file_chunk_len[i]);
+        }
+        return mapped_ram_pwrite(mapped_ram_send->fd, (uint8_t *)index,
+                                 nchunks * sizeof(uint32_t),
+                                 block->bitmap_offset);
+    } else {
+        size_t size = mapped_ram_bitmap_size(block);
+        g_autofree unsigned long *index = bitmap_new(size * BITS_PER_BYTE);
+
+        bitmap_to_le(index, block->file_bmap, size * BITS_PER_BYTE);
+        return mapped_ram_pwrite(mapped_ram_send->fd, (uint8_t *)index, size,
+                                 block->bitmap_offset);
+    }
+}
+
+/*
+ * Push the pending pages to the writers.  With @finish, partial chunks
+ * are pushed too, and once everything is on file the index of every
+ * block is written, leaving a complete image.
+ *
+ * Returns 0 on success, negative on error
+ */
+int mapped_ram_send_sync(bool finish)
+{
+    RAMBlock *block;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < mapped_ram_send->nwriters; i++) {
+        MappedRamWriter *w = &mapped_ram_send->writers[i];
+
+        if (w->batch) {
+            mapped_ram_submit(w, w->batch);
+            w->batch = NULL;
+        }
+    }
+    if (!finish) {
+        return qatomic_read(&mapped_ram_send->error);
+    }
+    if (mapped_ram_send->chunks) {
+        g_hash_table_foreach_steal(mapped_ram_send->chunks,
+                                   mapped_ram_submit_staged, NULL);
+    }
+
+    for (i = 0; i < mapped_ram_send->nwriters; i++) {
+        MappedRamWriter *w = &mapped_ram_send->writers[i];
+
+        qemu_mutex_lock(&w->mutex);
+        while (w->queued) {
+            qemu_cond_wait(&w->cond, &w->mutex);
+        }
+        qemu_mutex_unlock(&w->mutex);
+    }
+
+    ret = qatomic_read(&mapped_ram_send->error);
+    if (ret) {
+        return ret;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            ret = mapped_ram_write_index(block);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    trace_mapped_ram_send_sync_finish();
+    return 0;
+}
+
+static int mapped_ram_decompress(uint32_t compression, uint8_t *dst,
+                                 size_t len, const uint8_t *src, size_t zlen)
+{
+    switch (compression) {
+    case MULTIFD_COMPRESSION_ZLIB: {
+        uLongf dlen = len;
+
+        if (uncompress(dst, &dlen, src, zlen) != Z_OK || dlen != len) {
+            return -EIO;
+        }
+        return 0;
+    }
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ZSTD: {
+        size_t ret = ZSTD_decompress(dst, len, src, zlen);
+
+        if (ZSTD_isError(ret) || ret != len) {
+            return -EIO;
+        }
+        return 0;
+    }
+#endif
+    default:
+        return -ENOTSUP;
+    }
+}
+
+static int mapped_ram_load_pages(int fd, RAMBlock *block, off_t bitmap_offset,
+                                 off_t pages_offset)
+{
+    unsigned int page_bits = qemu_target_page_bits();
+    unsigned long npages = block->used_length >> page_bits;
+    size_t size = mapped_ram_bitmap_size(block);
+    g_autofree unsigned long *bmap = bitmap_new(size * BITS_PER_BYTE);
+    unsigned long start, end;
+    int ret;
+
+    ret = mapped_ram_pread(fd, (uint8_t *)bmap, size, bitmap_offset);
+    if (ret < 0) {
+        return ret;
+    }
+    bitmap_from_le(bmap, bmap, size * BITS_PER_BYTE);
+
+    for (start = find_first_bit(bmap, npages); start < npages;
+         start = find_next_bit(bmap, npages, end)) {
+        end = find_next_zero_bit(bmap, npages, start);
+        ret = mapped_ram_pread(fd, block->host + (start << page_bits),
+                               (end - start) << page_bits,
+                               pages_offset + (start << page_bits));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int mapped_ram_load_chunks(int fd, RAMBlock *block, size_t chunk_size,
+                                  uint32_t compression, off_t index_offset,
+                                  off_t pages_offset)
+{
+    unsigned long i, nchunks = mapped_ram_nchunks(block, chunk_size);
+    g_autofree uint32_t *index = g_new(uint32_t, nchunks);
+    g_autofree uint8_t *zbuf = g_malloc(chunk_size);
+    int ret;
+
+    ret = mapped_ram_pread(fd, (uint8_t *)index, nchunks * sizeof(uint32_t),
+                           index_offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nchunks; i++) {
+        size_t len = mapped_ram_chunk_len(block, chunk_size, i);
+        size_t zlen = be32_to_cpu(index[i]);
+        uint8_t *host = block->host + i * chunk_size;
+        off_t off = pages_offset + i * chunk_size;
+
+        if (!zlen) {
+            /* Not in the file */
+            continue;
+        }
+        if (zlen > len) {
+            return -EINVAL;
+        }
+        if (zlen == len) {
+            ret = mapped_ram_pread(fd, host, len, off);
+        } else {
+            ret = mapped_ram_pread(fd, zbuf, zlen, off);
+            if (!ret) {
+                ret = mapped_ram_decompress(compression, host, len, zbuf, zlen);
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Lazy restore: keep the index of @block, the pages are read when needed
+ */
+static int mapped_ram_lazy_load_index(int fd, RAMBlock *block,
+                                      uint32_t chunk_size, uint32_t compression,
+                                      off_t index_offset, off_t pages_offset)
+{
+    int ret;
+
+    if (!mapped_ram_lazy) {
+        mapped_ram_lazy = g_new0(typeof(*mapped_ram_lazy), 1);
+        /* The migration stream is closed long before we are done */
+        mapped_ram_lazy->fd = qemu_dup(fd);
+        if (mapped_ram_lazy->fd < 0) {
+            ret = -errno;
+            g_free(mapped_ram_lazy);
+            mapped_ram_lazy = NULL;
+            return ret;
+        }
+        qemu_mutex_init(&mapped_ram_lazy->mutex);
+    }
+    if (chunk_size && !mapped_ram_lazy->zcache) {
+        mapped_ram_lazy->zcache = g_malloc(chunk_size);
+        mapped_ram_lazy->zbuf = g_malloc(chunk_size);
+    }
+    mapped_ram_lazy->chunk_size = chunk_size;
+    mapped_ram_lazy->compression = compression;
+    block->bitmap_offset = index_offset;
+    block->pages_offset = pages_offset;
+
+    if (chunk_size) {
+        unsigned long i, nchunks = mapped_ram_nchunks(block, chunk_size);
+
+        g_free(block->file_chunk_len);
+        block->file_chunk_len = g_new(uint32_t, nchunks);
+        ret = mapped_ram_pread(fd, (uint8_t *)block->file_chunk_len,
+                               nchunks * sizeof(uint32_t), index_offset);
+        for (i = 0; i < nchunks; i++) {
+            block->file_chunk_len[i] = be32_to_cpu(block->file_chunk_len[i]);
+        }
+    } else {
+        size_t size = mapped_ram_bitmap_size(block);
+
+        g_free(block->file_bmap);
+        block->file_bmap = bitmap_new(size * BITS_PER_BYTE);
+        ret = mapped_ram_pread(fd, (uint8_t *)block->file_bmap, size,
+                               index_offset);
+        bitmap_from_le(block->file_bmap, block->file_bmap,
+                       size * BITS_PER_BYTE);
+    }
+    return ret;
+}
+
+/* Whether @len bytes of @block at @offset are all zero in the file */
+static bool mapped_ram_lazy_is_zero(RAMBlock *block, ram_addr_t offset,
+                                    size_t len)
+{
+    unsigned int page_bits = qemu_target_page_bits();
+    unsigned long end = (offset + len) >> page_bits;
+
+    if (mapped_ram_lazy->chunk_size) {
+        /* Only chunks missing from the file are known to be zero */
+        return false;
+    }
+    return !block->file_bmap ||
+           find_next_bit(block->file_bmap, end, offset >> page_bits) >= end;
+}
+
+/* Fill @dst with @len bytes of @block at @offset, as saved in the file */
+static int mapped_ram_lazy_read(RAMBlock *block, ram_addr_t offset,
+                                size_t len, uint8_t *dst)
+{
+    size_t chunk_size = mapped_ram_lazy->chunk_size;
+    int fd = mapped_ram_lazy->fd;
+    int ret = 0;
+
+    if (!chunk_size) {
+        unsigned int page_bits = qemu_target_page_bits();
+        unsigned long page = offset >> page_bits;
+        unsigned long end = (offset + len) >> page_bits;
+        unsigned long next;
+
+        for (; page < end && !ret; page = next) {
+            size_t size;
+            uint8_t *p = dst + ((page << page_bits) - offset);
+
+            if (test_bit(page, block->file_bmap)) {
+                next = find_next_zero_bit(block->file_bmap, end, page);
+                size = (next - page) << page_bits;
+                ret = mapped_ram_pread(fd, p, size,
+                                       block->pages_offset +
+                                       (page << page_bits));
+            } else {
+                next = find_next_bit(block->file_bmap, end, page);
+                memset(p, 0, (next - page) << page_bits);
+            }
+        }
+        return ret;
+    }
+
+    while (len && !ret) {
+        unsigned long chunk = offset / chunk_size;
+        size_t chunk_len = mapped_ram_chunk_len(block, chunk_size, chunk);
+        size_t coff = offset % chunk_size;
+        size_t n = MIN(len, chunk_len - coff);
+        size_t zlen = block->file_chunk_len[chunk];
+
+        if (!zlen) {
+            memset(dst, 0, n);
+        } else if (zlen > chunk_len) {
+            ret = -EINVAL;
+        } else if (zlen == chunk_len) {
+            ret = mapped_ram_pread(fd, dst, n, block->pages_offset + offset);
+        } else {
+            if (mapped_ram_lazy->zblock != block ||
+                mapped_ram_lazy->zchunk != chunk) {
+                mapped_ram_lazy->zblock = NULL;
+                ret = mapped_ram_pread(fd, mapped_ram_lazy->zbuf, zlen,
+                                       block->pages_offset +
+                                       chunk * chunk_size);
+                if (!ret) {
+                    ret = mapped_ram_decompress(mapped_ram_lazy->compression,
+                                                mapped_ram_lazy->zcache,
+                                                chunk_len,
+                                                mapped_ram_lazy->zbuf, zlen);
+                }
+                if (ret) {
+                    break;
+                }
+                mapped_ram_lazy->zblock = block;
+                mapped_ram_lazy->zchunk = chunk;
+            }
+            memcpy(dst, mapped_ram_lazy->zcache + coff, n);
+        }
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+    return ret;
+}
+
+/*
+ * Place the host page of @rb at @offset from the file, unless it's
+ * already there.  Called by the postcopy fault thread for the pages the
+ * guest touches, and by the fill thread for the others.
+ *
+ * Returns 0 on success, negative on error
+ */
+int mapped_ram_lazy_place(MigrationIncomingState *mis, RAMBlock *rb,
+                          ram_addr_t offset)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    void *host = rb->host + offset;
+    int ret;
+
+    QEMU_LOCK_GUARD(&mapped_ram_lazy->mutex);
+
+    if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+        return 0;
+    }
+    if (mapped_ram_lazy_is_zero(rb, offset, pagesize)) {
+        return postcopy_place_page_zero(mis, host, rb);
+    }
+
+    ret = mapped_ram_lazy_read(rb, offset, pagesize, mis->postcopy_tmp_page);
+    if (ret < 0) {
+        return ret;
+    }
+    return postcopy_place_page(mis, host, mis->postcopy_tmp_page, rb);
+}
+
+static void mapped_ram_lazy_finish_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    bool incoming_done = mis->state == MIGRATION_STATUS_COMPLETED ||
+                         mis->state == MIGRATION_STATUS_FAILED;
+    RAMBlock *rb;
+
+    qemu_thread_join(&mapped_ram_lazy->thread);
+    postcopy_ram_incoming_cleanup(mis);
+    mis->lazy_restore = false;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(rb) {
+            g_free(rb->file_bmap);
+            rb->file_bmap = NULL;
+            g_free(rb->file_chunk_len);
+            rb->file_chunk_len = NULL;
+            if (incoming_done) {
+                /* ram_load_cleanup() left them to us */
+                g_free(rb->receivedmap);
+                rb->receivedmap = NULL;
+            }
+        }
+    }
+    if (incoming_done && mis->page_requested) {
+        g_tree_destroy(mis->page_requested);
+        mis->page_requested = NULL;
+    }
+    if (incoming_done && mis->postcopy_remote_fds) {
+        g_array_free(mis->postcopy_remote_fds, TRUE);
+        mis->postcopy_remote_fds = NULL;
+    }
+
+    trace_mapped_ram_lazy_finish();
+    close(mapped_ram_lazy->fd);
+    qemu_mutex_destroy(&mapped_ram_lazy->mutex);
+    g_free(mapped_ram_lazy->zcache);
+    g_free(mapped_ram_lazy->zbuf);
+    g_free(mapped_ram_lazy);
+    mapped_ram_lazy = NULL;
+}
+
+static void *mapped_ram_lazy_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    RAMBlock *rb;
+    int ret = 0;
+
+    rcu_register_thread();
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            size_t pagesize = qemu_ram_pagesize(rb);
+            ram_addr_t offset;
+
+            for (offset = 0; offset < rb->used_length && !ret;
+                 offset += pagesize) {
+                ret = mapped_ram_lazy_place(mis, rb, offset);
+            }
+        }
+    }
+    rcu_unregister_thread();
+
+    if (ret) {
+        /*
+         * Dropping userfaultfd would leave holes in guest RAM, keep
+         * serving faults as long as we can.
+         */
+        error_report("Lazy restore of guest RAM failed: %s", strerror(-ret));
+        return NULL;
+    }
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            mapped_ram_lazy_finish_bh, mis);
+    return NULL;
+}
+
+/*
+ * Called once the headers of all RAM blocks are loaded: make the guest
+ * RAM fault on access, and start filling it in.
+ *
+ * Returns 0 on success, negative on error
+ */
+int mapped_ram_lazy_start(MigrationIncomingState *mis)
+{
+    if (!mapped_ram_lazy) {
+        /* No RAM */
+        return 0;
+    }
+
+    mis->largest_page_size = qemu_ram_pagesize_largest();
+    if (postcopy_ram_incoming_init(mis)) {
+        return -EINVAL;
+    }
+    mis->lazy_restore = true;
+    if (postcopy_ram_incoming_setup(mis)) {
+        mis->lazy_restore = false;
+        return -EINVAL;
+    }
+
+    trace_mapped_ram_lazy_start();
+    qemu_thread_create(&mapped_ram_lazy->thread, "mappedram/fill",
+                       mapped_ram_lazy_thread, mis, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+/*
+ * Read the mapped-ram header of @block from the stream, load its pages
+ * from the file and move the stream past its region.
+ */
+int mapped_ram_load_block(QEMUFile *f, RAMBlock *block, Error **errp)
+{
+    uint32_t chunk_size, compression;
+    off_t bitmap_offset, pages_offset;
+    int fd, ret;
+
+    chunk_size = qemu_get_be32(f);
+    compression = qemu_get_be32(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read mapped-ram header of %s",
+                         block->idstr);
+        return ret;
+    }
+
+    fd = mapped_ram_get_fd(f, errp);
+    if (fd < 0) {
+        return -EINVAL;
+    }
+
+    trace_mapped_ram_load_block(block->idstr, chunk_size, compression,
+                                bitmap_offset, pages_offset);
+    if (migrate_lazy_restore()) {
+        ret = mapped_ram_lazy_load_index(fd, block, chunk_size, compression,
+                                         bitmap_offset, pages_offset);
+    } else if (chunk_size) {
+        ret = mapped_ram_load_chunks(fd, block, chunk_size, compression,
+                                     bitmap_offset, pages_offset);
+    } else {
+        ret = mapped_ram_load_pages(fd, block, bitmap_offset, pages_offset);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to load RAM block %s from file",
+                         block->idstr);
+        return ret;
+    }
+
+    if (qemu_set_offset(f, pages_offset + block->used_length, errp) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
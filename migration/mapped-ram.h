@@ -0,0 +1,25 @@
+/*
+ * Mapped RAM migration format
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MAPPED_RAM_H
+#define QEMU_MIGRATION_MAPPED_RAM_H
+
+#include "exec/cpu-common.h"
+
+int mapped_ram_send_setup(QEMUFile *f, Error **errp);
+void mapped_ram_send_cleanup(void);
+int mapped_ram_send_block_header(QEMUFile *f, RAMBlock *block, Error **errp);
+int mapped_ram_save_page(RAMBlock *block, ram_addr_t offset);
+int mapped_ram_send_sync(bool finish);
+int mapped_ram_load_block(QEMUFile *f, RAMBlock *block, Error **errp);
+int mapped_ram_lazy_start(MigrationIncomingState *mis);
+int mapped_ram_lazy_place(MigrationIncomingState *mis, RAMBlock *rb,
+                          ram_addr_t offset);
+
+#endif
@@ -20,10 +20,12 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/kvm.h"
 #include "rdma.h"
 #include "ram.h"
 #include "migration/global_state.h"
@@ -57,6 +59,7 @@
 #include "net/announce.h"
 #include "qemu/queue.h"
 #include "multifd.h"
+#include "prediction.h"
 #include "qemu/yank.h"
 #include "sysemu/cpus.h"
 
@@ -131,6 +134,11 @@ enum mig_rp_message_type {
     MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
     MIG_RP_MSG_RECV_BITMAP,  /* send recved_bitmap back to source */
     MIG_RP_MSG_RESUME_ACK,   /* tell source that we are ready to resume */
+    /*
+     * Pages predicted to fault soon, data (start: be64, stride: be64,
+     * count: be32, id: string)
+     */
+    MIG_RP_MSG_REQ_PAGES_PREFETCH,
 
     MIG_RP_MSG_MAX
 };
@@ -210,6 +218,7 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_sem_init(&current_incoming->postcopy_qemufile_dst_done, 0);
     qemu_mutex_init(&current_incoming->page_request_mutex);
     current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
 
@@ -218,6 +227,7 @@ void migration_object_init(void)
         exit(1);
     }
 
+    migration_prediction_init();
     blk_mig_init();
     ram_mig_init();
     dirty_bitmap_mig_init();
@@ -275,14 +285,19 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
-    if (mis->postcopy_remote_fds) {
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
+    /* With lazy-restore, the fault thread still needs them */
+    if (mis->postcopy_remote_fds && !mis->lazy_restore) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
     }
 
     qemu_event_reset(&mis->main_thread_load_event);
 
-    if (mis->page_requested) {
+    if (mis->page_requested && !mis->lazy_restore) {
         g_tree_destroy(mis->page_requested);
         mis->page_requested = NULL;
     }
@@ -389,6 +404,37 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     return migrate_send_rp_message(mis, msg_type, msglen, bufc);
 }
 
+/* Request @count pages from the source VM, every @stride bytes from @start.
+ *   rb: the RAMBlock to request the pages in
+ *   start: Address offset of the first page within the RB
+ *   stride: Distance in bytes between the pages, a multiple of pagesize
+ *
+ * These are prefetches: the source sends them after the pages actually
+ * faulted on.
+ */
+int migrate_send_rp_req_pages_prefetch(MigrationIncomingState *mis,
+                                       RAMBlock *rb, ram_addr_t start,
+                                       int64_t stride, uint32_t count)
+{
+    uint8_t bufc[20 + 1 + 255]; /* start, stride, count, rbname up to 256 */
+    size_t msglen = 20;
+    const char *rbname = qemu_ram_get_idstr(rb);
+    int rbname_len = strlen(rbname);
+
+    assert(rbname_len < 256);
+
+    stq_be_p(bufc, start);
+    stq_be_p(bufc + 8, stride);
+    stl_be_p(bufc + 16, count);
+    bufc[msglen++] = rbname_len;
+    memcpy(bufc + msglen, rbname, rbname_len);
+    msglen += rbname_len;
+
+    /* The block name is always sent, leave mis->last_rb alone */
+    return migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES_PREFETCH,
+                                   msglen, bufc);
+}
+
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
                               RAMBlock *rb, ram_addr_t start, uint64_t haddr)
 {
@@ -471,6 +517,8 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         yank_unregister_instance(MIGRATION_YANK_INSTANCE);
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -723,7 +771,7 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
         start_migration = !migrate_use_multifd();
     } else {
         /* Multiple connections */
-        assert(migrate_use_multifd());
+        assert(migrate_use_multifd() || migrate_postcopy_preempt());
         start_migration = multifd_recv_new_channel(ioc, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
@@ -1231,6 +1279,87 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH] &&
+        !cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "Postcopy prefetch requires postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT] &&
+        !cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "Postcopy preempt requires postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        static const MigrationCapability incomp[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_X_COLO,
+        };
+        int idx;
+
+        for (idx = 0; idx < ARRAY_SIZE(incomp); idx++) {
+            if (cap_list[incomp[idx]]) {
+                error_setg(errp, "mapped-ram is not compatible with %s",
+                           MigrationCapability_str(incomp[idx]));
+                return false;
+            }
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_IO_URING]) {
+#ifndef CONFIG_LINUX_IO_URING
+        error_setg(errp, "io-uring is not supported by this QEMU build");
+        return false;
+#endif
+        /* mapped-ram seeks in the stream and writes pages to the fd */
+        if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "io-uring is not compatible with mapped-ram");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_ZSTD_DICTIONARY]) {
+#ifndef CONFIG_ZSTD
+        error_setg(errp, "zstd-dictionary is not supported by this QEMU build");
+        return false;
+#endif
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "zstd-dictionary requires multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_LAZY_RESTORE]) {
+        if (!cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "lazy-restore requires mapped-ram");
+            return false;
+        }
+        /* Only the destination needs userfaultfd */
+        if (runstate_check(RUN_STATE_INMIGRATE) &&
+            !postcopy_ram_supported_by_host(mis)) {
+            error_setg(errp, "lazy-restore needs postcopy support");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_VCPU_THROTTLE]) {
+        if (!cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+            error_setg(errp, "vcpu-throttle requires auto-converge");
+            return false;
+        }
+        if (!kvm_dirty_ring_enabled()) {
+            error_setg(errp, "vcpu-throttle requires the KVM dirty ring");
+            error_append_hint(errp, "Set dirty-ring-size of the kvm "
+                              "accelerator to enable it.\n");
+            return false;
+        }
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1820,6 +1949,7 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        postcopy_preempt_cleanup(s);
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -2046,6 +2176,8 @@ void migrate_init(MigrationState *s)
     s->vm_was_running = false;
     s->iteration_initial_bytes = 0;
     s->threshold_size = 0;
+
+    migration_prediction_reset();
 }
 
 int migrate_add_blocker(Error *reason, Error **errp)
@@ -2280,6 +2412,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2395,6 +2529,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_vcpu_throttle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_VCPU_THROTTLE];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -2404,6 +2547,78 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_postcopy_prefetch(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_io_uring(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_IO_URING];
+}
+
+bool migrate_zstd_dictionary(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZSTD_DICTIONARY];
+}
+
+bool migrate_incremental_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_INCREMENTAL_SNAPSHOT];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE];
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE];
+}
+
 bool migrate_postcopy_blocktime(void)
 {
     MigrationState *s;
@@ -2633,6 +2848,8 @@ static struct rp_cmd_args {
     [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
     [MIG_RP_MSG_RECV_BITMAP]    = { .len = -1, .name = "RECV_BITMAP" },
     [MIG_RP_MSG_RESUME_ACK]     = { .len =  4, .name = "RESUME_ACK" },
+    [MIG_RP_MSG_REQ_PAGES_PREFETCH] = { .len = -1,
+                                        .name = "REQ_PAGES_PREFETCH" },
     [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
 };
 
@@ -2665,6 +2882,35 @@ static void migrate_handle_rp_req_pages(MigrationState *ms, const char* rbname,
     }
 }
 
+static void migrate_handle_rp_req_pages_prefetch(MigrationState *ms,
+                                                 const char *rbname,
+                                                 ram_addr_t start,
+                                                 int64_t stride,
+                                                 uint32_t count)
+{
+    long our_host_ps = qemu_real_host_page_size;
+
+    trace_migrate_handle_rp_req_pages_prefetch(rbname, start, stride, count);
+
+    if (!migrate_postcopy_prefetch()) {
+        error_report("%s: prefetch request without postcopy-prefetch",
+                     __func__);
+        mark_source_rp_bad(ms);
+        return;
+    }
+
+    if (start & (our_host_ps - 1) || stride & (our_host_ps - 1)) {
+        error_report("%s: Misaligned prefetch request, start: " RAM_ADDR_FMT
+                     " stride: %" PRId64, __func__, start, stride);
+        mark_source_rp_bad(ms);
+        return;
+    }
+
+    if (ram_save_queue_prefetch_pages(rbname, start, stride, count)) {
+        mark_source_rp_bad(ms);
+    }
+}
+
 /* Return true to retry, false to quit */
 static bool postcopy_pause_return_path_thread(MigrationState *s)
 {
@@ -2722,6 +2968,7 @@ static void *source_return_path_thread(void *opaque)
     uint8_t buf[512];
     uint32_t tmp32, sibling_error;
     ram_addr_t start = 0; /* =0 to silence warning */
+    int64_t stride = 0;
     size_t  len = 0, expected_len;
     int res;
 
@@ -2838,6 +3085,26 @@ retry:
             }
             break;
 
+        case MIG_RP_MSG_REQ_PAGES_PREFETCH:
+            expected_len = 20 + 1; /* header + termination */
+
+            if (header_len >= expected_len) {
+                start = ldq_be_p(buf);
+                stride = ldq_be_p(buf + 8);
+                tmp32 = buf[20]; /* Length of the following idstr */
+                buf[21 + tmp32] = '\0';
+                expected_len += tmp32;
+            }
+            if (header_len != expected_len) {
+                error_report("RP: Req_Pages_Prefetch with length %d "
+                             "expecting %zd", header_len, expected_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            migrate_handle_rp_req_pages_prefetch(ms, (char *)&buf[21], start,
+                                                 stride, ldl_be_p(buf + 16));
+            break;
+
         default:
             break;
         }
@@ -3353,6 +3620,9 @@ static MigThrError postcopy_pause(MigrationState *s)
     while (true) {
         QEMUFile *file;
 
+        /* Faulted pages go through the main channel after recovery */
+        postcopy_preempt_cleanup(s);
+
         /* Current channel is possibly broken. Release it. */
         assert(s->to_dst_file);
         qemu_mutex_lock(&s->qemu_file_lock);
@@ -3522,6 +3792,8 @@ static void migration_update_counters(MigrationState *s,
         s->expected_downtime = ram_counters.remaining / bandwidth;
     }
 
+    migration_prediction_update(s, transferred, time_spent);
+
     qemu_file_reset_rate_limit(s->to_dst_file);
 
     update_iteration_initial_status(s);
@@ -4033,6 +4305,8 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    postcopy_preempt_setup(s);
+
     if (migrate_background_snapshot()) {
         qemu_thread_create(&s->thread, "bg_snapshot",
                 bg_migration_thread, s, QEMU_THREAD_JOINABLE);
@@ -4157,6 +4431,20 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-vcpu-throttle", MIGRATION_CAPABILITY_VCPU_THROTTLE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-prefetch",
+            MIGRATION_CAPABILITY_POSTCOPY_PREFETCH),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-parallel-device-state",
+            MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-lazy-restore", MIGRATION_CAPABILITY_LAZY_RESTORE),
+    DEFINE_PROP_MIG_CAP("x-incremental-snapshot",
+            MIGRATION_CAPABILITY_INCREMENTAL_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-io-uring", MIGRATION_CAPABILITY_IO_URING),
+    DEFINE_PROP_MIG_CAP("x-zstd-dictionary",
+                        MIGRATION_CAPABILITY_ZSTD_DICTIONARY),
 
     DEFINE_PROP_END_OF_LIST(),
 };
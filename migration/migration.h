@@ -60,6 +60,8 @@ struct MigrationIncomingState {
 
     size_t         largest_page_size;
     bool           have_fault_thread;
+    /* Guest RAM is being read from a mapped-ram file on fault */
+    bool           lazy_restore;
     QemuThread     fault_thread;
     QemuSemaphore  fault_thread_sem;
     /* Set this when we want the fault thread to quit */
@@ -79,6 +81,15 @@ struct MigrationIncomingState {
     RAMBlock *last_rb;
     void     *postcopy_tmp_page;
     void     *postcopy_tmp_zero_page;
+    /* Temporary page for the postcopy preempt channel */
+    void     *postcopy_preempt_tmp_page;
+
+    /* Postcopy preempt channel, carries the pages we faulted on */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Posted when the preempt channel is connected, or on cleanup */
+    QemuSemaphore postcopy_qemufile_dst_done;
+    bool      have_preempt_thread;
+    QemuThread preempt_thread;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -261,6 +272,13 @@ struct MigrationState {
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
+
+    /*
+     * Postcopy preempt channel, used by the migration thread to send the
+     * pages the destination is waiting on.  Set from the main loop once
+     * the channel is connected, NULL until then.
+     */
+    QEMUFile *postcopy_qemufile_src;
     /*
      * Whether we abort the migration if decompression errors are
      * detected at the destination. It is left at false for qemu
@@ -319,6 +337,7 @@ bool migrate_ignore_shared(void);
 bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
+bool migrate_vcpu_throttle(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
@@ -344,6 +363,14 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_prefetch(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_parallel_device_state(void);
+bool migrate_mapped_ram(void);
+bool migrate_lazy_restore(void);
+bool migrate_incremental_snapshot(void);
+bool migrate_io_uring(void);
+bool migrate_zstd_dictionary(void);
 bool migrate_background_snapshot(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -355,6 +382,9 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
                                       RAMBlock *rb, ram_addr_t start);
+int migrate_send_rp_req_pages_prefetch(MigrationIncomingState *mis,
+                                       RAMBlock *rb, ram_addr_t start,
+                                       int64_t stride, uint32_t count);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -0,0 +1,407 @@
+/*
+ * Multifd XBZRLE encoding implementation
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page of the packet is preceded by one byte telling how it has
+ * been encoded:
+ *  - NORMAL: the page follows as it is
+ *  - ENCODED: a be32 length follows, and then the XBZRLE delta against
+ *    the copy of the page that was sent last time
+ *  - UNCHANGED: nothing follows, the destination already has the page
+ */
+#define MULTIFD_XBZRLE_PAGE_NORMAL    0
+#define MULTIFD_XBZRLE_PAGE_ENCODED   1
+#define MULTIFD_XBZRLE_PAGE_UNCHANGED 2
+
+/* per page overhead: encoding byte and length */
+#define MULTIFD_XBZRLE_PAGE_HEADER    5
+
+struct xbzrle_data {
+    /* copy of the page that we are encoding */
+    uint8_t *current_buf;
+    /* encoded buffer */
+    uint8_t *buf;
+    /* size of encoded buffer */
+    uint32_t buf_len;
+};
+
+/* Protects xbzrle_counters, updated by all channels at the same time */
+static QemuMutex xbzrle_counters_lock;
+
+static struct xbzrle_data *xbzrle_data_new(bool send)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *x = g_new0(struct xbzrle_data, 1);
+
+    /* We will never have more than page_count pages */
+    x->buf_len = page_count *
+                 (qemu_target_page_size() + MULTIFD_XBZRLE_PAGE_HEADER);
+    x->buf = g_try_malloc(x->buf_len);
+    if (send) {
+        x->current_buf = g_try_malloc(qemu_target_page_size());
+    }
+    if (!x->buf || (send && !x->current_buf)) {
+        g_free(x->buf);
+        g_free(x->current_buf);
+        g_free(x);
+        return NULL;
+    }
+    return x;
+}
+
+static void xbzrle_data_free(struct xbzrle_data *x)
+{
+    g_free(x->buf);
+    g_free(x->current_buf);
+    g_free(x);
+}
+
+/* Multifd XBZRLE encoding */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Allocate the buffers used to encode the pages of one packet.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    p->data = xbzrle_data_new(true);
+    if (!p->data) {
+        error_setg(errp, "multifd %d: out of memory for xbzrle buffers",
+                   p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Return the buffers memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    xbzrle_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_send_page: encode one page into the packet buffer
+ *
+ * The page is copied first so that what we put in the cache is exactly
+ * what we send, even if the guest keeps writing to it.  Called with the
+ * shard lock of the page held.
+ *
+ * Returns the number of bytes written to @dst
+ *
+ * @x: encoding buffers of the channel
+ * @cache: XBZRLE cache
+ * @addr: ram address of the page
+ * @page: host address of the page
+ * @dst: where to write the encoded page
+ * @stats: XBZRLE counters for this packet
+ */
+static uint32_t xbzrle_send_page(struct xbzrle_data *x, PageCache *cache,
+                                 ram_addr_t addr, uint8_t *page, uint8_t *dst,
+                                 XBZRLECacheStats *stats)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t age = ram_counters.dirty_sync_count;
+    uint8_t *cached;
+    int encoded_len;
+
+    memcpy(x->current_buf, page, page_size);
+
+    if (!cache_is_cached(cache, addr, age)) {
+        stats->cache_miss++;
+        cache_insert(cache, addr, x->current_buf, age);
+        goto normal;
+    }
+
+    stats->pages++;
+    cached = get_cached_data(cache, addr);
+    encoded_len = xbzrle_encode_buffer(cached, x->current_buf, page_size,
+                                       dst + MULTIFD_XBZRLE_PAGE_HEADER,
+                                       page_size);
+    if (encoded_len == 0) {
+        dst[0] = MULTIFD_XBZRLE_PAGE_UNCHANGED;
+        return 1;
+    }
+
+    memcpy(cached, x->current_buf, page_size);
+    if (encoded_len == -1) {
+        stats->overflow++;
+        stats->bytes += page_size;
+        goto normal;
+    }
+
+    dst[0] = MULTIFD_XBZRLE_PAGE_ENCODED;
+    stl_be_p(dst + 1, encoded_len);
+    stats->bytes += encoded_len + MULTIFD_XBZRLE_PAGE_HEADER;
+    return encoded_len + MULTIFD_XBZRLE_PAGE_HEADER;
+
+normal:
+    dst[0] = MULTIFD_XBZRLE_PAGE_NORMAL;
+    memcpy(dst + 1, x->current_buf, page_size);
+    return page_size + 1;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Encode all the pages that we are going to send against the XBZRLE
+ * cache.  Only the shard that holds each page is locked, so all the
+ * channels can encode in parallel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    RAMBlock *block = p->pages->block;
+    XBZRLECacheStats stats = {};
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        PageCache *cache = xbzrle_cache_get();
+
+        /*
+         * Like the migration thread, don't use the cache during the
+         * first pass over RAM (before the second bitmap sync), every
+         * page is sent there anyways.  Postcopy pages are received in a
+         * staging buffer on the destination, there's nothing to encode
+         * them against.
+         */
+        if (!migrate_use_xbzrle() || ram_counters.dirty_sync_count < 2 ||
+            (p->flags & MULTIFD_FLAG_POSTCOPY)) {
+            cache = NULL;
+        }
+
+        for (i = 0; i < used; i++) {
+            ram_addr_t addr = block->offset + p->pages->offset[i];
+            uint8_t *dst = x->buf + out_size;
+
+            if (!cache) {
+                dst[0] = MULTIFD_XBZRLE_PAGE_NORMAL;
+                memcpy(dst + 1, p->pages->iov[i].iov_base,
+                       qemu_target_page_size());
+                out_size += qemu_target_page_size() + 1;
+                continue;
+            }
+
+            cache_lock(cache, addr);
+            out_size += xbzrle_send_page(x, cache, addr,
+                                         p->pages->iov[i].iov_base, dst,
+                                         &stats);
+            cache_unlock(cache, addr);
+        }
+    }
+
+    if (migrate_use_xbzrle()) {
+        qemu_mutex_lock(&xbzrle_counters_lock);
+        xbzrle_counters.pages += stats.pages;
+        xbzrle_counters.bytes += stats.bytes;
+        xbzrle_counters.cache_miss += stats.cache_miss;
+        xbzrle_counters.overflow += stats.overflow;
+        qemu_mutex_unlock(&xbzrle_counters_lock);
+    }
+
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    return qio_channel_write_all(p->c, (void *)x->buf, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Allocate the buffer where the encoded packet is read.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    p->data = xbzrle_data_new(false);
+    if (!p->data) {
+        error_setg(errp, "multifd %d: out of memory for xbzrle buffer", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Return the buffer memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    xbzrle_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the encoded buffer, and apply each page to guest memory.  The
+ * deltas are against what the destination already has: the source
+ * syncs all the channels between two sends of the same page.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    size_t page_size = qemu_target_page_size();
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > x->buf_len) {
+        error_setg(errp, "multifd %d: packet size received %u bigger than %u",
+                   p->id, in_size, x->buf_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)x->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint32_t len;
+
+        if (pos >= in_size) {
+            goto truncated;
+        }
+        switch (x->buf[pos++]) {
+        case MULTIFD_XBZRLE_PAGE_NORMAL:
+            if (in_size - pos < page_size) {
+                goto truncated;
+            }
+            memcpy(iov->iov_base, x->buf + pos, page_size);
+            pos += page_size;
+            break;
+        case MULTIFD_XBZRLE_PAGE_ENCODED:
+            if (in_size - pos < 4) {
+                goto truncated;
+            }
+            len = ldl_be_p(x->buf + pos);
+            pos += 4;
+            if (len > page_size || in_size - pos < len) {
+                goto truncated;
+            }
+            if (xbzrle_decode_buffer(x->buf + pos, len, iov->iov_base,
+                                     page_size) == -1) {
+                error_setg(errp, "multifd %d: xbzrle decode error for page %u",
+                           p->id, i);
+                return -1;
+            }
+            pos += len;
+            break;
+        case MULTIFD_XBZRLE_PAGE_UNCHANGED:
+            break;
+        default:
+            error_setg(errp, "multifd %d: unknown xbzrle encoding %d",
+                       p->id, x->buf[pos - 1]);
+            return -1;
+        }
+    }
+    if (pos != in_size) {
+        error_setg(errp, "multifd %d: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %d: xbzrle packet truncated at page %u",
+               p->id, i);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    qemu_mutex_init(&xbzrle_counters_lock);
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -12,18 +12,56 @@
 
 #include "qemu/osdep.h"
 #include <zstd.h>
+#include <zdict.h>
 #include "qemu/rcu.h"
+#include "qemu/units.h"
+#include "qemu/cutils.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+#include "qemu/thread.h"
 #include "exec/target_page.h"
+#include "exec/ramblock.h"
 #include "qapi/error.h"
 #include "migration.h"
+#include "ram.h"
 #include "trace.h"
 #include "multifd.h"
 
+/* Number of guest pages sampled to train the dictionary */
+#define ZSTD_DICT_SAMPLES 2048
+/* Maximum size of the dictionary */
+#define ZSTD_DICT_SIZE (112 * KiB)
+/* Room for the dictionary and its length at the start of a packet */
+#define ZSTD_DICT_HEADER (sizeof(uint32_t) + ZSTD_DICT_SIZE)
+
+/*
+ * Dictionary shared by the send channels.  Channels take a reference when
+ * they are set up and drop it when they are cleaned up, both from the main
+ * thread.  Sampling guest RAM and training take a while, so the send thread
+ * that first needs the dictionary trains it, under @lock, rather than the
+ * main thread with the BQL held.
+ */
+static struct {
+    QemuMutex lock;
+    bool trained;
+    void *dict;
+    size_t size;
+    ZSTD_CDict *cdict;
+    int refs;
+} zstd_dict;
+
 struct zstd_data {
     /* stream for compression */
     ZSTD_CStream *zcs;
     /* stream for decompression */
     ZSTD_DStream *zds;
+    /* dictionary, NULL when not used */
+    const ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    /* whether this channel holds a reference to zstd_dict */
+    bool dict_ref;
+    /* whether the dictionary was set up, and sent if any, on this channel */
+    bool dict_sent;
     /* buffers */
     ZSTD_inBuffer in;
     ZSTD_outBuffer out;
@@ -35,6 +73,108 @@ struct zstd_data {
 
 /* Multifd zstd compression */
 
+/**
+ * zstd_dict_train: train the dictionary shared by the send channels
+ *
+ * Guest pages are sampled evenly across RAM, zero pages left out.  If
+ * no dictionary can be trained, channels compress without one.
+ */
+static void zstd_dict_train(void)
+{
+    size_t page_size = qemu_target_page_size();
+    g_autofree uint8_t *samples = g_malloc(ZSTD_DICT_SAMPLES * page_size);
+    g_autofree size_t *sizes = g_new(size_t, ZSTD_DICT_SAMPLES);
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    uint64_t pages = 0, stride;
+    unsigned n = 0;
+    RAMBlock *block;
+    size_t ret;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            pages += block->used_length / page_size;
+        }
+        stride = MAX(pages / ZSTD_DICT_SAMPLES, 1) * page_size;
+
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ram_addr_t offset;
+
+            for (offset = 0; offset < block->used_length &&
+                 n < ZSTD_DICT_SAMPLES; offset += stride) {
+                if (buffer_is_zero(block->host + offset, page_size)) {
+                    continue;
+                }
+                memcpy(samples + n * page_size, block->host + offset,
+                       page_size);
+                sizes[n++] = page_size;
+            }
+        }
+    }
+
+    zstd_dict.dict = g_malloc(ZSTD_DICT_SIZE);
+    ret = ZDICT_trainFromBuffer(zstd_dict.dict, ZSTD_DICT_SIZE, samples,
+                                sizes, n);
+    if (ZDICT_isError(ret)) {
+        trace_multifd_zstd_dict_train_failed(n, ZDICT_getErrorName(ret));
+        goto fail;
+    }
+    zstd_dict.size = ret;
+
+    zstd_dict.cdict = ZSTD_createCDict(zstd_dict.dict, zstd_dict.size,
+                                       migrate_multifd_zstd_level());
+    if (!zstd_dict.cdict) {
+        trace_multifd_zstd_dict_train_failed(n, "createCDict failed");
+        goto fail;
+    }
+
+    trace_multifd_zstd_dict_train(n, zstd_dict.size,
+                                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                  start);
+    return;
+
+fail:
+    g_free(zstd_dict.dict);
+    zstd_dict.dict = NULL;
+    zstd_dict.size = 0;
+}
+
+/* Returns the dictionary, training it if no channel did so yet */
+static const ZSTD_CDict *zstd_dict_get(void)
+{
+    const ZSTD_CDict *cdict;
+
+    qemu_mutex_lock(&zstd_dict.lock);
+    if (!zstd_dict.trained) {
+        zstd_dict_train();
+        zstd_dict.trained = true;
+    }
+    cdict = zstd_dict.cdict;
+    qemu_mutex_unlock(&zstd_dict.lock);
+
+    return cdict;
+}
+
+static void zstd_dict_ref(void)
+{
+    if (!zstd_dict.refs++) {
+        qemu_mutex_init(&zstd_dict.lock);
+        zstd_dict.trained = false;
+    }
+}
+
+static void zstd_dict_unref(void)
+{
+    if (--zstd_dict.refs) {
+        return;
+    }
+    ZSTD_freeCDict(zstd_dict.cdict);
+    zstd_dict.cdict = NULL;
+    g_free(zstd_dict.dict);
+    zstd_dict.dict = NULL;
+    zstd_dict.size = 0;
+    qemu_mutex_destroy(&zstd_dict.lock);
+}
+
 /**
  * zstd_send_setup: setup send side
  *
@@ -70,6 +210,9 @@ static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
     /* We will never have more than page_count pages */
     z->zbuff_len = page_count * qemu_target_page_size();
     z->zbuff_len *= 2;
+    if (migrate_zstd_dictionary()) {
+        z->zbuff_len += ZSTD_DICT_HEADER;
+    }
     z->zbuff = g_try_malloc(z->zbuff_len);
     if (!z->zbuff) {
         ZSTD_freeCStream(z->zcs);
@@ -77,6 +220,41 @@ static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
         error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
         return -1;
     }
+
+    if (migrate_zstd_dictionary()) {
+        zstd_dict_ref();
+        z->dict_ref = true;
+    }
+    return 0;
+}
+
+/*
+ * Set up the dictionary of a channel before its first packet, and put it
+ * at the start of that packet.  Runs in the send thread.
+ */
+static int zstd_send_dict(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_data *z = p->data;
+    size_t res;
+
+    z->dict_sent = true;
+    z->cdict = zstd_dict_get();
+    if (!z->cdict) {
+        return 0;
+    }
+
+    res = ZSTD_CCtx_refCDict(z->zcs, z->cdict);
+    if (ZSTD_isError(res)) {
+        error_setg(errp, "multifd %d: refCDict failed with error %s",
+                   p->id, ZSTD_getErrorName(res));
+        z->cdict = NULL;
+        return -1;
+    }
+
+    stl_be_p(z->zbuff, zstd_dict.size);
+    memcpy(z->zbuff + sizeof(uint32_t), zstd_dict.dict, zstd_dict.size);
+    z->out.pos = sizeof(uint32_t) + zstd_dict.size;
+    p->flags |= MULTIFD_FLAG_ZSTD_DICT;
     return 0;
 }
 
@@ -91,6 +269,9 @@ static void zstd_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
     struct zstd_data *z = p->data;
 
+    if (z->dict_ref) {
+        zstd_dict_unref();
+    }
     ZSTD_freeCStream(z->zcs);
     z->zcs = NULL;
     g_free(z->zbuff);
@@ -121,11 +302,20 @@ static int zstd_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
     z->out.size = z->zbuff_len;
     z->out.pos = 0;
 
+    if (z->dict_ref && !z->dict_sent && zstd_send_dict(p, errp) < 0) {
+        return -1;
+    }
+
     for (i = 0; i < used; i++) {
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
+        /*
+         * With a dictionary every packet is a frame of its own, so that
+         * all of them can refer to the dictionary and not only the
+         * first ones of the stream.
+         */
         if (i == used - 1) {
-            flush = ZSTD_e_flush;
+            flush = z->cdict ? ZSTD_e_end : ZSTD_e_flush;
         }
         z->in.src = iov[i].iov_base;
         z->in.size = iov[i].iov_len;
@@ -216,6 +406,8 @@ static int zstd_recv_setup(MultiFDRecvParams *p, Error **errp)
     z->zbuff_len = page_count * qemu_target_page_size();
     /* We know compression "could" use more space */
     z->zbuff_len *= 2;
+    /* and the first packet can carry a dictionary */
+    z->zbuff_len += ZSTD_DICT_HEADER;
     z->zbuff = g_try_malloc(z->zbuff_len);
     if (!z->zbuff) {
         ZSTD_freeDStream(z->zds);
@@ -239,12 +431,60 @@ static void zstd_recv_cleanup(MultiFDRecvParams *p)
 
     ZSTD_freeDStream(z->zds);
     z->zds = NULL;
+    ZSTD_freeDDict(z->ddict);
+    z->ddict = NULL;
     g_free(z->zbuff);
     z->zbuff = NULL;
     g_free(p->data);
     p->data = NULL;
 }
 
+/**
+ * zstd_recv_dict: load the dictionary at the start of a packet
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int zstd_recv_dict(MultiFDRecvParams *p, Error **errp)
+{
+    struct zstd_data *z = p->data;
+    uint32_t size;
+    size_t ret;
+
+    if (z->ddict) {
+        error_setg(errp, "multifd %d: dictionary received twice", p->id);
+        return -1;
+    }
+    if (z->in.size < sizeof(uint32_t)) {
+        error_setg(errp, "multifd %d: truncated dictionary", p->id);
+        return -1;
+    }
+    size = ldl_be_p(z->zbuff);
+    if (size > z->in.size - sizeof(uint32_t)) {
+        error_setg(errp, "multifd %d: dictionary size %u larger than "
+                   "packet", p->id, size);
+        return -1;
+    }
+
+    z->ddict = ZSTD_createDDict(z->zbuff + sizeof(uint32_t), size);
+    if (!z->ddict) {
+        error_setg(errp, "multifd %d: createDDict failed", p->id);
+        return -1;
+    }
+    ret = ZSTD_DCtx_refDDict(z->zds, z->ddict);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd %d: refDDict failed with error %s",
+                   p->id, ZSTD_getErrorName(ret));
+        return -1;
+    }
+    z->in.pos = sizeof(uint32_t) + size;
+
+    trace_multifd_zstd_dict_recv(p->id, size);
+    return 0;
+}
+
 /**
  * zstd_recv_pages: read the data from the channel into actual pages
  *
@@ -272,6 +512,11 @@ static int zstd_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
                    p->id, flags, MULTIFD_FLAG_ZSTD);
         return -1;
     }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet size %u larger than buffer",
+                   p->id, in_size);
+        return -1;
+    }
     ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
 
     if (ret != 0) {
@@ -282,6 +527,10 @@ static int zstd_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
     z->in.size = in_size;
     z->in.pos = 0;
 
+    if ((p->flags & MULTIFD_FLAG_ZSTD_DICT) && zstd_recv_dict(p, errp) < 0) {
+        return -1;
+    }
+
     for (i = 0; i < used; i++) {
         struct iovec *iov = &p->pages->iov[i];
 
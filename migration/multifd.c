@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -24,6 +25,7 @@
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "postcopy-ram.h"
 
 #include "qemu/yank.h"
 #include "io/channel-socket.h"
@@ -176,23 +178,32 @@ void multifd_register_ops(int method, MultiFDMethods *ops)
     multifd_ops[method] = ops;
 }
 
-static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+/*
+ * Sends the packet that identifies a channel to the destination.  Also
+ * used by the postcopy preempt channel, with its own reserved id.
+ */
+int multifd_send_channel_header(QIOChannel *c, uint8_t id, Error **errp)
 {
     MultiFDInit_t msg = {};
     int ret;
 
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
     msg.version = cpu_to_be32(MULTIFD_VERSION);
-    msg.id = p->id;
+    msg.id = id;
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
-    ret = qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
+    ret = qio_channel_write_all(c, (char *)&msg, sizeof(msg), errp);
     if (ret != 0) {
         return -1;
     }
     return 0;
 }
 
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    return multifd_send_channel_header(p->c, p->id, errp);
+}
+
 static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
 {
     MultiFDInit_t msg;
@@ -229,7 +240,12 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
-    if (msg.id > migrate_multifd_channels()) {
+    if (msg.id == MULTIFD_CHANNEL_POSTCOPY_PREEMPT &&
+        migrate_postcopy_preempt()) {
+        return msg.id;
+    }
+
+    if (!migrate_use_multifd() || msg.id > migrate_multifd_channels()) {
         error_setg(errp, "multifd: received channel version %d "
                    "expected %d", msg.version, MULTIFD_VERSION);
         return -1;
@@ -328,6 +344,8 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     if (packet->pages_alloc > p->pages->allocated) {
         multifd_pages_clear(p->pages);
         p->pages = multifd_pages_init(packet->pages_alloc);
+        qemu_vfree(p->postcopy_buf);
+        p->postcopy_buf = NULL;
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
@@ -354,6 +372,25 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+        /*
+         * Pages have to be placed atomically once postcopy runs, receive
+         * them in a buffer of our own and place them afterwards.
+         */
+        if (qemu_ram_pagesize(block) != qemu_target_page_size()) {
+            error_setg(errp, "multifd: postcopy page for ram block %s "
+                       "with host page size %zu", block->idstr,
+                       qemu_ram_pagesize(block));
+            return -1;
+        }
+        if (!p->postcopy_buf) {
+            p->postcopy_buf = qemu_memalign(qemu_target_page_size(),
+                                            p->pages->allocated *
+                                            qemu_target_page_size());
+        }
+        p->pages->block = block;
+    }
+
     for (i = 0; i < p->pages->used; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -363,7 +400,13 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            p->pages->offset[i] = offset;
+            p->pages->iov[i].iov_base = p->postcopy_buf +
+                                        i * qemu_target_page_size();
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+        }
         p->pages->iov[i].iov_len = qemu_target_page_size();
     }
 
@@ -445,6 +488,9 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
@@ -488,6 +534,18 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return 1;
 }
 
+/*
+ * Sends the pages queued so far without waiting for the packet to fill.
+ * Used in postcopy when the destination faulted on one of them.
+ */
+int multifd_queue_flush(QEMUFile *f)
+{
+    if (!migrate_use_multifd() || !multifd_send_state->pages->used) {
+        return 0;
+    }
+    return multifd_send_pages(f);
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -526,6 +584,34 @@ static void multifd_send_terminate_threads(Error *err)
     }
 }
 
+/*
+ * Fill @stats with what each of the first @nchannels send channels did
+ * so far.
+ *
+ * Returns the number of channels filled
+ */
+int multifd_send_get_stats(MultiFDSendStats *stats, int nchannels)
+{
+    int i;
+
+    if (!migrate_use_multifd() || !multifd_send_state) {
+        return 0;
+    }
+
+    nchannels = MIN(nchannels, migrate_multifd_channels());
+    for (i = 0; i < nchannels; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        stats[i].pages = p->num_pages;
+        stats[i].bytes = p->bytes_sent;
+        stats[i].payload = p->payload_sent;
+        stats[i].busy_ns = p->busy_ns;
+        qemu_mutex_unlock(&p->mutex);
+    }
+    return nchannels;
+}
+
 void multifd_save_cleanup(void)
 {
     int i;
@@ -646,6 +732,8 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
+            uint32_t payload;
+            int64_t start;
             flags = p->flags;
 
             if (used) {
@@ -662,11 +750,13 @@ static void *multifd_send_thread(void *opaque)
             p->num_pages += used;
             p->pages->used = 0;
             p->pages->block = NULL;
+            payload = used ? p->next_packet_size : 0;
             qemu_mutex_unlock(&p->mutex);
 
             trace_multifd_send(p->id, packet_num, used, flags,
                                p->next_packet_size);
 
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
             ret = qio_channel_write_all(p->c, (void *)p->packet,
                                         p->packet_len, &local_err);
             if (ret != 0) {
@@ -682,6 +772,9 @@ static void *multifd_send_thread(void *opaque)
 
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
+            p->bytes_sent += p->packet_len + payload;
+            p->payload_sent += payload;
+            p->busy_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
@@ -915,6 +1008,8 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* set once the destination listens for postcopy page faults */
+    QemuEvent postcopy_listen;
     /* multifd ops */
     MultiFDMethods *ops;
 } *multifd_recv_state;
@@ -951,6 +1046,8 @@ static void multifd_recv_terminate_threads(Error *err)
         }
         qemu_mutex_unlock(&p->mutex);
     }
+    /* Don't leave a thread waiting to place postcopy pages */
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -995,9 +1092,12 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        qemu_vfree(p->postcopy_buf);
+        p->postcopy_buf = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_event_destroy(&multifd_recv_state->postcopy_listen);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -1033,6 +1133,46 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+void multifd_recv_postcopy_listen(void)
+{
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
+}
+
+/*
+ * Places the pages of a postcopy packet, received in p->postcopy_buf.
+ * The packet can arrive before we process the LISTEN command, wait until
+ * userfaultfd is set up for the guest RAM.
+ */
+static int multifd_recv_postcopy_place(MultiFDRecvParams *p, uint32_t used,
+                                       Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = p->pages->block;
+    uint32_t i;
+    int ret;
+
+    qemu_event_wait(&multifd_recv_state->postcopy_listen);
+    if (p->quit) {
+        return 0;
+    }
+
+    for (i = 0; i < used; i++) {
+        ret = postcopy_place_page(mis, block->host + p->pages->offset[i],
+                                  p->pages->iov[i].iov_base, block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %d: failed to place page "
+                             RAM_ADDR_FMT " of ram block %s", p->id,
+                             p->pages->offset[i], block->idstr);
+            return -1;
+        }
+    }
+    trace_multifd_recv_postcopy_place(p->id, block->idstr, used);
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1083,6 +1223,13 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (used && (flags & MULTIFD_FLAG_POSTCOPY)) {
+            ret = multifd_recv_postcopy_place(p, used, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1117,6 +1264,7 @@ int multifd_load_setup(Error **errp)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     qatomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_event_init(&multifd_recv_state->postcopy_listen, false);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -1172,6 +1320,11 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
 
     id = multifd_recv_initial_packet(ioc, &local_err);
     if (id < 0) {
+        if (!migrate_use_multifd()) {
+            error_propagate_prepend(errp, local_err,
+                                    "failed to receive channel packet: ");
+            return false;
+        }
         multifd_recv_terminate_threads(local_err);
         error_propagate_prepend(errp, local_err,
                                 "failed to receive packet"
@@ -1179,6 +1332,11 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
                                 qatomic_read(&multifd_recv_state->count));
         return false;
     }
+    if (id == MULTIFD_CHANNEL_POSTCOPY_PREEMPT) {
+        /* Not a multifd channel, and not needed to start the migration */
+        postcopy_preempt_new_channel(migration_incoming_get_current(), ioc);
+        return false;
+    }
     trace_multifd_recv_new_channel(id);
 
     p = &multifd_recv_state->params[id];
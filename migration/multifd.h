@@ -22,6 +22,25 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+int multifd_queue_flush(QEMUFile *f);
+void multifd_recv_postcopy_listen(void);
+int multifd_send_channel_header(QIOChannel *c, uint8_t id, Error **errp);
+
+typedef struct {
+    /* pages sent through the channel */
+    uint64_t pages;
+    /* bytes written, packet headers included */
+    uint64_t bytes;
+    /* bytes written for the pages, after compression */
+    uint64_t payload;
+    /* time spent writing */
+    int64_t busy_ns;
+} MultiFDSendStats;
+
+int multifd_send_get_stats(MultiFDSendStats *stats, int nchannels);
+
+/* Channel id announcing the postcopy preempt channel instead */
+#define MULTIFD_CHANNEL_POSTCOPY_PREEMPT 0xff
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,6 +51,13 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
+
+/* Pages sent during postcopy, they need to be placed atomically */
+#define MULTIFD_FLAG_POSTCOPY (1 << 4)
+
+/* The payload starts with the zstd dictionary used by the channel */
+#define MULTIFD_FLAG_ZSTD_DICT (1 << 5)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -104,6 +130,11 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* bytes written to this channel, and for pages only */
+    uint64_t bytes_sent;
+    uint64_t payload_sent;
+    /* time spent writing to this channel */
+    int64_t busy_ns;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
@@ -145,6 +176,8 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* pages of postcopy packets are received here before being placed */
+    uint8_t *postcopy_buf;
     /* used for de-compression methods */
     void *data;
 } MultiFDRecvParams;
@@ -17,6 +17,7 @@
 #include "qapi/qmp/qerror.h"
 #include "qapi/error.h"
 #include "qemu/host-utils.h"
+#include "qemu/thread.h"
 #include "page_cache.h"
 #include "trace.h"
 
@@ -36,9 +37,18 @@ struct PageCache {
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    /* one lock per shard, NULL if the cache is not sharded */
+    QemuMutex *shard_locks;
+    size_t num_shards;
 };
 
 PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
+{
+    return cache_init_sharded(new_size, page_size, 0, errp);
+}
+
+PageCache *cache_init_sharded(uint64_t new_size, size_t page_size,
+                              size_t num_shards, Error **errp)
 {
     int64_t i;
     size_t num_pages = new_size / page_size;
@@ -66,6 +76,8 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->shard_locks = NULL;
+    cache->num_shards = 0;
 
     trace_migration_pagecache_init(cache->max_num_items);
 
@@ -84,6 +96,17 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
         cache->page_cache[i].it_addr = -1;
     }
 
+    if (num_shards) {
+        /* shards are selected with a mask, and can't be smaller than a slot */
+        num_shards = MIN(pow2ceil(num_shards), cache->max_num_items);
+        cache->num_shards = num_shards;
+        cache->shard_locks = g_new(QemuMutex, num_shards);
+        for (i = 0; i < num_shards; i++) {
+            qemu_mutex_init(&cache->shard_locks[i]);
+        }
+    }
+    trace_migration_pagecache_shards(cache->num_shards);
+
     return cache;
 }
 
@@ -98,6 +121,12 @@ void cache_fini(PageCache *cache)
         g_free(cache->page_cache[i].it_data);
     }
 
+    for (i = 0; i < cache->num_shards; i++) {
+        qemu_mutex_destroy(&cache->shard_locks[i]);
+    }
+    g_free(cache->shard_locks);
+    cache->shard_locks = NULL;
+
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
@@ -110,6 +139,33 @@ static size_t cache_get_cache_pos(const PageCache *cache,
     return (address / cache->page_size) & (cache->max_num_items - 1);
 }
 
+static QemuMutex *cache_get_shard_lock(const PageCache *cache,
+                                       uint64_t addr)
+{
+    size_t pos = cache_get_cache_pos(cache, addr);
+
+    /*
+     * Interleave the shards so that neighbouring pages, which tend to
+     * travel together in the same multifd packet, end up in different
+     * shards and don't contend with each other.
+     */
+    return &cache->shard_locks[pos & (cache->num_shards - 1)];
+}
+
+void cache_lock(PageCache *cache, uint64_t addr)
+{
+    if (cache->shard_locks) {
+        qemu_mutex_lock(cache_get_shard_lock(cache, addr));
+    }
+}
+
+void cache_unlock(PageCache *cache, uint64_t addr)
+{
+    if (cache->shard_locks) {
+        qemu_mutex_unlock(cache_get_shard_lock(cache, addr));
+    }
+}
+
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
     size_t pos;
@@ -163,7 +219,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
             trace_migration_pagecache_insert();
             return -1;
         }
-        cache->num_items++;
+        qatomic_inc(&cache->num_items);
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
@@ -29,12 +29,50 @@ typedef struct PageCache PageCache;
  * @errp: set *errp if the check failed, with reason
  */
 PageCache *cache_init(uint64_t cache_size, size_t page_size, Error **errp);
+
+/**
+ * cache_init_sharded: Initialize a page cache shared between threads
+ *
+ * The cache slots are split in @num_shards shards, each one protected
+ * by its own lock, so that threads working on different pages don't
+ * serialize on a single lock.  Users must bracket every access to an
+ * address with cache_lock()/cache_unlock().
+ *
+ * Returns new allocated cache or NULL on error
+ *
+ * @cache_size: cache size in bytes
+ * @page_size: cache page size
+ * @num_shards: number of shards, rounded up to a power of 2; 0 means
+ *              an unlocked cache, like cache_init()
+ * @errp: set *errp if the check failed, with reason
+ */
+PageCache *cache_init_sharded(uint64_t cache_size, size_t page_size,
+                              size_t num_shards, Error **errp);
+
 /**
  * cache_fini: free all cache resources
  * @cache pointer to the PageCache struct
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_lock: lock the shard that holds an address
+ *
+ * Does nothing for caches that are not sharded.
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_lock(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_unlock: unlock the shard that holds an address
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_unlock(PageCache *cache, uint64_t addr);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -17,12 +17,18 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "multifd.h"
+#include "mapped-ram.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
+#include "qemu/yank.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
@@ -557,10 +563,29 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
+    if (mis->have_preempt_thread) {
+        /*
+         * The source ends the preempt channel with an EOS before it
+         * completes, only kick the thread out if we failed.
+         */
+        if (mis->state == MIGRATION_STATUS_FAILED &&
+            qatomic_read(&mis->postcopy_qemufile_dst)) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+        trace_postcopy_preempt_thread_join();
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->postcopy_tmp_page) {
         munmap(mis->postcopy_tmp_page, mis->largest_page_size);
         mis->postcopy_tmp_page = NULL;
     }
+    if (mis->postcopy_preempt_tmp_page) {
+        munmap(mis->postcopy_preempt_tmp_page, mis->largest_page_size);
+        mis->postcopy_preempt_tmp_page = NULL;
+    }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
         mis->postcopy_tmp_zero_page = NULL;
@@ -842,6 +867,196 @@ static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
     return true;
 }
 
+/*
+ * Postcopy fault prefetcher
+ *
+ * Every fault costs the faulting vcpu a round trip to the source.  When
+ * the faults follow a constant stride within a RAMBlock, e.g. a vcpu
+ * walking through a buffer, the prefetcher requests the next pages of
+ * the stream before the guest touches them.  Streams of several vcpus
+ * are tracked independently.  The prefetch depth doubles each time the
+ * prediction holds and the stream is forgotten when it breaks.
+ *
+ * Pages that arrived ahead of the guest do not fault, so the next fault
+ * of a stream that is served well is further away than its stride: any
+ * fault in the window already requested, or just after it, continues the
+ * stream.
+ */
+
+/* Streams tracked at once */
+#define POSTCOPY_PREFETCH_STREAMS      8
+/* Faults with the same stride needed before prefetching */
+#define POSTCOPY_PREFETCH_MIN_HITS     2
+/* Pages requested ahead of the fault, initially and at most */
+#define POSTCOPY_PREFETCH_MIN_DEPTH    4
+#define POSTCOPY_PREFETCH_MAX_DEPTH    64
+/* Largest stride recognized, in host pages */
+#define POSTCOPY_PREFETCH_MAX_STRIDE   16
+/* Upper bound of the bytes requested ahead of a stream */
+#define POSTCOPY_PREFETCH_MAX_BYTES    (4 * MiB)
+
+typedef struct PostcopyPrefetchStream {
+    RAMBlock *rb;
+    /* Offset of the last fault of the stream */
+    ram_addr_t last;
+    /* Distance between the last two faults, 0 if only one was seen */
+    int64_t stride;
+    /* Number of consecutive faults that followed @stride */
+    unsigned int hits;
+    /* Pages to have requested ahead of the last fault */
+    unsigned int depth;
+    /* Number of pages after @last already requested */
+    unsigned int ahead;
+} PostcopyPrefetchStream;
+
+typedef struct PostcopyPrefetcher {
+    PostcopyPrefetchStream streams[POSTCOPY_PREFETCH_STREAMS];
+    /* Next stream to recycle */
+    unsigned int victim;
+} PostcopyPrefetcher;
+
+/*
+ * Returns by how many strides a fault at @offset advances @st, if it falls
+ * within the pages requested ahead of the last fault or on the first page
+ * after them, and 0 if it does not follow the stream.
+ */
+static int64_t postcopy_prefetch_steps(PostcopyPrefetchStream *st,
+                                       ram_addr_t offset)
+{
+    int64_t delta = (int64_t)offset - (int64_t)st->last;
+    int64_t steps;
+
+    if (!st->stride || delta % st->stride) {
+        return 0;
+    }
+    steps = delta / st->stride;
+    if (steps < 1 || steps > (int64_t)st->ahead + 1) {
+        return 0;
+    }
+    return steps;
+}
+
+/*
+ * Returns the stream @offset continues, or a recycled one.  A stream is
+ * continued if @offset follows its stride, or failing that if it is
+ * within POSTCOPY_PREFETCH_MAX_STRIDE pages of its last fault.
+ */
+static PostcopyPrefetchStream *
+postcopy_prefetch_find_stream(PostcopyPrefetcher *pf, RAMBlock *rb,
+                              ram_addr_t offset, bool *new_stream)
+{
+    int64_t max_stride = POSTCOPY_PREFETCH_MAX_STRIDE * qemu_ram_pagesize(rb);
+    PostcopyPrefetchStream *st, *near = NULL;
+    int64_t delta;
+    int i;
+
+    for (i = 0; i < POSTCOPY_PREFETCH_STREAMS; i++) {
+        st = &pf->streams[i];
+        if (st->rb != rb) {
+            continue;
+        }
+        if (postcopy_prefetch_steps(st, offset)) {
+            *new_stream = false;
+            return st;
+        }
+        delta = (int64_t)offset - (int64_t)st->last;
+        if (delta == 0 || delta > max_stride || delta < -max_stride) {
+            continue;
+        }
+        if (!near) {
+            near = st;
+        }
+    }
+
+    if (near) {
+        *new_stream = false;
+        return near;
+    }
+
+    st = &pf->streams[pf->victim];
+    pf->victim = (pf->victim + 1) % POSTCOPY_PREFETCH_STREAMS;
+    *new_stream = true;
+    return st;
+}
+
+/*
+ * Account a fault at @offset of @rb and, if it continues a stream,
+ * request the next pages of that stream from the source.
+ */
+static void postcopy_prefetch_fault(MigrationIncomingState *mis,
+                                    PostcopyPrefetcher *pf, RAMBlock *rb,
+                                    ram_addr_t offset)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    PostcopyPrefetchStream *st;
+    unsigned int max_depth, count;
+    int64_t steps, first, last;
+    bool new_stream;
+
+    st = postcopy_prefetch_find_stream(pf, rb, offset, &new_stream);
+    if (new_stream) {
+        *st = (PostcopyPrefetchStream) { .rb = rb, .last = offset };
+        return;
+    }
+
+    steps = postcopy_prefetch_steps(st, offset);
+    if (!steps) {
+        /* A new pattern: start over with this stride */
+        st->stride = (int64_t)offset - (int64_t)st->last;
+        st->last = offset;
+        st->hits = 1;
+        st->depth = POSTCOPY_PREFETCH_MIN_DEPTH;
+        st->ahead = 0;
+        return;
+    }
+    st->last = offset;
+
+    /*
+     * The fault was predicted; the pages before it were consumed, unless
+     * it is past the window, which then was too small.
+     */
+    st->hits++;
+    st->ahead = steps <= st->ahead ? st->ahead - steps : 0;
+    if (st->hits < POSTCOPY_PREFETCH_MIN_HITS) {
+        return;
+    }
+    if (st->hits > POSTCOPY_PREFETCH_MIN_HITS) {
+        max_depth = MAX(POSTCOPY_PREFETCH_MAX_BYTES / pagesize, 1);
+        max_depth = MIN(max_depth, POSTCOPY_PREFETCH_MAX_DEPTH);
+        st->depth = MIN(st->depth * 2, max_depth);
+    }
+    if (st->ahead >= st->depth) {
+        return;
+    }
+
+    /*
+     * Request the part of the window that was not requested yet, clipped
+     * to the RAMBlock.
+     */
+    first = (int64_t)offset + st->stride * (st->ahead + 1);
+    count = st->depth - st->ahead;
+    while (count) {
+        last = first + st->stride * (count - 1);
+        if (first >= 0 && last >= 0 &&
+            MAX(first, last) + pagesize <= qemu_ram_get_used_length(rb)) {
+            break;
+        }
+        count--;
+    }
+    if (!count) {
+        return;
+    }
+
+    trace_postcopy_prefetch_request(qemu_ram_get_idstr(rb), first,
+                                    st->stride, count);
+    if (migrate_send_rp_req_pages_prefetch(mis, rb, first, st->stride,
+                                           count)) {
+        /* Leave the error to the next fault request */
+        return;
+    }
+    st->ahead += count;
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -852,6 +1067,8 @@ static void *postcopy_ram_fault_thread(void *opaque)
     int ret;
     size_t index;
     RAMBlock *rb = NULL;
+    PostcopyPrefetcher prefetcher = { };
+    bool prefetch = migrate_postcopy_prefetch();
 
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
@@ -893,7 +1110,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        if (!mis->to_src_file) {
+        if (!mis->to_src_file && !mis->lazy_restore) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
@@ -970,6 +1187,17 @@ static void *postcopy_ram_fault_thread(void *opaque)
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
 
+            if (mis->lazy_restore) {
+                /* No source, the page is in the file we are restoring */
+                ret = mapped_ram_lazy_place(mis, rb, rb_offset);
+                if (ret) {
+                    error_report("%s: mapped_ram_lazy_place() get %d",
+                                 __func__, ret);
+                    break;
+                }
+                continue;
+            }
+
 retry:
             /*
              * Send the request to the source - we want to request one
@@ -989,6 +1217,10 @@ retry:
                     break;
                 }
             }
+
+            if (prefetch) {
+                postcopy_prefetch_fault(mis, &prefetcher, rb, rb_offset);
+            }
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1053,6 +1285,41 @@ retry:
     return NULL;
 }
 
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f;
+    int ret;
+
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_done);
+    f = qatomic_read(&mis->postcopy_qemufile_dst);
+    if (!f) {
+        /* The source never connected it, nothing to do */
+        return NULL;
+    }
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+    }
+
+    if (ret < 0 && mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        /*
+         * Pages the source sent here are lost, fail the main channel as
+         * well so that postcopy pauses and resends them on recovery.
+         */
+        error_report("%s: postcopy preempt channel failed: %s",
+                     __func__, strerror(-ret));
+        qemu_file_shutdown(mis->from_src_file);
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1119,6 +1386,27 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    if (migrate_postcopy_preempt()) {
+        mis->postcopy_preempt_tmp_page = mmap(NULL, mis->largest_page_size,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS,
+                                              -1, 0);
+        if (mis->postcopy_preempt_tmp_page == MAP_FAILED) {
+            int e = errno;
+            mis->postcopy_preempt_tmp_page = NULL;
+            error_report("%s: Failed to map postcopy_preempt_tmp_page %s",
+                         __func__, strerror(e));
+            return -e;
+        }
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
+    /* Multifd channels may now place the pages they receive */
+    multifd_recv_postcopy_listen();
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1303,6 +1591,89 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Postcopy preempt channel
+ *
+ * The pages the destination faults on are sent through a channel of
+ * their own, so they don't wait behind the background pages already
+ * queued on the main channel.  The channel is opened when the migration
+ * starts and is announced with a multifd channel header carrying a
+ * reserved id.  If it can't be opened, the faulted pages keep going
+ * through the main channel.
+ */
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+    QEMUFile *f;
+
+    if (qio_task_propagate_error(task, &local_err) ||
+        multifd_send_channel_header(ioc, MULTIFD_CHANNEL_POSTCOPY_PREEMPT,
+                                    &local_err)) {
+        warn_report_err(local_err);
+        goto out;
+    }
+
+    /* The migration may have finished or failed meanwhile */
+    if (!s->to_dst_file) {
+        goto out;
+    }
+
+    /* Unregistered when the QEMUFile is closed */
+    yank_register_function(MIGRATION_YANK_INSTANCE, yank_generic_iochannel,
+                           ioc);
+    f = qemu_fopen_channel_output(ioc);
+    qemu_file_set_blocking(f, true);
+    qatomic_set(&s->postcopy_qemufile_src, f);
+    trace_postcopy_preempt_new_channel();
+
+out:
+    object_unref(OBJECT(ioc));
+}
+
+void postcopy_preempt_setup(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return;
+    }
+
+    if (!socket_send_channel_available()) {
+        warn_report("postcopy-preempt needs a socket transport, faulted "
+                    "pages will use the main migration channel");
+        return;
+    }
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        warn_report("postcopy-preempt doesn't support TLS, faulted "
+                    "pages will use the main migration channel");
+        return;
+    }
+
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+}
+
+void postcopy_preempt_cleanup(MigrationState *s)
+{
+    QEMUFile *f = qatomic_xchg(&s->postcopy_qemufile_src, NULL);
+
+    if (f) {
+        qemu_fclose(f);
+    }
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis,
+                                  QIOChannel *ioc)
+{
+    QEMUFile *f = qemu_fopen_channel_input(ioc);
+
+    qemu_file_set_blocking(f, true);
+    qatomic_set(&mis->postcopy_qemufile_dst, f);
+    trace_postcopy_preempt_new_channel();
+    qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
@@ -106,6 +106,14 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/* Opens the postcopy preempt channel when the migration starts */
+void postcopy_preempt_setup(MigrationState *s);
+/* Closes the postcopy preempt channel on the source */
+void postcopy_preempt_cleanup(MigrationState *s);
+/* Called when the destination receives the postcopy preempt channel */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis,
+                                  QIOChannel *ioc);
+
 /*
  * To be called once at the start before any device initialisation
  */
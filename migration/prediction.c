@@ -0,0 +1,341 @@
+/*
+ * Migration convergence prediction
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * While a precopy migration runs we keep a small model of it: how fast
+ * the guest dirties memory, how fast we push it out, how much of it is
+ * zero pages and how well it compresses.  From that we predict whether,
+ * and when, the migration converges, both with the current settings and
+ * with a few alternatives a management application could switch to.
+ *
+ * The model is the usual geometric one.  Let R be the bytes left, D the
+ * dirty rate and G the rate at which guest memory is migrated (the wire
+ * bandwidth divided by the fraction of each page that hits the wire).
+ * Each iteration sends what is left and leaves q = D / G of it behind,
+ * so we converge once R * q^n fits in the downtime limit, if q < 1.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "exec/target_page.h"
+#include "sysemu/cpu-throttle.h"
+#include "migration.h"
+#include "multifd.h"
+#include "ram.h"
+#include "prediction.h"
+#include "trace.h"
+
+/* Number of past dirty rates reported */
+#define PREDICTION_HISTORY 8
+/* Weight of the newest sample in the moving averages */
+#define PREDICTION_WEIGHT 0.25
+/* Channels busier than this are considered the bottleneck */
+#define PREDICTION_CHANNEL_BUSY 0.9
+
+/* Protects the model, updated by the migration thread */
+static QemuMutex prediction_lock;
+
+static struct {
+    /* at least one sample was taken */
+    bool valid;
+    uint64_t iteration;
+    /* all rates in bytes per millisecond */
+    double transfer_rate;
+    double dirty_rate;
+    uint64_t history[PREDICTION_HISTORY];
+    unsigned history_len;
+    double zero_ratio;
+    uint64_t duplicate;
+    uint64_t normal;
+    /* uncompressed / compressed size, 0 when not compressing */
+    double compression_ratio;
+    uint64_t remaining;
+    /* multifd channels */
+    int nchannels;
+    MultiFDSendStats *channels;
+    int64_t *busy_ns;
+    double *channel_rate;
+    double busy;
+} prediction;
+
+void migration_prediction_init(void)
+{
+    qemu_mutex_init(&prediction_lock);
+}
+
+void migration_prediction_reset(void)
+{
+    int nchannels = migrate_use_multifd() ? migrate_multifd_channels() : 0;
+
+    qemu_mutex_lock(&prediction_lock);
+    g_free(prediction.channels);
+    g_free(prediction.busy_ns);
+    g_free(prediction.channel_rate);
+    memset(&prediction, 0, sizeof(prediction));
+    prediction.nchannels = nchannels;
+    prediction.channels = g_new0(MultiFDSendStats, nchannels);
+    prediction.busy_ns = g_new0(int64_t, nchannels);
+    prediction.channel_rate = g_new0(double, nchannels);
+    qemu_mutex_unlock(&prediction_lock);
+}
+
+static double prediction_average(double avg, double sample, bool first)
+{
+    return first ? sample : avg + PREDICTION_WEIGHT * (sample - avg);
+}
+
+static void prediction_update_channels(uint64_t time_spent)
+{
+    uint64_t pages = 0, payload = 0;
+    int64_t busy = 0;
+    int i, n;
+
+    n = multifd_send_get_stats(prediction.channels, prediction.nchannels);
+    for (i = 0; i < n; i++) {
+        MultiFDSendStats *c = &prediction.channels[i];
+
+        if (c->busy_ns) {
+            prediction.channel_rate[i] = (double)c->bytes * 1000000 /
+                                         c->busy_ns;
+        }
+        busy += c->busy_ns - prediction.busy_ns[i];
+        prediction.busy_ns[i] = c->busy_ns;
+        pages += c->pages;
+        payload += c->payload;
+    }
+    if (n) {
+        prediction.busy = (double)busy / (n * time_spent * 1000000.0);
+    }
+
+    if (prediction.nchannels &&
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        if (payload) {
+            prediction.compression_ratio = (double)pages *
+                                           qemu_target_page_size() / payload;
+        }
+    } else if (migrate_use_compression()) {
+        prediction.compression_ratio = compression_counters.compression_rate;
+    }
+}
+
+/*
+ * Called from the migration thread every time the bandwidth is
+ * recalculated, with the bytes sent over the last @time_spent ms.
+ */
+void migration_prediction_update(MigrationState *s, uint64_t transferred,
+                                 uint64_t time_spent)
+{
+    uint64_t duplicate, normal, dirty;
+    bool first;
+
+    if (!time_spent || migration_in_postcopy()) {
+        return;
+    }
+
+    qemu_mutex_lock(&prediction_lock);
+    first = !prediction.valid;
+
+    prediction.transfer_rate = prediction_average(prediction.transfer_rate,
+                                                  (double)transferred /
+                                                  time_spent, first);
+
+    if (ram_counters.dirty_sync_count != prediction.iteration) {
+        dirty = ram_counters.dirty_pages_rate * qemu_target_page_size();
+        prediction.iteration = ram_counters.dirty_sync_count;
+        prediction.dirty_rate = dirty / 1000.0;
+        memmove(&prediction.history[1], &prediction.history[0],
+                sizeof(prediction.history[0]) * (PREDICTION_HISTORY - 1));
+        prediction.history[0] = dirty;
+        prediction.history_len = MIN(prediction.history_len + 1,
+                                     PREDICTION_HISTORY);
+    }
+
+    duplicate = ram_counters.duplicate - prediction.duplicate;
+    normal = ram_counters.normal - prediction.normal;
+    if (duplicate + normal) {
+        prediction.zero_ratio = prediction_average(prediction.zero_ratio,
+                                                   (double)duplicate /
+                                                   (duplicate + normal),
+                                                   first);
+    }
+    prediction.duplicate = ram_counters.duplicate;
+    prediction.normal = ram_counters.normal;
+
+    prediction_update_channels(time_spent);
+
+    prediction.remaining = ram_bytes_remaining();
+    prediction.valid = true;
+
+    trace_migration_prediction_update(prediction.iteration,
+                                      prediction.transfer_rate,
+                                      prediction.dirty_rate,
+                                      prediction.zero_ratio,
+                                      prediction.compression_ratio);
+    qemu_mutex_unlock(&prediction_lock);
+}
+
+/*
+ * Fill @sc with the outcome of a precopy migration sending @bandwidth
+ * bytes/ms while the guest dirties @dirty bytes/ms, when only @wire of
+ * each page ends up on the wire.
+ */
+static void prediction_model(MigrationPredictionScenario *sc,
+                             double bandwidth, double dirty, double wire,
+                             uint64_t remaining, uint64_t downtime_limit)
+{
+    double guest, threshold, q;
+    int64_t n;
+
+    if (!bandwidth) {
+        sc->converges = false;
+        return;
+    }
+
+    guest = bandwidth / wire;
+    threshold = guest * downtime_limit;
+    q = dirty / guest;
+
+    if (remaining <= threshold) {
+        n = 0;
+    } else if (q >= 1) {
+        sc->converges = false;
+        return;
+    } else if (q == 0) {
+        n = 1;
+    } else {
+        n = ceil(log(threshold / remaining) / log(q));
+    }
+
+    sc->converges = true;
+    sc->has_iterations = true;
+    sc->iterations = n;
+    sc->has_convergence_time = true;
+    sc->convergence_time = n ? remaining / guest * (1 - pow(q, n)) / (1 - q)
+                             : 0;
+    sc->has_downtime = true;
+    sc->downtime = remaining * pow(q, n) / guest;
+}
+
+static MigrationPredictionScenario *
+prediction_scenario(MigrationState *s, int channels, bool compression,
+                    int throttle, double bandwidth, double dirty)
+{
+    MigrationPredictionScenario *sc = g_new0(MigrationPredictionScenario, 1);
+    double wire = 1 - prediction.zero_ratio;
+
+    if (compression) {
+        wire /= prediction.compression_ratio;
+    }
+
+    sc->has_multifd_channels = channels != 0;
+    sc->multifd_channels = channels;
+    sc->compression = compression;
+    sc->cpu_throttle_percentage = throttle;
+    /* an all-zero guest still costs a few bytes per page */
+    prediction_model(sc, bandwidth, dirty, MAX(wire, 0.01),
+                     prediction.remaining, s->parameters.downtime_limit);
+    return sc;
+}
+
+MigrationPrediction *qmp_query_migrate_prediction(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationPrediction *info;
+    MigrationPredictionScenarioList **sc;
+    bool compression;
+    double bandwidth, capacity = 0;
+    int throttle, t, i;
+
+    if (s->state != MIGRATION_STATUS_ACTIVE) {
+        error_setg(errp, "No precopy migration is running");
+        return NULL;
+    }
+
+    qemu_mutex_lock(&prediction_lock);
+    if (!prediction.valid) {
+        qemu_mutex_unlock(&prediction_lock);
+        error_setg(errp, "Migration statistics are not available yet");
+        return NULL;
+    }
+
+    info = g_new0(MigrationPrediction, 1);
+    info->iteration = prediction.iteration;
+    info->dirty_rate = prediction.dirty_rate * 1000;
+    for (i = prediction.history_len - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(info->dirty_rate_history, prediction.history[i]);
+    }
+    info->transfer_rate = prediction.transfer_rate * 1000;
+    info->has_channel_rates = prediction.nchannels != 0;
+    for (i = prediction.nchannels - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(info->channel_rates,
+                          prediction.channel_rate[i] * 1000);
+        capacity += prediction.channel_rate[i];
+    }
+    compression = prediction.compression_ratio > 0;
+    info->has_compression_ratio = compression;
+    info->compression_ratio = prediction.compression_ratio;
+    info->zero_page_ratio = prediction.zero_ratio;
+    info->remaining = prediction.remaining;
+
+    sc = &info->scenarios;
+    bandwidth = prediction.transfer_rate;
+    throttle = cpu_throttle_get_percentage();
+
+    QAPI_LIST_APPEND(sc, prediction_scenario(s, prediction.nchannels,
+                                             compression, throttle,
+                                             bandwidth,
+                                             prediction.dirty_rate));
+
+    /*
+     * Twice the channels only helps when the channels themselves are
+     * what limits us; assume each new one goes as fast as the current
+     * ones do while writing, within the bandwidth limit.
+     */
+    if (prediction.nchannels && prediction.nchannels * 2 <= UINT8_MAX) {
+        double more = bandwidth;
+
+        if (prediction.busy > PREDICTION_CHANNEL_BUSY) {
+            more = MIN(capacity * 2,
+                       s->parameters.max_bandwidth / 1000.0);
+            more = MAX(more, bandwidth);
+        }
+        QAPI_LIST_APPEND(sc, prediction_scenario(s, prediction.nchannels * 2,
+                                                 compression, throttle, more,
+                                                 prediction.dirty_rate));
+    }
+
+    /*
+     * Without compression the pages go out as they are, at the same
+     * bandwidth.  We cannot tell how well memory would compress until
+     * it is tried, so there is no prediction the other way around.
+     */
+    if (compression) {
+        QAPI_LIST_APPEND(sc, prediction_scenario(s, prediction.nchannels,
+                                                 false, throttle, bandwidth,
+                                                 prediction.dirty_rate));
+    }
+
+    /* Throttling slows the guest, and its dirty rate, proportionally */
+    t = throttle ? throttle + s->parameters.cpu_throttle_increment :
+                   s->parameters.cpu_throttle_initial;
+    for (; t <= s->parameters.max_cpu_throttle;
+         t += s->parameters.cpu_throttle_increment) {
+        double dirty = prediction.dirty_rate * (100 - t) / (100 - throttle);
+
+        QAPI_LIST_APPEND(sc, prediction_scenario(s, prediction.nchannels,
+                                                 compression, t, bandwidth,
+                                                 dirty));
+    }
+    qemu_mutex_unlock(&prediction_lock);
+
+    return info;
+}
@@ -0,0 +1,20 @@
+/*
+ * Migration convergence prediction
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_PREDICTION_H
+#define QEMU_MIGRATION_PREDICTION_H
+
+#include "migration.h"
+
+void migration_prediction_init(void);
+void migration_prediction_reset(void);
+void migration_prediction_update(MigrationState *s, uint64_t transferred,
+                                 uint64_t time_spent);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * QEMUFile backend writing to regular files through io_uring
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The channel backend writes each flush of the QEMUFile synchronously,
+ * at most MAX_IOV_SIZE iovecs at a time.  Here, the stream is instead
+ * copied into a ring of large page-aligned buffers, each written with a
+ * single io_uring request once full, so that several writes are in
+ * flight while the migration thread keeps filling the next buffer.
+ *
+ * As nobody waits on the other side of a regular file, a buffer is only
+ * written once full or when the file is closed.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu/units.h"
+#include "io/channel-file.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu-file.h"
+#include "qemu-file-uring.h"
+#include "trace.h"
+
+#define QEMU_FILE_URING_BUF_SIZE    (1 * MiB)
+#define QEMU_FILE_URING_DEPTH       4
+
+typedef struct {
+    uint8_t *data;
+    /* Bytes copied in */
+    size_t len;
+    /* Bytes written, while in flight */
+    size_t done;
+    /* Where in the file it goes */
+    off_t offset;
+    bool busy;
+} QEMUFileUringBuf;
+
+typedef struct {
+    QIOChannel *ioc;
+    int fd;
+    struct io_uring ring;
+    /* Where the next buffer goes */
+    off_t offset;
+    /* Buffer being filled */
+    unsigned int cur;
+    unsigned int inflight;
+    /* Whether io_uring_submit() failed and left requests in the ring */
+    bool unsubmitted;
+    /* First error of a write */
+    int error;
+    QEMUFileUringBuf bufs[QEMU_FILE_URING_DEPTH];
+} QEMUFileUring;
+
+/*
+ * Hand the queued requests to the kernel.  If that fails they stay in the
+ * ring, still counted in flight, and the next wait tries again.
+ */
+static int uring_flush(QEMUFileUring *fu)
+{
+    int ret;
+
+    do {
+        ret = io_uring_submit(&fu->ring);
+    } while (ret == -EINTR);
+    fu->unsubmitted = ret < 0;
+    if (ret < 0 && !fu->error) {
+        fu->error = ret;
+    }
+    return ret;
+}
+
+static void uring_submit(QEMUFileUring *fu, QEMUFileUringBuf *buf)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&fu->ring);
+
+    /* There is one entry per buffer */
+    assert(sqe);
+    io_uring_prep_write(sqe, fu->fd, buf->data + buf->done,
+                        buf->len - buf->done, buf->offset + buf->done);
+    io_uring_sqe_set_data(sqe, buf);
+    uring_flush(fu);
+}
+
+static void uring_queue(QEMUFileUring *fu, QEMUFileUringBuf *buf)
+{
+    trace_qemu_file_uring_queue(fu->offset, buf->len);
+
+    buf->offset = fu->offset;
+    buf->done = 0;
+    buf->busy = true;
+    fu->offset += buf->len;
+    fu->inflight++;
+    uring_submit(fu, buf);
+}
+
+/* Reap one completion, waiting for it if @wait */
+static int uring_reap(QEMUFileUring *fu, bool wait)
+{
+    struct io_uring_cqe *cqe;
+    QEMUFileUringBuf *buf;
+    int ret;
+
+    if (!wait) {
+        ret = io_uring_peek_cqe(&fu->ring, &cqe);
+    } else {
+        do {
+            /* Requests left in the ring would never complete */
+            if (fu->unsubmitted && uring_flush(fu) < 0) {
+                return fu->error;
+            }
+            ret = io_uring_wait_cqe(&fu->ring, &cqe);
+        } while (ret == -EINTR);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    buf = io_uring_cqe_get_data(cqe);
+    ret = cqe->res;
+    io_uring_cqe_seen(&fu->ring, cqe);
+
+    if (ret > 0) {
+        buf->done += ret;
+        if (buf->done < buf->len) {
+            /* Short write, try the rest */
+            uring_submit(fu, buf);
+            return 0;
+        }
+    } else if (!fu->error) {
+        fu->error = ret ? ret : -EIO;
+    }
+    buf->busy = false;
+    buf->len = 0;
+    fu->inflight--;
+    return 0;
+}
+
+static ssize_t uring_writev_buffer(void *opaque, struct iovec *iov,
+                                   int iovcnt, int64_t pos, Error **errp)
+{
+    QEMUFileUring *fu = opaque;
+    ssize_t done = 0;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        const uint8_t *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len) {
+            QEMUFileUringBuf *buf = &fu->bufs[fu->cur];
+            size_t n;
+
+            if (buf->busy) {
+                ret = uring_reap(fu, true);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "io_uring wait failed");
+                    return -EIO;
+                }
+                continue;
+            }
+
+            n = MIN(len, QEMU_FILE_URING_BUF_SIZE - buf->len);
+            memcpy(buf->data + buf->len, p, n);
+            buf->len += n;
+            p += n;
+            len -= n;
+            done += n;
+
+            if (buf->len == QEMU_FILE_URING_BUF_SIZE) {
+                uring_queue(fu, buf);
+                fu->cur = (fu->cur + 1) % QEMU_FILE_URING_DEPTH;
+            }
+        }
+    }
+
+    /* Pick up what completed meanwhile, for errors */
+    while (fu->inflight && uring_reap(fu, false) == 0) {
+        /* nothing */
+    }
+    if (fu->error) {
+        error_setg_errno(errp, -fu->error, "Failed to write migration file");
+        return -EIO;
+    }
+    return done;
+}
+
+static int uring_close(void *opaque, Error **errp)
+{
+    QEMUFileUring *fu = opaque;
+    QEMUFileUringBuf *buf = &fu->bufs[fu->cur];
+    int i, ret = 0;
+
+    if (buf->len && !buf->busy && !fu->error) {
+        uring_queue(fu, buf);
+    }
+    /* The kernel may still access the buffers until every write completed */
+    while (fu->inflight) {
+        ret = uring_reap(fu, true);
+        if (ret < 0) {
+            break;
+        }
+    }
+    if (!ret) {
+        ret = fu->error;
+    }
+    trace_qemu_file_uring_close(fu->offset, ret);
+
+    if (!fu->inflight) {
+        io_uring_queue_exit(&fu->ring);
+        for (i = 0; i < QEMU_FILE_URING_DEPTH; i++) {
+            qemu_vfree(fu->bufs[i].data);
+        }
+    } else {
+        /* Leak the ring and buffers rather than free them under the kernel */
+        error_report("Failed to wait for migration file writes: %s",
+                     strerror(-ret));
+    }
+    if (qio_channel_close(fu->ioc, ret ? NULL : errp) < 0 && !ret) {
+        ret = -EIO;
+    }
+    object_unref(OBJECT(fu->ioc));
+    g_free(fu);
+    return ret;
+}
+
+static int uring_set_blocking(void *opaque, bool enabled, Error **errp)
+{
+    QEMUFileUring *fu = opaque;
+
+    if (qio_channel_set_blocking(fu->ioc, enabled, errp) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static const QEMUFileOps uring_output_ops = {
+    .writev_buffer = uring_writev_buffer,
+    .close = uring_close,
+    .set_blocking = uring_set_blocking,
+};
+
+/*
+ * Open a QEMUFile writing to @ioc through io_uring
+ *
+ * Returns NULL if @ioc is not a regular file or io_uring is not
+ * available, the caller should then use the channel backend.
+ */
+QEMUFile *qemu_fopen_uring_output(QIOChannel *ioc)
+{
+    QEMUFileUring *fu;
+    struct stat st;
+    off_t offset;
+    int fd, ret, i;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        return NULL;
+    }
+    fd = QIO_CHANNEL_FILE(ioc)->fd;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        return NULL;
+    }
+
+    fu = g_new0(QEMUFileUring, 1);
+    ret = io_uring_queue_init(QEMU_FILE_URING_DEPTH, &fu->ring, 0);
+    if (ret < 0) {
+        trace_qemu_file_uring_unavailable(ret);
+        g_free(fu);
+        return NULL;
+    }
+    for (i = 0; i < QEMU_FILE_URING_DEPTH; i++) {
+        fu->bufs[i].data = qemu_memalign(qemu_real_host_page_size,
+                                         QEMU_FILE_URING_BUF_SIZE);
+    }
+    fu->ioc = ioc;
+    fu->fd = fd;
+    fu->offset = offset;
+    object_ref(OBJECT(ioc));
+
+    trace_qemu_file_uring_open(fd, offset);
+    return qemu_fopen_ops(fu, &uring_output_ops, false);
+}
@@ -0,0 +1,24 @@
+/*
+ * QEMUFile backend writing to regular files through io_uring
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_FILE_URING_H
+#define QEMU_FILE_URING_H
+
+#include "io/channel.h"
+
+#ifdef CONFIG_LINUX_IO_URING
+QEMUFile *qemu_fopen_uring_output(QIOChannel *ioc);
+#else
+static inline QEMUFile *qemu_fopen_uring_output(QIOChannel *ioc)
+{
+    return NULL;
+}
+#endif
+
+#endif
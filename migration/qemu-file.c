@@ -55,6 +55,8 @@ struct QEMUFile {
     Error *last_error_obj;
     /* has the file has been shutdown */
     bool shutdown;
+    /* opaque is a QIOChannel */
+    bool has_ioc;
 };
 
 /*
@@ -101,7 +103,7 @@ bool qemu_file_mode_is_not_valid(const char *mode)
     return false;
 }
 
-QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
+QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops, bool has_ioc)
 {
     QEMUFile *f;
 
@@ -109,9 +111,19 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->has_ioc = has_ioc;
     return f;
 }
 
+/*
+ * Get the channel a file is built on, or NULL if it doesn't sit on top
+ * of a QIOChannel.
+ */
+QIOChannel *qemu_file_get_ioc(QEMUFile *file)
+{
+    return file->has_ioc ? QIO_CHANNEL(file->opaque) : NULL;
+}
+
 
 void qemu_file_set_hooks(QEMUFile *f, const QEMUFileHooks *hooks)
 {
@@ -657,6 +669,52 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Offset in the underlying channel of the next byte to be read or
+ * written.  Only works for files on top of a seekable channel.
+ *
+ * Returns the offset, or -1 on error
+ */
+off_t qemu_get_offset(QEMUFile *f, Error **errp)
+{
+    off_t off;
+
+    if (!f->has_ioc) {
+        error_setg(errp, "Migration stream is not seekable");
+        return -1;
+    }
+
+    qemu_fflush(f);
+    off = qio_channel_io_seek(QIO_CHANNEL(f->opaque), 0, SEEK_CUR, errp);
+    if (off >= 0 && !qemu_file_is_writable(f)) {
+        /* What has been read ahead isn't consumed yet */
+        off -= f->buf_size - f->buf_index;
+    }
+    return off;
+}
+
+/*
+ * Move the file to @off in the underlying channel; anything buffered is
+ * written out first on output and dropped on input.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int qemu_set_offset(QEMUFile *f, off_t off, Error **errp)
+{
+    if (!f->has_ioc) {
+        error_setg(errp, "Migration stream is not seekable");
+        return -1;
+    }
+
+    qemu_fflush(f);
+    f->buf_index = 0;
+    f->buf_size = 0;
+    if (qio_channel_io_seek(QIO_CHANNEL(f->opaque), off, SEEK_SET, errp) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
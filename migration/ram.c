@@ -29,6 +29,7 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -53,9 +54,12 @@
 #include "block.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "mapped-ram.h"
 #include "sysemu/runstate.h"
 
 #if defined(__linux__)
@@ -81,6 +85,9 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/* Bytes of prefetch requests queued at most, older ones are dropped */
+#define RAM_PREFETCH_QUEUE_MAX (64 * MiB)
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -95,7 +102,10 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE, Protected by lock.  The multifd channels access
+     * it under RCU instead, and serialize on the cache shard locks.
+     */
     PageCache *cache;
     QemuMutex lock;
     /* it will store a page full of zeros */
@@ -118,6 +128,45 @@ static void XBZRLE_cache_unlock(void)
     }
 }
 
+/*
+ * When the pages are XBZRLE encoded by the multifd channels, the cache
+ * is shared by all of them, so split it in a few shards per channel.
+ */
+static size_t xbzrle_cache_shards(void)
+{
+    if (!migrate_use_multifd() ||
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_XBZRLE) {
+        return 0;
+    }
+    return migrate_multifd_channels() * 4;
+}
+
+/*
+ * Replace the XBZRLE cache, waiting for the multifd channels to stop
+ * using the old one before freeing it.  Called with XBZRLE.lock held.
+ */
+static void xbzrle_cache_replace(PageCache *new_cache)
+{
+    PageCache *old_cache = XBZRLE.cache;
+
+    qatomic_rcu_set(&XBZRLE.cache, new_cache);
+    if (old_cache) {
+        synchronize_rcu();
+        cache_fini(old_cache);
+    }
+}
+
+/**
+ * xbzrle_cache_get: get the XBZRLE cache for the multifd channels
+ *
+ * Returns the cache, or NULL if XBZRLE is not in use.  Must be called
+ * with the RCU read lock held, the cache can't be used after that.
+ */
+PageCache *xbzrle_cache_get(void)
+{
+    return qatomic_rcu_read(&XBZRLE.cache);
+}
+
 /**
  * xbzrle_cache_resize: resize the xbzrle cache
  *
@@ -151,14 +200,14 @@ int xbzrle_cache_resize(uint64_t new_size, Error **errp)
     XBZRLE_cache_lock();
 
     if (XBZRLE.cache != NULL) {
-        new_cache = cache_init(new_size, TARGET_PAGE_SIZE, errp);
+        new_cache = cache_init_sharded(new_size, TARGET_PAGE_SIZE,
+                                       xbzrle_cache_shards(), errp);
         if (!new_cache) {
             ret = -1;
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        xbzrle_cache_replace(new_cache);
     }
 out:
     XBZRLE_cache_unlock();
@@ -299,6 +348,9 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+typedef QSIMPLEQ_HEAD(RAMSrcPageRequestQueue, RAMSrcPageRequest)
+    RAMSrcPageRequestQueue;
+
 /* State of RAM for migration */
 struct RAMState {
     /* QEMUFile used for this migration */
@@ -309,6 +361,11 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /*
+     * last_sent_block of the postcopy channel that isn't rs->f, see
+     * postcopy_preempt_switch_channel()
+     */
+    RAMBlock *other_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -326,6 +383,12 @@ struct RAMState {
     uint64_t bytes_xfer_prev;
     /* number of dirty pages since start_time */
     uint64_t num_dirty_pages_period;
+    /* dirty pages collected from each vcpu at start_time */
+    uint64_t *vcpu_dirty_pages_prev;
+    /* dirty pages collected from each vcpu during the last period */
+    uint64_t *vcpu_dirty_pages_period;
+    /* number of entries of the two arrays above */
+    int nr_vcpu_dirty_pages;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
     /* Amount of xbzrle pages since the beginning of the period */
@@ -353,7 +416,15 @@ struct RAMState {
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
-    QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    RAMSrcPageRequestQueue src_page_requests;
+    /*
+     * Pages the destination expects to fault on soon, also protected by
+     * src_page_req_mutex.  Served after src_page_requests, before the
+     * background scan.
+     */
+    RAMSrcPageRequestQueue src_page_prefetch_requests;
+    /* Bytes in src_page_prefetch_requests */
+    uint64_t src_page_prefetch_bytes;
 };
 typedef struct RAMState RAMState;
 
@@ -410,6 +481,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* The destination is waiting for this page, in postcopy */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -563,7 +636,7 @@ static int compress_threads_save_setup(void)
         /* comp_param[i].file is just used as a dummy buffer to save data,
          * set its ops to empty.
          */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops, false);
         comp_param[i].done = true;
         comp_param[i].quit = false;
         qemu_mutex_init(&comp_param[i].mutex);
@@ -652,6 +725,134 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
     }
 }
 
+/**
+ * mig_throttle_vcpus_down: throttle down the vcpus dirtying memory
+ *
+ * Per-vcpu flavour of mig_throttle_guest_down: only the vcpus that
+ * dirtied more than their share of @bytes_dirty_threshold during the
+ * last period are throttled, or throttled further.  The vcpus that
+ * hardly write to memory are not slowed down at all.
+ *
+ * @rs: current RAM state
+ * @bytes_dirty_threshold: bytes the whole guest may dirty in a period
+ */
+static void mig_throttle_vcpus_down(RAMState *rs,
+                                    uint64_t bytes_dirty_threshold)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_initial = s->parameters.cpu_throttle_initial;
+    uint64_t pct_increment = s->parameters.cpu_throttle_increment;
+    int pct_max = s->parameters.max_cpu_throttle;
+    uint64_t bytes_dirty_vcpu, bytes_dirty_vcpu_threshold;
+    CPUState *cpu;
+    int nr_vcpus = 0;
+    int pct;
+
+    CPU_FOREACH(cpu) {
+        nr_vcpus++;
+    }
+    bytes_dirty_vcpu_threshold = bytes_dirty_threshold / MAX(nr_vcpus, 1);
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index >= rs->nr_vcpu_dirty_pages) {
+            continue;
+        }
+        bytes_dirty_vcpu = rs->vcpu_dirty_pages_period[cpu->cpu_index] *
+                           qemu_real_host_page_size;
+        if (bytes_dirty_vcpu <= bytes_dirty_vcpu_threshold) {
+            continue;
+        }
+
+        pct = cpu_throttle_get_vcpu_percentage(cpu);
+        if (!pct) {
+            pct = pct_initial;
+        } else {
+            pct = MIN(pct + pct_increment, pct_max);
+        }
+        trace_migration_throttle_vcpu(cpu->cpu_index, bytes_dirty_vcpu, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+}
+
+/**
+ * mig_throttle_vcpus_up: lift the throttle of vcpus that calmed down
+ *
+ * Steps back the throttle of every vcpu that dirtied no more than its
+ * share of @bytes_dirty_threshold during the last period, and removes
+ * it once it would fall below the initial percentage.
+ *
+ * @rs: current RAM state
+ * @bytes_dirty_threshold: bytes the whole guest may dirty in a period
+ */
+static void mig_throttle_vcpus_up(RAMState *rs,
+                                  uint64_t bytes_dirty_threshold)
+{
+    MigrationState *s = migrate_get_current();
+    int pct_initial = s->parameters.cpu_throttle_initial;
+    int pct_increment = s->parameters.cpu_throttle_increment;
+    uint64_t bytes_dirty_vcpu, bytes_dirty_vcpu_threshold;
+    CPUState *cpu;
+    int nr_vcpus = 0;
+    int pct;
+
+    CPU_FOREACH(cpu) {
+        nr_vcpus++;
+    }
+    bytes_dirty_vcpu_threshold = bytes_dirty_threshold / MAX(nr_vcpus, 1);
+
+    CPU_FOREACH(cpu) {
+        pct = cpu_throttle_get_vcpu_percentage(cpu);
+        if (!pct || cpu->cpu_index >= rs->nr_vcpu_dirty_pages) {
+            continue;
+        }
+        bytes_dirty_vcpu = rs->vcpu_dirty_pages_period[cpu->cpu_index] *
+                           qemu_real_host_page_size;
+        if (bytes_dirty_vcpu > bytes_dirty_vcpu_threshold) {
+            continue;
+        }
+
+        pct -= pct_increment;
+        if (pct < pct_initial) {
+            pct = 0;
+        }
+        trace_migration_throttle_vcpu(cpu->cpu_index, bytes_dirty_vcpu, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+}
+
+/*
+ * Account the pages each vcpu dirtied since the previous call, as
+ * collected from the KVM dirty rings.  Called with the BQL held.
+ */
+static void migration_update_vcpu_dirty_pages(RAMState *rs)
+{
+    CPUState *cpu;
+
+    if (!rs->vcpu_dirty_pages_prev) {
+        rs->nr_vcpu_dirty_pages = current_machine->smp.max_cpus;
+        rs->vcpu_dirty_pages_prev = g_new0(uint64_t, rs->nr_vcpu_dirty_pages);
+        rs->vcpu_dirty_pages_period = g_new0(uint64_t,
+                                             rs->nr_vcpu_dirty_pages);
+        CPU_FOREACH(cpu) {
+            if (cpu->cpu_index < rs->nr_vcpu_dirty_pages) {
+                rs->vcpu_dirty_pages_prev[cpu->cpu_index] = cpu->dirty_pages;
+            }
+        }
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        int idx = cpu->cpu_index;
+
+        if (idx >= rs->nr_vcpu_dirty_pages) {
+            continue;
+        }
+        rs->vcpu_dirty_pages_period[idx] = cpu->dirty_pages -
+                                           rs->vcpu_dirty_pages_prev[idx];
+        rs->vcpu_dirty_pages_prev[idx] = cpu->dirty_pages;
+    }
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -672,8 +873,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
+    cache_lock(XBZRLE.cache, current_addr);
     cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
                  ram_counters.dirty_sync_count);
+    cache_unlock(XBZRLE.cache, current_addr);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -955,6 +1158,10 @@ static void migration_trigger_throttle(RAMState *rs)
     uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
     uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
 
+    if (migrate_vcpu_throttle()) {
+        migration_update_vcpu_dirty_pages(rs);
+    }
+
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
@@ -965,12 +1172,20 @@ static void migration_trigger_throttle(RAMState *rs)
            we were in this routine reaches the threshold. If that happens
            twice, start or increase throttling. */
 
+        if (migrate_vcpu_throttle()) {
+            mig_throttle_vcpus_up(rs, bytes_dirty_threshold);
+        }
+
         if ((bytes_dirty_period > bytes_dirty_threshold) &&
             (++rs->dirty_rate_high_cnt >= 2)) {
             trace_migration_throttle();
             rs->dirty_rate_high_cnt = 0;
-            mig_throttle_guest_down(bytes_dirty_period,
-                                    bytes_dirty_threshold);
+            if (migrate_vcpu_throttle()) {
+                mig_throttle_vcpus_down(rs, bytes_dirty_threshold);
+            } else {
+                mig_throttle_guest_down(bytes_dirty_period,
+                                        bytes_dirty_threshold);
+            }
         }
     }
 }
@@ -1210,6 +1425,25 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     return pages;
 }
 
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    int res = mapped_ram_save_page(block, offset);
+
+    if (res < 0) {
+        return res;
+    }
+    if (res) {
+        ram_counters.normal++;
+        ram_counters.transferred += TARGET_PAGE_SIZE;
+        qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    } else {
+        ram_counters.duplicate++;
+    }
+
+    return 1;
+}
+
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
@@ -1402,10 +1636,43 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     }
 }
 
+/*
+ * Pops the next page off @queue, called with src_page_req_mutex held.
+ * Returns the block of the page, or NULL if @queue is empty.
+ */
+static RAMBlock *unqueue_page_from(RAMSrcPageRequestQueue *queue,
+                                   ram_addr_t *offset, bool urgent)
+{
+    struct RAMSrcPageRequest *entry = QSIMPLEQ_FIRST(queue);
+    RAMBlock *block;
+
+    if (!entry) {
+        return NULL;
+    }
+
+    block = entry->rb;
+    *offset = entry->offset;
+
+    if (entry->len > TARGET_PAGE_SIZE) {
+        entry->len -= TARGET_PAGE_SIZE;
+        entry->offset += TARGET_PAGE_SIZE;
+    } else {
+        memory_region_unref(block->mr);
+        QSIMPLEQ_REMOVE_HEAD(queue, next_req);
+        g_free(entry);
+        if (urgent) {
+            migration_consume_urgent_request();
+        }
+    }
+
+    return block;
+}
+
 /**
  * unqueue_page: gets a page of the queue
  *
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Helper for 'get_queued_page' - gets a page off the queue.  Pages the
+ * destination faulted on come first, then the pages it prefetches.
  *
  * Returns the block of the page (or NULL if none available)
  *
@@ -1414,27 +1681,20 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
  */
 static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
 {
-    RAMBlock *block = NULL;
+    RAMBlock *block;
 
-    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
+    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests) &&
+        QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_prefetch_requests)) {
         return NULL;
     }
 
     QEMU_LOCK_GUARD(&rs->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
-        struct RAMSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&rs->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
-
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
-        } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
-            g_free(entry);
-            migration_consume_urgent_request();
+    block = unqueue_page_from(&rs->src_page_requests, offset, true);
+    if (!block) {
+        block = unqueue_page_from(&rs->src_page_prefetch_requests, offset,
+                                  false);
+        if (block) {
+            rs->src_page_prefetch_bytes -= TARGET_PAGE_SIZE;
         }
     }
 
@@ -1704,6 +1964,78 @@ void ram_write_tracking_stop(void)
 }
 #endif /* defined(__linux__) */
 
+/*
+ * Incremental snapshots: once a snapshot is saved, dirty logging is left
+ * running, so that the next snapshot only has to save the pages dirtied
+ * since.  Any other user of the migration dirty bitmap consumes the dirty
+ * bits, and ends the tracking.
+ */
+static struct {
+    /* A savevm is in progress */
+    bool saving;
+    /* Dirty logging is to be left running after this savevm */
+    bool keep_tracking;
+    /* Only the pages dirtied since the last snapshot are saved */
+    bool incremental;
+    /* Dirty logging has been running since the last snapshot */
+    bool tracking;
+} ram_snapshot;
+
+/**
+ * ram_snapshot_tracking: whether the next snapshot can be incremental
+ *
+ * Returns true if all the pages dirtied since the last snapshot are
+ * still known
+ */
+bool ram_snapshot_tracking(void)
+{
+    return ram_snapshot.tracking && global_dirty_log;
+}
+
+/**
+ * ram_snapshot_begin: prepare RAM for a savevm
+ *
+ * @keep_tracking: leave dirty logging running after the snapshot
+ * @incremental: only save the pages dirtied since the last snapshot,
+ *               requires ram_snapshot_tracking()
+ */
+void ram_snapshot_begin(bool keep_tracking, bool incremental)
+{
+    assert(!incremental || ram_snapshot_tracking());
+
+    ram_snapshot.saving = true;
+    ram_snapshot.keep_tracking = keep_tracking;
+    ram_snapshot.incremental = incremental;
+    trace_ram_snapshot_begin(keep_tracking, incremental);
+}
+
+/**
+ * ram_snapshot_end: done with a savevm
+ *
+ * @success: the snapshot was created
+ */
+void ram_snapshot_end(bool success)
+{
+    ram_snapshot.saving = false;
+    ram_snapshot.incremental = false;
+    if (!success || !ram_snapshot.keep_tracking) {
+        ram_snapshot_stop_tracking();
+    }
+}
+
+/* Forget the pages dirtied since the last snapshot */
+void ram_snapshot_stop_tracking(void)
+{
+    if (!ram_snapshot.tracking) {
+        return;
+    }
+    ram_snapshot.tracking = false;
+    if (migration_is_idle()) {
+        memory_global_dirty_log_stop();
+    }
+    trace_ram_snapshot_stop_tracking();
+}
+
 /**
  * get_queued_page: unqueue a page from the postcopy requests
  *
@@ -1736,6 +2068,15 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
                                                 page);
+                /*
+                 * It may still wait for its packet to fill in multifd,
+                 * the destination is blocked on it so don't wait.
+                 */
+                if (migration_in_postcopy() &&
+                    multifd_queue_flush(rs->f) < 0) {
+                    qemu_file_set_error(rs->f, -EIO);
+                    return false;
+                }
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -1767,6 +2108,7 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
          */
         pss->block = block;
         pss->page = offset >> TARGET_PAGE_BITS;
+        pss->postcopy_requested = migration_in_postcopy();
 
         /*
          * This unqueued page would break the "one round" check, even is
@@ -1798,6 +2140,13 @@ static void migration_page_queue_free(RAMState *rs)
         QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &rs->src_page_prefetch_requests, next_req,
+                          next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&rs->src_page_prefetch_requests, next_req);
+        g_free(mspr);
+    }
+    rs->src_page_prefetch_bytes = 0;
 }
 
 /**
@@ -1865,6 +2214,92 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
     return 0;
 }
 
+/**
+ * ram_save_queue_prefetch_pages: queue pages the destination predicts
+ * it will fault on
+ *
+ * The pages are @count host pages of the block, every @stride bytes
+ * from @start.  They are sent after the pages the destination actually
+ * faulted on, but before the background scan reaches them.
+ *
+ * Unlike ram_save_queue_pages this does not change the RAMBlock that
+ * the requests without block name refer to.
+ *
+ * Returns zero on success or negative on error
+ *
+ * @rbname: Name of the RAMBlock of the request
+ * @start: offset of the first page from the start of the RAMBlock
+ * @stride: distance in bytes between two pages, may be negative
+ * @count: number of pages
+ */
+int ram_save_queue_prefetch_pages(const char *rbname, ram_addr_t start,
+                                  int64_t stride, uint32_t count)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *ramblock;
+    size_t pagesize;
+    RAMSrcPageRequestQueue entries = QSIMPLEQ_HEAD_INITIALIZER(entries);
+    struct RAMSrcPageRequest *new_entry, *old;
+    int64_t last;
+    uint32_t i;
+
+    RCU_READ_LOCK_GUARD();
+
+    ramblock = qemu_ram_block_by_name(rbname);
+    if (!ramblock) {
+        error_report("%s no block '%s'", __func__, rbname);
+        return -1;
+    }
+    pagesize = qemu_ram_pagesize(ramblock);
+    trace_ram_save_queue_prefetch_pages(ramblock->idstr, start, stride, count);
+
+    last = (int64_t)start + stride * (int64_t)(count - 1);
+    if (!count || !stride || stride % (int64_t)pagesize || last < 0 ||
+        start + pagesize > ramblock->used_length ||
+        last + pagesize > ramblock->used_length) {
+        error_report("%s bad request start=" RAM_ADDR_FMT " stride=%" PRId64
+                     " count=%" PRIu32 " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, stride, count, ramblock->used_length);
+        return -1;
+    }
+    count = MIN(count, MAX(RAM_PREFETCH_QUEUE_MAX / pagesize, 1));
+
+    if (stride == (int64_t)pagesize) {
+        /* Sequential: a single request for the whole range */
+        new_entry = g_new0(struct RAMSrcPageRequest, 1);
+        new_entry->rb = ramblock;
+        new_entry->offset = start;
+        new_entry->len = pagesize * count;
+        memory_region_ref(ramblock->mr);
+        QSIMPLEQ_INSERT_TAIL(&entries, new_entry, next_req);
+    } else {
+        for (i = 0; i < count; i++) {
+            new_entry = g_new0(struct RAMSrcPageRequest, 1);
+            new_entry->rb = ramblock;
+            new_entry->offset = start + stride * (int64_t)i;
+            new_entry->len = pagesize;
+            memory_region_ref(ramblock->mr);
+            QSIMPLEQ_INSERT_TAIL(&entries, new_entry, next_req);
+        }
+    }
+
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    /* The oldest predictions are the least likely to still be useful */
+    while (rs->src_page_prefetch_bytes + pagesize * count >
+           RAM_PREFETCH_QUEUE_MAX &&
+           (old = QSIMPLEQ_FIRST(&rs->src_page_prefetch_requests))) {
+        rs->src_page_prefetch_bytes -= old->len;
+        QSIMPLEQ_REMOVE_HEAD(&rs->src_page_prefetch_requests, next_req);
+        memory_region_unref(old->rb->mr);
+        g_free(old);
+    }
+    QSIMPLEQ_CONCAT(&rs->src_page_prefetch_requests, &entries);
+    rs->src_page_prefetch_bytes += pagesize * count;
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+
+    return 0;
+}
+
 static bool save_page_use_compression(RAMState *rs)
 {
     if (!migrate_use_compression()) {
@@ -1937,6 +2372,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
@@ -1959,10 +2398,14 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
      * Do not use multifd for:
      * 1. Compression as the first page in the new block should be posted out
      *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
+     * 2. In postcopy, for pages the destination is waiting on, and for
+     *    host pages bigger than a target page, as one whole host page
+     *    should be placed
      */
     if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+        && (!migration_in_postcopy() ||
+            (!pss->postcopy_requested &&
+             qemu_ram_pagesize(block) == TARGET_PAGE_SIZE))) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2042,6 +2485,21 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
  * pages in a host page that are dirty.
  */
 
+/*
+ * In postcopy, the pages the destination is waiting on go through the
+ * preempt channel so they don't wait behind the background pages already
+ * queued on the main channel.  Each channel keeps its own notion of the
+ * last block sent, for RAM_SAVE_FLAG_CONTINUE.
+ */
+static void postcopy_preempt_switch_channel(RAMState *rs, QEMUFile *f)
+{
+    RAMBlock *block = rs->last_sent_block;
+
+    rs->last_sent_block = rs->other_last_sent_block;
+    rs->other_last_sent_block = block;
+    rs->f = f;
+}
+
 static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
@@ -2056,6 +2514,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    pss.postcopy_requested = false;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -2071,7 +2530,27 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         }
 
         if (found) {
+            QEMUFile *preempt = NULL;
+            QEMUFile *main_f = rs->f;
+
+            if (pss.postcopy_requested) {
+                preempt = qatomic_read(
+                    &migrate_get_current()->postcopy_qemufile_src);
+            }
+            if (preempt) {
+                postcopy_preempt_switch_channel(rs, preempt);
+            }
             pages = ram_save_host_page(rs, &pss, last_stage);
+            if (preempt) {
+                qemu_fflush(preempt);
+                postcopy_preempt_switch_channel(rs, main_f);
+                if (qemu_file_get_error(preempt)) {
+                    /* Let the main channel fail, postcopy pauses then */
+                    qemu_file_set_error(main_f,
+                                        qemu_file_get_error(preempt));
+                    pages = -EIO;
+                }
+            }
         }
     } while (!pages && again);
 
@@ -2135,6 +2614,8 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->vcpu_dirty_pages_prev);
+        g_free((*rsp)->vcpu_dirty_pages_period);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -2144,11 +2625,10 @@ static void xbzrle_cleanup(void)
 {
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        xbzrle_cache_replace(NULL);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
         g_free(XBZRLE.zero_target_page);
-        XBZRLE.cache = NULL;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
         XBZRLE.zero_target_page = NULL;
@@ -2161,8 +2641,11 @@ static void ram_save_cleanup(void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
-    /* We don't use dirty log with background snapshots */
-    if (!migrate_background_snapshot()) {
+    if (ram_snapshot.saving && ram_snapshot.keep_tracking) {
+        /* Keep logging the pages dirtied until the next snapshot */
+        ram_snapshot.tracking = true;
+    } else if (!migrate_background_snapshot()) {
+        /* We don't use dirty log with background snapshots */
         /* caller have hold iothread lock or is in a bh, so there is
          * no writing race against the migration bitmap
          */
@@ -2174,10 +2657,15 @@ static void ram_save_cleanup(void *opaque)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+        g_free(block->file_chunk_len);
+        block->file_chunk_len = NULL;
     }
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    mapped_ram_send_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -2185,6 +2673,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->other_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -2446,6 +2935,7 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->other_last_sent_block = NULL;
     rs->last_page = 0;
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2519,8 +3009,9 @@ static int xbzrle_init(void)
         goto err_out;
     }
 
-    XBZRLE.cache = cache_init(migrate_xbzrle_cache_size(),
-                              TARGET_PAGE_SIZE, &local_err);
+    XBZRLE.cache = cache_init_sharded(migrate_xbzrle_cache_size(),
+                                      TARGET_PAGE_SIZE, xbzrle_cache_shards(),
+                                      &local_err);
     if (!XBZRLE.cache) {
         error_report_err(local_err);
         goto free_zero_page;
@@ -2568,6 +3059,7 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    QSIMPLEQ_INIT(&(*rsp)->src_page_prefetch_requests);
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2610,9 +3102,13 @@ static void ram_list_init_bitmaps(void)
              * new migration after a failed migration, ram_list.
              * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
              * guest memory.
+             * An incremental snapshot only wants the pages dirtied since
+             * the last one, which the first sync brings in.
              */
             block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
+            if (!ram_snapshot.incremental) {
+                bitmap_set(block->bmap, 0, pages);
+            }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
         }
@@ -2627,6 +3123,13 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
+        if (ram_snapshot.incremental) {
+            rs->migration_dirty_pages = 0;
+            rs->ram_bulk_stage = false;
+        } else if (!ram_snapshot.saving) {
+            /* The migration takes the dirty bits of the next snapshot */
+            ram_snapshot_stop_tracking();
+        }
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
             memory_global_dirty_log_start();
@@ -2674,6 +3177,7 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->other_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     /*
@@ -2754,6 +3258,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    Error *local_err = NULL;
 
     if (compress_threads_save_setup()) {
         return -1;
@@ -2768,6 +3273,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->f = f;
 
+    if (migrate_mapped_ram() && mapped_ram_send_setup(f, &local_err)) {
+        error_report_err(local_err);
+        return -1;
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -2782,6 +3292,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram() &&
+                mapped_ram_send_block_header(f, block, &local_err)) {
+                error_report_err(local_err);
+                return -1;
+            }
         }
     }
 
@@ -2888,6 +3403,17 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 out:
     if (ret >= 0
         && migration_is_setup_or_active(migrate_get_current()->state)) {
+        if (migrate_mapped_ram()) {
+            /*
+             * A background snapshot is over once all of RAM was saved,
+             * ram_save_complete() isn't called for it.
+             */
+            int res = mapped_ram_send_sync(done &&
+                                           migrate_background_snapshot());
+            if (res < 0) {
+                qemu_file_set_error(f, res);
+            }
+        }
         multifd_send_sync_main(rs->f);
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
@@ -2946,7 +3472,22 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     }
 
+    if (ret >= 0 && migrate_mapped_ram()) {
+        ret = mapped_ram_send_sync(true);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+
     if (ret >= 0) {
+        QEMUFile *preempt =
+            qatomic_read(&migrate_get_current()->postcopy_qemufile_src);
+
+        if (preempt && migration_in_postcopy()) {
+            /* Lets the destination's preempt thread finish */
+            qemu_put_be64(preempt, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(preempt);
+        }
         multifd_send_sync_main(rs->f);
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
@@ -3027,19 +3568,22 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel @f is, each one continues its own previous block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block;
+    static RAMBlock *last_block[RAM_CHANNEL_MAX];
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!last_block[channel]) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return last_block[channel];
     }
 
     len = qemu_get_byte(f);
@@ -3047,6 +3591,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
     id[len] = 0;
 
     block = qemu_ram_block_by_name(id);
+    last_block[channel] = block;
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -3310,6 +3855,185 @@ static void colo_init_ram_state(void)
     ram_state->ram_bulk_stage = false;
 }
 
+/*
+ * The colo cache is flushed into SVM's RAM by COLO_FLUSH_THREADS threads,
+ * each taking COLO_FLUSH_CHUNK pages at a time.  The dirty log of SVM is
+ * synced ahead of the flush by a bottom half in the main loop, while the
+ * device state of the checkpoint is being received.  The threads do not
+ * need the BQL, so they can be stopped with it held.
+ */
+#define COLO_FLUSH_THREADS  4
+/* Pages, a multiple of BITS_PER_LONG so threads don't share bitmap words */
+#define COLO_FLUSH_CHUNK    512
+
+static struct {
+    QemuThread threads[COLO_FLUSH_THREADS];
+    QemuMutex mutex;
+    /* A sync or a flush was requested, or quit */
+    QemuCond work_cond;
+    /* The threads are done with a flush */
+    QemuCond done_cond;
+    /* Syncs the dirty log in the main loop */
+    QEMUBH *sync_bh;
+    /* The dirty log was synced, protected by the BQL */
+    QemuCond synced_cond;
+    bool synced;
+    /* colo_flush_ram_cache_begin() was called */
+    bool sync_pending;
+    /* Incremented for each flush */
+    unsigned int generation;
+    /* Threads still flushing */
+    unsigned int busy;
+    /* Next chunk to flush */
+    RAMBlock *block;
+    unsigned long page;
+    /* Pages flushed */
+    uint64_t pages;
+    bool quit;
+} *colo_flush;
+
+/* Called with the BQL held */
+static void colo_flush_sync(void)
+{
+    RAMBlock *block;
+
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(ram_state, block);
+        }
+    }
+    colo_flush->synced = true;
+    qemu_cond_broadcast(&colo_flush->synced_cond);
+}
+
+static void colo_flush_sync_bh(void *opaque)
+{
+    colo_flush_sync();
+}
+
+static void colo_flush_chunks(void)
+{
+    uint64_t pages = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    while (true) {
+        RAMBlock *block;
+        unsigned long page, end, i, n = 0;
+
+        qemu_mutex_lock(&colo_flush->mutex);
+        block = colo_flush->block;
+        while (block && (ramblock_is_ignored(block) ||
+                         colo_flush->page >=
+                         block->used_length >> TARGET_PAGE_BITS)) {
+            block = QLIST_NEXT_RCU(block, next);
+            colo_flush->page = 0;
+        }
+        colo_flush->block = block;
+        page = colo_flush->page;
+        colo_flush->page += COLO_FLUSH_CHUNK;
+        qemu_mutex_unlock(&colo_flush->mutex);
+
+        if (!block) {
+            break;
+        }
+
+        end = MIN(page + COLO_FLUSH_CHUNK,
+                  block->used_length >> TARGET_PAGE_BITS);
+        for (i = find_next_bit(block->bmap, end, page); i < end;
+             i = find_next_bit(block->bmap, end, i + 1)) {
+            ram_addr_t offset = ((ram_addr_t)i) << TARGET_PAGE_BITS;
+
+            memcpy(block->host + offset, block->colo_cache + offset,
+                   TARGET_PAGE_SIZE);
+            n++;
+        }
+        if (n) {
+            bitmap_clear(block->bmap, page, end - page);
+            qemu_mutex_lock(&ram_state->bitmap_mutex);
+            ram_state->migration_dirty_pages -= n;
+            qemu_mutex_unlock(&ram_state->bitmap_mutex);
+            pages += n;
+        }
+    }
+
+    qemu_mutex_lock(&colo_flush->mutex);
+    colo_flush->pages += pages;
+    qemu_mutex_unlock(&colo_flush->mutex);
+}
+
+static void *colo_flush_thread(void *opaque)
+{
+    unsigned int generation = 0;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&colo_flush->mutex);
+    while (true) {
+        if (colo_flush->quit) {
+            break;
+        }
+        if (colo_flush->generation == generation) {
+            qemu_cond_wait(&colo_flush->work_cond, &colo_flush->mutex);
+            continue;
+        }
+
+        generation = colo_flush->generation;
+        qemu_mutex_unlock(&colo_flush->mutex);
+        colo_flush_chunks();
+        qemu_mutex_lock(&colo_flush->mutex);
+        if (--colo_flush->busy == 0) {
+            qemu_cond_signal(&colo_flush->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&colo_flush->mutex);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void colo_flush_threads_create(void)
+{
+    int i;
+
+    colo_flush = g_new0(typeof(*colo_flush), 1);
+    qemu_mutex_init(&colo_flush->mutex);
+    qemu_cond_init(&colo_flush->work_cond);
+    qemu_cond_init(&colo_flush->done_cond);
+    qemu_cond_init(&colo_flush->synced_cond);
+    colo_flush->sync_bh = qemu_bh_new(colo_flush_sync_bh, NULL);
+    for (i = 0; i < COLO_FLUSH_THREADS; i++) {
+        qemu_thread_create(&colo_flush->threads[i], "colo/flush",
+                           colo_flush_thread, &colo_flush->threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void colo_flush_threads_destroy(void)
+{
+    int i;
+
+    if (!colo_flush) {
+        return;
+    }
+
+    qemu_mutex_lock(&colo_flush->mutex);
+    colo_flush->quit = true;
+    qemu_cond_broadcast(&colo_flush->work_cond);
+    qemu_mutex_unlock(&colo_flush->mutex);
+    for (i = 0; i < COLO_FLUSH_THREADS; i++) {
+        qemu_thread_join(&colo_flush->threads[i]);
+    }
+    /* Drops a sync that did not run yet */
+    qemu_bh_delete(colo_flush->sync_bh);
+    qemu_cond_destroy(&colo_flush->synced_cond);
+    qemu_cond_destroy(&colo_flush->done_cond);
+    qemu_cond_destroy(&colo_flush->work_cond);
+    qemu_mutex_destroy(&colo_flush->mutex);
+    g_free(colo_flush);
+    colo_flush = NULL;
+}
+
 /*
  * colo cache: this is for secondary VM, we cache the whole
  * memory of the secondary VM, it is need to hold the global lock
@@ -3354,6 +4078,7 @@ int colo_init_ram_cache(void)
     }
 
     colo_init_ram_state();
+    colo_flush_threads_create();
     return 0;
 }
 
@@ -3384,6 +4109,7 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
+    colo_flush_threads_destroy();
     memory_global_dirty_log_stop();
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
@@ -3432,6 +4158,11 @@ static int ram_load_cleanup(void *opaque)
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
 
+    /* With lazy-restore, RAM is still being placed */
+    if (migration_incoming_get_current()->lazy_restore) {
+        return 0;
+    }
+
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
@@ -3461,19 +4192,22 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_POSTCOPY for the preempt channel
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = channel == RAM_CHANNEL_POSTCOPY ?
+        mis->postcopy_preempt_tmp_page : mis->postcopy_tmp_page;
     void *this_host = NULL;
     bool all_zero = true;
     int target_pages = 0;
@@ -3504,7 +4238,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3596,7 +4330,9 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3649,46 +4385,61 @@ static bool postcopy_is_running(void)
     return ps >= POSTCOPY_INCOMING_LISTENING && ps < POSTCOPY_INCOMING_END;
 }
 
+/*
+ * Sync the dirty log of SVM in the background, once the RAM of the
+ * checkpoint is in the cache.  SVM is stopped, so nothing it dirties
+ * can be missed until colo_flush_ram_cache().
+ */
+void colo_flush_ram_cache_begin(void)
+{
+    qemu_mutex_lock(&colo_flush->mutex);
+    colo_flush->sync_pending = true;
+    qemu_mutex_unlock(&colo_flush->mutex);
+    qemu_bh_schedule(colo_flush->sync_bh);
+}
+
 /*
  * Flush content of RAM cache into SVM's memory.
  * Only flush the pages that be dirtied by PVM or SVM or both.
+ *
+ * Returns the number of pages flushed
  */
-void colo_flush_ram_cache(void)
+uint64_t colo_flush_ram_cache(void)
 {
-    RAMBlock *block = NULL;
-    void *dst_host;
-    void *src_host;
-    unsigned long offset = 0;
+    bool sync_pending;
+    uint64_t pages;
 
-    memory_global_dirty_log_sync();
-    WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(ram_state, block);
-        }
+    qemu_mutex_lock(&colo_flush->mutex);
+    sync_pending = colo_flush->sync_pending;
+    colo_flush->sync_pending = false;
+    qemu_mutex_unlock(&colo_flush->mutex);
+
+    if (!sync_pending) {
+        colo_flush_sync();
+    }
+    while (!colo_flush->synced) {
+        qemu_cond_wait_iothread(&colo_flush->synced_cond);
     }
+    colo_flush->synced = false;
 
     trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
+    qemu_mutex_lock(&colo_flush->mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        block = QLIST_FIRST_RCU(&ram_list.blocks);
-
-        while (block) {
-            offset = migration_bitmap_find_dirty(ram_state, block, offset);
-
-            if (((ram_addr_t)offset) << TARGET_PAGE_BITS
-                >= block->used_length) {
-                offset = 0;
-                block = QLIST_NEXT_RCU(block, next);
-            } else {
-                migration_bitmap_clear_dirty(ram_state, block, offset);
-                dst_host = block->host
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                src_host = block->colo_cache
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                memcpy(dst_host, src_host, TARGET_PAGE_SIZE);
-            }
-        }
+        colo_flush->block = QLIST_FIRST_RCU(&ram_list.blocks);
     }
-    trace_colo_flush_ram_cache_end();
+    colo_flush->page = 0;
+    colo_flush->pages = 0;
+    colo_flush->busy = COLO_FLUSH_THREADS;
+    colo_flush->generation++;
+    qemu_cond_broadcast(&colo_flush->work_cond);
+    while (colo_flush->busy) {
+        qemu_cond_wait(&colo_flush->done_cond, &colo_flush->mutex);
+    }
+    pages = colo_flush->pages;
+    qemu_mutex_unlock(&colo_flush->mutex);
+    trace_colo_flush_ram_cache_end(pages);
+
+    return pages;
 }
 
 /**
@@ -3741,7 +4492,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3830,6 +4582,14 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        Error *local_err = NULL;
+
+                        ret = mapped_ram_load_block(f, block, &local_err);
+                        if (ret < 0) {
+                            error_report_err(local_err);
+                        }
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3840,6 +4600,12 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_lazy_restore()) {
+                ret = mapped_ram_lazy_start(migration_incoming_get_current());
+                if (ret < 0) {
+                    error_report("Failed to start lazy restore of RAM");
+                }
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -3918,7 +4684,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -48,11 +48,14 @@ bool ramblock_is_ignored(RAMBlock *block);
         if (!qemu_ram_is_migratable(block)) {} else
 
 int xbzrle_cache_resize(uint64_t new_size, Error **errp);
+struct PageCache *xbzrle_cache_get(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_total(void);
 
 uint64_t ram_pagesize_summary(void);
 int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
+int ram_save_queue_prefetch_pages(const char *rbname, ram_addr_t start,
+                                  int64_t stride, uint32_t count);
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
                            unsigned long pages);
@@ -63,6 +66,15 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
 
+/* Channels a postcopy destination receives pages from */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY,
+    RAM_CHANNEL_MAX,
+};
+
+int ram_load_postcopy(QEMUFile *f, int channel);
+
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
 int ramblock_recv_bitmap_test(RAMBlock *rb, void *host_addr);
@@ -75,7 +87,8 @@ int ram_dirty_bitmap_reload(MigrationState *s, RAMBlock *rb);
 
 /* ram cache */
 int colo_init_ram_cache(void);
-void colo_flush_ram_cache(void);
+void colo_flush_ram_cache_begin(void);
+uint64_t colo_flush_ram_cache(void);
 void colo_release_ram_cache(void);
 void colo_incoming_start_dirty_log(void);
 
@@ -85,4 +98,10 @@ bool ram_write_tracking_compatible(void);
 int ram_write_tracking_start(void);
 void ram_write_tracking_stop(void);
 
+/* Incremental snapshots */
+bool ram_snapshot_tracking(void);
+void ram_snapshot_begin(bool keep_tracking, bool incremental);
+void ram_snapshot_end(bool success);
+void ram_snapshot_stop_tracking(void);
+
 #endif
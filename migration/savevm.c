@@ -87,6 +87,7 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_SNAPSHOT_INCREMENT, /* Incremental snapshot, needs its base */
     MIG_CMD_MAX
 };
 
@@ -106,6 +107,8 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_SNAPSHOT_INCREMENT] = {
+                                   .len =  0, .name = "SNAPSHOT_INCREMENT" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -168,9 +171,9 @@ static const QEMUFileOps bdrv_write_ops = {
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
     if (is_writable) {
-        return qemu_fopen_ops(bs, &bdrv_write_ops);
+        return qemu_fopen_ops(bs, &bdrv_write_ops, false);
     }
-    return qemu_fopen_ops(bs, &bdrv_read_ops);
+    return qemu_fopen_ops(bs, &bdrv_read_ops, false);
 }
 
 
@@ -910,6 +913,19 @@ static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
     return vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
 }
 
+/* Describe a section as a single opaque buffer of @size bytes */
+static void vmstate_desc_opaque(JSONWriter *vmdesc, int64_t size)
+{
+    json_writer_int64(vmdesc, "size", size);
+    json_writer_start_array(vmdesc, "fields");
+    json_writer_start_object(vmdesc, NULL);
+    json_writer_str(vmdesc, "name", "data");
+    json_writer_int64(vmdesc, "size", size);
+    json_writer_str(vmdesc, "type", "buffer");
+    json_writer_end_object(vmdesc);
+    json_writer_end_array(vmdesc);
+}
+
 static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se,
                                    JSONWriter *vmdesc)
 {
@@ -920,14 +936,7 @@ static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se,
     size = qemu_ftell_fast(f) - old_offset;
 
     if (vmdesc) {
-        json_writer_int64(vmdesc, "size", size);
-        json_writer_start_array(vmdesc, "fields");
-        json_writer_start_object(vmdesc, NULL);
-        json_writer_str(vmdesc, "name", "data");
-        json_writer_int64(vmdesc, "size", size);
-        json_writer_str(vmdesc, "type", "buffer");
-        json_writer_end_object(vmdesc);
-        json_writer_end_array(vmdesc);
+        vmstate_desc_opaque(vmdesc, size);
     }
 }
 
@@ -943,7 +952,8 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se,
 }
 
 /*
- * Write the header for device section (QEMU_VM_SECTION START/END/PART/FULL)
+ * Write the header for device section
+ * (QEMU_VM_SECTION START/END/PART/FULL/FULL_SIZED)
  */
 static void save_section_header(QEMUFile *f, SaveStateEntry *se,
                                 uint8_t section_type)
@@ -952,6 +962,7 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
+        section_type == QEMU_VM_SECTION_FULL_SIZED ||
         section_type == QEMU_VM_SECTION_START) {
         /* ID string */
         size_t len = strlen(se->idstr);
@@ -975,6 +986,210 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/*
+ * Parallel device state
+ *
+ * With the VM stopped, sections whose description only touches the
+ * device's own state (see vmstate_parallel_safe()) are serialized into
+ * per-section buffers by a few threads.  The buffers are then sent in
+ * handler order as QEMU_VM_SECTION_FULL_SIZED sections, which carry
+ * their length so that the destination can hand them out to threads
+ * too.  Only runs of consecutive sections with the same priority are
+ * batched, so the order relative to every other section is unchanged.
+ */
+#define SAVEVM_PARALLEL_THREADS_MAX 8
+
+typedef struct SaveVMParallelJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+} SaveVMParallelJob;
+
+typedef struct SaveVMParallel {
+    GArray *jobs;
+    MigrationPriority priority;
+    bool load;
+    /* Next job to pick, used atomically by the threads */
+    unsigned int next;
+} SaveVMParallel;
+
+static bool savevm_parallel_eligible(SaveStateEntry *se)
+{
+    return se->vmsd && !se->ops && vmstate_parallel_safe(se->vmsd);
+}
+
+static void savevm_parallel_init(SaveVMParallel *p, bool load)
+{
+    p->jobs = g_array_new(FALSE, TRUE, sizeof(SaveVMParallelJob));
+    p->load = load;
+    p->next = 0;
+}
+
+/*
+ * Queue @se; on the load side @bioc holds the section data, on the save
+ * side a new buffer is allocated.
+ */
+static void savevm_parallel_add(SaveVMParallel *p, SaveStateEntry *se,
+                                QIOChannelBuffer *bioc)
+{
+    SaveVMParallelJob job = { .se = se };
+
+    if (p->load) {
+        job.bioc = bioc;
+        job.f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    } else {
+        job.bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(job.bioc),
+                             "migration-savevm-parallel");
+        job.f = qemu_fopen_channel_output(QIO_CHANNEL(job.bioc));
+    }
+    p->priority = save_state_priority(se);
+    g_array_append_val(p->jobs, job);
+}
+
+static void savevm_parallel_reset(SaveVMParallel *p)
+{
+    unsigned int i;
+
+    for (i = 0; i < p->jobs->len; i++) {
+        SaveVMParallelJob *job = &g_array_index(p->jobs, SaveVMParallelJob, i);
+
+        qemu_fclose(job->f);
+        object_unref(OBJECT(job->bioc));
+    }
+    g_array_set_size(p->jobs, 0);
+}
+
+static void savevm_parallel_cleanup(SaveVMParallel *p)
+{
+    if (p->jobs) {
+        savevm_parallel_reset(p);
+        g_array_free(p->jobs, TRUE);
+        p->jobs = NULL;
+    }
+}
+
+static void *savevm_parallel_thread(void *opaque)
+{
+    SaveVMParallel *p = opaque;
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&p->next)) < p->jobs->len) {
+        SaveVMParallelJob *job = &g_array_index(p->jobs, SaveVMParallelJob, i);
+
+        if (p->load) {
+            job->ret = vmstate_load(job->f, job->se);
+        } else {
+            job->ret = vmstate_save(job->f, job->se, NULL);
+            qemu_fflush(job->f);
+            if (!job->ret) {
+                job->ret = qemu_file_get_error(job->f);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Run every queued job, on the calling thread plus some helpers */
+static void savevm_parallel_run(SaveVMParallel *p)
+{
+    unsigned int nthreads = 1, i;
+    QemuThread *threads;
+
+    if (migrate_parallel_device_state()) {
+        nthreads = MIN(p->jobs->len, MIN(g_get_num_processors(),
+                                         SAVEVM_PARALLEL_THREADS_MAX));
+        nthreads = MAX(nthreads, 1);
+    }
+    trace_savevm_parallel_run(p->load, p->jobs->len, nthreads);
+
+    p->next = 0;
+    threads = g_new0(QemuThread, nthreads);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "savevm_parallel",
+                           savevm_parallel_thread, p, QEMU_THREAD_JOINABLE);
+    }
+    savevm_parallel_thread(p);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+}
+
+/* Save the queued sections and put them on @f in order */
+static int savevm_parallel_save_flush(QEMUFile *f, SaveVMParallel *p,
+                                      JSONWriter *vmdesc)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (!p->jobs->len) {
+        return 0;
+    }
+
+    savevm_parallel_run(p);
+
+    for (i = 0; i < p->jobs->len; i++) {
+        SaveVMParallelJob *job = &g_array_index(p->jobs, SaveVMParallelJob, i);
+        SaveStateEntry *se = job->se;
+
+        if (job->ret) {
+            error_report("%s: failed to save state of '%s': %d",
+                         __func__, se->idstr, job->ret);
+            ret = job->ret;
+            break;
+        }
+
+        trace_savevm_section_start(se->idstr, se->section_id);
+        save_section_header(f, se, QEMU_VM_SECTION_FULL_SIZED);
+        qemu_put_be32(f, job->bioc->usage);
+        qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+        trace_savevm_section_end(se->idstr, se->section_id, 0);
+        save_section_footer(f, se);
+
+        json_writer_start_object(vmdesc, NULL);
+        json_writer_str(vmdesc, "name", se->idstr);
+        json_writer_int64(vmdesc, "instance_id", se->instance_id);
+        vmstate_desc_opaque(vmdesc, job->bioc->usage);
+        json_writer_end_object(vmdesc);
+    }
+
+    savevm_parallel_reset(p);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
+/* Load the queued sections */
+static int savevm_parallel_load_flush(SaveVMParallel *p)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (!p->jobs->len) {
+        return 0;
+    }
+
+    savevm_parallel_run(p);
+
+    for (i = 0; i < p->jobs->len; i++) {
+        SaveVMParallelJob *job = &g_array_index(p->jobs, SaveVMParallelJob, i);
+
+        if (job->ret < 0) {
+            error_report("error while loading state for instance 0x%"PRIx32" of"
+                         " device '%s'", job->se->instance_id, job->se->idstr);
+            ret = job->ret;
+            break;
+        }
+    }
+
+    savevm_parallel_reset(p);
+    return ret;
+}
+
 /**
  * qemu_savevm_command_send: Send a 'QEMU_VM_COMMAND' type element with the
  *                           command and associated data.
@@ -1398,10 +1613,15 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool inactivate_disks)
 {
     g_autoptr(JSONWriter) vmdesc = NULL;
+    SaveVMParallel par = {};
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
+    if (migrate_parallel_device_state()) {
+        savevm_parallel_init(&par, false);
+    }
+
     vmdesc = json_writer_new(false);
     json_writer_start_object(vmdesc, NULL);
     json_writer_int64(vmdesc, "page_size", qemu_target_page_size());
@@ -1416,6 +1636,23 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             continue;
         }
 
+        if (par.jobs) {
+            if (par.jobs->len && par.priority != save_state_priority(se)) {
+                ret = savevm_parallel_save_flush(f, &par, vmdesc);
+                if (ret) {
+                    goto out;
+                }
+            }
+            if (savevm_parallel_eligible(se)) {
+                savevm_parallel_add(&par, se, NULL);
+                continue;
+            }
+            ret = savevm_parallel_save_flush(f, &par, vmdesc);
+            if (ret) {
+                goto out;
+            }
+        }
+
         trace_savevm_section_start(se->idstr, se->section_id);
 
         json_writer_start_object(vmdesc, NULL);
@@ -1426,7 +1663,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
-            return ret;
+            goto out;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
@@ -1434,6 +1671,14 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         json_writer_end_object(vmdesc);
     }
 
+    if (par.jobs) {
+        ret = savevm_parallel_save_flush(f, &par, vmdesc);
+        savevm_parallel_cleanup(&par);
+        if (ret) {
+            return ret;
+        }
+    }
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_invalidate_cache_all() on the other end won't fail. */
@@ -1461,6 +1706,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     }
 
     return 0;
+
+out:
+    savevm_parallel_cleanup(&par);
+    return ret;
 }
 
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
@@ -1548,7 +1797,11 @@ void qemu_savevm_state_cleanup(void)
     }
 }
 
-static int qemu_savevm_state(QEMUFile *f, Error **errp)
+/*
+ * Save the state of the VM to @f.  With @increment, it is an incremental
+ * snapshot that needs those it depends on to be loaded first.
+ */
+static int qemu_savevm_state(QEMUFile *f, bool increment, Error **errp)
 {
     int ret;
     MigrationState *ms = migrate_get_current();
@@ -1570,6 +1823,9 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
 
     qemu_mutex_unlock_iothread();
     qemu_savevm_state_header(f);
+    if (increment) {
+        qemu_savevm_command_send(f, MIG_CMD_SNAPSHOT_INCREMENT, 0, NULL);
+    }
     qemu_savevm_state_setup(f);
     qemu_mutex_lock_iothread();
 
@@ -2248,6 +2504,8 @@ static int loadvm_process_enable_colo(MigrationIncomingState *mis)
     return ret;
 }
 
+static int loadvm_handle_snapshot_increment(MigrationIncomingState *mis);
+
 /*
  * Process an incoming 'QEMU_VM_COMMAND'
  * 0           just a normal return
@@ -2330,6 +2588,9 @@ static int loadvm_process_command(QEMUFile *f)
 
     case MIG_CMD_ENABLE_COLO:
         return loadvm_process_enable_colo(mis);
+
+    case MIG_CMD_SNAPSHOT_INCREMENT:
+        return loadvm_handle_snapshot_increment(mis);
     }
 
     return 0;
@@ -2378,8 +2639,11 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
-static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * Read the header of a QEMU_VM_SECTION_START/FULL/FULL_SIZED section and
+ * look up the matching handler in @sep.
+ */
+static int qemu_loadvm_section_header(QEMUFile *f, SaveStateEntry **sep)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2430,16 +2694,79 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    *sep = se;
+    return 0;
+}
+
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", se->instance_id, se->idstr);
+        return ret;
+    }
+    if (!check_section_footer(f, se)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * A QEMU_VM_SECTION_FULL_SIZED section is read whole and queued on @par;
+ * it is loaded together with its neighbours of the same priority.
+ */
+static int
+qemu_loadvm_section_full_sized(QEMUFile *f, SaveVMParallel *par)
+{
+    QIOChannelBuffer *bioc;
+    SaveStateEntry *se;
+    uint32_t length;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, &se);
+    if (ret < 0) {
         return ret;
     }
+
+    if (par->jobs->len && par->priority != save_state_priority(se)) {
+        ret = savevm_parallel_load_flush(par);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    length = qemu_get_be32(f);
+    trace_qemu_loadvm_state_section_full_sized(se->idstr, length);
+
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-loadvm-parallel");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_report("%s: failed to read %" PRIu32 " bytes for '%s'",
+                     __func__, length, se->idstr);
+        ret = qemu_file_get_error(f);
+        return ret < 0 ? ret : -EINVAL;
+    }
+    bioc->usage = length;
+
     if (!check_section_footer(f, se)) {
+        object_unref(OBJECT(bioc));
         return -EINVAL;
     }
 
+    savevm_parallel_add(par, se, bioc);
     return 0;
 }
 
@@ -2583,6 +2910,11 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
     migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_ACTIVE,
                       MIGRATION_STATUS_POSTCOPY_PAUSED);
 
+    /* The source stops using the preempt channel on recovery */
+    if (qatomic_read(&mis->postcopy_qemufile_dst)) {
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
     /* Notify the fault thread for the invalidated file handle */
     postcopy_fault_thread_notify(mis);
 
@@ -2600,9 +2932,12 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    SaveVMParallel par;
     uint8_t section_type;
     int ret = 0;
 
+    savevm_parallel_init(&par, true);
+
 retry:
     while (true) {
         section_type = qemu_get_byte(f);
@@ -2613,7 +2948,21 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_FULL_SIZED) {
+            /* Anything else may depend on the queued sections */
+            ret = savevm_parallel_load_flush(&par);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+
         switch (section_type) {
+        case QEMU_VM_SECTION_FULL_SIZED:
+            ret = qemu_loadvm_section_full_sized(f, &par);
+            if (ret < 0) {
+                goto out;
+            }
+            break;
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
             ret = qemu_loadvm_section_start_full(f, mis);
@@ -2648,6 +2997,7 @@ retry:
 out:
     if (ret < 0) {
         qemu_file_set_error(f, ret);
+        savevm_parallel_reset(&par);
 
         /* Cancel bitmaps incoming regardless of recovery */
         dirty_bitmap_mig_cancel_incoming();
@@ -2670,6 +3020,7 @@ out:
             goto retry;
         }
     }
+    savevm_parallel_cleanup(&par);
     return ret;
 }
 
@@ -2766,6 +3117,348 @@ int qemu_load_device_state(QEMUFile *f)
     return 0;
 }
 
+/*
+ * Incremental snapshots
+ *
+ * With the incremental-snapshot capability, the RAM saved in a snapshot
+ * is only what was dirtied since the previous one of the chain.  Such a
+ * VM state starts with a MIG_CMD_SNAPSHOT_INCREMENT command, which older
+ * versions reject, and is followed by a trailer describing the snapshots
+ * it depends on, base first:
+ *
+ *   be32 magic,
+ *   { u8 length, id, u8 length, name,
+ *     be32 date_sec, be32 date_nsec, be64 vm_clock_nsec }...,
+ *   be32 count, be32 size, be32 magic
+ *
+ * where size covers the whole trailer, so that it is found from the end
+ * of the VM state.  qemu_loadvm_state() stops before it.  The id, date
+ * and VM clock tell a snapshot from a later one of the same name.
+ */
+#define SNAPSHOT_CHAIN_MAGIC    0x51534943  /* "QSIC" */
+#define SNAPSHOT_CHAIN_MAX      16
+
+static struct {
+    /* Node the VM state of the chain is saved to */
+    char *node_name;
+    /* QEMUSnapshotInfo of the snapshots of the chain, base first */
+    GArray *snapshots;
+    /* load_snapshot() has loaded what the VM state being loaded needs */
+    bool loading_increment;
+} snapshot_chain;
+
+/*
+ * The RAM of an incremental snapshot is only complete on top of that of
+ * the snapshots it depends on
+ */
+static int loadvm_handle_snapshot_increment(MigrationIncomingState *mis)
+{
+    if (!snapshot_chain.loading_increment) {
+        error_report("Incremental snapshot loaded without the snapshots "
+                     "it depends on");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void snapshot_chain_reset(void)
+{
+    g_free(snapshot_chain.node_name);
+    snapshot_chain.node_name = NULL;
+    if (snapshot_chain.snapshots) {
+        g_array_free(snapshot_chain.snapshots, true);
+        snapshot_chain.snapshots = NULL;
+    }
+}
+
+static bool snapshot_chain_contains(const char *name)
+{
+    int i;
+
+    for (i = 0; snapshot_chain.snapshots &&
+                i < snapshot_chain.snapshots->len; i++) {
+        QEMUSnapshotInfo *sn = &g_array_index(snapshot_chain.snapshots,
+                                              QEMUSnapshotInfo, i);
+        if (!strcmp(sn->name, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether @a and @b describe the same snapshot */
+static bool snapshot_chain_same(const QEMUSnapshotInfo *a,
+                                const QEMUSnapshotInfo *b)
+{
+    return !strcmp(a->id_str, b->id_str) && !strcmp(a->name, b->name) &&
+           a->date_sec == b->date_sec && a->date_nsec == b->date_nsec &&
+           a->vm_clock_nsec == b->vm_clock_nsec;
+}
+
+/*
+ * Check that the snapshots in @chain still exist in @bs, and have not been
+ * replaced by others of the same name
+ */
+static bool snapshot_chain_check(BlockDriverState *bs, GArray *chain,
+                                 Error **errp)
+{
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    QEMUSnapshotInfo sn;
+    int i, ret;
+
+    for (i = 0; i < chain->len; i++) {
+        QEMUSnapshotInfo *base = &g_array_index(chain, QEMUSnapshotInfo, i);
+
+        aio_context_acquire(aio_context);
+        ret = bdrv_snapshot_find(bs, &sn, base->name);
+        aio_context_release(aio_context);
+        if (ret < 0) {
+            error_setg(errp, "Snapshot '%s' does not exist", base->name);
+            return false;
+        }
+        if (!snapshot_chain_same(&sn, base)) {
+            error_setg(errp, "Snapshot '%s' has been replaced", base->name);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Whether the next snapshot, saved to @bs, can be an increment */
+static bool snapshot_chain_usable(BlockDriverState *bs)
+{
+    if (!snapshot_chain.snapshots || !ram_snapshot_tracking() ||
+        snapshot_chain.snapshots->len >= SNAPSHOT_CHAIN_MAX ||
+        strcmp(snapshot_chain.node_name, bdrv_get_node_name(bs))) {
+        return false;
+    }
+
+    return snapshot_chain_check(bs, snapshot_chain.snapshots, NULL);
+}
+
+static void snapshot_chain_add(BlockDriverState *bs, const char *name,
+                               bool incremental)
+{
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    QEMUSnapshotInfo sn;
+    int ret;
+
+    /* Record the id the block driver assigned, as well as the dates */
+    aio_context_acquire(aio_context);
+    ret = bdrv_snapshot_find(bs, &sn, name);
+    aio_context_release(aio_context);
+    if (ret < 0) {
+        snapshot_chain_reset();
+        return;
+    }
+
+    if (!incremental) {
+        snapshot_chain_reset();
+        snapshot_chain.node_name = g_strdup(bdrv_get_node_name(bs));
+        snapshot_chain.snapshots = g_array_new(false, false,
+                                               sizeof(QEMUSnapshotInfo));
+    }
+    g_array_append_val(snapshot_chain.snapshots, sn);
+}
+
+static void snapshot_chain_put_string(QEMUFile *f, const char *str,
+                                      uint32_t *size)
+{
+    /* Names and ids come from QEMUSnapshotInfo, they fit in a byte */
+    size_t len = strlen(str);
+
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (const uint8_t *)str, len);
+    *size += 1 + len;
+}
+
+static void snapshot_chain_put(QEMUFile *f)
+{
+    uint32_t size = 4 * sizeof(uint32_t);
+    int i;
+
+    qemu_put_be32(f, SNAPSHOT_CHAIN_MAGIC);
+    for (i = 0; i < snapshot_chain.snapshots->len; i++) {
+        QEMUSnapshotInfo *sn = &g_array_index(snapshot_chain.snapshots,
+                                              QEMUSnapshotInfo, i);
+
+        snapshot_chain_put_string(f, sn->id_str, &size);
+        snapshot_chain_put_string(f, sn->name, &size);
+        qemu_put_be32(f, sn->date_sec);
+        qemu_put_be32(f, sn->date_nsec);
+        qemu_put_be64(f, sn->vm_clock_nsec);
+        size += 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    }
+    qemu_put_be32(f, snapshot_chain.snapshots->len);
+    qemu_put_be32(f, size);
+    qemu_put_be32(f, SNAPSHOT_CHAIN_MAGIC);
+}
+
+/*
+ * Copy a string of the trailer in @buf at *@pos, which must end before
+ * @end, to @dest of size @dest_size
+ */
+static bool snapshot_chain_get_string(const uint8_t *buf, uint32_t *pos,
+                                      uint32_t end, char *dest,
+                                      size_t dest_size)
+{
+    uint32_t len;
+
+    if (*pos >= end || end - *pos - 1 < buf[*pos]) {
+        return false;
+    }
+    len = buf[(*pos)++];
+    if (len >= dest_size) {
+        return false;
+    }
+    memcpy(dest, buf + *pos, len);
+    dest[len] = '\0';
+    *pos += len;
+    return true;
+}
+
+/*
+ * Read the snapshots that the VM state of @bs depends on
+ *
+ * Returns NULL on error, and an empty array if it is complete
+ */
+static GArray *snapshot_chain_get(BlockDriverState *bs,
+                                  uint64_t vm_state_size, Error **errp)
+{
+    g_autoptr(GArray) chain = g_array_new(false, true,
+                                          sizeof(QEMUSnapshotInfo));
+    g_autofree uint8_t *buf = NULL;
+    uint32_t tail[3], count, size, end, pos, i;
+
+    if (vm_state_size < sizeof(tail)) {
+        return g_steal_pointer(&chain);
+    }
+    if (bdrv_load_vmstate(bs, (uint8_t *)tail,
+                          vm_state_size - sizeof(tail), sizeof(tail)) < 0) {
+        error_setg(errp, "Could not read VM state");
+        return NULL;
+    }
+    if (be32_to_cpu(tail[2]) != SNAPSHOT_CHAIN_MAGIC) {
+        return g_steal_pointer(&chain);
+    }
+
+    count = be32_to_cpu(tail[0]);
+    size = be32_to_cpu(tail[1]);
+    if (size < 4 * sizeof(uint32_t) || size > vm_state_size ||
+        count > SNAPSHOT_CHAIN_MAX) {
+        goto invalid;
+    }
+    buf = g_malloc(size);
+    if (bdrv_load_vmstate(bs, buf, vm_state_size - size, size) < 0) {
+        error_setg(errp, "Could not read VM state");
+        return NULL;
+    }
+    if (ldl_be_p(buf) != SNAPSHOT_CHAIN_MAGIC) {
+        goto invalid;
+    }
+
+    g_array_set_size(chain, count);
+    end = size - sizeof(tail);
+    for (pos = sizeof(uint32_t), i = 0; i < count; i++) {
+        QEMUSnapshotInfo *sn = &g_array_index(chain, QEMUSnapshotInfo, i);
+
+        if (!snapshot_chain_get_string(buf, &pos, end, sn->id_str,
+                                       sizeof(sn->id_str)) ||
+            !snapshot_chain_get_string(buf, &pos, end, sn->name,
+                                       sizeof(sn->name)) ||
+            end - pos < 2 * sizeof(uint32_t) + sizeof(uint64_t)) {
+            goto invalid;
+        }
+        sn->date_sec = ldl_be_p(buf + pos);
+        sn->date_nsec = ldl_be_p(buf + pos + 4);
+        sn->vm_clock_nsec = ldq_be_p(buf + pos + 8);
+        pos += 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    }
+    if (pos != end) {
+        goto invalid;
+    }
+    return g_steal_pointer(&chain);
+
+invalid:
+    error_setg(errp, "Invalid snapshot chain in VM state");
+    return NULL;
+}
+
+/*
+ * Check that no incremental snapshot saved to @bs depends on the snapshot
+ * @name of @bs
+ */
+static bool snapshot_chain_check_dependents_bs(BlockDriverState *bs,
+                                               const char *name,
+                                               Error **errp)
+{
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    g_autofree QEMUSnapshotInfo *sn_tab = NULL;
+    QEMUSnapshotInfo base;
+    int nb_sns, i, j;
+    bool ok = true;
+
+    aio_context_acquire(aio_context);
+    if (!bdrv_can_snapshot(bs) || bdrv_snapshot_find(bs, &base, name) < 0) {
+        goto out;
+    }
+
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    for (i = 0; ok && i < nb_sns; i++) {
+        g_autoptr(GArray) chain = NULL;
+
+        if (!sn_tab[i].vm_state_size ||
+            snapshot_chain_same(&sn_tab[i], &base)) {
+            continue;
+        }
+        chain = snapshot_chain_get(bs, sn_tab[i].vm_state_size, NULL);
+        for (j = 0; chain && j < chain->len; j++) {
+            if (snapshot_chain_same(&g_array_index(chain, QEMUSnapshotInfo, j),
+                                    &base)) {
+                error_setg(errp, "Snapshot '%s' can't be deleted, incremental "
+                           "snapshot '%s' depends on it", name,
+                           sn_tab[i].name);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+out:
+    aio_context_release(aio_context);
+    return ok;
+}
+
+/*
+ * Check that deleting the snapshot @name from the given devices does not
+ * leave behind an incremental snapshot that depends on it
+ */
+static bool snapshot_chain_check_dependents(const char *name,
+                                            bool has_devices,
+                                            strList *devices, Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvNextIterator it;
+
+    if (has_devices) {
+        for (; devices; devices = devices->next) {
+            bs = bdrv_find_node(devices->value);
+            if (bs && !snapshot_chain_check_dependents_bs(bs, name, errp)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
+        if (!snapshot_chain_check_dependents_bs(bs, name, errp)) {
+            bdrv_next_cleanup(&it);
+            return false;
+        }
+    }
+    return true;
+}
+
 bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
                   bool has_devices, strList *devices, Error **errp)
 {
@@ -2778,6 +3471,7 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
     qemu_timeval tv;
     struct tm tm;
     AioContext *aio_context;
+    bool incremental = false;
 
     if (migration_is_blocked(errp)) {
         return false;
@@ -2796,10 +3490,16 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
     /* Delete old snapshots of the same name */
     if (name) {
         if (overwrite) {
-            if (bdrv_all_delete_snapshot(name, has_devices,
+            if (!snapshot_chain_check_dependents(name, has_devices, devices,
+                                                 errp) ||
+                bdrv_all_delete_snapshot(name, has_devices,
                                          devices, errp) < 0) {
                 return false;
             }
+            if (snapshot_chain_contains(name)) {
+                /* The next snapshot can't depend on it */
+                snapshot_chain_reset();
+            }
         } else {
             ret2 = bdrv_all_has_snapshot(name, has_devices, devices, errp);
             if (ret2 < 0) {
@@ -2820,6 +3520,10 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
     }
     aio_context = bdrv_get_aio_context(bs);
 
+    if (migrate_incremental_snapshot()) {
+        incremental = snapshot_chain_usable(bs);
+    }
+
     saved_vm_running = runstate_is_running();
 
     ret = global_state_store();
@@ -2855,12 +3559,18 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
     }
 
     /* save the VM state */
+    ram_snapshot_begin(migrate_incremental_snapshot(), incremental);
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
         error_setg(errp, "Could not open VM state file");
         goto the_end;
     }
-    ret = qemu_savevm_state(f, errp);
+    ret = qemu_savevm_state(f, incremental, errp);
+    if (ret == 0 && incremental) {
+        trace_save_snapshot_incremental(sn->name,
+                                        snapshot_chain.snapshots->len);
+        snapshot_chain_put(f);
+    }
     vm_state_size = qemu_ftell(f);
     ret2 = qemu_fclose(f);
     if (ret < 0) {
@@ -2893,6 +3603,13 @@ bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
         aio_context_release(aio_context);
     }
 
+    ram_snapshot_end(ret == 0);
+    if (ret == 0 && migrate_incremental_snapshot()) {
+        snapshot_chain_add(bs, sn->name, incremental);
+    } else {
+        snapshot_chain_reset();
+    }
+
     bdrv_drain_all_end();
 
     if (saved_vm_running) {
@@ -2983,15 +3700,60 @@ void qmp_xen_load_devices_state(const char *filename, Error **errp)
     migration_incoming_state_destroy();
 }
 
+/* Load the VM state of @bs, as of the snapshot it was last reverted to */
+static int load_snapshot_vmstate(BlockDriverState *bs, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    QEMUFile *f;
+    int ret;
+
+    f = qemu_fopen_bdrv(bs, 0);
+    if (!f) {
+        error_setg(errp, "Could not open VM state file");
+        return -EINVAL;
+    }
+    mis->from_src_file = f;
+
+    if (!yank_register_instance(MIGRATION_YANK_INSTANCE, errp)) {
+        return -EINVAL;
+    }
+    aio_context_acquire(aio_context);
+    ret = qemu_loadvm_state(f);
+    migration_incoming_state_destroy();
+    aio_context_release(aio_context);
+
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading VM state", ret);
+    }
+    return ret;
+}
+
+/* Revert @bs alone to snapshot @name */
+static int load_snapshot_goto(BlockDriverState *bs, const char *name,
+                              Error **errp)
+{
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    int ret;
+
+    aio_context_acquire(aio_context);
+    ret = bdrv_snapshot_goto(bs, name, errp);
+    aio_context_release(aio_context);
+    if (ret < 0) {
+        error_prepend(errp, "Could not load snapshot '%s' on '%s': ",
+                      name, bdrv_get_device_or_node_name(bs));
+    }
+    return ret;
+}
+
 bool load_snapshot(const char *name, const char *vmstate,
                    bool has_devices, strList *devices, Error **errp)
 {
     BlockDriverState *bs_vm_state;
     QEMUSnapshotInfo sn;
-    QEMUFile *f;
-    int ret;
+    g_autoptr(GArray) chain = NULL;
+    int ret, i;
     AioContext *aio_context;
-    MigrationIncomingState *mis = migration_incoming_get_current();
 
     if (!bdrv_all_can_snapshot(has_devices, devices, errp)) {
         return false;
@@ -3038,33 +3800,51 @@ bool load_snapshot(const char *name, const char *vmstate,
         goto err_drain;
     }
 
-    /* restore the VM state */
-    f = qemu_fopen_bdrv(bs_vm_state, 0);
-    if (!f) {
-        error_setg(errp, "Could not open VM state file");
+    aio_context_acquire(aio_context);
+    chain = snapshot_chain_get(bs_vm_state, sn.vm_state_size, errp);
+    aio_context_release(aio_context);
+    if (!chain) {
         goto err_drain;
     }
+    if (!snapshot_chain_check(bs_vm_state, chain, errp)) {
+        error_prepend(errp, "Snapshot '%s' can't be loaded: ", name);
+        goto err_drain;
+    }
+
+    /* RAM is about to change behind the back of dirty tracking */
+    ram_snapshot_stop_tracking();
+    snapshot_chain_reset();
 
     qemu_system_reset(SHUTDOWN_CAUSE_NONE);
-    mis->from_src_file = f;
 
-    if (!yank_register_instance(MIGRATION_YANK_INSTANCE, errp)) {
-        ret = -EINVAL;
-        goto err_drain;
+    /* An incremental snapshot applies on top of those it depends on */
+    snapshot_chain.loading_increment = chain->len > 0;
+    for (i = 0; i < chain->len; i++) {
+        const char *base = g_array_index(chain, QEMUSnapshotInfo, i).name;
+
+        trace_load_snapshot_chain(name, base);
+        if (load_snapshot_goto(bs_vm_state, base, errp) < 0 ||
+            load_snapshot_vmstate(bs_vm_state, errp) < 0) {
+            error_prepend(errp, "Snapshot '%s' depends on '%s': ", name, base);
+            goto err_chain;
+        }
+    }
+    if (chain->len && load_snapshot_goto(bs_vm_state, name, errp) < 0) {
+        goto err_chain;
     }
-    aio_context_acquire(aio_context);
-    ret = qemu_loadvm_state(f);
-    migration_incoming_state_destroy();
-    aio_context_release(aio_context);
+
+    /* restore the VM state */
+    ret = load_snapshot_vmstate(bs_vm_state, errp);
+    snapshot_chain.loading_increment = false;
 
     bdrv_drain_all_end();
 
-    if (ret < 0) {
-        error_setg(errp, "Error %d while loading VM state", ret);
-        return false;
-    }
+    return ret >= 0;
 
-    return true;
+err_chain:
+    snapshot_chain.loading_increment = false;
+    /* Leave the VM state node at the same snapshot as the other nodes */
+    load_snapshot_goto(bs_vm_state, name, NULL);
 
 err_drain:
     bdrv_drain_all_end();
@@ -3078,10 +3858,19 @@ bool delete_snapshot(const char *name, bool has_devices,
         return false;
     }
 
+    if (!snapshot_chain_check_dependents(name, has_devices, devices, errp)) {
+        return false;
+    }
+
     if (bdrv_all_delete_snapshot(name, has_devices, devices, errp) < 0) {
         return false;
     }
 
+    if (snapshot_chain_contains(name)) {
+        /* The next snapshot can't depend on it */
+        snapshot_chain_reset();
+    }
+
     return true;
 }
 
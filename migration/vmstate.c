@@ -17,7 +17,9 @@
 #include "qapi/qmp/json-writer.h"
 #include "qemu-file.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "trace.h"
 
 static int vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
@@ -75,10 +77,308 @@ static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
     }
 }
 
+/*
+ * Copy plans
+ *
+ * Runs of fields that are plain integers or buffers, fixed in size and
+ * always present, are written as one big endian block, whatever their
+ * number.  A plan turns such runs into a few bulk copies, coalescing
+ * neighbouring fields of the same width, and leaves the other fields to
+ * the interpreter.
+ */
+
+typedef struct VMStateCopy {
+    /* offset in the structure */
+    size_t offset;
+    /* length in bytes, a multiple of @width */
+    size_t len;
+    /* width of the big endian integers, 1 for bytes */
+    int width;
+} VMStateCopy;
+
+typedef struct VMStatePlanStep {
+    const VMStateField *field;
+    int nfields;
+    /* copies covering all the fields, or NULL to interpret them */
+    GArray *copies;
+} VMStatePlanStep;
+
+typedef struct VMStatePlan {
+    guint nsteps;
+    VMStatePlanStep *steps;
+} VMStatePlan;
+
+/*
+ * Plans by VMStateDescription, or NULL when there is nothing to copy in
+ * bulk.  Descriptions are static, so plans are compiled on first use
+ * and kept for good.
+ */
+static GHashTable *vmstate_plans;
+static QemuMutex vmstate_plans_lock;
+
+static void __attribute__((constructor)) vmstate_plans_init(void)
+{
+    qemu_mutex_init(&vmstate_plans_lock);
+    vmstate_plans = g_hash_table_new(NULL, NULL);
+}
+
+/* Width of a field that can be copied in bulk, 0 if it can't */
+static int vmstate_field_width(const VMStateDescription *vmsd,
+                               const VMStateField *field)
+{
+    static const struct {
+        const VMStateInfo *info;
+        int width;
+    } infos[] = {
+        { &vmstate_info_int8, 1 }, { &vmstate_info_uint8, 1 },
+        { &vmstate_info_int16, 2 }, { &vmstate_info_uint16, 2 },
+        { &vmstate_info_int32, 4 }, { &vmstate_info_uint32, 4 },
+        { &vmstate_info_int64, 8 }, { &vmstate_info_uint64, 8 },
+    };
+    int i;
+
+    if (field->field_exists || field->version_id > vmsd->version_id ||
+        (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER |
+                          VMS_MUST_EXIST))) {
+        return 0;
+    }
+    if (field->info == &vmstate_info_buffer) {
+        return 1;
+    }
+    for (i = 0; i < ARRAY_SIZE(infos); i++) {
+        if (field->info == infos[i].info) {
+            return field->size == infos[i].width ? infos[i].width : 0;
+        }
+    }
+    return 0;
+}
+
+static VMStatePlan *vmstate_plan_compile(const VMStateDescription *vmsd)
+{
+    GArray *steps = g_array_new(FALSE, TRUE, sizeof(VMStatePlanStep));
+    const VMStateField *field;
+    VMStatePlanStep *step = NULL;
+    VMStatePlan *plan;
+    bool copies = false;
+
+    for (field = vmsd->fields; field->name; field++) {
+        int width = vmstate_field_width(vmsd, field);
+        VMStateCopy *last;
+        size_t len;
+
+        if (!step || !width != !step->copies) {
+            g_array_set_size(steps, steps->len + 1);
+            step = &g_array_index(steps, VMStatePlanStep, steps->len - 1);
+            step->field = field;
+            if (width) {
+                step->copies = g_array_new(FALSE, FALSE, sizeof(VMStateCopy));
+                copies = true;
+            }
+        }
+        step->nfields++;
+        if (!width) {
+            continue;
+        }
+
+        len = field->size * (field->flags & VMS_ARRAY ? field->num : 1);
+        if (!len) {
+            continue;
+        }
+        last = step->copies->len ?
+               &g_array_index(step->copies, VMStateCopy,
+                              step->copies->len - 1) : NULL;
+        if (last && last->width == width &&
+            last->offset + last->len == field->offset) {
+            last->len += len;
+        } else {
+            VMStateCopy copy = {
+                .offset = field->offset,
+                .len = len,
+                .width = width,
+            };
+            g_array_append_val(step->copies, copy);
+        }
+    }
+
+    if (!copies) {
+        g_array_free(steps, TRUE);
+        trace_vmstate_plan_compile(vmsd->name, 0);
+        return NULL;
+    }
+
+    plan = g_new0(VMStatePlan, 1);
+    plan->nsteps = steps->len;
+    plan->steps = (VMStatePlanStep *)g_array_free(steps, FALSE);
+    trace_vmstate_plan_compile(vmsd->name, plan->nsteps);
+    return plan;
+}
+
+static const VMStatePlan *vmstate_plan_get(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+    gpointer value;
+
+    QEMU_LOCK_GUARD(&vmstate_plans_lock);
+    if (g_hash_table_lookup_extended(vmstate_plans, vmsd, NULL, &value)) {
+        return value;
+    }
+    plan = vmstate_plan_compile(vmsd);
+    g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    return plan;
+}
+
+/* Convert @len bytes of @width wide integers between host and big endian */
+static void vmstate_copy_swap(uint8_t *dst, const uint8_t *src, size_t len,
+                              int width)
+{
+    size_t i;
+
+    switch (width) {
+    case 2:
+        for (i = 0; i < len; i += 2) {
+            stw_he_p(dst + i, cpu_to_be16(lduw_he_p(src + i)));
+        }
+        break;
+    case 4:
+        for (i = 0; i < len; i += 4) {
+            stl_he_p(dst + i, cpu_to_be32(ldl_he_p(src + i)));
+        }
+        break;
+    case 8:
+        for (i = 0; i < len; i += 8) {
+            stq_he_p(dst + i, cpu_to_be64(ldq_he_p(src + i)));
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void vmstate_copy_put(QEMUFile *f, void *opaque, const VMStateCopy *c)
+{
+    uint8_t *src = opaque + c->offset;
+    uint64_t buf[128];
+    size_t done, n;
+
+    if (c->width == 1) {
+        qemu_put_buffer(f, src, c->len);
+        return;
+    }
+    for (done = 0; done < c->len; done += n) {
+        n = MIN(c->len - done, sizeof(buf));
+        vmstate_copy_swap((uint8_t *)buf, src + done, n, c->width);
+        qemu_put_buffer(f, (uint8_t *)buf, n);
+    }
+}
+
+static void vmstate_copy_get(QEMUFile *f, void *opaque, const VMStateCopy *c)
+{
+    uint8_t *dst = opaque + c->offset;
+
+    qemu_get_buffer(f, dst, c->len);
+    if (c->width > 1) {
+        vmstate_copy_swap(dst, dst, c->len, c->width);
+    }
+}
+
+static int vmstate_load_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              const VMStateField *field, void *opaque,
+                              int version_id)
+{
+    int ret = 0;
+
+    trace_vmstate_load_state_field(vmsd->name, field->name);
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+
+        vmstate_handle_alloc(first_elem, field, opaque);
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+            assert(first_elem || !n_elems || !size);
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                curr_elem = *(void **)curr_elem;
+            }
+            if (!curr_elem && size) {
+                /* if null pointer check placeholder and do not follow */
+                assert(field->flags & VMS_ARRAY_OF_POINTER);
+                ret = vmstate_info_nullptr.get(f, curr_elem, size, NULL);
+            } else if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, curr_elem,
+                                         field->vmsd->version_id);
+            } else if (field->flags & VMS_VSTRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, curr_elem,
+                                         field->struct_version_id);
+            } else {
+                ret = field->info->get(f, curr_elem, size, field);
+            }
+            if (ret >= 0) {
+                ret = qemu_file_get_error(f);
+            }
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                error_report("Failed to load %s:%s", vmsd->name,
+                             field->name);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+        }
+    } else if (field->flags & VMS_MUST_EXIST) {
+        error_report("Input validation failed: %s/%s",
+                     vmsd->name, field->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int vmstate_plan_load(QEMUFile *f, const VMStateDescription *vmsd,
+                             const VMStatePlan *plan, void *opaque)
+{
+    guint i, j;
+    int ret;
+
+    for (i = 0; i < plan->nsteps; i++) {
+        const VMStatePlanStep *step = &plan->steps[i];
+
+        if (!step->copies) {
+            for (j = 0; j < step->nfields; j++) {
+                ret = vmstate_load_field(f, vmsd, step->field + j, opaque,
+                                         vmsd->version_id);
+                if (ret) {
+                    return ret;
+                }
+            }
+            continue;
+        }
+
+        for (j = 0; j < step->copies->len; j++) {
+            vmstate_copy_get(f, opaque,
+                             &g_array_index(step->copies, VMStateCopy, j));
+        }
+        ret = qemu_file_get_error(f);
+        if (ret < 0) {
+            error_report("Failed to load %s:%s", vmsd->name,
+                         step->field->name);
+            trace_vmstate_load_field_error(step->field->name, ret);
+            return ret;
+        }
+    }
+    return 0;
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
     const VMStateField *field = vmsd->fields;
+    const VMStatePlan *plan = NULL;
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -108,57 +408,22 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
-    while (field->name) {
-        trace_vmstate_load_state_field(vmsd->name, field->name);
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *first_elem = opaque + field->offset;
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-
-            vmstate_handle_alloc(first_elem, field, opaque);
-            if (field->flags & VMS_POINTER) {
-                first_elem = *(void **)first_elem;
-                assert(first_elem || !n_elems || !size);
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *curr_elem = first_elem + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    curr_elem = *(void **)curr_elem;
-                }
-                if (!curr_elem && size) {
-                    /* if null pointer check placeholder and do not follow */
-                    assert(field->flags & VMS_ARRAY_OF_POINTER);
-                    ret = vmstate_info_nullptr.get(f, curr_elem, size, NULL);
-                } else if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, curr_elem,
-                                             field->vmsd->version_id);
-                } else if (field->flags & VMS_VSTRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, curr_elem,
-                                             field->struct_version_id);
-                } else {
-                    ret = field->info->get(f, curr_elem, size, field);
-                }
-                if (ret >= 0) {
-                    ret = qemu_file_get_error(f);
-                }
-                if (ret < 0) {
-                    qemu_file_set_error(f, ret);
-                    error_report("Failed to load %s:%s", vmsd->name,
-                                 field->name);
-                    trace_vmstate_load_field_error(field->name, ret);
-                    return ret;
-                }
+    if (version_id == vmsd->version_id) {
+        plan = vmstate_plan_get(vmsd);
+    }
+    if (plan) {
+        ret = vmstate_plan_load(f, vmsd, plan, opaque);
+        if (ret) {
+            return ret;
+        }
+    } else {
+        while (field->name) {
+            ret = vmstate_load_field(f, vmsd, field, opaque, version_id);
+            if (ret) {
+                return ret;
             }
-        } else if (field->flags & VMS_MUST_EXIST) {
-            error_report("Input validation failed: %s/%s",
-                         vmsd->name, field->name);
-            return -1;
+            field++;
         }
-        field++;
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
@@ -316,6 +581,182 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
     return true;
 }
 
+/* Field types that only read or write the field itself */
+static bool vmstate_info_parallel_safe(const VMStateInfo *info)
+{
+    static const VMStateInfo *const safe_infos[] = {
+        &vmstate_info_bool,
+        &vmstate_info_int8, &vmstate_info_int16,
+        &vmstate_info_int32, &vmstate_info_int64,
+        &vmstate_info_uint8_equal, &vmstate_info_uint16_equal,
+        &vmstate_info_int32_equal, &vmstate_info_uint32_equal,
+        &vmstate_info_uint64_equal, &vmstate_info_int32_le,
+        &vmstate_info_uint8, &vmstate_info_uint16,
+        &vmstate_info_uint32, &vmstate_info_uint64,
+        &vmstate_info_nullptr, &vmstate_info_cpudouble,
+        &vmstate_info_buffer, &vmstate_info_unused_buffer,
+        &vmstate_info_bitmap,
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(safe_infos); i++) {
+        if (info == safe_infos[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Whether a section described by @vmsd can be saved and loaded outside
+ * the BQL, see VMStateDescription.parallel_safe.
+ */
+bool vmstate_parallel_safe(const VMStateDescription *vmsd)
+{
+    const VMStateField *field;
+    const VMStateDescription **sub;
+
+    if (vmsd->load_state_old) {
+        return false;
+    }
+    if (!vmsd->parallel_safe &&
+        (vmsd->pre_load || vmsd->post_load ||
+         vmsd->pre_save || vmsd->post_save || vmsd->needed)) {
+        return false;
+    }
+
+    for (field = vmsd->fields; field && field->name; field++) {
+        if (!vmsd->parallel_safe && field->field_exists) {
+            return false;
+        }
+        if (field->vmsd) {
+            if (!vmstate_parallel_safe(field->vmsd)) {
+                return false;
+            }
+        } else if (!vmsd->parallel_safe &&
+                   !vmstate_info_parallel_safe(field->info)) {
+            return false;
+        }
+    }
+
+    for (sub = vmsd->subsections; sub && *sub; sub++) {
+        if (!vmstate_parallel_safe(*sub)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static int vmstate_save_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              const VMStateField *field, void *opaque,
+                              JSONWriter *vmdesc, int version_id)
+{
+    int ret = 0;
+
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+        int64_t old_offset, written_bytes;
+        JSONWriter *vmdesc_loop = vmdesc;
+
+        trace_vmstate_save_state_loop(vmsd->name, field->name, n_elems);
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+            assert(first_elem || !n_elems || !size);
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+
+            vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
+            old_offset = qemu_ftell_fast(f);
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                assert(curr_elem);
+                curr_elem = *(void **)curr_elem;
+            }
+            if (!curr_elem && size) {
+                /* if null pointer write placeholder and do not follow */
+                assert(field->flags & VMS_ARRAY_OF_POINTER);
+                ret = vmstate_info_nullptr.put(f, curr_elem, size, NULL,
+                                               NULL);
+            } else if (field->flags & VMS_STRUCT) {
+                ret = vmstate_save_state(f, field->vmsd, curr_elem,
+                                         vmdesc_loop);
+            } else if (field->flags & VMS_VSTRUCT) {
+                ret = vmstate_save_state_v(f, field->vmsd, curr_elem,
+                                           vmdesc_loop,
+                                           field->struct_version_id);
+            } else {
+                ret = field->info->put(f, curr_elem, size, field,
+                                 vmdesc_loop);
+            }
+            if (ret) {
+                error_report("Save of field %s/%s failed",
+                             vmsd->name, field->name);
+                return ret;
+            }
+
+            written_bytes = qemu_ftell_fast(f) - old_offset;
+            vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
+
+            /* Compressed arrays only care about the first element */
+            if (vmdesc_loop && vmsd_can_compress(field)) {
+                vmdesc_loop = NULL;
+            }
+        }
+    } else {
+        if (field->flags & VMS_MUST_EXIST) {
+            error_report("Output state validation failed: %s/%s",
+                    vmsd->name, field->name);
+            assert(!(field->flags & VMS_MUST_EXIST));
+        }
+    }
+    return 0;
+}
+
+static int vmstate_plan_save(QEMUFile *f, const VMStateDescription *vmsd,
+                             const VMStatePlan *plan, void *opaque,
+                             JSONWriter *vmdesc)
+{
+    guint i, j;
+    int ret;
+
+    for (i = 0; i < plan->nsteps; i++) {
+        const VMStatePlanStep *step = &plan->steps[i];
+
+        if (!step->copies) {
+            for (j = 0; j < step->nfields; j++) {
+                ret = vmstate_save_field(f, vmsd, step->field + j, opaque,
+                                         vmdesc, vmsd->version_id);
+                if (ret) {
+                    return ret;
+                }
+            }
+            continue;
+        }
+
+        for (j = 0; j < step->copies->len; j++) {
+            vmstate_copy_put(f, opaque,
+                             &g_array_index(step->copies, VMStateCopy, j));
+        }
+
+        /* Describe the fields as the interpreter does, arrays compressed */
+        for (j = 0; vmdesc && j < step->nfields; j++) {
+            const VMStateField *field = step->field + j;
+            int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+
+            if (n_elems) {
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmsd_desc_field_end(vmsd, vmdesc, field, field->size, 0);
+            }
+        }
+    }
+    return 0;
+}
 
 int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, JSONWriter *vmdesc_id)
@@ -328,6 +769,7 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
 {
     int ret = 0;
     const VMStateField *field = vmsd->fields;
+    const VMStatePlan *plan = NULL;
 
     trace_vmstate_save_state_top(vmsd->name);
 
@@ -346,72 +788,23 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
         json_writer_start_array(vmdesc, "fields");
     }
 
-    while (field->name) {
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *first_elem = opaque + field->offset;
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-            int64_t old_offset, written_bytes;
-            JSONWriter *vmdesc_loop = vmdesc;
-
-            trace_vmstate_save_state_loop(vmsd->name, field->name, n_elems);
-            if (field->flags & VMS_POINTER) {
-                first_elem = *(void **)first_elem;
-                assert(first_elem || !n_elems || !size);
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *curr_elem = first_elem + size * i;
-
-                vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
-                old_offset = qemu_ftell_fast(f);
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    assert(curr_elem);
-                    curr_elem = *(void **)curr_elem;
-                }
-                if (!curr_elem && size) {
-                    /* if null pointer write placeholder and do not follow */
-                    assert(field->flags & VMS_ARRAY_OF_POINTER);
-                    ret = vmstate_info_nullptr.put(f, curr_elem, size, NULL,
-                                                   NULL);
-                } else if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_save_state(f, field->vmsd, curr_elem,
-                                             vmdesc_loop);
-                } else if (field->flags & VMS_VSTRUCT) {
-                    ret = vmstate_save_state_v(f, field->vmsd, curr_elem,
-                                               vmdesc_loop,
-                                               field->struct_version_id);
-                } else {
-                    ret = field->info->put(f, curr_elem, size, field,
-                                     vmdesc_loop);
-                }
-                if (ret) {
-                    error_report("Save of field %s/%s failed",
-                                 vmsd->name, field->name);
-                    if (vmsd->post_save) {
-                        vmsd->post_save(opaque);
-                    }
-                    return ret;
-                }
-
-                written_bytes = qemu_ftell_fast(f) - old_offset;
-                vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
-
-                /* Compressed arrays only care about the first element */
-                if (vmdesc_loop && vmsd_can_compress(field)) {
-                    vmdesc_loop = NULL;
-                }
-            }
-        } else {
-            if (field->flags & VMS_MUST_EXIST) {
-                error_report("Output state validation failed: %s/%s",
-                        vmsd->name, field->name);
-                assert(!(field->flags & VMS_MUST_EXIST));
-            }
+    if (version_id == vmsd->version_id) {
+        plan = vmstate_plan_get(vmsd);
+    }
+    if (plan) {
+        ret = vmstate_plan_save(f, vmsd, plan, opaque, vmdesc);
+    } else {
+        while (field->name && !ret) {
+            ret = vmstate_save_field(f, vmsd, field, opaque, vmdesc,
+                                     version_id);
+            field++;
         }
-        field++;
+    }
+    if (ret) {
+        if (vmsd->post_save) {
+            vmsd->post_save(opaque);
+        }
+        return ret;
     }
 
     if (vmdesc) {
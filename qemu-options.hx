@@ -139,6 +139,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
@@ -165,6 +166,16 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``dirty-ring-size=n``
+        When the KVM accelerator is used, it controls the size of the per-vCPU
+        dirty page ring buffer (number of entries for each vCPU). It should
+        be a value that is power of two, and it should be 1024 or bigger (but
+        still less than the maximum value that the kernel supports).  4096
+        could be a good initial value if you have no idea which is the best.
+        Set this value to 0 to disable the feature.  By default, this feature
+        is disabled (dirty-ring-size=0), and KVM records dirty pages in a
+        bitmap instead.
+
     ``split-wx=on|off``
         Controls the use of split w^x mapping for the TCG code generation
         buffer. Some operating systems require this to be enabled, and in
@@ -1162,6 +1173,29 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``compressed-readahead``
+            The number of compressed clusters to read ahead and
+            decompress in the background when the guest reads
+            compressed clusters sequentially (default: 0, disabled;
+            at most 64)
+
+        ``compressed-shared-cache``
+            A file in which decompressed clusters are shared with other
+            QEMU processes using the same image, for example a memfd
+            passed with ``-add-fd`` or a file in ``/dev/shm``. It is
+            only used while the image is opened read-only. The compressed
+            data is still read, only its decompression is shared.
+
+        ``compressed-shared-cache-size``
+            The size of the shared cache file if it is empty and has to
+            be initialized (default: 256M)
+
+        ``chain-map``
+            Remember which image of the backing chain holds the data of
+            clusters that are unallocated in this image, so that reads
+            from long backing chains need not look at every layer
+            (on/off; default: off)
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
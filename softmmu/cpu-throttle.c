@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/rcu.h"
 #include "hw/core/cpu.h"
 #include "qemu/main-loop.h"
 #include "sysemu/cpus.h"
@@ -33,25 +34,60 @@
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* Number of vcpus with a throttle percentage of their own */
+static unsigned int throttle_vcpus;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
 #define CPU_THROTTLE_TIMESLICE_NS 10000000
 
+/* The percentage @cpu is throttled by, from all throttles applying to it */
+static int cpu_throttle_get_effective_percentage(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               cpu_throttle_get_vcpu_percentage(cpu));
+}
+
+/*
+ * The percentage of the most throttled vcpu, which sets the period of
+ * the throttle timer.
+ */
+static int cpu_throttle_get_max_percentage(void)
+{
+    CPUState *cpu;
+    int pct = cpu_throttle_get_percentage();
+
+    if (!qatomic_read(&throttle_vcpus)) {
+        return pct;
+    }
+
+    CPU_FOREACH(cpu) {
+        pct = MAX(pct, cpu_throttle_get_vcpu_percentage(cpu));
+    }
+    return pct;
+}
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
-    double pct;
-    double throttle_ratio;
+    double pct, max_pct;
+    double period_ns;
     int64_t sleeptime_ns, endtime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_get_effective_percentage(cpu)) {
+        qatomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage() / 100;
-    throttle_ratio = pct / (1 - pct);
+    pct = (double)cpu_throttle_get_effective_percentage(cpu) / 100;
+    max_pct = (double)cpu_throttle_get_max_percentage() / 100;
+    /*
+     * Sleep for @pct of each timer period.  Without per-vcpu throttles
+     * that is pct / (1 - pct) timeslices, as the period is set by the
+     * same percentage.
+     */
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - max_pct);
     /* Add 1ns to fix double's rounding error (like 0.9999999...) */
-    sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
+    sleeptime_ns = (int64_t)(pct * period_ns + 1);
     endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
     while (sleeptime_ns > 0 && !cpu->stop) {
         if (sleeptime_ns > SCALE_MS) {
@@ -73,17 +109,21 @@ static void cpu_throttle_timer_tick(void *opaque)
     double pct;
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_active()) {
         return;
     }
     CPU_FOREACH(cpu) {
+        /* vcpus nobody throttles keep running undisturbed */
+        if (!cpu_throttle_get_effective_percentage(cpu)) {
+            continue;
+        }
         if (!qatomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
                              RUN_ON_CPU_NULL);
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage() / 100;
+    pct = (double)cpu_throttle_get_max_percentage() / 100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                    CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
 }
@@ -107,14 +147,48 @@ void cpu_throttle_set(int new_throttle_pct)
     }
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    bool throttle_active = cpu_throttle_active();
+    unsigned int old_throttle_pct;
+
+    if (new_throttle_pct) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    }
+
+    old_throttle_pct = qatomic_xchg(&cpu->throttle_percentage,
+                                    new_throttle_pct);
+    if (!old_throttle_pct && new_throttle_pct) {
+        qatomic_inc(&throttle_vcpus);
+    } else if (old_throttle_pct && !new_throttle_pct) {
+        qatomic_dec(&throttle_vcpus);
+    }
+
+    if (!throttle_active && new_throttle_pct) {
+        cpu_throttle_timer_tick(NULL);
+    }
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     qatomic_set(&throttle_percentage, 0);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        CPU_FOREACH(cpu) {
+            if (qatomic_xchg(&cpu->throttle_percentage, 0)) {
+                qatomic_dec(&throttle_vcpus);
+            }
+        }
+    }
 }
 
 bool cpu_throttle_active(void)
 {
-    return (cpu_throttle_get_percentage() != 0);
+    return (cpu_throttle_get_percentage() != 0) ||
+           (qatomic_read(&throttle_vcpus) != 0);
 }
 
 int cpu_throttle_get_percentage(void)
@@ -122,6 +196,11 @@ int cpu_throttle_get_percentage(void)
     return qatomic_read(&throttle_percentage);
 }
 
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return qatomic_read(&cpu->throttle_percentage);
+}
+
 void cpu_throttle_init(void)
 {
     throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
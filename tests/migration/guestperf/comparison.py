@@ -121,4 +121,45 @@ def __init__(self, name, scenarios):
         Scenario("compr-xbzrle-cache-50",
                  compression_xbzrle=True, compression_xbzrle_cache=50),
     ]),
+
+
+    # Looking at effect of multifd with varying numbers
+    # of channels
+    Comparison("multifd-channels", scenarios = [
+        Scenario("multifd-channels-1",
+                 multifd=True, multifd_channels=1),
+        Scenario("multifd-channels-2",
+                 multifd=True, multifd_channels=2),
+        Scenario("multifd-channels-4",
+                 multifd=True, multifd_channels=4),
+        Scenario("multifd-channels-8",
+                 multifd=True, multifd_channels=8),
+    ]),
+
+
+    # Looking at effect of multifd compression methods
+    Comparison("multifd-compression", scenarios = [
+        Scenario("multifd-compression-none",
+                 multifd=True, multifd_channels=4,
+                 multifd_compression="none"),
+        Scenario("multifd-compression-zlib",
+                 multifd=True, multifd_channels=4,
+                 multifd_compression="zlib"),
+        Scenario("multifd-compression-zstd",
+                 multifd=True, multifd_channels=4,
+                 multifd_compression="zstd"),
+    ]),
+
+
+    # Looking at effect of the guest memory dirtying pattern
+    Comparison("dirty-pattern", scenarios = [
+        Scenario("dirty-pattern-sequential",
+                 dirty_pattern="sequential"),
+        Scenario("dirty-pattern-random",
+                 dirty_pattern="random"),
+        Scenario("dirty-pattern-hotspot-5",
+                 dirty_pattern="hotspot", dirty_hotspot=5),
+        Scenario("dirty-pattern-hotspot-25",
+                 dirty_pattern="hotspot", dirty_hotspot=25),
+    ]),
 ]
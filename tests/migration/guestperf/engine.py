@@ -116,6 +116,10 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
             src_threads.append(vcpu["thread_id"])
 
         # XXX how to get dst timings on remote host ?
+        dst_qemu_time = []
+        dst_pid = None
+        if self._dst_host == "localhost":
+            dst_pid = dst.get_pid()
 
         if self._verbose:
             print("Sleeping %d seconds for initial guest workload run" % self._sleep)
@@ -186,6 +190,23 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                                value=(hardware._mem * 1024 * 1024 * 1024 / 100 *
                                       scenario._compression_xbzrle_cache))
 
+        if scenario._multifd:
+            for vm in (src, dst):
+                resp = vm.command("migrate-set-capabilities",
+                                  capabilities = [
+                                      { "capability": "multifd",
+                                        "state": True }
+                                  ])
+                resp = vm.command("migrate-set-parameters",
+                                  multifd_channels=scenario._multifd_channels,
+                                  multifd_compression=scenario._multifd_compression)
+
+        # Samples bracketing the migration, for its CPU cost
+        src_qemu_time.append(self._cpu_timing(src_pid))
+        src_vcpu_time.extend(self._vcpu_timing(src_pid, src_threads))
+        if dst_pid is not None:
+            dst_qemu_time.append(self._cpu_timing(dst_pid))
+
         resp = src.command("migrate", uri=connect_uri)
 
         post_copy = False
@@ -203,6 +224,8 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
             if (loop % 20) == 0:
                 src_qemu_time.append(self._cpu_timing(src_pid))
                 src_vcpu_time.extend(self._vcpu_timing(src_pid, src_threads))
+                if dst_pid is not None:
+                    dst_qemu_time.append(self._cpu_timing(dst_pid))
 
             if (len(progress_history) == 0 or
                 (progress_history[-1]._ram._iterations <
@@ -210,6 +233,11 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                 progress_history.append(progress)
 
             if progress._status in ("completed", "failed", "cancelled"):
+                src_qemu_time.append(self._cpu_timing(src_pid))
+                src_vcpu_time.extend(self._vcpu_timing(src_pid, src_threads))
+                if dst_pid is not None:
+                    dst_qemu_time.append(self._cpu_timing(dst_pid))
+
                 if progress._status == "completed" and paused:
                     dst.command("cont")
                 if progress_history[-1] != progress:
@@ -225,7 +253,8 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                         src_vcpu_time.extend(self._vcpu_timing(src_pid, src_threads))
                         sleep_secs -= 1
 
-                return [progress_history, src_qemu_time, src_vcpu_time]
+                return [progress_history, src_qemu_time, src_vcpu_time,
+                        dst_qemu_time]
 
             if self._verbose and (loop % 20) == 0:
                 print("Iter %d: remain %5dMB of %5dMB (total %5dMB @ %5dMb/sec)" % (
@@ -264,7 +293,7 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                 resp = src.command("stop")
                 paused = True
 
-    def _get_common_args(self, hardware, tunnelled=False):
+    def _get_common_args(self, hardware, scenario, tunnelled=False):
         args = [
             "noapic",
             "edd=off",
@@ -280,6 +309,8 @@ def _get_common_args(self, hardware, tunnelled=False):
             args.append("quiet")
 
         args.append("ramsize=%s" % hardware._mem)
+        args.append("pattern=%s" % scenario._dirty_pattern)
+        args.append("hotspot=%d" % scenario._dirty_hotspot)
 
         cmdline = " ".join(args)
         if tunnelled:
@@ -310,14 +341,14 @@ def _get_common_args(self, hardware, tunnelled=False):
 
         return argv
 
-    def _get_src_args(self, hardware):
-        return self._get_common_args(hardware)
+    def _get_src_args(self, hardware, scenario):
+        return self._get_common_args(hardware, scenario)
 
-    def _get_dst_args(self, hardware, uri):
+    def _get_dst_args(self, hardware, scenario, uri):
         tunnelled = False
         if self._dst_host != "localhost":
             tunnelled = True
-        argv = self._get_common_args(hardware, tunnelled)
+        argv = self._get_common_args(hardware, scenario, tunnelled)
         return argv + ["-incoming", uri]
 
     @staticmethod
@@ -386,13 +417,13 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
         srcmonaddr = "/var/tmp/qemu-src-%d-monitor.sock" % os.getpid()
 
         src = QEMUMachine(self._binary,
-                          args=self._get_src_args(hardware),
+                          args=self._get_src_args(hardware, scenario),
                           wrapper=self._get_src_wrapper(hardware),
                           name="qemu-src-%d" % os.getpid(),
                           monitor_address=srcmonaddr)
 
         dst = QEMUMachine(self._binary,
-                          args=self._get_dst_args(hardware, uri),
+                          args=self._get_dst_args(hardware, scenario, uri),
                           wrapper=self._get_dst_wrapper(hardware),
                           name="qemu-dst-%d" % os.getpid(),
                           monitor_address=dstmonaddr)
@@ -405,6 +436,7 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
             progress_history = ret[0]
             qemu_timings = ret[1]
             vcpu_timings = ret[2]
+            dst_qemu_timings = ret[3]
             if uri[0:5] == "unix:":
                 os.remove(uri[5:])
             if self._verbose:
@@ -418,7 +450,8 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
                           Timings(qemu_timings),
                           Timings(vcpu_timings),
                           self._binary, self._dst_host, self._kernel,
-                          self._initrd, self._transport, self._sleep)
+                          self._initrd, self._transport, self._sleep,
+                          Timings(dst_qemu_timings))
         except Exception as e:
             if self._debug:
                 print("Failed: %s" % str(e))
@@ -38,7 +38,8 @@ def __init__(self,
                  kernel,
                  initrd,
                  transport,
-                 sleep):
+                 sleep,
+                 dst_qemu_timings=None):
 
         self._hardware = hardware
         self._scenario = scenario
@@ -52,6 +53,68 @@ def __init__(self,
         self._initrd = initrd
         self._transport = transport
         self._sleep = sleep
+        if dst_qemu_timings is None:
+            dst_qemu_timings = Timings([])
+        self._dst_qemu_timings = dst_qemu_timings
+
+    @staticmethod
+    def _cpu_used(records, start, end):
+        # CPU time in ms consumed by each thread between the last sample
+        # before @start and the first one after @end
+        used = {}
+        for tid in set([record._tid for record in records]):
+            samples = [record for record in records if record._tid == tid]
+            before = [record for record in samples if record._timestamp <= start]
+            after = [record for record in samples if record._timestamp >= end]
+            if len(before) == 0 or len(after) == 0:
+                return None
+            used[tid] = after[0]._value - before[-1]._value
+        return used
+
+    def summary(self):
+        if len(self._progress_history) == 0:
+            return {}
+
+        first = self._progress_history[0]
+        last = self._progress_history[-1]
+        start = first._now - (first._duration / 1000.0)
+        end = last._now
+
+        summary = {
+            "status": last._status,
+            "duration": last._duration,
+            "setup_time": last._setup_time,
+            "downtime": last._downtime,
+            "iterations": last._ram._iterations,
+            "transferred_bytes": last._ram._transferred_bytes,
+            "throughput_mbs": 0,
+            "src_cpu_ms": None,
+            "dst_cpu_ms": None,
+            "cpu_ns_per_byte": None,
+        }
+
+        if last._duration:
+            summary["throughput_mbs"] = (last._ram._transferred_bytes /
+                                         (1024 * 1024) /
+                                         (last._duration / 1000.0))
+
+        # Migration cost on the source is what QEMU used beyond its vCPUs;
+        # the destination vCPUs do not run until migration completes.
+        qemu = self._cpu_used(self._qemu_timings._records, start, end)
+        vcpu = self._cpu_used(self._vcpu_timings._records, start, end)
+        if qemu is not None and vcpu is not None:
+            summary["src_cpu_ms"] = sum(qemu.values()) - sum(vcpu.values())
+        dst = self._cpu_used(self._dst_qemu_timings._records, start, end)
+        if dst:
+            summary["dst_cpu_ms"] = sum(dst.values())
+
+        if (summary["src_cpu_ms"] is not None and
+            last._ram._transferred_bytes):
+            cpu = summary["src_cpu_ms"] + (summary["dst_cpu_ms"] or 0)
+            summary["cpu_ns_per_byte"] = (cpu * 1000 * 1000 /
+                                          last._ram._transferred_bytes)
+
+        return summary
 
     def serialize(self):
         return {
@@ -67,6 +130,8 @@ def serialize(self):
             "initrd": self._initrd,
             "transport": self._transport,
             "sleep": self._sleep,
+            "dst_qemu_timings": self._dst_qemu_timings.serialize(),
+            "summary": self.summary(),
         }
 
     @classmethod
@@ -83,7 +148,8 @@ def deserialize(cls, data):
             data["kernel"],
             data["initrd"],
             data["transport"],
-            data["sleep"])
+            data["sleep"],
+            Timings.deserialize(data.get("dst_qemu_timings", [])))
 
     def to_json(self):
         return json.dumps(self.serialize(), indent=4)
@@ -29,7 +29,10 @@ def __init__(self, name,
                  post_copy=False, post_copy_iters=5,
                  auto_converge=False, auto_converge_step=10,
                  compression_mt=False, compression_mt_threads=1,
-                 compression_xbzrle=False, compression_xbzrle_cache=10):
+                 compression_xbzrle=False, compression_xbzrle_cache=10,
+                 multifd=False, multifd_channels=2,
+                 multifd_compression="none",
+                 dirty_pattern="sequential", dirty_hotspot=10):
 
         self._name = name
 
@@ -56,6 +59,14 @@ def __init__(self, name,
         self._compression_xbzrle = compression_xbzrle
         self._compression_xbzrle_cache = compression_xbzrle_cache # percentage of guest RAM
 
+        self._multifd = multifd
+        self._multifd_channels = multifd_channels
+        self._multifd_compression = multifd_compression # 'none', 'zlib' or 'zstd'
+
+        # Guest workload
+        self._dirty_pattern = dirty_pattern # 'sequential', 'random' or 'hotspot'
+        self._dirty_hotspot = dirty_hotspot # percentage of guest RAM
+
     def serialize(self):
         return {
             "name": self._name,
@@ -73,6 +84,11 @@ def serialize(self):
             "compression_mt_threads": self._compression_mt_threads,
             "compression_xbzrle": self._compression_xbzrle,
             "compression_xbzrle_cache": self._compression_xbzrle_cache,
+            "multifd": self._multifd,
+            "multifd_channels": self._multifd_channels,
+            "multifd_compression": self._multifd_compression,
+            "dirty_pattern": self._dirty_pattern,
+            "dirty_hotspot": self._dirty_hotspot,
         }
 
     @classmethod
@@ -92,4 +108,9 @@ def deserialize(cls, data):
             data["compression_mt"],
             data["compression_mt_threads"],
             data["compression_xbzrle"],
-            data["compression_xbzrle_cache"])
+            data["compression_xbzrle_cache"],
+            data.get("multifd", False),
+            data.get("multifd_channels", 2),
+            data.get("multifd_compression", "none"),
+            data.get("dirty_pattern", "sequential"),
+            data.get("dirty_hotspot", 10))
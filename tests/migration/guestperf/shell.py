@@ -20,6 +20,7 @@
 
 import argparse
 import fnmatch
+import json
 import os
 import os.path
 import platform
@@ -122,6 +123,15 @@ def __init__(self):
         parser.add_argument("--compression-xbzrle", dest="compression_xbzrle", default=False, action="store_true")
         parser.add_argument("--compression-xbzrle-cache", dest="compression_xbzrle_cache", default=10, type=int)
 
+        parser.add_argument("--multifd", dest="multifd", default=False, action="store_true")
+        parser.add_argument("--multifd-channels", dest="multifd_channels", default=2, type=int)
+        parser.add_argument("--multifd-compression", dest="multifd_compression", default="none",
+                            choices=["none", "zlib", "zstd"])
+
+        parser.add_argument("--dirty-pattern", dest="dirty_pattern", default="sequential",
+                            choices=["sequential", "random", "hotspot"])
+        parser.add_argument("--dirty-hotspot", dest="dirty_hotspot", default=10, type=int)
+
     def get_scenario(self, args):
         return Scenario(name="perfreport",
                         downtime=args.downtime,
@@ -142,7 +152,14 @@ def get_scenario(self, args):
                         compression_mt_threads=args.compression_mt_threads,
 
                         compression_xbzrle=args.compression_xbzrle,
-                        compression_xbzrle_cache=args.compression_xbzrle_cache)
+                        compression_xbzrle_cache=args.compression_xbzrle_cache,
+
+                        multifd=args.multifd,
+                        multifd_channels=args.multifd_channels,
+                        multifd_compression=args.multifd_compression,
+
+                        dirty_pattern=args.dirty_pattern,
+                        dirty_hotspot=args.dirty_hotspot)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -266,3 +283,82 @@ def run(self, argv):
                     args.vcpu_cpu)
 
         plot.generate(args.output)
+
+
+class SummaryShell(object):
+
+    # Metrics compared against the baseline, and whether higher is better
+    METRICS = {
+        "throughput_mbs": True,
+        "downtime": False,
+        "iterations": False,
+        "duration": False,
+        "cpu_ns_per_byte": False,
+    }
+
+    def __init__(self):
+        super(SummaryShell, self).__init__()
+
+        self._parser = argparse.ArgumentParser(description="Migration Test Tool")
+
+        self._parser.add_argument("--output", dest="output", default=None)
+        self._parser.add_argument("--baseline", dest="baseline", default=[], action="append")
+        self._parser.add_argument("--threshold", dest="threshold", default=10, type=int)
+
+        self._parser.add_argument("reports", nargs='*')
+
+    def _regressions(self, summary, baseline, threshold):
+        regressions = []
+        if baseline["status"] == "completed" and summary["status"] != "completed":
+            regressions.append("status")
+            return regressions
+
+        for metric, higher in self.METRICS.items():
+            old = baseline.get(metric)
+            new = summary.get(metric)
+            if old is None or new is None or old == 0:
+                continue
+            change = (new - old) * 100.0 / old
+            if higher:
+                change = -change
+            if change > threshold:
+                regressions.append(metric)
+        return regressions
+
+    def run(self, argv):
+        args = self._parser.parse_args(argv)
+
+        if len(args.reports) == 0:
+            print("At least one report required", file=sys.stderr)
+            return 1
+
+        baselines = {}
+        for filename in args.baseline:
+            report = Report.from_json_file(filename)
+            baselines[report._scenario._name] = report.summary()
+
+        results = []
+        regressed = False
+        for filename in args.reports:
+            report = Report.from_json_file(filename)
+            result = {
+                "name": report._scenario._name,
+                "scenario": report._scenario.serialize(),
+                "summary": report.summary(),
+            }
+            baseline = baselines.get(report._scenario._name)
+            if baseline is not None:
+                result["regressions"] = self._regressions(result["summary"],
+                                                          baseline,
+                                                          args.threshold)
+                if len(result["regressions"]) > 0:
+                    regressed = True
+            results.append(result)
+
+        if args.output is None:
+            print(json.dumps(results, indent=4))
+        else:
+            with open(args.output, "w") as fh:
+                print(json.dumps(results, indent=4), file=fh)
+
+        return 1 if regressed else 0
@@ -29,6 +29,23 @@ const char *argv0;
 
 #define RAM_PAGE_SIZE 4096
 
+enum {
+    PATTERN_SEQUENTIAL,
+    PATTERN_RANDOM,
+    PATTERN_HOTSPOT,
+};
+
+static const char *pattern_names[] = {
+    [PATTERN_SEQUENTIAL] = "sequential",
+    [PATTERN_RANDOM] = "random",
+    [PATTERN_HOTSPOT] = "hotspot",
+};
+
+/* How pages are picked for dirtying */
+static int pattern = PATTERN_SEQUENTIAL;
+/* Percentage of RAM dirtied by the hotspot pattern */
+static unsigned long long hotspot = 10;
+
 #ifndef CONFIG_GETTID
 static int gettid(void)
 {
@@ -123,6 +140,22 @@ static int get_command_arg_ull(const char *name,
 }
 
 
+static int parse_pattern(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(pattern_names); i++) {
+        if (g_str_equal(name, pattern_names[i])) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "%s (%05d): ERROR: unknown pattern %s\n",
+            argv0, gettid(), name);
+    return -1;
+}
+
+
 static int random_bytes(char *buf, size_t len)
 {
     int fd;
@@ -156,9 +189,28 @@ static unsigned long long now(void)
     return (tv.tv_sec * 1000ull) + (tv.tv_usec / 1000ull);
 }
 
+/* Index of the page to dirty as the @page'th one of a pass over RAM */
+static size_t stress_page(size_t page, size_t npages, size_t hotpages,
+                          uint64_t *seed)
+{
+    if (pattern == PATTERN_SEQUENTIAL) {
+        return page;
+    }
+
+    /* xorshift64, cheap enough not to dominate the dirtying */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+
+    return *seed % (pattern == PATTERN_RANDOM ? npages : hotpages);
+}
+
 static void stressone(unsigned long long ramsizeMB)
 {
     size_t pagesPerMB = 1024 * 1024 / RAM_PAGE_SIZE;
+    size_t npages = ramsizeMB * pagesPerMB;
+    size_t hotpages = MAX(npages * hotspot / 100, 1);
+    uint64_t seed = gettid();
     g_autofree char *ram = g_malloc(ramsizeMB * 1024 * 1024);
     char *ramptr;
     size_t i, j, k;
@@ -182,14 +234,15 @@ static void stressone(unsigned long long ramsizeMB)
 
     while (1) {
 
-        ramptr = ram;
         for (i = 0; i < ramsizeMB; i++, nMB++) {
             for (j = 0; j < pagesPerMB; j++) {
+                ramptr = ram + stress_page(i * pagesPerMB + j, npages,
+                                           hotpages, &seed) * RAM_PAGE_SIZE;
                 dataptr = data;
                 for (k = 0; k < RAM_PAGE_SIZE; k += sizeof(long long)) {
+                    *(unsigned long long *)ramptr ^= *(unsigned long long *)dataptr;
                     ramptr += sizeof(long long);
                     dataptr += sizeof(long long);
-                    *(unsigned long long *)ramptr ^= *(unsigned long long *)dataptr;
                 }
             }
 
@@ -266,15 +319,18 @@ int main(int argc, char **argv)
     char *end;
     int ch;
     int opt_ind = 0;
-    const char *sopt = "hr:c:";
+    const char *sopt = "hr:c:p:s:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "ramsize", required_argument, NULL, 'r' },
         { "cpus", required_argument, NULL, 'c' },
+        { "pattern", required_argument, NULL, 'p' },
+        { "hotspot", required_argument, NULL, 's' },
         { NULL, 0, NULL, 0 }
     };
     int ret;
     int ncpus = 0;
+    char *name;
 
     argv0 = argv[0];
 
@@ -300,9 +356,28 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'p':
+            pattern = parse_pattern(optarg);
+            if (pattern < 0) {
+                exit_failure();
+            }
+            break;
+
+        case 's':
+            errno = 0;
+            hotspot = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end || hotspot < 1 || hotspot > 100) {
+                fprintf(stderr, "%s (%05d): ERROR: Cannot parse hotspot %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
         case '?':
         case 'h':
-            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]\n", argv0);
+            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]"
+                    "[--pattern sequential|random|hotspot][--hotspot PERCENT]\n",
+                    argv0);
             exit_failure();
         }
     }
@@ -314,13 +389,31 @@ int main(int argc, char **argv)
         ret = get_command_arg_ull("ramsize", &ramsizeGB);
         if (ret < 0)
             exit_failure();
+
+        ret = get_command_arg_str("pattern", &name);
+        if (ret < 0) {
+            exit_failure();
+        }
+        if (ret > 0) {
+            pattern = parse_pattern(name);
+            g_free(name);
+            if (pattern < 0) {
+                exit_failure();
+            }
+        }
+
+        ret = get_command_arg_ull("hotspot", &hotspot);
+        if (ret < 0 || hotspot < 1 || hotspot > 100) {
+            exit_failure();
+        }
     }
 
     if (ncpus == 0)
         ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs\n",
-            argv0, gettid(), ramsizeGB, ncpus);
+    fprintf(stdout,
+            "%s (%05d): INFO: RAM %llu GiB across %d CPUs, %s pattern\n",
+            argv0, gettid(), ramsizeGB, ncpus, pattern_names[pattern]);
 
     stress(ramsizeGB, ncpus);
 
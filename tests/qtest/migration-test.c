@@ -472,6 +472,8 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* for migrate_postcopy_prepare(): enable postcopy-preempt */
+    bool postcopy_preempt;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -710,6 +712,7 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -720,6 +723,11 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -767,6 +775,24 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+/*
+ * Same as test_postcopy(), but the pages the destination faults on come
+ * through the preempt channel
+ */
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1105,6 +1131,196 @@ static void test_migrate_fd_proto(void)
     test_migrate_end(from, to, true);
 }
 
+/* Migrate the source, which must be stopped, to the file @name in tmpfs */
+static void migrate_to_file(QTestState *from, const char *name)
+{
+    char *uri = g_strdup_printf("file:%s/%s", tmpfs, name);
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+    g_free(uri);
+}
+
+/* Load the file @name in tmpfs into a target started with -incoming defer */
+static void migrate_from_file(QTestState *to, const char *name)
+{
+    char *uri = g_strdup_printf("file:%s/%s", tmpfs, name);
+    QDict *rsp;
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    wait_for_migration_complete(to);
+    g_free(uri);
+}
+
+/* Check that the test area of @to holds what it holds in @from */
+static void compare_guests_ram(QTestState *from, QTestState *to)
+{
+    unsigned address;
+    uint8_t src_byte, dest_byte;
+
+    for (address = start_address; address < end_address;
+         address += TEST_MEM_PAGE_SIZE) {
+        qtest_memread(from, address, &src_byte, 1);
+        qtest_memread(to, address, &dest_byte, 1);
+        g_assert_cmpint(src_byte, ==, dest_byte);
+    }
+}
+
+/*
+ * Save the stopped source to a mapped-ram file with several writer
+ * threads and load it into a (paused) target, which must end up with the
+ * RAM the source had and keep running from there.
+ */
+static void test_precopy_file_mapped_ram(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    g_free(args->opts_target);
+    args->opts_target = g_strdup("-S");
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    /* The pages are written by that many threads, in any order */
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'stop' }");
+    qobject_unref(rsp);
+    migrate_to_file(from, "migfile");
+    migrate_from_file(to, "migfile");
+    compare_guests_ram(from, to);
+
+    rsp = wait_command(to, "{ 'execute': 'cont' }");
+    qobject_unref(rsp);
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+}
+
+/*
+ * Like test_precopy_file_mapped_ram(), but the target loads its RAM
+ * lazily: comparing the RAM reads it from the file through userfaultfd,
+ * while the rest is filled in the background.
+ */
+static void test_precopy_file_lazy_restore(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    g_free(args->opts_target);
+    args->opts_target = g_strdup("-S");
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+
+    rsp = qtest_qmp(to, "{ 'execute': 'migrate-set-capabilities',"
+                        "  'arguments': { 'capabilities': [ {"
+                        "    'capability': 'lazy-restore', 'state': true } ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        g_test_skip("lazy-restore not available");
+        test_migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'stop' }");
+    qobject_unref(rsp);
+    migrate_to_file(from, "migfile");
+    migrate_from_file(to, "migfile");
+    compare_guests_ram(from, to);
+
+    rsp = wait_command(to, "{ 'execute': 'cont' }");
+    qobject_unref(rsp);
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Save the stopped source to a file without io-uring and load it into a
+ * (paused) target, then let the source run for a while and do the same
+ * with io-uring.  Each target must end up with the RAM the source had.
+ */
+static void test_precopy_file_io_uring(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to, *to2;
+    QDict *rsp;
+
+    g_free(args->opts_target);
+    args->opts_target = g_strdup("-S");
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                          "  'arguments': { 'capabilities': [ {"
+                          "    'capability': 'io-uring', 'state': true } ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        g_test_skip("io_uring not available");
+        test_migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+    migrate_set_capability(from, "io-uring", false);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'stop' }");
+    qobject_unref(rsp);
+    migrate_to_file(from, "migfile");
+    migrate_from_file(to, "migfile");
+    compare_guests_ram(from, to);
+
+    rsp = wait_command(from, "{ 'execute': 'cont' }");
+    qobject_unref(rsp);
+    usleep(1000 * 100);
+    rsp = wait_command(from, "{ 'execute': 'stop' }");
+    qobject_unref(rsp);
+
+    migrate_set_capability(from, "io-uring", true);
+    migrate_to_file(from, "migfile-uring");
+
+    args = migrate_start_new();
+    args->only_target = true;
+    g_free(args->opts_target);
+    args->opts_target = g_strdup("-S");
+
+    if (test_migrate_start(&from, &to2, "defer", args)) {
+        return;
+    }
+    migrate_from_file(to2, "migfile-uring");
+    compare_guests_ram(from, to2);
+    check_guests_ram(to2);
+
+    qtest_quit(to2);
+    test_migrate_end(from, to, false);
+    cleanup("migfile");
+    cleanup("migfile-uring");
+}
+#endif
+
 static void do_test_validate_uuid(MigrateStart *args, bool should_fail)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1266,7 +1482,11 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+/*
+ * With @zstd_dictionary, the source trains a dictionary for the zstd
+ * method; the target does not need to know.
+ */
+static void do_test_multifd_tcp(const char *method, bool zstd_dictionary)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1293,8 +1513,16 @@ static void test_multifd_tcp(const char *method)
     migrate_set_parameter_str(from, "multifd-compression", method);
     migrate_set_parameter_str(to, "multifd-compression", method);
 
+    if (g_str_equal(method, "xbzrle")) {
+        migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+        migrate_set_capability(from, "xbzrle", "true");
+    }
+
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
+    if (zstd_dictionary) {
+        migrate_set_capability(from, "zstd-dictionary", true);
+    }
 
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
@@ -1323,6 +1551,11 @@ static void test_multifd_tcp(const char *method)
     g_free(uri);
 }
 
+static void test_multifd_tcp(const char *method)
+{
+    do_test_multifd_tcp(method, false);
+}
+
 static void test_multifd_tcp_none(void)
 {
     test_multifd_tcp("none");
@@ -1338,8 +1571,18 @@ static void test_multifd_tcp_zstd(void)
 {
     test_multifd_tcp("zstd");
 }
+
+static void test_multifd_tcp_zstd_dict(void)
+{
+    do_test_multifd_tcp("zstd", true);
+}
 #endif
 
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("xbzrle");
+}
+
 /*
  * This test does:
  *  source               target
@@ -1486,6 +1729,7 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
@@ -1493,6 +1737,14 @@ int main(int argc, char **argv)
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
+    qtest_add_func("/migration/precopy/file/lazy-restore",
+                   test_precopy_file_lazy_restore);
+#ifdef CONFIG_LINUX_IO_URING
+    qtest_add_func("/migration/precopy/file/io-uring",
+                   test_precopy_file_io_uring);
+#endif
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
@@ -1506,7 +1758,10 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+    qtest_add_func("/migration/multifd/tcp/zstd-dict",
+                   test_multifd_tcp_zstd_dict);
 #endif
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
 
     ret = g_test_run();
 
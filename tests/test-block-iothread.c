@@ -73,6 +73,28 @@ static BlockDriver bdrv_test = {
     .bdrv_co_block_status   = bdrv_test_co_block_status,
 };
 
+static AioContext *mq_request_ctx;
+static bool mq_drained;
+
+static int coroutine_fn bdrv_test_mq_co_prwv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    /* No request may reach the driver inside a drained section */
+    g_assert(!qatomic_read(&mq_drained));
+    qatomic_set(&mq_request_ctx, qemu_get_current_aio_context());
+    return 0;
+}
+
+static BlockDriver bdrv_test_mq = {
+    .format_name            = "test-mq",
+    .instance_size          = 1,
+    .supports_multiqueue    = true,
+
+    .bdrv_co_preadv         = bdrv_test_mq_co_prwv,
+    .bdrv_co_pwritev        = bdrv_test_mq_co_prwv,
+};
+
 static void test_sync_op_pread(BdrvChild *c)
 {
     uint8_t buf[512];
@@ -749,6 +771,210 @@ static void test_attach_preserve_blk_ctx(void)
     blk_unref(blk);
 }
 
+static void test_multiqueue_cb(void *opaque, int ret)
+{
+    AioContext **ctx = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    *ctx = qemu_get_current_aio_context();
+}
+
+/*
+ * Submit a read from the main loop to a BlockBackend in an iothread and
+ * check where it ran and completed.
+ */
+static void test_multiqueue_read(BlockBackend *blk, AioContext *run_ctx)
+{
+    AioContext *main_ctx = qemu_get_aio_context();
+    AioContext *done_ctx = NULL;
+    QEMUIOVector qiov;
+    uint8_t buf[512];
+
+    qemu_iovec_init_buf(&qiov, buf, sizeof(buf));
+    mq_request_ctx = NULL;
+    blk_aio_preadv(blk, 0, &qiov, 0, test_multiqueue_cb, &done_ctx);
+    while (!done_ctx) {
+        aio_poll(main_ctx, true);
+    }
+    g_assert(done_ctx == main_ctx);
+    if (run_ctx) {
+        g_assert(mq_request_ctx == run_ctx);
+    }
+}
+
+#define MQ_SUBMITTERS 3
+
+typedef struct MQSubmitter {
+    BlockBackend *blk;
+    QEMUIOVector qiov;
+    uint8_t buf[512];
+    bool stop;
+    bool done;
+    int completed;
+} MQSubmitter;
+
+static void test_multiqueue_submit_cb(void *opaque, int ret);
+
+static void test_multiqueue_submit(MQSubmitter *sub)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    blk_aio_preadv(sub->blk, 0, &sub->qiov, 0,
+                   test_multiqueue_submit_cb, sub);
+    aio_context_release(ctx);
+}
+
+static void test_multiqueue_submit_cb(void *opaque, int ret)
+{
+    MQSubmitter *sub = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    qatomic_inc(&sub->completed);
+    if (qatomic_read(&sub->stop)) {
+        qatomic_set(&sub->done, true);
+        aio_wait_kick();
+    } else {
+        test_multiqueue_submit(sub);
+    }
+}
+
+static void test_multiqueue_submit_bh(void *opaque)
+{
+    test_multiqueue_submit(opaque);
+}
+
+/* Drained section started from the home iothread of the BlockBackend */
+static void test_multiqueue_drain_bh(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    aio_context_acquire(ctx);
+    bdrv_drained_begin(bs);
+    qatomic_set(&mq_drained, true);
+    g_usleep(1000);
+    qatomic_set(&mq_drained, false);
+    bdrv_drained_end(bs);
+    aio_context_release(ctx);
+}
+
+/*
+ * Keep requests coming from several iothreads while drained sections and
+ * a graph change run in the home iothread and the main loop.
+ */
+static void test_multiqueue_concurrent(void)
+{
+    IOThread *iothreads[MQ_SUBMITTERS];
+    MQSubmitter subs[MQ_SUBMITTERS] = {};
+    AioContext *ctx, *main_ctx = qemu_get_aio_context();
+    BlockBackend *blk;
+    BlockDriverState *bs, *bs2;
+    int i, j;
+
+    for (i = 0; i < MQ_SUBMITTERS; i++) {
+        iothreads[i] = iothread_new();
+    }
+    ctx = iothread_get_aio_context(iothreads[0]);
+
+    blk = blk_new(ctx, BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test_mq, "base-mq", BDRV_O_RDWR,
+                              &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+    g_assert(blk_set_multiqueue(blk, true));
+
+    bs2 = bdrv_new_open_driver(&bdrv_test_mq, "base-mq2", BDRV_O_RDWR,
+                               &error_abort);
+    bs2->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    bdrv_try_set_aio_context(bs2, ctx, &error_abort);
+
+    for (i = 0; i < MQ_SUBMITTERS; i++) {
+        subs[i].blk = blk;
+        qemu_iovec_init_buf(&subs[i].qiov, subs[i].buf, sizeof(subs[i].buf));
+        aio_bh_schedule_oneshot(iothread_get_aio_context(iothreads[i]),
+                                test_multiqueue_submit_bh, &subs[i]);
+    }
+
+    aio_context_acquire(ctx);
+    for (j = 0; j < 100; j++) {
+        aio_wait_bh_oneshot(ctx, test_multiqueue_drain_bh, bs);
+
+        bdrv_drained_begin(bs);
+        qatomic_set(&mq_drained, true);
+        g_usleep(1000);
+        qatomic_set(&mq_drained, false);
+        bdrv_drained_end(bs);
+    }
+
+    /* Graph change: requests must move over to bs2 */
+    bdrv_drained_begin(bs);
+    bdrv_replace_node(bs, bs2, &error_abort);
+    bdrv_drained_end(bs);
+    g_assert(blk_bs(blk) == bs2);
+
+    for (i = 0; i < MQ_SUBMITTERS; i++) {
+        qatomic_set(&subs[i].completed, 0);
+    }
+    for (i = 0; i < MQ_SUBMITTERS; i++) {
+        AIO_WAIT_WHILE(ctx, qatomic_read(&subs[i].completed) == 0);
+        qatomic_set(&subs[i].stop, true);
+    }
+    for (i = 0; i < MQ_SUBMITTERS; i++) {
+        AIO_WAIT_WHILE(ctx, !qatomic_read(&subs[i].done));
+    }
+
+    blk_set_aio_context(blk, main_ctx, &error_abort);
+    aio_context_release(ctx);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+    bdrv_unref(bs2);
+    for (i = 0; i < MQ_SUBMITTERS; i++) {
+        iothread_join(iothreads[i]);
+    }
+}
+
+static void test_multiqueue(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    BlockBackend *blk;
+    BlockDriverState *bs;
+
+    /* Not supported by the graph: run in the iothread, complete here */
+    blk = blk_new(ctx, BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test, "base", BDRV_O_RDWR, &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+    g_assert(!blk_set_multiqueue(blk, true));
+    test_multiqueue_read(blk, NULL);
+
+    aio_context_acquire(ctx);
+    blk_set_aio_context(blk, qemu_get_aio_context(), &error_abort);
+    aio_context_release(ctx);
+    bdrv_unref(bs);
+    blk_unref(blk);
+
+    /* Supported: run where submitted */
+    blk = blk_new(ctx, BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test_mq, "base-mq", BDRV_O_RDWR,
+                              &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+    g_assert(blk_set_multiqueue(blk, true));
+    test_multiqueue_read(blk, qemu_get_aio_context());
+
+    aio_context_acquire(ctx);
+    blk_set_aio_context(blk, qemu_get_aio_context(), &error_abort);
+    aio_context_release(ctx);
+    bdrv_unref(bs);
+    blk_unref(blk);
+
+    /* Submitted from several iothreads */
+    test_multiqueue_concurrent();
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -769,6 +995,7 @@ int main(int argc, char **argv)
     g_test_add_func("/propagate/basic", test_propagate_basic);
     g_test_add_func("/propagate/diamond", test_propagate_diamond);
     g_test_add_func("/propagate/mirror", test_propagate_mirror);
+    g_test_add_func("/multiqueue/read", test_multiqueue);
 
     return g_test_run();
 }
@@ -332,6 +332,75 @@ static void test_simple_array(void)
                          sizeof(wire_simple_arr)));
 }
 
+/* Neighbouring fields of the same width are copied in one go */
+
+typedef struct TestCoalesced {
+    uint32_t regs[3];
+    uint32_t ctrl;
+    bool     flag;
+    uint8_t  buf[3];
+    uint16_t half[2];
+} TestCoalesced;
+
+TestCoalesced obj_coalesced = {
+    .regs = { 0x01020304, 0x05060708, 0x090a0b0c },
+    .ctrl = 0x0d0e0f10,
+    .flag = true,
+    .buf = { 0x11, 0x12, 0x13 },
+    .half = { 0x1415, 0x1617 },
+};
+
+static const VMStateDescription vmstate_coalesced = {
+    .name = "simple/coalesced",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, TestCoalesced, 3),
+        VMSTATE_UINT32(ctrl, TestCoalesced),
+        VMSTATE_BOOL(flag, TestCoalesced),
+        VMSTATE_BUFFER(buf, TestCoalesced),
+        VMSTATE_UINT16_ARRAY(half, TestCoalesced, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+uint8_t wire_coalesced[] = {
+    /* regs */  0x01, 0x02, 0x03, 0x04,
+    /* regs */  0x05, 0x06, 0x07, 0x08,
+    /* regs */  0x09, 0x0a, 0x0b, 0x0c,
+    /* ctrl */  0x0d, 0x0e, 0x0f, 0x10,
+    /* flag */  0x01,
+    /* buf */   0x11, 0x12, 0x13,
+    /* half */  0x14, 0x15,
+    /* half */  0x16, 0x17,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_coalesced_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestCoalesced));
+}
+
+static void test_simple_coalesced(void)
+{
+    TestCoalesced obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    save_vmstate(&vmstate_coalesced, &obj_coalesced);
+
+    compare_vmstate(wire_coalesced, sizeof(wire_coalesced));
+
+    SUCCESS(load_vmstate(&vmstate_coalesced, &obj, &obj_clone,
+                         obj_coalesced_copy, 1, wire_coalesced,
+                         sizeof(wire_coalesced)));
+
+    SUCCESS(memcmp(obj.regs, obj_coalesced.regs, sizeof(obj.regs)));
+    g_assert_cmpint(obj.ctrl, ==, obj_coalesced.ctrl);
+    g_assert_cmpint(obj.flag, ==, obj_coalesced.flag);
+    SUCCESS(memcmp(obj.buf, obj_coalesced.buf, sizeof(obj.buf)));
+    SUCCESS(memcmp(obj.half, obj_coalesced.half, sizeof(obj.half)));
+}
+
 typedef struct TestStruct {
     uint32_t a, b, c, e;
     uint64_t d, f;
@@ -1494,6 +1563,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
     g_test_add_func("/vmstate/simple/array", test_simple_array);
+    g_test_add_func("/vmstate/simple/coalesced", test_simple_coalesced);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);